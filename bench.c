@@ -0,0 +1,579 @@
+/* bench.c - In-kernel microbenchmarks */
+#include "bench.h"
+#include "cycles.h"
+#include "io.h"
+#include "kprintf.h"
+#include "memory.h"
+#include "process.h"
+#include "scheduler.h"
+#include "serial.h"
+#include "string.h"
+#include "shell.h"
+#include "timer.h"
+
+#define BENCH_ALLOC_OPS         4096
+#define BENCH_FRAG_SLOTS        256
+#define BENCH_FRAG_ROUNDS       16
+#define BENCH_PROCESS_OPS       256
+#define BENCH_QUEUE_OPS         4096
+#define BENCH_QUEUE_MAX         512
+#define BENCH_SWITCH_OPS        4096
+#define BENCH_IPC_OPS           4096
+#define BENCH_COPY_BYTES        (256 * 1024)    /* Bytes moved per size */
+#define BENCH_COPY_MAX          16384
+#define BENCH_CHECK_SEGMENTS    40
+#define BENCH_CHECK_SEGMENT     250     /* Ticks between checkpoints */
+#define BENCH_CHECK_AGING       100     /* Aging threshold for the check */
+#define BENCH_CHECK_INTERVAL    50      /* Aging interval for the check */
+#define BENCH_CHECK_YIELD_RUNS  7       /* check-count yields every this many runs */
+#define BENCH_CHECK_EXIT_RUNS   1500    /* and exits after this many */
+
+/* One process of the advance check's workload */
+typedef struct {
+    const char *name;
+    process_func_t entry;
+    process_priority_t priority;
+    uint32_t required_time;         /* 0: runs until terminated */
+    uint32_t deadline;              /* Ticks from creation; 0: none */
+    uint32_t quantum;               /* 0: the default quantum */
+    uint32_t segment;               /* Created as this segment starts */
+} bench_task_t;
+
+static uint32_t bench_seed = 1;
+static void *frag_slots[BENCH_FRAG_SLOTS];
+static process_t *queue_procs[BENCH_QUEUE_MAX];
+static uint64_t ipc_cycles;         /* Written by bench_ipc_process() */
+static uint32_t ipc_message;
+
+/* Forward declarations for internal functions */
+static uint32_t bench_random(void);
+static void bench_report(const char *name, uint32_t ops, uint64_t cycles);
+static void bench_alloc(const char *name, size_t min_size, size_t max_size);
+static void bench_fragmentation(void);
+static void bench_process_lifecycle(void);
+static void bench_ready_queue(const char *name, uint32_t backlog);
+static void bench_context_switch(void);
+static void bench_ipc(void);
+static void bench_ipc_process(void);
+static void bench_copy(void);
+static void bench_idle_process(void);
+static void bench_sleep_short(void);
+static void bench_sleep_long(void);
+static void bench_count_runs(void);
+static int bench_check_advance(void);
+static int bench_check_run(sched_policy_t policy, uint8_t preempt, uint8_t batched);
+static uint32_t bench_check_state(uint32_t start, const sched_stats_t *base);
+static uint32_t bench_hash(uint32_t hash, uint32_t value);
+
+/* Spinners, jobs that complete, sleepers that wake on timers, a deadline,
+ * late arrivals and a process that acts on how often it has run, so every
+ * reason a stretch ends comes up */
+static const bench_task_t check_tasks[] = {
+    { "check-spin",     bench_idle_process, PROC_PRIORITY_LOW,      0,   0,    0,  0 },
+    { "check-spin-q",   bench_idle_process, PROC_PRIORITY_NORMAL,   0,   0,    25, 0 },
+    { "check-job",      bench_idle_process, PROC_PRIORITY_HIGH,     180, 0,    40, 0 },
+    { "check-sleep",    bench_sleep_short,  PROC_PRIORITY_HIGH,     0,   0,    0,  0 },
+    { "check-deadline", bench_idle_process, PROC_PRIORITY_NORMAL,   120, 4000, 0,  1 },
+    { "check-nap",      bench_sleep_long,   PROC_PRIORITY_CRITICAL, 0,   0,    0,  2 },
+    { "check-long",     bench_idle_process, PROC_PRIORITY_NORMAL,   900, 0,    0,  3 },
+    { "check-late",     bench_idle_process, PROC_PRIORITY_CRITICAL, 300, 0,    15, 11 },
+    { "check-count",    bench_count_runs,   PROC_PRIORITY_NORMAL,   0,   0,    30, 0 },
+};
+
+#define BENCH_CHECK_TASKS   (sizeof(check_tasks) / sizeof(check_tasks[0]))
+
+static uint32_t check_pids[BENCH_CHECK_TASKS];
+static uint32_t check_hashes[BENCH_CHECK_SEGMENTS];
+static uint32_t check_runs;         /* Times check-count got the CPU this run */
+
+/*
+ * Run every benchmark, then the advance check
+ */
+int bench_run_all(void) {
+    bench_seed = 1;
+    
+    serial_puts("\n=== Benchmarks (TSC cycles) ===\n");
+    serial_puts("Operation                          Ops    Cyc/op\n");
+    serial_puts("------------------------------  ------  --------\n");
+    
+    bench_alloc("kmalloc+kfree 16-128B", 16, 128);
+    bench_alloc("kmalloc+kfree 256-2048B", 256, 2048);
+    bench_alloc("kmalloc+kfree 4-16KB", 4096, 16384);
+    bench_fragmentation();
+    bench_process_lifecycle();
+    bench_ready_queue("dequeue+enqueue, +32 ready", 32);
+    bench_ready_queue("dequeue+enqueue, +128 ready", 128);
+    bench_ready_queue("dequeue+enqueue, +512 ready", BENCH_QUEUE_MAX);
+    bench_context_switch();
+    bench_ipc();
+    bench_copy();
+    
+    serial_puts("===============================\n\n");
+    
+    return bench_check_advance();
+}
+
+/*
+ * Write the exit code to isa-debug-exit, flushing queued output first
+ */
+void bench_exit(uint8_t code) {
+    serial_flush();
+    outb(BENCH_EXIT_PORT, code);
+    
+    /* Not running under QEMU with the device */
+    for (;;) {
+        __asm__ volatile ("cli; hlt");
+    }
+}
+
+/*
+ * Deterministic pseudo-random numbers so runs are comparable
+ */
+static uint32_t bench_random(void) {
+    bench_seed = bench_seed * 1103515245 + 12345;
+    return bench_seed >> 8;
+}
+
+/*
+ * Print one result row
+ */
+static void bench_report(const char *name, uint32_t ops, uint64_t cycles) {
+    serial_puts(name);
+    for (uint32_t j = strlen(name); j < 30; j++) {
+        serial_puts(" ");
+    }
+    cycles_put_padded(ops, 8);
+    cycles_put_padded(ops ? cycles_div(cycles, ops) : 0, 10);
+    serial_puts("\n");
+}
+
+/*
+ * kmalloc/kfree pairs with sizes drawn uniformly from [min_size, max_size]
+ */
+static void bench_alloc(const char *name, size_t min_size, size_t max_size) {
+    static uint32_t sizes[BENCH_ALLOC_OPS];
+    
+    for (uint32_t i = 0; i < BENCH_ALLOC_OPS; i++) {
+        sizes[i] = min_size + bench_random() % (max_size - min_size + 1);
+    }
+    
+    uint64_t start = cycles_now();
+    for (uint32_t i = 0; i < BENCH_ALLOC_OPS; i++) {
+        kfree(kmalloc(sizes[i]));
+    }
+    bench_report(name, BENCH_ALLOC_OPS, cycles_now() - start);
+}
+
+/*
+ * Keep a working set of mixed-size blocks and replace random members, so
+ * frees land between live neighbours and the bins see every size class
+ */
+static void bench_fragmentation(void) {
+    for (uint32_t i = 0; i < BENCH_FRAG_SLOTS; i++) {
+        frag_slots[i] = kmalloc(16 + bench_random() % 4096);
+    }
+    
+    uint32_t ops = BENCH_FRAG_SLOTS * BENCH_FRAG_ROUNDS;
+    uint64_t start = cycles_now();
+    for (uint32_t i = 0; i < ops; i++) {
+        uint32_t slot = bench_random() % BENCH_FRAG_SLOTS;
+        kfree(frag_slots[slot]);
+        frag_slots[slot] = kmalloc(16 + bench_random() % 4096);
+    }
+    bench_report("fragmentation kfree+kmalloc", ops, cycles_now() - start);
+    
+    for (uint32_t i = 0; i < BENCH_FRAG_SLOTS; i++) {
+        kfree(frag_slots[i]);
+        frag_slots[i] = NULL;
+    }
+}
+
+/*
+ * Entry point for benchmark processes: hand the CPU straight back
+ */
+static void bench_idle_process(void) {
+    for (;;) {
+        scheduler_wait_tick();
+    }
+}
+
+/*
+ * Entry points for the advance check's sleepers: sleep again every time
+ * they get the CPU
+ */
+static void bench_sleep_short(void) {
+    for (;;) {
+        process_sleep(process_get_current_pid(), 5);
+    }
+}
+
+static void bench_sleep_long(void) {
+    for (;;) {
+        process_sleep(process_get_current_pid(), 17);
+    }
+}
+
+/*
+ * Entry point for the advance check's run counter: a batched tick that
+ * did not run it would show up in the count, in its yields and in when
+ * it exits
+ */
+static void bench_count_runs(void) {
+    for (;;) {
+        check_runs++;
+        if (check_runs == BENCH_CHECK_EXIT_RUNS) {
+            process_exit(0);
+        } else if (check_runs % BENCH_CHECK_YIELD_RUNS == 0) {
+            scheduler_yield();
+        } else {
+            scheduler_wait_tick();
+        }
+    }
+}
+
+/*
+ * process_create + process_terminate pairs
+ */
+static void bench_process_lifecycle(void) {
+    uint64_t start = cycles_now();
+    for (uint32_t i = 0; i < BENCH_PROCESS_OPS; i++) {
+        process_t *proc = process_create("bench", bench_idle_process, PROC_PRIORITY_LOW);
+        if (proc == NULL) {
+            serial_puts("process create/terminate: create failed\n");
+            return;
+        }
+        process_terminate(proc->pid);
+        process_reap(1);
+    }
+    bench_report("process create+terminate", BENCH_PROCESS_OPS, cycles_now() - start);
+}
+
+/*
+ * Dequeue + enqueue with backlog extra ready processes spread over all
+ * priority levels
+ */
+static void bench_ready_queue(const char *name, uint32_t backlog) {
+    uint32_t created = 0;
+    
+    while (created < backlog) {
+        process_t *proc = process_create_with_stack("bench-ready", bench_idle_process,
+                                                    (process_priority_t)(created % PROC_PRIORITY_LEVELS),
+                                                    STACK_MIN_SIZE);
+        if (proc == NULL) {
+            break;
+        }
+        queue_procs[created++] = proc;
+    }
+    
+    uint64_t start = cycles_now();
+    for (uint32_t i = 0; i < BENCH_QUEUE_OPS; i++) {
+        process_enqueue_ready(process_dequeue_ready());
+    }
+    uint64_t cycles = cycles_now() - start;
+    
+    bench_report(name, BENCH_QUEUE_OPS, cycles);
+    
+    for (uint32_t i = 0; i < created; i++) {
+        process_terminate(queue_procs[i]->pid);
+        queue_procs[i] = NULL;
+    }
+}
+
+/*
+ * Null context -> process -> null context, i.e. two switch_to() calls
+ */
+static void bench_context_switch(void) {
+    process_t *partner = process_create("bench-switch", bench_idle_process, PROC_PRIORITY_LOW);
+    if (partner == NULL || scheduler_get_running() != NULL) {
+        serial_puts("context switch: cannot run from a process\n");
+        if (partner != NULL) {
+            process_terminate(partner->pid);
+        }
+        return;
+    }
+    
+    /* First entry goes through process_start; keep it out of the timing */
+    scheduler_switch_context(NULL, partner);
+    
+    uint64_t start = cycles_now();
+    for (uint32_t i = 0; i < BENCH_SWITCH_OPS; i++) {
+        scheduler_switch_context(NULL, partner);
+    }
+    bench_report("context switch round trip", BENCH_SWITCH_OPS, cycles_now() - start);
+    
+    process_terminate(partner->pid);
+}
+
+/*
+ * process_send_message + process_receive_message to the running process.
+ * The loop runs on the receiver's own stack, since only a running
+ * process has a mailbox to receive from.
+ */
+static void bench_ipc(void) {
+    process_t *receiver = process_create("bench-ipc", bench_ipc_process, PROC_PRIORITY_LOW);
+    if (receiver == NULL || scheduler_get_running() != NULL) {
+        serial_puts("ipc: cannot run from a process\n");
+        if (receiver != NULL) {
+            process_terminate(receiver->pid);
+        }
+        return;
+    }
+    
+    ipc_message = 0;
+    ipc_cycles = 0;
+    scheduler_switch_context(NULL, receiver);
+    process_terminate(receiver->pid);
+    
+    if (ipc_message != BENCH_IPC_OPS - 1) {
+        serial_puts("ipc: messages lost\n");
+        return;
+    }
+    bench_report("ipc send+receive", BENCH_IPC_OPS, ipc_cycles);
+}
+
+/*
+ * The receiver of bench_ipc(): mails itself, then hands back the result
+ */
+static void bench_ipc_process(void) {
+    uint32_t self = scheduler_get_running()->pid;
+    uint32_t message = 0;
+    uint64_t start = cycles_now();
+    
+    for (uint32_t i = 0; i < BENCH_IPC_OPS; i++) {
+        process_send_message(self, i);
+        process_receive_message(&message);
+    }
+    ipc_cycles = cycles_now() - start;
+    ipc_message = message;
+    
+    bench_idle_process();
+}
+
+/*
+ * memcpy and memset from 16 bytes to 16KB, misaligned source for memcpy
+ */
+static void bench_copy(void) {
+    uint8_t *src = (uint8_t *)kmalloc(BENCH_COPY_MAX + 64);
+    uint8_t *dst = (uint8_t *)kmalloc(BENCH_COPY_MAX + 64);
+    if (src == NULL || dst == NULL) {
+        kfree(src);
+        kfree(dst);
+        return;
+    }
+    memset(src, 0x5A, BENCH_COPY_MAX + 64);
+    
+    static const char *copy_names[] = {
+        "memcpy 16B", "memcpy 64B", "memcpy 256B", "memcpy 1KB", "memcpy 4KB", "memcpy 16KB"
+    };
+    static const char *set_names[] = {
+        "memset 16B", "memset 64B", "memset 256B", "memset 1KB", "memset 4KB", "memset 16KB"
+    };
+    
+    uint32_t index = 0;
+    for (size_t size = 16; size <= BENCH_COPY_MAX; size *= 4, index++) {
+        uint32_t ops = BENCH_COPY_BYTES / size;
+        
+        uint64_t start = cycles_now();
+        for (uint32_t i = 0; i < ops; i++) {
+            memcpy(dst, src + 1, size);
+        }
+        bench_report(copy_names[index], ops, cycles_now() - start);
+        
+        start = cycles_now();
+        for (uint32_t i = 0; i < ops; i++) {
+            memset(dst, (int)i, size);
+        }
+        bench_report(set_names[index], ops, cycles_now() - start);
+    }
+    
+    kfree(src);
+    kfree(dst);
+}
+
+/*
+ * Run the check workload under every policy, with and without preemption,
+ * once tick by tick and once through scheduler_advance(), and compare
+ * the two at each checkpoint. Needs manual ticks from the null context
+ * and no other runnable processes; returns how many runs disagreed.
+ */
+static int bench_check_advance(void) {
+    if (timer_is_scheduling() || scheduler_get_running() != NULL ||
+        process_get_current() != NULL || process_count_by_state(PROC_STATE_READY) != 0 ||
+        process_count_by_state(PROC_STATE_SLEEPING) != 0) {
+        serial_puts("advance check: needs manual ticks and no other processes, skipped\n\n");
+        return 0;
+    }
+    
+    sched_config_t saved;
+    scheduler_get_config(&saved);
+    
+    uint32_t ticks = BENCH_CHECK_SEGMENTS * BENCH_CHECK_SEGMENT;
+    int failures = 0;
+    
+    kprintf("=== scheduler_advance() vs %u x scheduler_tick() ===\n", ticks);
+    for (uint32_t policy = 0; policy <= SCHED_POLICY_SRTF; policy++) {
+        for (uint32_t run = 0; run < 2; run++) {
+            uint8_t preempt = (run == 0);
+            
+            bench_check_run((sched_policy_t)policy, preempt, 0);
+            int segment = bench_check_run((sched_policy_t)policy, preempt, 1);
+            
+            kprintf("%-22s %-14s ", scheduler_policy_to_string((sched_policy_t)policy),
+                    preempt ? "preemptive" : "cooperative");
+            if (segment < 0) {
+                kprintf("identical\n");
+            } else {
+                kprintf("DIFFERS by tick %u\n", (uint32_t)(segment + 1) * BENCH_CHECK_SEGMENT);
+                failures++;
+            }
+        }
+    }
+    serial_puts("===============================\n\n");
+    
+    scheduler_set_policy(saved.policy);
+    scheduler_enable_preemption(saved.enable_preemption);
+    scheduler_enable_aging(saved.enable_aging);
+    scheduler_set_aging_threshold(saved.aging_threshold);
+    scheduler_set_aging_interval(saved.aging_boost_interval);
+    
+    return failures;
+}
+
+/*
+ * One run of the check workload. The tick-by-tick run records a hash of
+ * the state at each checkpoint; the batched run compares against it and
+ * returns the first segment that differs, or -1.
+ */
+static int bench_check_run(sched_policy_t policy, uint8_t preempt, uint8_t batched) {
+    int mismatch = -1;
+    
+    /* Same settings and the same aging phase for both runs; ticks are
+     * counted from the start of the run */
+    scheduler_set_policy(policy);
+    scheduler_enable_preemption(preempt);
+    scheduler_enable_aging(1);
+    scheduler_set_aging_threshold(BENCH_CHECK_AGING);
+    scheduler_set_aging_interval(BENCH_CHECK_INTERVAL);
+    
+    uint32_t start = scheduler_get_ticks();
+    sched_stats_t base;
+    scheduler_get_stats(&base);
+    check_runs = 0;
+    
+    for (uint32_t segment = 0; segment < BENCH_CHECK_SEGMENTS; segment++) {
+        for (uint32_t i = 0; i < BENCH_CHECK_TASKS; i++) {
+            const bench_task_t *task = &check_tasks[i];
+            process_t *proc;
+            
+            if (task->segment != segment) {
+                continue;
+            }
+            if (task->deadline != 0) {
+                proc = process_create_with_deadline(task->name, task->entry, task->priority,
+                                                    task->required_time, task->deadline);
+            } else {
+                proc = process_create_with_time(task->name, task->entry, task->priority,
+                                                task->required_time);
+            }
+            check_pids[i] = (proc != NULL) ? proc->pid : 0;
+            if (proc != NULL && task->quantum != 0) {
+                scheduler_set_process_quantum(proc->pid, task->quantum);
+            }
+        }
+        
+        if (batched) {
+            scheduler_advance(BENCH_CHECK_SEGMENT);
+        } else {
+            for (uint32_t tick = 0; tick < BENCH_CHECK_SEGMENT; tick++) {
+                scheduler_tick();
+            }
+        }
+        
+        uint32_t hash = bench_check_state(start, &base);
+        if (!batched) {
+            check_hashes[segment] = hash;
+        } else if (mismatch < 0 && hash != check_hashes[segment]) {
+            mismatch = (int)segment;
+        }
+    }
+    
+    /* Leave nothing behind for the next run */
+    for (uint32_t i = 0; i < BENCH_CHECK_TASKS; i++) {
+        if (check_pids[i] != 0 && process_get_state(check_pids[i]) != PROC_STATE_TERMINATED) {
+            process_terminate(check_pids[i]);
+        }
+        check_pids[i] = 0;
+    }
+    while (process_reap(PROC_REAP_BATCH) > 0) {
+    }
+    
+    return mismatch;
+}
+
+/*
+ * Hash of what the scheduling decisions produced so far: the clock,
+ * the counters a tick can change, how often check-count has run and
+ * each workload process's state. Processes that are gone count as
+ * terminated, as an idle CPU may already have freed them.
+ */
+static uint32_t bench_check_state(uint32_t start, const sched_stats_t *base) {
+    sched_stats_t stats;
+    uint32_t hash = 2166136261u;
+    uint32_t current = process_get_current_pid();
+    
+    scheduler_get_stats(&stats);
+    hash = bench_hash(hash, scheduler_get_ticks() - start);
+    hash = bench_hash(hash, stats.total_ticks - base->total_ticks);
+    hash = bench_hash(hash, stats.idle_ticks - base->idle_ticks);
+    hash = bench_hash(hash, stats.preemptions - base->preemptions);
+    hash = bench_hash(hash, stats.total_aging_boosts - base->total_aging_boosts);
+    hash = bench_hash(hash, stats.deadline_misses - base->deadline_misses);
+    hash = bench_hash(hash, stats.total_context_switches - base->total_context_switches);
+    hash = bench_hash(hash, stats.voluntary_yields - base->voluntary_yields);
+    hash = bench_hash(hash, check_runs);
+    
+    for (uint32_t i = 0; i < BENCH_CHECK_TASKS; i++) {
+        process_t copy;
+        
+        if (check_pids[i] == 0 || process_snapshot(check_pids[i], &copy) != 0 ||
+            copy.state == PROC_STATE_TERMINATED) {
+            hash = bench_hash(hash, PROC_STATE_TERMINATED);
+            continue;
+        }
+        hash = bench_hash(hash, copy.state);
+        hash = bench_hash(hash, copy.priority);
+        hash = bench_hash(hash, copy.cpu_time);
+        hash = bench_hash(hash, copy.enqueue_tick - start);
+        if (copy.pid == current) {
+            hash = bench_hash(hash, i);
+        }
+    }
+    
+    return hash;
+}
+
+/*
+ * FNV-1a over the four bytes of value
+ */
+static uint32_t bench_hash(uint32_t hash, uint32_t value) {
+    for (uint32_t i = 0; i < 4; i++) {
+        hash = (hash ^ (value & 0xFF)) * 16777619u;
+        value >>= 8;
+    }
+    return hash;
+}
+
+/* Shell commands */
+
+/*
+ * bench: run the microbenchmark suite
+ */
+static int bench_cmd_bench(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    bench_run_all();
+    return 0;
+}
+
+SHELL_COMMAND(bench, "bench", "bench", "Run the microbenchmark suite", bench_cmd_bench);
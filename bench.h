@@ -0,0 +1,29 @@
+/* bench.h - In-kernel microbenchmarks */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "types.h"
+
+/*
+ * Each benchmark times a loop of N operations with the TSC and reports
+ * cycles per operation. Run from the shell with 'bench', or headless with
+ * 'make bench', which boots with "bench" on the kernel command line and
+ * leaves QEMU through the isa-debug-exit device.
+ *
+ * The suite ends with a check rather than a timing: the same workloads
+ * are run once with scheduler_tick() and once with scheduler_advance(),
+ * under every policy, and their scheduling state has to agree at every
+ * checkpoint. A mismatch makes 'make bench' fail.
+ */
+
+#define BENCH_EXIT_PORT     0xF4    /* isa-debug-exit iobase */
+#define BENCH_EXIT_SUCCESS  0       /* QEMU exits with (code << 1) | 1 */
+#define BENCH_EXIT_FAILURE  1
+
+/* Run every benchmark and print the results; non-zero if a check failed */
+int bench_run_all(void);
+
+/* Leave QEMU through isa-debug-exit; halts if the device is absent */
+void bench_exit(uint8_t code);
+
+#endif /* BENCH_H */
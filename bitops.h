@@ -0,0 +1,26 @@
+/* bitops.h - Bit scan helpers */
+#ifndef BITOPS_H
+#define BITOPS_H
+
+#include "types.h"
+
+/*
+ * Index of the lowest set bit (bsf). Undefined for value == 0,
+ * so callers must test for an empty mask first.
+ */
+static inline uint32_t bit_scan_forward(uint32_t value) {
+    uint32_t index;
+    __asm__ ("bsf %1, %0" : "=r"(index) : "rm"(value) : "cc");
+    return index;
+}
+
+/*
+ * Index of the highest set bit (bsr). Undefined for value == 0.
+ */
+static inline uint32_t bit_scan_reverse(uint32_t value) {
+    uint32_t index;
+    __asm__ ("bsr %1, %0" : "=r"(index) : "rm"(value) : "cc");
+    return index;
+}
+
+#endif /* BITOPS_H */
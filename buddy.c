@@ -0,0 +1,499 @@
+/* buddy.c - Buddy Page-Frame Allocator Implementation */
+#include "buddy.h"
+#include "memory.h"
+#include "string.h"
+#include "serial.h"
+#include "klog.h"
+#include "bitops.h"
+#include "spinlock.h"
+#include "shell.h"
+
+/* End of the kernel image (from link.ld) */
+extern uint8_t __kernel_end[];
+
+/* One state byte per physical frame, placed right after the kernel */
+static uint8_t *frame_state = NULL;
+static uint32_t max_frame = 0;
+static uint32_t total_frames = 0;
+static uint32_t free_frames = 0;
+
+/* Free lists per order and a bitmap of non-empty orders */
+static buddy_block_t *free_lists[BUDDY_MAX_ORDER + 1];
+static uint32_t free_counts[BUDDY_MAX_ORDER + 1];
+static uint32_t free_map = 0;
+static spinlock_t buddy_lock = SPINLOCK_INIT;   /* Free lists, frame states and counts */
+
+/* Usable regions copied out of the memory map before it can be overwritten */
+#define MAX_MEMORY_REGIONS 32
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} memory_region_t;
+
+/* Boot information the loader may have put anywhere above the kernel:
+ * the info block, command line, memory map and modules. QEMU's -kernel
+ * loader puts it in the pages right after the image. */
+#define MAX_BOOT_MODULES    8
+#define MAX_BOOT_RANGES     (4 + 2 * MAX_BOOT_MODULES)
+
+#define FRAME_ADDR(pfn)     ((void*)((pfn) << PAGE_SHIFT))
+#define ADDR_FRAME(addr)    ((uint32_t)(addr) >> PAGE_SHIFT)
+
+/* Forward declarations for internal functions */
+static uint32_t collect_regions(uint32_t magic, multiboot_info_t *mbi,
+                                memory_region_t *regions);
+static uint32_t collect_boot_ranges(uint32_t magic, multiboot_info_t *mbi,
+                                    memory_region_t *ranges);
+static uint32_t boot_range_overlap(const memory_region_t *ranges, uint32_t count,
+                                   uint32_t start, uint32_t end);
+static void free_list_push(uint32_t pfn, uint32_t order);
+static void free_list_remove(uint32_t pfn, uint32_t order);
+static void free_block(uint32_t pfn, uint32_t order);
+
+/*
+ * Initialize the page-frame allocator from the multiboot memory map
+ */
+void buddy_init(uint32_t magic, multiboot_info_t *mbi) {
+    memory_region_t regions[MAX_MEMORY_REGIONS];
+    uint32_t num_regions = collect_regions(magic, mbi, regions);
+    
+    /* Size the frame table for the highest usable address */
+    max_frame = 0;
+    for (uint32_t i = 0; i < num_regions; i++) {
+        if (ADDR_FRAME(regions[i].end) > max_frame) {
+            max_frame = ADDR_FRAME(regions[i].end);
+        }
+    }
+    
+    /* The frame table goes after the kernel, past any boot information
+     * it would cover; that information stays reserved for good */
+    memory_region_t boot_ranges[MAX_BOOT_RANGES];
+    uint32_t num_boot_ranges = collect_boot_ranges(magic, mbi, boot_ranges);
+    uint32_t table_start = ((uint32_t)__kernel_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint32_t table_end = (table_start + max_frame + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint32_t blocked;
+    while ((blocked = boot_range_overlap(boot_ranges, num_boot_ranges,
+                                         table_start, table_end)) != 0) {
+        table_start = (blocked + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        table_end = (table_start + max_frame + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    }
+    frame_state = (uint8_t*)table_start;
+    memset(frame_state, BUDDY_FRAME_RESERVED, max_frame);
+    
+    for (uint32_t i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        free_lists[i] = NULL;
+        free_counts[i] = 0;
+    }
+    free_map = 0;
+    total_frames = 0;
+    free_frames = 0;
+    
+    /* Hand every usable frame above the kernel and frame table to the allocator */
+    for (uint32_t i = 0; i < num_regions; i++) {
+        uint32_t start = regions[i].start;
+        if (start < BUDDY_LOW_MEMORY_LIMIT) start = BUDDY_LOW_MEMORY_LIMIT;
+        if (start < table_end) start = table_end;
+        
+        uint32_t first = (start + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        uint32_t last = ADDR_FRAME(regions[i].end);
+        
+        for (uint32_t pfn = first; pfn < last; pfn++) {
+            if (frame_state[pfn] != BUDDY_FRAME_RESERVED) {
+                continue;  /* Overlapping map entries */
+            }
+            if (boot_range_overlap(boot_ranges, num_boot_ranges,
+                                   pfn << PAGE_SHIFT, (pfn + 1) << PAGE_SHIFT) != 0) {
+                continue;  /* Boot information */
+            }
+            frame_state[pfn] = 0;
+            total_frames++;
+            free_frames++;
+            free_block(pfn, 0);
+        }
+    }
+    
+    KLOG(KLOG_INFO, serial_puts("[BUDDY] Page-frame allocator initialized\n"),
+         serial_puts("[BUDDY] "),
+         serial_puts((magic == MULTIBOOT_BOOTLOADER_MAGIC && mbi != NULL &&
+                      (mbi->flags & MULTIBOOT_INFO_MEM_MAP)) ? "Memory map: " : "No memory map, assuming: "),
+         serial_put_dec(total_frames * (PAGE_SIZE / 1024) / 1024),
+         serial_puts(" MB usable in "), serial_put_dec(total_frames), serial_puts(" frames\n"));
+}
+
+/*
+ * Copy usable RAM ranges from the boot information, falling back to
+ * mem_upper or a fixed size when no memory map is available
+ */
+static uint32_t collect_regions(uint32_t magic, multiboot_info_t *mbi,
+                                memory_region_t *regions) {
+    uint32_t count = 0;
+    
+    if (magic == MULTIBOOT_BOOTLOADER_MAGIC && mbi != NULL &&
+        (mbi->flags & MULTIBOOT_INFO_MEM_MAP)) {
+        uint32_t addr = mbi->mmap_addr;
+        uint32_t end = mbi->mmap_addr + mbi->mmap_length;
+        
+        while (addr < end && count < MAX_MEMORY_REGIONS) {
+            multiboot_mmap_entry_t *entry = (multiboot_mmap_entry_t*)addr;
+            
+            /* 32-bit kernel: ignore anything starting above 4GB, clip the rest */
+            if (entry->type == MULTIBOOT_MEMORY_AVAILABLE && entry->addr_high == 0 &&
+                entry->addr_low < 0xFFFFF000) {
+                uint32_t start = entry->addr_low;
+                uint32_t limit = 0xFFFFF000 - start;
+                uint32_t len = (entry->len_high != 0 || entry->len_low > limit) ?
+                               limit : entry->len_low;
+                
+                regions[count].start = start;
+                regions[count].end = (start + len) & ~(PAGE_SIZE - 1);
+                count++;
+            }
+            
+            addr += entry->size + sizeof(entry->size);
+        }
+        return count;
+    }
+    
+    regions[0].start = BUDDY_LOW_MEMORY_LIMIT;
+    if (magic == MULTIBOOT_BOOTLOADER_MAGIC && mbi != NULL &&
+        (mbi->flags & MULTIBOOT_INFO_MEMORY)) {
+        regions[0].end = BUDDY_LOW_MEMORY_LIMIT + mbi->mem_upper * 1024;
+    } else {
+        regions[0].end = BUDDY_FALLBACK_MEMORY;
+    }
+    return 1;
+}
+
+/*
+ * Byte ranges of the boot information, so neither the frame table nor
+ * the allocator lands on it before kmain() has read it
+ */
+static uint32_t collect_boot_ranges(uint32_t magic, multiboot_info_t *mbi,
+                                    memory_region_t *ranges) {
+    uint32_t count = 0;
+    
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC || mbi == NULL) {
+        return 0;
+    }
+    
+    ranges[count].start = (uint32_t)mbi;
+    ranges[count++].end = (uint32_t)mbi + sizeof(multiboot_info_t);
+    
+    if ((mbi->flags & MULTIBOOT_INFO_CMDLINE) && mbi->cmdline != 0) {
+        ranges[count].start = mbi->cmdline;
+        ranges[count++].end = mbi->cmdline + strlen((const char *)mbi->cmdline) + 1;
+    }
+    if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+        ranges[count].start = mbi->mmap_addr;
+        ranges[count++].end = mbi->mmap_addr + mbi->mmap_length;
+    }
+    if ((mbi->flags & MULTIBOOT_INFO_MODS) && mbi->mods_count != 0) {
+        const multiboot_module_t *mods = (const multiboot_module_t *)mbi->mods_addr;
+        uint32_t mods_count = (mbi->mods_count < MAX_BOOT_MODULES) ?
+                              mbi->mods_count : MAX_BOOT_MODULES;
+        
+        ranges[count].start = mbi->mods_addr;
+        ranges[count++].end = mbi->mods_addr + mbi->mods_count * sizeof(multiboot_module_t);
+        for (uint32_t i = 0; i < mods_count; i++) {
+            ranges[count].start = mods[i].mod_start;
+            ranges[count++].end = mods[i].mod_end;
+            if (mods[i].string != 0) {
+                ranges[count].start = mods[i].string;
+                ranges[count++].end = mods[i].string + strlen((const char *)mods[i].string) + 1;
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ * End of the last boot range that overlaps [start, end), 0 if none does
+ */
+static uint32_t boot_range_overlap(const memory_region_t *ranges, uint32_t count,
+                                   uint32_t start, uint32_t end) {
+    uint32_t blocked = 0;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        if (ranges[i].start < end && ranges[i].end > start && ranges[i].end > blocked) {
+            blocked = ranges[i].end;
+        }
+    }
+    return blocked;
+}
+
+/*
+ * Push a free block onto its order's list
+ */
+static void free_list_push(uint32_t pfn, uint32_t order) {
+    buddy_block_t *block = (buddy_block_t*)FRAME_ADDR(pfn);
+    
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (free_lists[order] != NULL) {
+        free_lists[order]->prev = block;
+    }
+    free_lists[order] = block;
+    free_map |= 1u << order;
+    free_counts[order]++;
+    
+    frame_state[pfn] = BUDDY_FRAME_FREE | order;
+}
+
+/*
+ * Unlink a free block from its order's list
+ */
+static void free_list_remove(uint32_t pfn, uint32_t order) {
+    buddy_block_t *block = (buddy_block_t*)FRAME_ADDR(pfn);
+    
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        free_lists[order] = block->next;
+        if (free_lists[order] == NULL) {
+            free_map &= ~(1u << order);
+        }
+    }
+    
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    
+    free_counts[order]--;
+    frame_state[pfn] = 0;
+}
+
+/*
+ * Release a block, merging with its buddy for as long as the buddy is free
+ */
+static void free_block(uint32_t pfn, uint32_t order) {
+    while (order < BUDDY_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        
+        if (buddy >= max_frame || frame_state[buddy] != (BUDDY_FRAME_FREE | order)) {
+            break;
+        }
+        
+        free_list_remove(buddy, order);
+        pfn &= ~(1u << order);  /* Merged block starts at the lower half */
+        order++;
+    }
+    
+    free_list_push(pfn, order);
+}
+
+/*
+ * Smallest order whose block holds num_pages frames
+ */
+uint32_t buddy_order_for_pages(uint32_t num_pages) {
+    if (num_pages <= 1) {
+        return 0;
+    }
+    return bit_scan_reverse(num_pages - 1) + 1;
+}
+
+/*
+ * Allocate a block of 2^order contiguous frames
+ */
+void *buddy_alloc(uint32_t order) {
+    if (order > BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+    
+    /* Smallest non-empty order that is large enough */
+    uint32_t flags = spin_lock_irqsave(&buddy_lock);
+    uint32_t candidates = free_map & ~((1u << order) - 1);
+    if (candidates == 0) {
+        spin_unlock_irqrestore(&buddy_lock, flags);
+        KLOG(KLOG_ERROR, serial_puts("[BUDDY] Out of page frames\n"));
+        return NULL;
+    }
+    
+    uint32_t current = bit_scan_forward(candidates);
+    uint32_t pfn = ADDR_FRAME(free_lists[current]);
+    free_list_remove(pfn, current);
+    
+    /* Split down to the requested order, freeing the upper halves */
+    while (current > order) {
+        current--;
+        free_list_push(pfn + (1u << current), current);
+    }
+    
+    frame_state[pfn] = BUDDY_FRAME_ALLOCATED | order;
+    free_frames -= 1u << order;
+    spin_unlock_irqrestore(&buddy_lock, flags);
+    
+    return FRAME_ADDR(pfn);
+}
+
+/*
+ * Free a block previously returned by buddy_alloc with the same order
+ */
+void buddy_free(void *addr, uint32_t order) {
+    uint32_t pfn = ADDR_FRAME(addr);
+    uint32_t flags = spin_lock_irqsave(&buddy_lock);
+    
+    if (addr == NULL || ((uint32_t)addr & (PAGE_SIZE - 1)) != 0 ||
+        pfn >= max_frame || frame_state[pfn] != (BUDDY_FRAME_ALLOCATED | order)) {
+        spin_unlock_irqrestore(&buddy_lock, flags);
+        KLOG(KLOG_WARN, serial_puts("[BUDDY] Warning: invalid free of 0x"),
+             serial_put_hex((uint32_t)addr), serial_puts("\n"));
+        return;
+    }
+    
+    frame_state[pfn] = 0;
+    free_frames += 1u << order;
+    free_block(pfn, order);
+    spin_unlock_irqrestore(&buddy_lock, flags);
+}
+
+/*
+ * Allocate exactly num_pages contiguous frames. The run is cut from the
+ * smallest block that holds it and the rest goes straight back; the run
+ * itself is kept as the aligned blocks of num_pages' binary digits,
+ * largest first, so it frees without any record of how it was cut.
+ */
+void *buddy_alloc_pages(uint32_t num_pages) {
+    uint32_t order = buddy_order_for_pages(num_pages);
+    
+    if (num_pages == 0 || order > BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&buddy_lock);
+    uint32_t candidates = free_map & ~((1u << order) - 1);
+    if (candidates == 0) {
+        spin_unlock_irqrestore(&buddy_lock, flags);
+        KLOG(KLOG_ERROR, serial_puts("[BUDDY] Out of page frames\n"));
+        return NULL;
+    }
+    
+    uint32_t current = bit_scan_forward(candidates);
+    uint32_t pfn = ADDR_FRAME(free_lists[current]);
+    free_list_remove(pfn, current);
+    while (current > order) {
+        current--;
+        free_list_push(pfn + (1u << current), current);
+    }
+    
+    /* The run's blocks, then the tail back to the free lists */
+    uint32_t offset = 0;
+    for (int32_t k = (int32_t)order; k >= 0; k--) {
+        if (num_pages & (1u << k)) {
+            frame_state[pfn + offset] = BUDDY_FRAME_ALLOCATED | (uint32_t)k;
+            offset += 1u << k;
+        }
+    }
+    while (offset < (1u << order)) {
+        uint32_t k = bit_scan_forward(offset);
+        free_block(pfn + offset, k);
+        offset += 1u << k;
+    }
+    
+    free_frames -= num_pages;
+    spin_unlock_irqrestore(&buddy_lock, flags);
+    
+    return FRAME_ADDR(pfn);
+}
+
+/*
+ * Free a run previously returned by buddy_alloc_pages with the same count
+ */
+void buddy_free_pages(void *addr, uint32_t num_pages) {
+    uint32_t pfn = ADDR_FRAME(addr);
+    uint32_t flags = spin_lock_irqsave(&buddy_lock);
+    
+    uint32_t valid = (addr != NULL && ((uint32_t)addr & (PAGE_SIZE - 1)) == 0 &&
+                      num_pages != 0 && pfn + num_pages <= max_frame);
+    uint32_t offset = 0;
+    for (int32_t k = 31; valid && k >= 0; k--) {
+        if (num_pages & (1u << k)) {
+            valid = (frame_state[pfn + offset] == (BUDDY_FRAME_ALLOCATED | (uint32_t)k));
+            offset += 1u << k;
+        }
+    }
+    if (!valid) {
+        spin_unlock_irqrestore(&buddy_lock, flags);
+        KLOG(KLOG_WARN, serial_puts("[BUDDY] Warning: invalid free of 0x"),
+             serial_put_hex((uint32_t)addr), serial_puts("\n"));
+        return;
+    }
+    
+    offset = 0;
+    for (int32_t k = 31; k >= 0; k--) {
+        if (num_pages & (1u << k)) {
+            frame_state[pfn + offset] = 0;
+            free_block(pfn + offset, (uint32_t)k);
+            offset += 1u << k;
+        }
+    }
+    free_frames += num_pages;
+    spin_unlock_irqrestore(&buddy_lock, flags);
+}
+
+/*
+ * Get page-frame statistics
+ */
+void buddy_get_stats(buddy_stats_t *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&buddy_lock);
+    stats->total_frames = total_frames;
+    stats->free_frames = free_frames;
+    stats->max_frame = max_frame;
+    for (uint32_t i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        stats->free_blocks[i] = free_counts[i];
+    }
+    spin_unlock_irqrestore(&buddy_lock, flags);
+}
+
+/*
+ * Print page-frame statistics
+ */
+void buddy_print_stats(void) {
+    serial_puts("\n=== Page Frames ===\n");
+    serial_puts("Total:       ");
+    serial_put_dec(total_frames);
+    serial_puts(" (");
+    serial_put_dec(total_frames * (PAGE_SIZE / 1024));
+    serial_puts(" KB)\n");
+    
+    serial_puts("Free:        ");
+    serial_put_dec(free_frames);
+    serial_puts(" (");
+    serial_put_dec(free_frames * (PAGE_SIZE / 1024));
+    serial_puts(" KB)\n");
+    
+    serial_puts("Highest:     0x");
+    serial_put_hex(max_frame << PAGE_SHIFT);
+    serial_puts("\n");
+    
+    serial_puts("Free blocks per order:\n");
+    for (uint32_t i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        serial_puts("  order ");
+        if (i < 10) serial_puts(" ");
+        serial_put_dec(i);
+        serial_puts(" (");
+        serial_put_dec((PAGE_SIZE / 1024) << i);
+        serial_puts(" KB): ");
+        serial_put_dec(free_counts[i]);
+        serial_puts("\n");
+    }
+    serial_puts("===================\n\n");
+}
+
+/* Shell commands */
+
+/*
+ * pages: display page-frame allocator statistics
+ */
+static int buddy_cmd_pages(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    buddy_print_stats();
+    return 0;
+}
+
+SHELL_COMMAND(pages, "pages", "pages", "Display page-frame allocator statistics", buddy_cmd_pages);
@@ -0,0 +1,56 @@
+/* buddy.h - Buddy Page-Frame Allocator Interface */
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#include "types.h"
+#include "multiboot.h"
+
+/*
+ * Physical memory is managed in 4KB page frames. A block of order k is
+ * 2^k contiguous frames aligned to its own size; freeing a block merges it
+ * with its "buddy" (the neighbouring block of the same order) whenever that
+ * buddy is free too, so allocation and free are both O(log n).
+ *
+ * Usable RAM comes from the multiboot memory map; everything else
+ * (low memory, the kernel image, the frame table) stays reserved.
+ */
+
+#define BUDDY_MAX_ORDER         10          /* Largest block: 2^10 pages = 4MB */
+#define BUDDY_LOW_MEMORY_LIMIT  0x100000    /* Never hand out frames below 1MB */
+#define BUDDY_FALLBACK_MEMORY   0x2000000   /* Assume 32MB without boot info */
+
+/* Per-frame state byte */
+#define BUDDY_FRAME_ORDER_MASK  0x1F        /* Order of the block headed here */
+#define BUDDY_FRAME_FREE        0x20        /* Frame heads a free block */
+#define BUDDY_FRAME_ALLOCATED   0x40        /* Frame heads an allocated block */
+#define BUDDY_FRAME_RESERVED    0x80        /* Frame is not managed */
+
+/* Free block header, stored in the first bytes of the free block itself */
+typedef struct buddy_block {
+    struct buddy_block *next;
+    struct buddy_block *prev;
+} buddy_block_t;
+
+/* Page-frame statistics */
+typedef struct buddy_stats {
+    uint32_t total_frames;          /* Frames managed by the allocator */
+    uint32_t free_frames;           /* Frames currently free */
+    uint32_t max_frame;             /* Highest frame number + 1 */
+    uint32_t free_blocks[BUDDY_MAX_ORDER + 1]; /* Free blocks per order */
+} buddy_stats_t;
+
+/* Initialization from boot information (mbi may be NULL) */
+void buddy_init(uint32_t magic, multiboot_info_t *mbi);
+
+/* Block allocation */
+void *buddy_alloc(uint32_t order);              /* Allocate 2^order frames */
+void buddy_free(void *addr, uint32_t order);    /* Free a block */
+void *buddy_alloc_pages(uint32_t num_pages);    /* Exactly num_pages frames */
+void buddy_free_pages(void *addr, uint32_t num_pages);
+uint32_t buddy_order_for_pages(uint32_t num_pages);
+
+/* Statistics */
+void buddy_get_stats(buddy_stats_t *stats);
+void buddy_print_stats(void);
+
+#endif /* BUDDY_H */
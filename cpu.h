@@ -0,0 +1,99 @@
+/* cpu.h - CPU identification and control register helpers */
+#ifndef CPU_H
+#define CPU_H
+
+#include "types.h"
+
+/* CPUID leaf 1 EDX feature bits */
+#define CPUID_FEAT_EDX_TSC      (1u << 4)
+#define CPUID_FEAT_EDX_PSE      (1u << 3)
+#define CPUID_FEAT_EDX_APIC     (1u << 9)
+#define CPUID_FEAT_EDX_PGE      (1u << 13)
+#define CPUID_FEAT_EDX_FXSR     (1u << 24)
+#define CPUID_FEAT_EDX_SSE      (1u << 25)
+#define CPUID_FEAT_EDX_SSE2     (1u << 26)
+
+/* Control register bits */
+#define CR0_MP                  (1u << 1)   /* Monitor coprocessor */
+#define CR0_EM                  (1u << 2)   /* x87 emulation */
+#define CR0_WP                  (1u << 16)  /* Read-only pages bind ring 0 too */
+#define CR0_PG                  (1u << 31)  /* Paging */
+#define CR4_PSE                 (1u << 4)   /* 4MB pages */
+#define CR4_PGE                 (1u << 7)   /* Global pages */
+#define CR4_OSFXSR              (1u << 9)   /* OS supports FXSAVE/SSE */
+#define CR4_OSXMMEXCPT          (1u << 10)  /* OS handles SIMD exceptions */
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+                         uint32_t *ecx, uint32_t *edx) {
+    __asm__ volatile ("cpuid"
+                      : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                      : "a"(leaf), "c"(0));
+}
+
+/* Feature bits from CPUID leaf 1, EDX */
+static inline uint32_t cpu_features_edx(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return edx;
+}
+
+static inline uint32_t read_cr0(void) {
+    uint32_t value;
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint32_t value) {
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint32_t read_cr2(void) {
+    uint32_t value;
+    __asm__ volatile ("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint32_t read_cr3(void) {
+    uint32_t value;
+    __asm__ volatile ("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr3(uint32_t value) {
+    __asm__ volatile ("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline uint32_t read_cr4(void) {
+    uint32_t value;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint32_t value) {
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+/* Drop this CPU's TLB entry for one page, global or not */
+static inline void invlpg(uint32_t addr) {
+    __asm__ volatile ("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+/* Time-stamp counter (every CPU since the Pentium) */
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/* Save EFLAGS and disable interrupts; pair with irq_restore() */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ volatile ("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ volatile ("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+#endif /* CPU_H */
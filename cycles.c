@@ -0,0 +1,136 @@
+/* cycles.c - TSC cycle accounting and latency histograms */
+#include "cycles.h"
+#include "bitops.h"
+#include "serial.h"
+#include "string.h"
+
+/*
+ * Empty a histogram
+ */
+void cycle_hist_reset(cycle_hist_t *hist) {
+    memset(hist, 0, sizeof(cycle_hist_t));
+}
+
+/*
+ * Add one sample; samples beyond 32 bits are clamped
+ */
+void cycle_hist_record(cycle_hist_t *hist, uint64_t cycles) {
+    uint32_t sample = (cycles >> 32) ? 0xFFFFFFFF : (uint32_t)cycles;
+    
+    if (hist->count == 0 || sample < hist->min) {
+        hist->min = sample;
+    }
+    if (sample > hist->max) {
+        hist->max = sample;
+    }
+    hist->count++;
+    hist->total += sample;
+    hist->buckets[(sample > 1) ? bit_scan_reverse(sample) : 0]++;
+}
+
+/*
+ * Fold the samples of one histogram into another
+ */
+void cycle_hist_merge(cycle_hist_t *hist, const cycle_hist_t *other) {
+    if (other->count == 0) {
+        return;
+    }
+    if (hist->count == 0 || other->min < hist->min) {
+        hist->min = other->min;
+    }
+    if (other->max > hist->max) {
+        hist->max = other->max;
+    }
+    hist->count += other->count;
+    hist->total += other->total;
+    for (uint32_t b = 0; b < CYCLE_HIST_BUCKETS; b++) {
+        hist->buckets[b] += other->buckets[b];
+    }
+}
+
+/*
+ * Mean sample, 0 when empty
+ */
+uint32_t cycle_hist_average(const cycle_hist_t *hist) {
+    if (hist->count == 0) {
+        return 0;
+    }
+    return (uint32_t)cycles_div(hist->total, hist->count);
+}
+
+/*
+ * Upper bound of the bucket holding the given percentile, capped at max
+ */
+uint32_t cycle_hist_percentile(const cycle_hist_t *hist, uint32_t percent) {
+    if (hist->count == 0) {
+        return 0;
+    }
+    
+    uint32_t target = (uint32_t)cycles_div((uint64_t)hist->count * percent + 99, 100);
+    uint32_t seen = 0;
+    
+    for (uint32_t b = 0; b < CYCLE_HIST_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen >= target) {
+            uint32_t bound = (b == CYCLE_HIST_BUCKETS - 1) ? 0xFFFFFFFF : (2u << b) - 1;
+            return (bound < hist->max) ? bound : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/*
+ * Column header for cycle_hist_print()
+ */
+void cycle_hist_print_header(void) {
+    serial_puts("Path              Count       Min       Avg       P99       Max\n");
+    serial_puts("------------  ---------  --------  --------  --------  --------\n");
+}
+
+/*
+ * One row: name, sample count and min/avg/p99/max in cycles
+ */
+void cycle_hist_print(const char *name, const cycle_hist_t *hist) {
+    serial_puts(name);
+    for (uint32_t j = strlen(name); j < 12; j++) {
+        serial_puts(" ");
+    }
+    
+    cycles_put_padded(hist->count, 11);
+    cycles_put_padded(hist->min, 10);
+    cycles_put_padded(cycle_hist_average(hist), 10);
+    cycles_put_padded(cycle_hist_percentile(hist, 99), 10);
+    cycles_put_padded(hist->max, 10);
+    serial_puts("\n");
+}
+
+/*
+ * Print a 64-bit cycle count in decimal
+ */
+void cycles_put_dec(uint64_t value) {
+    char buffer[21];
+    int i = 20;
+    
+    buffer[i] = '\0';
+    do {
+        uint64_t quot = cycles_div(value, 10);
+        buffer[--i] = '0' + (char)(value - quot * 10);
+        value = quot;
+    } while (value != 0);
+    
+    serial_puts(&buffer[i]);
+}
+
+/*
+ * Print a cycle count right-aligned in a column of the given width
+ */
+void cycles_put_padded(uint64_t value, uint32_t width) {
+    uint32_t digits = 1;
+    for (uint64_t v = cycles_div(value, 10); v != 0; v = cycles_div(v, 10)) {
+        digits++;
+    }
+    for (; digits < width; digits++) {
+        serial_puts(" ");
+    }
+    cycles_put_dec(value);
+}
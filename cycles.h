@@ -0,0 +1,59 @@
+/* cycles.h - TSC cycle accounting and latency histograms */
+#ifndef CYCLES_H
+#define CYCLES_H
+
+#include "types.h"
+#include "cpu.h"
+
+/*
+ * Latencies are measured in raw TSC cycles. A histogram keeps exact
+ * count/min/max/total plus power-of-two buckets (bucket b holds samples
+ * in [2^b, 2^(b+1)), bucket 0 also holds 0), so a percentile is reported
+ * as the upper bound of the bucket it falls in.
+ */
+
+#define CYCLE_HIST_BUCKETS  32
+
+typedef struct cycle_hist {
+    uint32_t count;                 /* Samples recorded */
+    uint32_t min;                   /* Smallest sample */
+    uint32_t max;                   /* Largest sample */
+    uint64_t total;                 /* Sum of all samples */
+    uint32_t buckets[CYCLE_HIST_BUCKETS];
+} cycle_hist_t;
+
+/* Current cycle count */
+static inline uint64_t cycles_now(void) {
+    return rdtsc();
+}
+
+/*
+ * 64-by-32 bit division with two divl, since the kernel does not link
+ * libgcc's __udivdi3
+ */
+static inline uint64_t cycles_div(uint64_t value, uint32_t divisor) {
+    uint32_t high = (uint32_t)(value >> 32);
+    uint32_t low = (uint32_t)value;
+    uint32_t quot_high = high / divisor;
+    uint32_t rem = high % divisor;
+    uint32_t quot_low;
+    
+    __asm__ ("divl %4" : "=a"(quot_low), "=d"(rem)
+                       : "a"(low), "d"(rem), "rm"(divisor) : "cc");
+    return ((uint64_t)quot_high << 32) | quot_low;
+}
+
+/* Histograms */
+void cycle_hist_reset(cycle_hist_t *hist);
+void cycle_hist_record(cycle_hist_t *hist, uint64_t cycles);
+void cycle_hist_merge(cycle_hist_t *hist, const cycle_hist_t *other);
+uint32_t cycle_hist_average(const cycle_hist_t *hist);
+uint32_t cycle_hist_percentile(const cycle_hist_t *hist, uint32_t percent);
+
+/* Output: a header line, then one row per histogram */
+void cycle_hist_print_header(void);
+void cycle_hist_print(const char *name, const cycle_hist_t *hist);
+void cycles_put_dec(uint64_t value);
+void cycles_put_padded(uint64_t value, uint32_t width);   /* Right-aligned */
+
+#endif /* CYCLES_H */
@@ -0,0 +1,337 @@
+/* idt.c - Interrupt Descriptor Table and interrupt dispatch */
+#include "idt.h"
+#include "pic.h"
+#include "serial.h"
+#include "smp.h"
+#include "cpu.h"
+#include "paging.h"
+
+/* IDT gate descriptor */
+typedef struct __attribute__((packed)) {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t zero;
+    uint8_t type_attr;
+    uint16_t offset_high;
+} idt_entry_t;
+
+/* Operand of lidt */
+typedef struct __attribute__((packed)) {
+    uint16_t limit;
+    uint32_t base;
+} idt_pointer_t;
+
+#define IDT_GATE_INTERRUPT  0x8E    /* Present, ring 0, 32-bit interrupt gate (clears IF) */
+#define IDT_GATE_TASK       0x85    /* Present, ring 0, task gate */
+
+/* 32-bit task-state segment. The kernel never switches tasks itself:
+ * each CPU's TSS only receives the state a double fault leaves behind. */
+typedef struct __attribute__((packed)) {
+    uint32_t prev_task;                         /* Selector of the interrupted task */
+    uint32_t esp0, ss0, esp1, ss1, esp2, ss2;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs, ldt;
+    uint16_t trap, iomap_base;
+} tss_t;
+
+_Static_assert(sizeof(tss_t) == 104, "tss_t must match the hardware layout");
+
+#define TSS_ACCESS          0x89    /* Present, ring 0, available 32-bit TSS */
+#define DOUBLE_FAULT_VECTOR 8
+#define DOUBLE_FAULT_STACK  4096
+
+/* GDT (boot.S): MAX_CPUS TSS descriptors, then the double-fault one */
+extern uint32_t gdt_tss[];
+extern uint8_t gdt_start[];
+
+#define TSS_SELECTOR(slot)  ((uint32_t)((uint8_t *)&gdt_tss[2 * (slot)] - gdt_start))
+
+/* Entry stubs from isr.S */
+extern uint32_t isr_stub_table[IDT_NUM_VECTORS];
+
+static idt_entry_t idt[IDT_NUM_VECTORS];
+static irq_handler_t irq_handlers[IRQ_COUNT];
+static irq_handler_t local_handlers[LOCAL_VECTOR_COUNT];
+static uint32_t spurious_irqs = 0;
+
+/* Stack overflow runs into a guard page, and the page fault it raises
+ * cannot be pushed onto that stack either. The double fault that follows
+ * is a task gate, so it starts afresh on a stack of its own. */
+static tss_t cpu_tss[MAX_CPUS];
+static tss_t double_fault_tss;
+static uint8_t double_fault_stack[DOUBLE_FAULT_STACK] __attribute__((aligned(16)));
+
+static const char *exception_names[IDT_NUM_EXCEPTIONS] = {
+    "Divide error", "Debug", "NMI", "Breakpoint",
+    "Overflow", "Bound range", "Invalid opcode", "Device not available",
+    "Double fault", "Coprocessor overrun", "Invalid TSS", "Segment not present",
+    "Stack fault", "General protection", "Page fault", "Reserved",
+    "x87 FPU error", "Alignment check", "Machine check", "SIMD exception",
+    "Virtualization", "Control protection", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved",
+    "Hypervisor injection", "VMM communication", "Security", "Reserved"
+};
+
+/* Forward declarations for internal functions */
+static void idt_set_gate(uint32_t vector, uint32_t handler);
+static void exception_panic(interrupt_frame_t *frame);
+static void tss_install(uint32_t slot, tss_t *tss);
+static void double_fault_task(void) __attribute__((noreturn));
+
+/*
+ * Build the IDT, load it and remap the PIC. Interrupts stay disabled.
+ */
+void idt_init(void) {
+    for (uint32_t i = 0; i < IDT_NUM_VECTORS; i++) {
+        idt_set_gate(i, isr_stub_table[i]);
+    }
+    
+    /* Double faults run as their own task (see double_fault_tss) */
+    double_fault_tss.cr3 = read_cr3();
+    double_fault_tss.eip = (uint32_t)double_fault_task;
+    double_fault_tss.eflags = 0x2;              /* Interrupts off */
+    double_fault_tss.esp = (uint32_t)double_fault_stack + DOUBLE_FAULT_STACK;
+    double_fault_tss.cs = KERNEL_CODE_SELECTOR;
+    double_fault_tss.ds = KERNEL_DATA_SELECTOR;
+    double_fault_tss.es = KERNEL_DATA_SELECTOR;
+    double_fault_tss.fs = KERNEL_DATA_SELECTOR;
+    double_fault_tss.gs = KERNEL_DATA_SELECTOR;
+    double_fault_tss.ss = KERNEL_DATA_SELECTOR;
+    double_fault_tss.iomap_base = sizeof(tss_t);
+    tss_install(MAX_CPUS, &double_fault_tss);
+    
+    idt[DOUBLE_FAULT_VECTOR].offset_low = 0;
+    idt[DOUBLE_FAULT_VECTOR].selector = TSS_SELECTOR(MAX_CPUS);
+    idt[DOUBLE_FAULT_VECTOR].type_attr = IDT_GATE_TASK;
+    idt[DOUBLE_FAULT_VECTOR].offset_high = 0;
+    for (uint32_t i = 0; i < IRQ_COUNT; i++) {
+        irq_handlers[i] = NULL;
+    }
+    for (uint32_t i = 0; i < LOCAL_VECTOR_COUNT; i++) {
+        local_handlers[i] = NULL;
+    }
+    
+    idt_load();
+    
+    pic_init(IRQ_BASE_VECTOR);
+    
+    serial_puts("[IDT] Interrupt table loaded (");
+    serial_put_dec(IDT_NUM_VECTORS);
+    serial_puts(" vectors, IRQs at ");
+    serial_put_dec(IRQ_BASE_VECTOR);
+    serial_puts(")\n");
+}
+
+/*
+ * Load the table on this CPU, and its TSS: a task switch needs somewhere
+ * to save the state it leaves
+ */
+void idt_load(void) {
+    uint32_t cpu = smp_cpu_id();
+    idt_pointer_t pointer;
+    pointer.limit = sizeof(idt) - 1;
+    pointer.base = (uint32_t)idt;
+    __asm__ volatile ("lidt %0" : : "m"(pointer));
+    
+    cpu_tss[cpu].iomap_base = sizeof(tss_t);
+    tss_install(cpu, &cpu_tss[cpu]);
+    __asm__ volatile ("ltr %w0" : : "r"(TSS_SELECTOR(cpu)));
+}
+
+/*
+ * The page directory the double-fault task runs on; the task switch
+ * loads CR3 from its TSS
+ */
+void idt_set_page_directory(uint32_t cr3) {
+    double_fault_tss.cr3 = cr3;
+}
+
+/*
+ * Point a TSS descriptor at tss (byte granular, limit = its size)
+ */
+static void tss_install(uint32_t slot, tss_t *tss) {
+    uint32_t base = (uint32_t)tss;
+    uint32_t limit = sizeof(tss_t) - 1;
+    
+    gdt_tss[slot * 2] = (base << 16) | (limit & 0xFFFF);
+    gdt_tss[slot * 2 + 1] = (base & 0xFF000000) | (limit & 0xF0000) |
+                            (TSS_ACCESS << 8) | ((base >> 16) & 0xFF);
+}
+
+/*
+ * Point one IDT entry at a handler
+ */
+static void idt_set_gate(uint32_t vector, uint32_t handler) {
+    idt[vector].offset_low = handler & 0xFFFF;
+    idt[vector].selector = KERNEL_CODE_SELECTOR;
+    idt[vector].zero = 0;
+    idt[vector].type_attr = IDT_GATE_INTERRUPT;
+    idt[vector].offset_high = (handler >> 16) & 0xFFFF;
+}
+
+/*
+ * Install a handler for an IRQ line and unmask it
+ */
+void irq_register(uint32_t irq, irq_handler_t handler) {
+    if (irq >= IRQ_COUNT) {
+        return;
+    }
+    irq_handlers[irq] = handler;
+    pic_unmask(irq);
+}
+
+/*
+ * Mask an IRQ line and remove its handler
+ */
+void irq_unregister(uint32_t irq) {
+    if (irq >= IRQ_COUNT) {
+        return;
+    }
+    pic_mask(irq);
+    irq_handlers[irq] = NULL;
+}
+
+/*
+ * Install a handler for a local APIC vector
+ */
+void local_vector_register(uint32_t vector, irq_handler_t handler) {
+    if (vector < LOCAL_BASE_VECTOR || vector >= IDT_NUM_VECTORS) {
+        return;
+    }
+    local_handlers[vector - LOCAL_BASE_VECTOR] = handler;
+}
+
+/*
+ * Common C entry for every interrupt and exception
+ */
+void interrupt_dispatch(interrupt_frame_t *frame) {
+    if (frame->vector < IDT_NUM_EXCEPTIONS) {
+        exception_panic(frame);
+        return;
+    }
+    
+    /* Local APIC: the spurious vector must not be acknowledged */
+    if (frame->vector >= LOCAL_BASE_VECTOR) {
+        if (frame->vector == LAPIC_SPURIOUS_VECTOR) {
+            spurious_irqs++;
+            return;
+        }
+        lapic_eoi();
+        
+        irq_handler_t handler = local_handlers[frame->vector - LOCAL_BASE_VECTOR];
+        if (handler != NULL) {
+            handler(frame);
+        }
+        return;
+    }
+    
+    uint32_t irq = frame->vector - IRQ_BASE_VECTOR;
+    if (irq >= IRQ_COUNT) {
+        return;
+    }
+    
+    if (pic_is_spurious(irq)) {
+        spurious_irqs++;
+        return;
+    }
+    
+    /* Acknowledge first: a handler may switch to another process and not
+     * come back through here for a while */
+    pic_send_eoi(irq);
+    
+    if (irq_handlers[irq] != NULL) {
+        irq_handlers[irq](frame);
+    }
+}
+
+/*
+ * Report a CPU exception and halt; the kernel has no way to recover yet
+ */
+static void exception_panic(interrupt_frame_t *frame) {
+    serial_puts("\n[IDT] *** CPU exception ");
+    serial_put_dec(frame->vector);
+    serial_puts(": ");
+    serial_puts(exception_names[frame->vector]);
+    serial_puts(" ***\n");
+    
+    serial_puts("  EIP=0x");
+    serial_put_hex(frame->eip);
+    serial_puts(" CS=0x");
+    serial_put_hex(frame->cs);
+    serial_puts(" EFLAGS=0x");
+    serial_put_hex(frame->eflags);
+    serial_puts(" ERR=0x");
+    serial_put_hex(frame->error_code);
+    serial_puts("\n");
+    
+    serial_puts("  EAX=0x");
+    serial_put_hex(frame->eax);
+    serial_puts(" EBX=0x");
+    serial_put_hex(frame->ebx);
+    serial_puts(" ECX=0x");
+    serial_put_hex(frame->ecx);
+    serial_puts(" EDX=0x");
+    serial_put_hex(frame->edx);
+    serial_puts("\n");
+    
+    serial_puts("  ESI=0x");
+    serial_put_hex(frame->esi);
+    serial_puts(" EDI=0x");
+    serial_put_hex(frame->edi);
+    serial_puts(" EBP=0x");
+    serial_put_hex(frame->ebp);
+    serial_puts("\n");
+    
+    if (frame->vector == 14) {
+        uint32_t fault_addr = read_cr2();
+        serial_puts("  CR2=0x");
+        serial_put_hex(fault_addr);
+        serial_puts((frame->error_code & PAGE_FAULT_WRITE) ? " (write, " : " (read, ");
+        serial_puts((frame->error_code & PAGE_FAULT_PRESENT) ? "protection)\n" : "not present)\n");
+        paging_describe(fault_addr);
+    }
+    
+    serial_puts("[IDT] System halted\n");
+    serial_flush();
+    for (;;) {
+        __asm__ volatile ("cli; hlt");
+    }
+}
+
+/*
+ * Double-fault task. The faulting CPU's TSS holds the registers it had;
+ * the usual cause is a process stack that ran into its guard page.
+ */
+static void double_fault_task(void) {
+    uint32_t cpu = (double_fault_tss.prev_task - TSS_SELECTOR(0)) / 8;
+    if (cpu >= MAX_CPUS) {
+        cpu = 0;
+    }
+    tss_t *prev = &cpu_tss[cpu];
+    uint32_t fault_addr = read_cr2();
+    
+    /* smp_cpu_id() and the per-CPU counters need the CPU's own %gs */
+    __asm__ volatile ("mov %0, %%gs" : : "r"((uint32_t)PERCPU_SELECTOR(cpu)) : "memory");
+    
+    serial_puts("\n[IDT] *** CPU exception 8: Double fault on CPU ");
+    serial_put_dec(cpu);
+    serial_puts(" ***\n");
+    
+    serial_puts("  EIP=0x");
+    serial_put_hex(prev->eip);
+    serial_puts(" ESP=0x");
+    serial_put_hex(prev->esp);
+    serial_puts(" EBP=0x");
+    serial_put_hex(prev->ebp);
+    serial_puts(" CR2=0x");
+    serial_put_hex(fault_addr);
+    serial_puts("\n");
+    paging_describe(fault_addr);
+    
+    serial_puts("[IDT] System halted\n");
+    serial_flush();
+    for (;;) {
+        __asm__ volatile ("cli; hlt");
+    }
+}
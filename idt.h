@@ -0,0 +1,60 @@
+/* idt.h - Interrupt Descriptor Table and interrupt dispatch */
+#ifndef IDT_H
+#define IDT_H
+
+#include "types.h"
+
+/*
+ * Vectors 0-31 are CPU exceptions. The 16 legacy IRQ lines are remapped
+ * by the PIC to vectors IRQ_BASE_VECTOR .. IRQ_BASE_VECTOR + 15, so they
+ * do not collide with exceptions. The local APIC's own interrupts (timer,
+ * inter-processor) take the 16 vectors after them.
+ */
+#define IDT_NUM_EXCEPTIONS  32
+#define IRQ_BASE_VECTOR     32
+#define IRQ_COUNT           16
+#define LOCAL_BASE_VECTOR   (IRQ_BASE_VECTOR + IRQ_COUNT)
+#define LOCAL_VECTOR_COUNT  16
+#define IDT_NUM_VECTORS     (LOCAL_BASE_VECTOR + LOCAL_VECTOR_COUNT)
+
+#define KERNEL_CODE_SELECTOR 0x08
+#define KERNEL_DATA_SELECTOR 0x10
+
+/* Register state pushed by isr.S (lowest address first) */
+typedef struct interrupt_frame {
+    uint32_t es, ds;                            /* Pushed by isr_common */
+    uint32_t edi, esi, ebp, esp_saved;          /* Pushed by pusha */
+    uint32_t ebx, edx, ecx, eax;
+    uint32_t vector;                            /* Pushed by the stub */
+    uint32_t error_code;                        /* CPU or stub (0) */
+    uint32_t eip, cs, eflags;                   /* Pushed by the CPU */
+} interrupt_frame_t;
+
+/* IRQ handler, called with interrupts disabled after the EOI was sent */
+typedef void (*irq_handler_t)(interrupt_frame_t *frame);
+
+/* Initialization: build and load the IDT, remap the PIC */
+void idt_init(void);
+void idt_load(void);                /* Load the same table on another CPU */
+void idt_set_page_directory(uint32_t cr3);  /* For the double-fault task */
+
+/* IRQ handlers */
+void irq_register(uint32_t irq, irq_handler_t handler);
+void irq_unregister(uint32_t irq);
+
+/* Local APIC vector handlers (LOCAL_BASE_VECTOR ..) */
+void local_vector_register(uint32_t vector, irq_handler_t handler);
+
+/* Called from isr.S */
+void interrupt_dispatch(interrupt_frame_t *frame);
+
+/* Interrupt flag control */
+static inline void interrupts_enable(void) {
+    __asm__ volatile ("sti" : : : "memory");
+}
+
+static inline void interrupts_disable(void) {
+    __asm__ volatile ("cli" : : : "memory");
+}
+
+#endif /* IDT_H */
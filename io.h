@@ -14,4 +14,9 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
+/* Short delay for devices that need time between port writes (old PICs) */
+static inline void io_wait(void) {
+    outb(0x80, 0);
+}
+
 #endif
\ No newline at end of file
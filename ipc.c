@@ -0,0 +1,429 @@
+/* ipc.c - Message channels */
+#include "ipc.h"
+#include "process.h"
+#include "scheduler.h"
+#include "memory.h"
+#include "slab.h"
+#include "string.h"
+#include "cpu.h"
+#include "bitops.h"
+
+/* Every message starts with this header; records stay 4-byte aligned */
+typedef struct {
+    uint32_t length;                /* Payload bytes */
+    uint32_t type;                  /* IPC_RECORD_* */
+} ipc_record_t;
+
+#define IPC_RECORD_INLINE   0       /* Payload follows the header */
+#define IPC_RECORD_BUFFER   1       /* A buffer pointer follows the header */
+
+#define RECORD_SIZE(payload)    (sizeof(ipc_record_t) + (((payload) + 3) & ~3u))
+
+static kmem_cache_t *channel_cache = NULL;
+
+/* Forward declarations for internal functions */
+static void ring_write(ipc_channel_t *channel, uint32_t pos, const void *src, uint32_t length);
+static void ring_read(ipc_channel_t *channel, uint32_t pos, void *dst, uint32_t length);
+static int channel_put(ipc_channel_t *channel, uint32_t type, const void *payload,
+                       uint32_t length, uint32_t flags);
+static int channel_peek(ipc_channel_t *channel, ipc_record_t *record, uint32_t flags);
+static void channel_pop(ipc_channel_t *channel, ipc_record_t *record);
+static int channel_wait(ipc_channel_t *channel, ipc_wait_list_t *list, uint32_t flags);
+static void channel_free(ipc_channel_t *channel);
+static void wait_list_wake(ipc_wait_list_t *list, int all);
+static void channel_unlock(ipc_channel_t *channel, uint32_t irq_flags, int result);
+
+/*
+ * Create a channel with a ring of at least size bytes
+ */
+ipc_channel_t *ipc_channel_create(uint32_t size) {
+    if (size < IPC_MIN_CHANNEL_SIZE) {
+        size = IPC_MIN_CHANNEL_SIZE;
+    }
+    if (size > IPC_MAX_CHANNEL_SIZE) {
+        return NULL;
+    }
+    size = 1u << (bit_scan_reverse(size - 1) + 1);
+    
+    /* Two CPUs creating the first channel at once: one cache survives */
+    if (__atomic_load_n(&channel_cache, __ATOMIC_ACQUIRE) == NULL) {
+        kmem_cache_t *cache = kmem_cache_create("ipc_channel", sizeof(ipc_channel_t), 0, NULL);
+        kmem_cache_t *expected = NULL;
+        
+        if (cache != NULL && !__atomic_compare_exchange_n(&channel_cache, &expected, cache, 0,
+                                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            kmem_cache_destroy(cache);
+        }
+        if (__atomic_load_n(&channel_cache, __ATOMIC_ACQUIRE) == NULL) {
+            return NULL;
+        }
+    }
+    
+    ipc_channel_t *channel = (ipc_channel_t *)kmem_cache_alloc(channel_cache);
+    if (channel == NULL) {
+        return NULL;
+    }
+    
+    memset(channel, 0, sizeof(ipc_channel_t));
+    spin_lock_init(&channel->lock);
+    channel->ring = (uint8_t *)kmalloc(size);
+    if (channel->ring == NULL) {
+        kmem_cache_free(channel_cache, channel);
+        return NULL;
+    }
+    channel->size = size;
+    
+    return channel;
+}
+
+/*
+ * Destroy a channel. Queued buffers are freed and every waiter returns
+ * IPC_ERR_CLOSED; the memory goes once the last of them has left.
+ */
+void ipc_channel_destroy(ipc_channel_t *channel) {
+    if (channel == NULL) {
+        return;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&channel->lock);
+    if (channel->closed) {
+        spin_unlock_irqrestore(&channel->lock, flags);
+        return;
+    }
+    
+    while (channel->count > 0) {
+        ipc_record_t record;
+        channel_peek(channel, &record, IPC_NONBLOCK);
+        if (record.type == IPC_RECORD_BUFFER) {
+            void *buffer;
+            ring_read(channel, channel->tail + sizeof(ipc_record_t), &buffer, sizeof(buffer));
+            kfree(buffer);
+        }
+        channel_pop(channel, &record);
+    }
+    
+    channel->closed = 1;
+    wait_list_wake(&channel->senders, 1);
+    wait_list_wake(&channel->receivers, 1);
+    
+    int unused = (channel->waiters == 0 && channel->refs == 0);
+    spin_unlock_irqrestore(&channel->lock, flags);
+    if (unused) {
+        channel_free(channel);
+    }
+}
+
+/*
+ * Take a hold on a channel that has not been destroyed yet
+ */
+void ipc_channel_hold(ipc_channel_t *channel) {
+    __atomic_add_fetch(&channel->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * Drop a hold; the last one out of a destroyed channel frees it
+ */
+void ipc_channel_release(ipc_channel_t *channel) {
+    uint32_t flags = spin_lock_irqsave(&channel->lock);
+    channel->refs--;
+    int last = (channel->closed && channel->waiters == 0 && channel->refs == 0);
+    spin_unlock_irqrestore(&channel->lock, flags);
+    
+    if (last) {
+        channel_free(channel);
+    }
+}
+
+/*
+ * Release the ring and the channel itself (unlocked: nobody else can
+ * reach it any more)
+ */
+static void channel_free(ipc_channel_t *channel) {
+    kfree(channel->ring);
+    kmem_cache_free(channel_cache, channel);
+}
+
+/*
+ * Copy into the ring at a free-running position, wrapping at the end
+ */
+static void ring_write(ipc_channel_t *channel, uint32_t pos, const void *src, uint32_t length) {
+    uint32_t offset = pos & (channel->size - 1);
+    uint32_t first = channel->size - offset;
+    
+    if (first > length) {
+        first = length;
+    }
+    memcpy(channel->ring + offset, src, first);
+    memcpy(channel->ring, (const uint8_t *)src + first, length - first);
+}
+
+/*
+ * Copy out of the ring at a free-running position, wrapping at the end
+ */
+static void ring_read(ipc_channel_t *channel, uint32_t pos, void *dst, uint32_t length) {
+    uint32_t offset = pos & (channel->size - 1);
+    uint32_t first = channel->size - offset;
+    
+    if (first > length) {
+        first = length;
+    }
+    memcpy(dst, channel->ring + offset, first);
+    memcpy((uint8_t *)dst + first, channel->ring, length - first);
+}
+
+/*
+ * Block the running process on one side of a channel until woken. Past
+ * IPC_MAX_WAITERS a caller is not queued and retries every tick instead.
+ * The channel lock is dropped while waiting; being blocked before that
+ * means a wake-up in between is not lost.
+ */
+static int channel_wait(ipc_channel_t *channel, ipc_wait_list_t *list, uint32_t flags) {
+    process_t *self = scheduler_get_running();
+    
+    if ((flags & IPC_NONBLOCK) || self == NULL) {
+        return IPC_ERR_WOULD_BLOCK;
+    }
+    
+    channel->waiters++;
+    self->cold->ipc_wait = channel;
+    if (list->head - list->tail < IPC_MAX_WAITERS) {
+        list->pids[list->head++ % IPC_MAX_WAITERS] = self->pid;
+        process_block(self->pid);
+    }
+    
+    spin_unlock(&channel->lock);
+    scheduler_wait_tick();
+    spin_lock(&channel->lock);
+    
+    self->cold->ipc_wait = NULL;
+    channel->waiters--;
+    return channel->closed ? IPC_ERR_CLOSED : IPC_OK;
+}
+
+/*
+ * Wake the first (or every) process still blocked on a wait list;
+ * entries of processes that moved on since are dropped
+ */
+static void wait_list_wake(ipc_wait_list_t *list, int all) {
+    while (list->tail != list->head) {
+        uint32_t pid = list->pids[list->tail++ % IPC_MAX_WAITERS];
+        
+        if (process_get_state(pid) == PROC_STATE_BLOCKED) {
+            process_unblock(pid);
+            if (!all) {
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Unlock after a call. When a wait ended on a destroyed channel, the
+ * last waiter to leave frees it.
+ */
+static void channel_unlock(ipc_channel_t *channel, uint32_t irq_flags, int result) {
+    int last = (result == IPC_ERR_CLOSED && channel->waiters == 0 && channel->refs == 0);
+    
+    spin_unlock_irqrestore(&channel->lock, irq_flags);
+    if (last) {
+        channel_free(channel);
+    }
+}
+
+/*
+ * A process terminated while blocked on a channel: drop its part in the
+ * waiter count. Its wait list entry goes stale and is skipped.
+ */
+void ipc_cancel_wait(struct process *proc) {
+    ipc_channel_t *channel = proc->cold->ipc_wait;
+    
+    if (channel == NULL) {
+        return;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&channel->lock);
+    proc->cold->ipc_wait = NULL;
+    channel->waiters--;
+    int last = (channel->closed && channel->waiters == 0 && channel->refs == 0);
+    spin_unlock_irqrestore(&channel->lock, flags);
+    
+    if (last) {
+        channel_free(channel);
+    }
+}
+
+/*
+ * Append one record once there is room for it
+ */
+static int channel_put(ipc_channel_t *channel, uint32_t type, const void *payload,
+                       uint32_t length, uint32_t flags) {
+    uint32_t stored = (type == IPC_RECORD_BUFFER) ? sizeof(void *) : length;
+    uint32_t needed = RECORD_SIZE(stored);
+    
+    if (channel->closed) {
+        return IPC_ERR_CLOSED;
+    }
+    if (needed > channel->size) {
+        return IPC_ERR_TOO_BIG;
+    }
+    
+    while (channel->size - (channel->head - channel->tail) < needed) {
+        int result = channel_wait(channel, &channel->senders, flags);
+        if (result != IPC_OK) {
+            return result;
+        }
+    }
+    
+    ipc_record_t record = { length, type };
+    ring_write(channel, channel->head, &record, sizeof(record));
+    ring_write(channel, channel->head + sizeof(record), payload, stored);
+    channel->head += needed;
+    channel->count++;
+    channel->messages_sent++;
+    
+    wait_list_wake(&channel->receivers, 0);
+    return IPC_OK;
+}
+
+/*
+ * Read the oldest record's header, waiting for one if needed
+ */
+static int channel_peek(ipc_channel_t *channel, ipc_record_t *record, uint32_t flags) {
+    if (channel->closed) {
+        return IPC_ERR_CLOSED;
+    }
+    while (channel->count == 0) {
+        int result = channel_wait(channel, &channel->receivers, flags);
+        if (result != IPC_OK) {
+            return result;
+        }
+    }
+    
+    ring_read(channel, channel->tail, record, sizeof(ipc_record_t));
+    return IPC_OK;
+}
+
+/*
+ * Drop the oldest record and let a waiting sender use the room
+ */
+static void channel_pop(ipc_channel_t *channel, ipc_record_t *record) {
+    uint32_t stored = (record->type == IPC_RECORD_BUFFER) ? sizeof(void *) : record->length;
+    
+    channel->tail += RECORD_SIZE(stored);
+    channel->count--;
+    wait_list_wake(&channel->senders, 0);
+}
+
+/*
+ * Send a small message by copy
+ */
+int ipc_send(ipc_channel_t *channel, const void *data, uint32_t length, uint32_t flags) {
+    if (channel == NULL || (data == NULL && length > 0)) {
+        return IPC_ERR_INVALID;
+    }
+    if (length > IPC_MAX_INLINE) {
+        return IPC_ERR_TOO_BIG;
+    }
+    
+    uint32_t irq_flags = spin_lock_irqsave(&channel->lock);
+    int result = channel_put(channel, IPC_RECORD_INLINE, data, length, flags);
+    channel_unlock(channel, irq_flags, result);
+    
+    return result;
+}
+
+/*
+ * Send a kmalloc'd buffer by handing it over. On failure the caller
+ * still owns it.
+ */
+int ipc_send_buffer(ipc_channel_t *channel, void *buffer, uint32_t length, uint32_t flags) {
+    if (channel == NULL || buffer == NULL) {
+        return IPC_ERR_INVALID;
+    }
+    
+    uint32_t irq_flags = spin_lock_irqsave(&channel->lock);
+    int result = channel_put(channel, IPC_RECORD_BUFFER, &buffer, length, flags);
+    if (result == IPC_OK) {
+        channel->buffers_sent++;
+    }
+    channel_unlock(channel, irq_flags, result);
+    
+    return result;
+}
+
+/*
+ * Receive into a caller buffer; a handed-over buffer is copied and freed
+ */
+int ipc_receive(ipc_channel_t *channel, void *buffer, uint32_t size, uint32_t flags) {
+    if (channel == NULL || (buffer == NULL && size > 0)) {
+        return IPC_ERR_INVALID;
+    }
+    
+    uint32_t irq_flags = spin_lock_irqsave(&channel->lock);
+    ipc_record_t record;
+    int result = channel_peek(channel, &record, flags);
+    
+    if (result == IPC_OK && record.length > size) {
+        result = IPC_ERR_TOO_BIG;
+    }
+    if (result == IPC_OK) {
+        uint32_t pos = channel->tail + sizeof(ipc_record_t);
+        
+        if (record.type == IPC_RECORD_BUFFER) {
+            void *data;
+            ring_read(channel, pos, &data, sizeof(data));
+            memcpy(buffer, data, record.length);
+            kfree(data);
+        } else {
+            ring_read(channel, pos, buffer, record.length);
+        }
+        channel_pop(channel, &record);
+        result = (int)record.length;
+    }
+    channel_unlock(channel, irq_flags, result);
+    
+    return result;
+}
+
+/*
+ * Receive as a kmalloc'd buffer; a small copied message gets one
+ * allocated for it
+ */
+int ipc_receive_buffer(ipc_channel_t *channel, void **buffer, uint32_t flags) {
+    if (channel == NULL || buffer == NULL) {
+        return IPC_ERR_INVALID;
+    }
+    
+    uint32_t irq_flags = spin_lock_irqsave(&channel->lock);
+    ipc_record_t record;
+    int result = channel_peek(channel, &record, flags);
+    
+    if (result == IPC_OK) {
+        uint32_t pos = channel->tail + sizeof(ipc_record_t);
+        
+        if (record.type == IPC_RECORD_BUFFER) {
+            ring_read(channel, pos, buffer, sizeof(void *));
+        } else {
+            *buffer = kmalloc(record.length ? record.length : 1);
+            if (*buffer == NULL) {
+                result = IPC_ERR_NO_MEMORY;
+            } else {
+                ring_read(channel, pos, *buffer, record.length);
+            }
+        }
+    }
+    if (result == IPC_OK) {
+        channel_pop(channel, &record);
+        result = (int)record.length;
+    }
+    channel_unlock(channel, irq_flags, result);
+    
+    return result;
+}
+
+/*
+ * Messages waiting to be received
+ */
+uint32_t ipc_channel_count(ipc_channel_t *channel) {
+    return (channel != NULL) ? channel->count : 0;
+}
@@ -0,0 +1,93 @@
+/* ipc.h - Message channels */
+#ifndef IPC_H
+#define IPC_H
+
+#include "types.h"
+#include "spinlock.h"
+
+/*
+ * A channel is a power-of-two byte ring of variable-length records. head
+ * and tail run freely and are masked on access, so neither side ever
+ * shifts queued data. Small payloads are copied into the ring; a large
+ * one travels as a kmalloc'd buffer whose ownership passes from sender
+ * to receiver, so only the pointer is queued.
+ *
+ * Sending to a full channel or receiving from an empty one blocks the
+ * running process until the other side makes room or data. The null
+ * context cannot block and gets IPC_ERR_WOULD_BLOCK instead, as does any
+ * caller passing IPC_NONBLOCK.
+ *
+ * Each channel has its own lock, which a waiter drops while it sleeps.
+ * It is taken before the process lock, never after.
+ */
+
+#define IPC_NONBLOCK            0x1     /* Fail instead of waiting */
+
+#define IPC_MIN_CHANNEL_SIZE    64      /* Ring bytes */
+#define IPC_MAX_CHANNEL_SIZE    65536
+#define IPC_MAX_INLINE          256     /* Larger payloads go by buffer */
+#define IPC_MAX_WAITERS         8       /* Blocked processes per side; more poll */
+
+/* Results; receive calls return the message length on success */
+#define IPC_OK                  0
+#define IPC_ERR_INVALID         (-1)
+#define IPC_ERR_WOULD_BLOCK     (-2)
+#define IPC_ERR_TOO_BIG         (-3)    /* Too big for the channel or receive buffer */
+#define IPC_ERR_CLOSED          (-4)    /* Channel destroyed while waiting */
+#define IPC_ERR_NO_MEMORY       (-5)
+
+/* PIDs of processes blocked on one side of a channel */
+typedef struct ipc_wait_list {
+    uint32_t pids[IPC_MAX_WAITERS];
+    uint32_t head;                  /* Free running, like the ring */
+    uint32_t tail;
+} ipc_wait_list_t;
+
+typedef struct ipc_channel {
+    spinlock_t lock;                /* Everything below */
+    uint8_t *ring;                  /* size bytes from kmalloc */
+    uint32_t size;                  /* Power of two */
+    uint32_t head;                  /* Next byte written */
+    uint32_t tail;                  /* Next byte read */
+    uint32_t count;                 /* Messages queued */
+    uint32_t waiters;               /* Processes inside a blocking call */
+    uint32_t refs;                  /* Holds taken with ipc_channel_hold() */
+    uint8_t closed;                 /* Destroyed; freed when waiters and holds drain */
+    ipc_wait_list_t senders;        /* Waiting for room */
+    ipc_wait_list_t receivers;      /* Waiting for a message */
+    uint32_t messages_sent;
+    uint32_t buffers_sent;          /* Of those, handed over by pointer */
+} ipc_channel_t;
+
+/* Channel lifetime; size is rounded up to a power of two */
+ipc_channel_t *ipc_channel_create(uint32_t size);
+void ipc_channel_destroy(ipc_channel_t *channel);
+
+/* Keep a channel's memory alive across a call made without its owner's
+ * lock. Only while it cannot have been destroyed yet; a call on a
+ * channel destroyed meanwhile returns IPC_ERR_CLOSED. */
+void ipc_channel_hold(ipc_channel_t *channel);
+void ipc_channel_release(ipc_channel_t *channel);
+
+/* Copy up to IPC_MAX_INLINE bytes into the channel */
+int ipc_send(ipc_channel_t *channel, const void *data, uint32_t length, uint32_t flags);
+
+/* Queue a kmalloc'd buffer; the channel owns it from here on, the
+ * receiver after it is delivered */
+int ipc_send_buffer(ipc_channel_t *channel, void *buffer, uint32_t length, uint32_t flags);
+
+/* Copy the next message into buffer (IPC_ERR_TOO_BIG leaves it queued) */
+int ipc_receive(ipc_channel_t *channel, void *buffer, uint32_t size, uint32_t flags);
+
+/* Take the next message as a kmalloc'd buffer the caller must kfree;
+ * zero-copy for messages sent with ipc_send_buffer() */
+int ipc_receive_buffer(ipc_channel_t *channel, void **buffer, uint32_t flags);
+
+/* Messages queued */
+uint32_t ipc_channel_count(ipc_channel_t *channel);
+
+/* A terminated process stops waiting on its channel */
+struct process;
+void ipc_cancel_wait(struct process *proc);
+
+#endif /* IPC_H */
@@ -2,11 +2,23 @@
 #include "types.h"
 #include "serial.h"
 #include "string.h"
+#include "multiboot.h"
+#include "buddy.h"
 #include "memory.h"
+#include "slab.h"
 #include "process.h"
 #include "scheduler.h"
+#include "idt.h"
+#include "timer.h"
+#include "trace.h"
+#include "bench.h"
+#include "smp.h"
+#include "paging.h"
+#include "shell.h"
 
-#define MAX_INPUT 128
+/* Multiboot command line, copied before the memory it came in is reused */
+#define BOOT_CMDLINE_SIZE   256
+static char boot_cmdline[BOOT_CMDLINE_SIZE];
 
 void test_memory_manager(void);
 void test_process_manager(void);
@@ -14,26 +26,61 @@ void test_scheduler(void);
 void dummy_process_1(void);
 void dummy_process_2(void);
 void dummy_process_3(void);
+static void boot_save_cmdline(uint32_t magic, multiboot_info_t *mbi);
+static int boot_option(const char *option);
+static process_priority_t parse_priority(const char *text);
 
-void kmain(void) {
-    char input[MAX_INPUT];
-    int pos = 0;
+void kmain(uint32_t magic, multiboot_info_t *mbi) {
+    /* Boot options, before anything can reuse the memory they are in */
+    boot_save_cmdline(magic, mbi);
+    
+    /* This CPU's %gs area; smp_cpu_id() reads it from here on */
+    percpu_init(0);
     
     /* Initialize hardware */
     serial_init();
     
+    /* Pick memcpy/memset strategy for this CPU */
+    string_init();
+    
+    /* Install interrupt table and remap the PIC (interrupts stay off) */
+    idt_init();
+    
+    /* Ring-buffered, interrupt-driven COM1 from here on */
+    serial_enable_interrupts();
+    
+    /* Initialize page-frame allocator from the boot memory map */
+    buddy_init(magic, mbi);
+    
+    /* Identity-map RAM and turn on paging */
+    paging_init();
+    
     /* Initialize memory manager */
     memory_init();
     
+    /* Initialize slab allocator (object caches) */
+    slab_init();
+    
     /* Initialize process manager */
     process_init();
     
     /* Initialize scheduler */
     scheduler_init(SCHED_POLICY_PRIORITY, 100);
     
+    /* Start the hardware timer; 'timer on' lets it drive the scheduler */
+    timer_init(TIMER_HZ);
+    
+    /* Start the other CPUs; they idle until the timer drives scheduling */
+    smp_init();
+    
     /* Start scheduler */
     scheduler_start();
     
+    /* 'make bench': run the suite on a clean system and leave QEMU */
+    if (boot_option("bench")) {
+        bench_exit((bench_run_all() == 0) ? BENCH_EXIT_SUCCESS : BENCH_EXIT_FAILURE);
+    }
+    
     /* Create some demo processes for testing */
     serial_puts("\n[DEMO] Creating test processes...\n");
     process_create_with_time("CriticalTask", dummy_process_1, PROC_PRIORITY_CRITICAL, 250);
@@ -52,201 +99,47 @@ void kmain(void) {
     serial_puts("Type 'help' for commands, 'tick 100' to run scheduler\n\n");
     
     /* Main loop - the "null process" */
-    while (1) {
-        serial_puts("kacchiOS> ");
-        pos = 0;
+    shell_run();
+}
+
+/*
+ * Copy the multiboot command line into boot_cmdline, cut at
+ * BOOT_CMDLINE_SIZE - 1 characters. Runs before the allocators take
+ * over the pages the loader left it in.
+ */
+static void boot_save_cmdline(uint32_t magic, multiboot_info_t *mbi) {
+    uint32_t len = 0;
+    
+    if (magic == MULTIBOOT_BOOTLOADER_MAGIC && mbi != NULL &&
+        (mbi->flags & MULTIBOOT_INFO_CMDLINE) && mbi->cmdline != 0) {
+        const char *cmdline = (const char *)mbi->cmdline;
         
-        /* Read input line */
-        while (1) {
-            char c = serial_getc();
-            
-            /* Handle Enter key */
-            if (c == '\r' || c == '\n') {
-                input[pos] = '\0';
-                serial_puts("\n");
-                break;
-            }
-            /* Handle Backspace */
-            else if ((c == '\b' || c == 0x7F) && pos > 0) {
-                pos--;
-                serial_puts("\b \b");  /* Erase character on screen */
-            }
-            /* Handle normal characters */
-            else if (c >= 32 && c < 127 && pos < MAX_INPUT - 1) {
-                input[pos++] = c;
-                serial_putc(c);  /* Echo character */
-            }
+        while (len < BOOT_CMDLINE_SIZE - 1 && cmdline[len] != '\0') {
+            boot_cmdline[len] = cmdline[len];
+            len++;
         }
+    }
+    boot_cmdline[len] = '\0';
+}
+
+/*
+ * Check the saved command line for a whitespace-separated word
+ */
+static int boot_option(const char *option) {
+    const char *p = boot_cmdline;
+    size_t len = strlen(option);
+    
+    while (*p != '\0') {
+        while (*p == ' ') p++;
+        
+        const char *word = p;
+        while (*p != '\0' && *p != ' ') p++;
         
-        /* Echo back the input */
-        if (pos > 0) {
-            /* Check for built-in commands */
-            if (strcmp(input, "help") == 0) {
-                serial_puts("Available commands:\n");
-                serial_puts("  help      - Show this help message\n");
-                serial_puts("  memstats  - Display memory statistics\n");
-                serial_puts("  memtest   - Run memory allocation tests\n");
-                serial_puts("  ps        - Show process table\n");
-                serial_puts("  proctest  - Run process manager tests\n");
-                serial_puts("  create <name> <priority> <time> - Create a process\n");
-                serial_puts("  kill <n>  - Terminate process with PID n\n");
-                serial_puts("  info <n>  - Show process info for PID n\n");
-                serial_puts("  schedtest - Run scheduler tests\n");
-                serial_puts("  schedstats- Show scheduler statistics\n");
-                serial_puts("  schedconf - Show scheduler configuration\n");
-                serial_puts("  sched     - Start the scheduler\n");
-                serial_puts("  tick [n]  - Advance scheduler by n ticks (default 1)\n");
-                serial_puts("  clear     - Clear the screen\n");
-            }
-            else if (strcmp(input, "memstats") == 0) {
-                memory_print_stats();
-            }
-            else if (strcmp(input, "memtest") == 0) {
-                test_memory_manager();
-            }
-            else if (strcmp(input, "ps") == 0) {
-                process_print_table();
-            }
-            else if (strcmp(input, "proctest") == 0) {
-                test_process_manager();
-            }
-            else if (strcmp(input, "schedtest") == 0) {
-                test_scheduler();
-            }
-            else if (strcmp(input, "schedstats") == 0) {
-                scheduler_print_stats();
-            }
-            else if (strcmp(input, "schedconf") == 0) {
-                scheduler_print_config();
-            }
-            else if (strcmp(input, "sched") == 0) {
-                scheduler_start();
-            }
-            else if (strlen(input) >= 4 && input[0] == 't' && input[1] == 'i' && 
-                     input[2] == 'c' && input[3] == 'k') {
-                /* Parse tick count */
-                uint32_t ticks = 1;
-                if (input[4] == ' ') {
-                    int idx = 5;
-                    ticks = 0;
-                    while (input[idx] >= '0' && input[idx] <= '9') {
-                        ticks = ticks * 10 + (input[idx] - '0');
-                        idx++;
-                    }
-                    if (ticks == 0) ticks = 1;
-                }
-                
-                serial_puts("Advancing scheduler by ");
-                serial_put_dec(ticks);
-                serial_puts(" tick(s)\n");
-                
-                for (uint32_t i = 0; i < ticks; i++) {
-                    scheduler_tick();
-                }
-            }
-            else if (strlen(input) >= 6 && input[0] == 'c' && input[1] == 'r' && 
-                     input[2] == 'e' && input[3] == 'a' && input[4] == 't' && input[5] == 'e') {
-                /* Parse: create <name> <priority> <required_time> */
-                char name[32] = "Process";
-                process_priority_t priority = PROC_PRIORITY_NORMAL;
-                uint32_t required_time = 0;
-                
-                /* Skip "create " */
-                int idx = 7;
-                
-                /* Parse name */
-                int name_idx = 0;
-                while (input[idx] != '\0' && input[idx] != ' ' && name_idx < 31) {
-                    name[name_idx++] = input[idx++];
-                }
-                name[name_idx] = '\0';
-                
-                /* Skip spaces */
-                while (input[idx] == ' ') idx++;
-                
-                /* Parse priority */
-                if (input[idx] != '\0') {
-                    if (input[idx] == 'h' || input[idx] == 'H') {
-                        priority = PROC_PRIORITY_HIGH;
-                    } else if (input[idx] == 'n' || input[idx] == 'N') {
-                        priority = PROC_PRIORITY_NORMAL;
-                    } else if (input[idx] == 'l' || input[idx] == 'L') {
-                        priority = PROC_PRIORITY_LOW;
-                    } else if (input[idx] == 'c' || input[idx] == 'C') {
-                        priority = PROC_PRIORITY_CRITICAL;
-                    } else {
-                        /* Try numeric priority (0-3) */
-                        int prio = input[idx] - '0';
-                        if (prio >= 0 && prio <= 3) {
-                            priority = (process_priority_t)prio;
-                        }
-                    }
-                    
-                    /* Skip to next space */
-                    while (input[idx] != '\0' && input[idx] != ' ') idx++;
-                    while (input[idx] == ' ') idx++;
-                    
-                    /* Parse required time */
-                    if (input[idx] >= '0' && input[idx] <= '9') {
-                        required_time = 0;
-                        while (input[idx] >= '0' && input[idx] <= '9') {
-                            required_time = required_time * 10 + (input[idx] - '0');
-                            idx++;
-                        }
-                    }
-                }
-                
-                process_t *proc;
-                if (required_time > 0) {
-                    proc = process_create_with_time(name, dummy_process_1, priority, required_time);
-                } else {
-                    proc = process_create(name, dummy_process_1, priority);
-                }
-                
-                if (proc) {
-                    serial_puts("Created process '");
-                    serial_puts(name);
-                    serial_puts("' with PID ");
-                    serial_put_dec(proc->pid);
-                    serial_puts(" and priority ");
-                    serial_put_dec(priority);
-                    serial_puts("\n");
-                }
-            }
-            else if (strlen(input) > 5 && input[0] == 'k' && input[1] == 'i' && 
-                     input[2] == 'l' && input[3] == 'l' && input[4] == ' ') {
-                /* Simple atoi for PID */
-                uint32_t pid = 0;
-                for (int i = 5; input[i] >= '0' && input[i] <= '9'; i++) {
-                    pid = pid * 10 + (input[i] - '0');
-                }
-                process_terminate(pid);
-            }
-            else if (strlen(input) > 5 && input[0] == 'i' && input[1] == 'n' && 
-                     input[2] == 'f' && input[3] == 'o' && input[4] == ' ') {
-                /* Simple atoi for PID */
-                uint32_t pid = 0;
-                for (int i = 5; input[i] >= '0' && input[i] <= '9'; i++) {
-                    pid = pid * 10 + (input[i] - '0');
-                }
-                process_print_info(pid);
-            }
-            else if (strcmp(input, "clear") == 0) {
-                serial_puts("\033[2J\033[H");  /* ANSI escape codes to clear screen */
-            }
-            else {
-                serial_puts("You typed: ");
-                serial_puts(input);
-                serial_puts("\n");
-                serial_puts("Type 'help' for available commands\n");
-            }
+        if ((size_t)(p - word) == len && memcmp(word, option, len) == 0) {
+            return 1;
         }
     }
-    
-    /* Should never reach here */
-    for (;;) {
-        __asm__ volatile ("hlt");
-    }
+    return 0;
 }
 
 /* Test the memory manager */
@@ -324,14 +217,23 @@ void test_memory_manager(void) {
 void dummy_process_1(void) {
     serial_puts("[Process 1] Running...\n");
     /* In a real OS, this would execute process code */
+    for (;;) {
+        scheduler_wait_tick();
+    }
 }
 
 void dummy_process_2(void) {
     serial_puts("[Process 2] Running...\n");
+    for (;;) {
+        scheduler_wait_tick();
+    }
 }
 
 void dummy_process_3(void) {
     serial_puts("[Process 3] Running...\n");
+    for (;;) {
+        scheduler_wait_tick();
+    }
 }
 
 /* Test the process manager */
@@ -436,7 +338,7 @@ void test_scheduler(void) {
     process_t *selected = scheduler_select_next_process();
     if (selected) {
         serial_puts("  Selected: ");
-        serial_puts(selected->name);
+        serial_puts(selected->cold->name);
         serial_puts(" (PID ");
         serial_put_dec(selected->pid);
         serial_puts(", Priority ");
@@ -451,39 +353,42 @@ void test_scheduler(void) {
         scheduler_tick();
     }
     
-    /* Test 5: Context switch simulation */
-    serial_puts("\nTest 5: Context switch simulation...\n");
+    /* Test 5: Context switch round trip */
+    serial_puts("\nTest 5: Context switch round trip...\n");
     process_t *from = process_dequeue_ready();
     process_t *to = process_dequeue_ready();
     
     if (from && to) {
         serial_puts("  Switching from ");
-        serial_puts(from->name);
+        serial_puts(from->cold->name);
         serial_puts(" to ");
-        serial_puts(to->name);
+        serial_puts(to->cold->name);
         serial_puts("\n");
         
-        scheduler_switch_context(from, to);
+        /* Runs to on its own stack until it waits for the next tick */
+        scheduler_switch_context(NULL, to);
         serial_puts("  Context switch completed\n");
     }
+    if (from) process_enqueue_ready(from);
+    if (to) process_enqueue_ready(to);
     
     /* Test 6: Test aging */
     serial_puts("\nTest 6: Testing aging mechanism...\n");
     if (p3) {
         serial_puts("  Process ");
-        serial_puts(p3->name);
+        serial_puts(p3->cold->name);
         serial_puts(" age before: ");
-        serial_put_dec(p3->age);
+        serial_put_dec(process_get_age(p3));
         serial_puts("\n");
         
-        /* Artificially age the process */
-        p3->age = 95;
-        serial_puts("  Artificially set age to 95\n");
+        /* Artificially age the process: pretend it was enqueued 100 ticks ago */
+        p3->enqueue_tick -= 100;
+        serial_puts("  Artificially added 100 ticks of waiting\n");
         
         scheduler_check_aging();
         
         serial_puts("  Process age after: ");
-        serial_put_dec(p3->age);
+        serial_put_dec(process_get_age(p3));
         serial_puts(", Priority: ");
         serial_put_dec(p3->priority);
         serial_puts("\n");
@@ -507,7 +412,7 @@ void test_scheduler(void) {
     
     if (p1) {
         serial_puts("  Setting process quantum for ");
-        serial_puts(p1->name);
+        serial_puts(p1->cold->name);
         serial_puts(" to 200 ticks\n");
         scheduler_set_process_quantum(p1->pid, 200);
     }
@@ -532,3 +437,90 @@ void test_scheduler(void) {
     
     serial_puts("=== Scheduler Test Complete ===\n\n");
 }
+
+/*
+ * Priority from a word: its first letter (critical, high, normal, low)
+ * or a digit 0-3; anything else is normal
+ */
+static process_priority_t parse_priority(const char *text) {
+    switch (text[0]) {
+        case 'c': case 'C': return PROC_PRIORITY_CRITICAL;
+        case 'h': case 'H': return PROC_PRIORITY_HIGH;
+        case 'l': case 'L': return PROC_PRIORITY_LOW;
+        case '0': case '1': case '2': case '3':
+            return (process_priority_t)(text[0] - '0');
+        default: return PROC_PRIORITY_NORMAL;
+    }
+}
+
+/* Shell commands */
+
+/*
+ * create <name> <priority> <time> <deadline>: start a demo process;
+ * priority, required time and deadline are optional. A deadline goes
+ * through admission control and may be refused.
+ */
+static int kernel_cmd_create(int argc, char **argv) {
+    const char *name = (argc > 1) ? argv[1] : "Process";
+    process_priority_t priority = (argc > 2) ? parse_priority(argv[2]) : PROC_PRIORITY_NORMAL;
+    uint32_t required_time = 0;
+    uint32_t deadline = 0;
+    
+    if (argc > 5 || (argc >= 4 && shell_parse_uint(argv[3], &required_time) != 0) ||
+        (argc == 5 && shell_parse_uint(argv[4], &deadline) != 0)) {
+        return -1;
+    }
+    
+    process_t *proc;
+    if (deadline > 0) {
+        proc = process_create_with_deadline(name, dummy_process_1, priority, required_time, deadline);
+    } else if (required_time > 0) {
+        proc = process_create_with_time(name, dummy_process_1, priority, required_time);
+    } else {
+        proc = process_create(name, dummy_process_1, priority);
+    }
+    
+    if (proc) {
+        serial_puts("Created process '");
+        serial_puts(proc->cold->name);
+        serial_puts("' with PID ");
+        serial_put_dec(proc->pid);
+        serial_puts(" and priority ");
+        serial_put_dec(priority);
+        serial_puts("\n");
+    }
+    return 0;
+}
+
+/*
+ * memtest, proctest, schedtest: the built-in tests
+ */
+static int kernel_cmd_memtest(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    test_memory_manager();
+    return 0;
+}
+
+static int kernel_cmd_proctest(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    test_process_manager();
+    return 0;
+}
+
+static int kernel_cmd_schedtest(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    test_scheduler();
+    return 0;
+}
+
+SHELL_COMMAND(create, "create", "create <name> <priority> <time> <deadline>", "Create a process",
+              kernel_cmd_create);
+SHELL_COMMAND(memtest, "memtest", "memtest", "Run memory allocation tests", kernel_cmd_memtest);
+SHELL_COMMAND(proctest, "proctest", "proctest", "Run process manager tests", kernel_cmd_proctest);
+SHELL_COMMAND(schedtest, "schedtest", "schedtest", "Run scheduler tests", kernel_cmd_schedtest);
@@ -0,0 +1,38 @@
+/* klog.h - Compile-time filtered kernel diagnostics */
+#ifndef KLOG_H
+#define KLOG_H
+
+#include "serial.h"
+
+/*
+ * KLOG(level, ...) emits a diagnostic only when level is at or above
+ * KLOG_LEVEL, which is fixed at build time (Makefile KLOG_LEVEL). The
+ * arguments are the output calls themselves, separated by commas:
+ *
+ *     KLOG(KLOG_DEBUG, serial_puts("[SCHEDULER] Switching to PID "),
+ *          serial_put_dec(pid), serial_puts("\n"));
+ *
+ * The test is a constant, so a call below the threshold compiles to
+ * nothing: neither the arguments nor their strings reach the image.
+ */
+
+#define KLOG_DEBUG  0       /* Per-tick and per-switch tracing */
+#define KLOG_INFO   1       /* Lifecycle and configuration events */
+#define KLOG_WARN   2       /* Recoverable misuse or resource exhaustion */
+#define KLOG_ERROR  3       /* Failures the caller has to handle */
+#define KLOG_NONE   4       /* Silence every diagnostic */
+
+#ifndef KLOG_LEVEL
+#define KLOG_LEVEL  KLOG_INFO
+#endif
+
+#define KLOG_ENABLED(level) ((level) >= KLOG_LEVEL)
+
+#define KLOG(level, ...) \
+    do { \
+        if (KLOG_ENABLED(level)) { \
+            __VA_ARGS__; \
+        } \
+    } while (0)
+
+#endif /* KLOG_H */
@@ -0,0 +1,292 @@
+/* kprintf.c - Formatted output */
+#include "kprintf.h"
+#include "serial.h"
+#include "cycles.h"
+#include "cpu.h"
+#include "smp.h"
+
+/* Conversion flags */
+#define FMT_LEFT            0x01    /* '-': pad on the right */
+#define FMT_ZERO            0x02    /* '0': pad with zeros after the sign */
+
+/* Longest conversion: 20 digits of a 64-bit value, or "0x" and 16 digits */
+#define FMT_DIGITS_MAX      24
+
+/* Where formatted characters go: a caller's buffer, truncated at size,
+ * or a CPU's line buffer that is flushed to the serial port when full */
+typedef struct kprintf_out {
+    char *buffer;
+    size_t size;
+    size_t pos;                     /* Characters in buffer */
+    size_t total;                   /* Characters produced, stored or not */
+    uint8_t console;                /* Flush instead of truncating */
+} kprintf_out_t;
+
+/* One line buffer per CPU, each in cache lines of its own */
+static char kprintf_buffers[MAX_CPUS][KPRINTF_BUFFER_SIZE] __attribute__((aligned(64)));
+
+/* "00" to "99", so a decimal number takes one step per two digits */
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const char hex_lower[] = "0123456789abcdef";
+static const char hex_upper[] = "0123456789ABCDEF";
+
+/* Forward declarations for internal functions */
+static int kformat(kprintf_out_t *out, const char *fmt, va_list args);
+
+static inline void out_char(kprintf_out_t *out, char c) {
+    if (out->console) {
+        if (out->pos == out->size) {
+            serial_write(out->buffer, out->pos);
+            out->pos = 0;
+        }
+        out->buffer[out->pos++] = c;
+    } else if (out->pos + 1 < out->size) {
+        out->buffer[out->pos++] = c;
+    }
+    out->total++;
+}
+
+static void out_repeat(kprintf_out_t *out, char c, uint32_t count) {
+    while (count-- > 0) {
+        out_char(out, c);
+    }
+}
+
+/*
+ * Write value's decimal digits backwards, ending just before end; returns
+ * the first digit. The divisions are by constants, which GCC turns into a
+ * multiply and shift, so no divl is executed.
+ */
+static char *format_dec32(char *end, uint32_t value) {
+    while (value >= 100) {
+        uint32_t pair = (value % 100) * 2;
+        value /= 100;
+        *--end = digit_pairs[pair + 1];
+        *--end = digit_pairs[pair];
+    }
+    if (value >= 10) {
+        *--end = digit_pairs[value * 2 + 1];
+        *--end = digit_pairs[value * 2];
+    } else {
+        *--end = (char)('0' + value);
+    }
+    return end;
+}
+
+/*
+ * 64-bit decimal, nine digits per cycles_div() until the rest fits in 32
+ * bits; at most two of those for any value
+ */
+static char *format_dec64(char *end, uint64_t value) {
+    while (value >> 32) {
+        uint64_t quot = cycles_div(value, 1000000000);
+        uint32_t rem = (uint32_t)(value - quot * 1000000000);
+        char *start = format_dec32(end, rem);
+        
+        while (start > end - 9) {
+            *--start = '0';
+        }
+        end = start;
+        value = quot;
+    }
+    return format_dec32(end, (uint32_t)value);
+}
+
+static char *format_hex(char *end, uint64_t value, const char *digits) {
+    do {
+        *--end = digits[value & 0xF];
+        value >>= 4;
+    } while (value != 0);
+    return end;
+}
+
+/*
+ * Emit one converted field: sign or prefix, padding, then the digits
+ */
+static void out_field(kprintf_out_t *out, const char *prefix, const char *text,
+                      uint32_t len, uint32_t width, uint32_t flags) {
+    uint32_t prefix_len = 0;
+    while (prefix[prefix_len] != '\0') {
+        prefix_len++;
+    }
+    
+    uint32_t pad = (width > len + prefix_len) ? width - len - prefix_len : 0;
+    
+    if (!(flags & (FMT_LEFT | FMT_ZERO))) {
+        out_repeat(out, ' ', pad);
+    }
+    for (uint32_t i = 0; i < prefix_len; i++) {
+        out_char(out, prefix[i]);
+    }
+    if ((flags & (FMT_LEFT | FMT_ZERO)) == FMT_ZERO) {
+        out_repeat(out, '0', pad);
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        out_char(out, text[i]);
+    }
+    if (flags & FMT_LEFT) {
+        out_repeat(out, ' ', pad);
+    }
+}
+
+/*
+ * The formatter both entry points share
+ */
+static int kformat(kprintf_out_t *out, const char *fmt, va_list args) {
+    char digits[FMT_DIGITS_MAX];
+    char *end = digits + FMT_DIGITS_MAX;
+    
+    for (; *fmt != '\0'; fmt++) {
+        if (*fmt != '%') {
+            out_char(out, *fmt);
+            continue;
+        }
+        fmt++;
+        
+        /* Flags */
+        uint32_t flags = 0;
+        for (;; fmt++) {
+            if (*fmt == '-') {
+                flags |= FMT_LEFT;
+            } else if (*fmt == '0') {
+                flags |= FMT_ZERO;
+            } else {
+                break;
+            }
+        }
+        
+        /* Width */
+        uint32_t width = 0;
+        if (*fmt == '*') {
+            int arg = va_arg(args, int);
+            if (arg < 0) {
+                flags |= FMT_LEFT;
+                arg = -arg;
+            }
+            width = (uint32_t)arg;
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9') {
+                width = width * 10 + (uint32_t)(*fmt++ - '0');
+            }
+        }
+        
+        /* Length: int, or 'll' for 64 bits */
+        uint8_t wide = 0;
+        if (fmt[0] == 'l' && fmt[1] == 'l') {
+            wide = 1;
+            fmt += 2;
+        }
+        
+        const char *prefix = "";
+        char *start;
+        
+        switch (*fmt) {
+        case 'd':
+        case 'i': {
+            int64_t value = wide ? va_arg(args, int64_t) : va_arg(args, int);
+            uint64_t magnitude = (uint64_t)value;
+            if (value < 0) {
+                prefix = "-";
+                magnitude = 0 - magnitude;
+            }
+            start = format_dec64(end, magnitude);
+            out_field(out, prefix, start, (uint32_t)(end - start), width, flags);
+            break;
+        }
+        case 'u':
+            start = wide ? format_dec64(end, va_arg(args, uint64_t)) :
+                           format_dec32(end, va_arg(args, uint32_t));
+            out_field(out, prefix, start, (uint32_t)(end - start), width, flags);
+            break;
+        case 'x':
+        case 'X': {
+            uint64_t value = wide ? va_arg(args, uint64_t) : va_arg(args, uint32_t);
+            start = format_hex(end, value, (*fmt == 'x') ? hex_lower : hex_upper);
+            out_field(out, prefix, start, (uint32_t)(end - start), width, flags);
+            break;
+        }
+        case 'p': {
+            uint32_t value = (uint32_t)va_arg(args, void *);
+            start = end;
+            for (uint32_t i = 0; i < 8; i++) {
+                *--start = hex_upper[value & 0xF];
+                value >>= 4;
+            }
+            out_field(out, "0x", start, 8, width, flags & ~FMT_ZERO);
+            break;
+        }
+        case 's': {
+            const char *text = va_arg(args, const char *);
+            uint32_t len = 0;
+            if (text == NULL) {
+                text = "(null)";
+            }
+            while (text[len] != '\0') {
+                len++;
+            }
+            out_field(out, prefix, text, len, width, flags & ~FMT_ZERO);
+            break;
+        }
+        case 'c':
+            digits[0] = (char)va_arg(args, int);
+            out_field(out, prefix, digits, 1, width, flags & ~FMT_ZERO);
+            break;
+        case '%':
+            out_char(out, '%');
+            break;
+        case '\0':
+            /* Lone '%' at the end */
+            return (int)out->total;
+        default:
+            /* Unknown conversion: print it as written */
+            out_char(out, '%');
+            out_char(out, *fmt);
+            break;
+        }
+    }
+    
+    return (int)out->total;
+}
+
+int kvsnprintf(char *buffer, size_t size, const char *fmt, va_list args) {
+    kprintf_out_t out = { buffer, size, 0, 0, 0 };
+    
+    int total = kformat(&out, fmt, args);
+    if (size > 0) {
+        buffer[out.pos] = '\0';
+    }
+    return total;
+}
+
+int ksnprintf(char *buffer, size_t size, const char *fmt, ...) {
+    va_list args;
+    
+    va_start(args, fmt);
+    int total = kvsnprintf(buffer, size, fmt, args);
+    va_end(args);
+    return total;
+}
+
+/*
+ * Format into this CPU's line buffer and write it out in one piece
+ */
+int kprintf(const char *fmt, ...) {
+    va_list args;
+    uint32_t flags = irq_save();
+    kprintf_out_t out = { kprintf_buffers[smp_cpu_id()], KPRINTF_BUFFER_SIZE, 0, 0, 1 };
+    
+    va_start(args, fmt);
+    int total = kformat(&out, fmt, args);
+    va_end(args);
+    
+    if (out.pos > 0) {
+        serial_write(out.buffer, out.pos);
+    }
+    irq_restore(flags);
+    return total;
+}
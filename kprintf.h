@@ -0,0 +1,43 @@
+/* kprintf.h - Formatted output */
+#ifndef KPRINTF_H
+#define KPRINTF_H
+
+#include "types.h"
+
+/*
+ * A printf subset for the kernel's reports:
+ *
+ *     %d %i %u %x %X %s %p %c %%
+ *
+ * with the '-' (left-align) and '0' (zero-pad) flags, a field width given
+ * as digits or '*', and an 'll' length for 64-bit integers (%llu, %llx,
+ * ...). %p prints 0x and eight hex digits.
+ *
+ * kprintf() formats into its CPU's line buffer and hands the result to
+ * the serial TX ring in one locked write when the call ends, or when the
+ * buffer fills, rather than taking serial_lock once per field. A table
+ * dump that used to be dozens of serial_puts() and serial_put_dec() calls
+ * per row becomes one call per row, and its lines do not interleave with
+ * other CPUs' output. Interrupts are off for the call so a handler on
+ * the same CPU cannot reuse the buffer; percpu_init() has to have run.
+ */
+
+#define KPRINTF_BUFFER_SIZE     256     /* Per CPU; longer output is flushed in pieces */
+
+typedef __builtin_va_list va_list;
+#define va_start(ap, last)      __builtin_va_start(ap, last)
+#define va_arg(ap, type)        __builtin_va_arg(ap, type)
+#define va_end(ap)              __builtin_va_end(ap)
+
+/* Print to the serial console; returns the number of characters */
+int kprintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/*
+ * Format into buffer, truncating to size - 1 characters plus the NUL.
+ * Returns the length the whole output would have had, as C99 does.
+ */
+int ksnprintf(char *buffer, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+int kvsnprintf(char *buffer, size_t size, const char *fmt, va_list args);
+
+#endif /* KPRINTF_H */
@@ -2,189 +2,634 @@
 #include "memory.h"
 #include "string.h"
 #include "serial.h"
+#include "kprintf.h"
+#include "klog.h"
+#include "trace.h"
+#include "cycles.h"
+#include "bitops.h"
+#include "buddy.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "percpu.h"
+#include "smp.h"
+#include "paging.h"
+#include "shell.h"
 
 /* Global heap management */
-static heap_block_t heap_blocks[MAX_BLOCKS];
-static uint32_t num_heap_blocks = 0;
-static void *heap_start = (void*)HEAP_START;
-static void *heap_current = (void*)HEAP_START;
-static size_t heap_used = 0;
-
-/* Global stack management */
-#define MAX_PROCESS_STACKS 32
-static stack_descriptor_t stack_table[MAX_PROCESS_STACKS];
+#define ARENA_MAP_SHIFT     (PAGE_SHIFT + HEAP_ARENA_ORDER) /* One arena map entry per 1MB */
+#define ARENA_MAP_SIZE      (1u << (32 - ARENA_MAP_SHIFT))
+static heap_chunk_t *bins[HEAP_NUM_BINS];  /* Segregated free lists */
+static uint32_t bin_map = 0;               /* Bit i set => bins[i] non-empty */
+static uint32_t bin_count[HEAP_NUM_BINS];  /* Free chunks per bin */
+static uint8_t arena_map[ARENA_MAP_SIZE];  /* Arena order + 1 per 1MB, 0 if none */
+static size_t heap_total = 0;              /* Bytes in all arenas */
+static uint32_t num_arenas = 0;
+static uint32_t num_free_chunks = 0;
+static spinlock_t heap_lock = SPINLOCK_INIT; /* Bins and arenas */
+
+/* Per-CPU magazines (see memory.h) and the depot behind them. A batch in
+ * the depot is a chain of cached chunks linked through their payloads. */
+typedef struct {
+    uint32_t rounds;                            /* Chunks loaded */
+    heap_chunk_t *chunks[HEAP_MAG_ROUNDS];      /* Newest on top */
+} heap_magazine_t;
+
+typedef struct {
+    heap_magazine_t magazines[HEAP_MAG_CLASSES];
+    uint32_t refills;                           /* Magazine found empty */
+    uint32_t flushes;                           /* Magazine found full */
+    cycle_hist_t kmalloc_cycles;                /* Successful kmalloc() latency */
+    cycle_hist_t kfree_cycles;                  /* Successful kfree() latency */
+} __attribute__((aligned(64))) heap_cpu_t;
+
+typedef struct {
+    heap_chunk_t *batches;                      /* Full batches, newest first */
+    uint32_t count;
+} heap_depot_t;
+
+static heap_cpu_t heap_cpus[MAX_CPUS];
+static heap_depot_t heap_depot[HEAP_MAG_CLASSES];
+static spinlock_t depot_lock = SPINLOCK_INIT;  /* Never held with heap_lock */
+
+/* Global stack management
+ * Live stacks are found through a small PID hash; freed stacks go to a
+ * pool per size in pages and are handed out again without touching their
+ * memory. A stack and its guard are one run of exactly that many pages. */
+#define STACK_HASH_SIZE     256
+#define STACK_GUARD_PAGES   (STACK_GUARD_SIZE / PAGE_SIZE)
+#define STACK_POOL_CLASSES  (STACK_MAX_SIZE / PAGE_SIZE + 1)
+static stack_descriptor_t *stack_hash[STACK_HASH_SIZE];
+static stack_descriptor_t *stack_pool[STACK_POOL_CLASSES];
+static uint32_t stack_pool_count[STACK_POOL_CLASSES];
+static kmem_cache_t *stack_desc_cache = NULL;
 static uint32_t num_stacks = 0;
-static void *stack_region_start = NULL;
+static size_t stack_bytes = 0;
+static spinlock_t stack_lock = SPINLOCK_INIT; /* Stack hash and pools */
+
+/* Chunk geometry helpers */
+#define TAG_SIZE            sizeof(heap_tag_t)
+#define MIN_CHUNK_SIZE      ((sizeof(heap_chunk_t) + TAG_SIZE + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1))
+#define TAG_SIZE_MASK       (~(heap_tag_t)(HEAP_ALIGN - 1))
+
+#define CHUNK_SIZE(c)       ((c)->header & TAG_SIZE_MASK)
+#define CHUNK_IS_FREE(c)    (((c)->header & HEAP_TAG_ALLOCATED) == 0)
+#define CHUNK_FOOTER(c)     ((heap_tag_t*)((uint8_t*)(c) + CHUNK_SIZE(c) - TAG_SIZE))
+#define CHUNK_NEXT(c)       ((heap_chunk_t*)((uint8_t*)(c) + CHUNK_SIZE(c)))
+#define CHUNK_PREV_FOOTER(c) ((heap_tag_t*)((uint8_t*)(c) - TAG_SIZE))
+#define CHUNK_PAYLOAD(c)    ((void*)((uint8_t*)(c) + TAG_SIZE))
+#define PAYLOAD_CHUNK(p)    ((heap_chunk_t*)((uint8_t*)(p) - TAG_SIZE))
+
+/* Largest single allocation: one maximum-order arena minus its fences */
+#define HEAP_MAX_ALLOC      (HEAP_ARENA_SIZE(BUDDY_MAX_ORDER) - 4 * HEAP_ALIGN)
 
 /* Forward declarations for internal functions */
-static heap_block_t *find_free_block(size_t size);
-static void merge_free_blocks(void);
-static void split_block(heap_block_t *block, size_t size);
+static int heap_add_arena(size_t min_chunk);
+static int heap_release_arena(heap_chunk_t *chunk);
+static void set_chunk_tags(heap_chunk_t *chunk, size_t size, uint32_t allocated);
+static uint32_t size_to_bin(size_t size);
+static void free_list_insert(heap_chunk_t *chunk);
+static void free_list_remove(heap_chunk_t *chunk);
+static heap_chunk_t *find_free_chunk(size_t size);
+static void split_chunk(heap_chunk_t *chunk, size_t size);
+static heap_chunk_t *coalesce_chunk(heap_chunk_t *chunk);
+static size_t request_to_chunk_size(size_t size);
+static heap_chunk_t *validate_payload(void *ptr);
+static heap_chunk_t *heap_take(size_t chunk_size);
+static void heap_put(heap_chunk_t *chunk);
+static void magazine_refill(heap_magazine_t *mag, uint32_t cls);
+static void magazine_flush(heap_magazine_t *mag, uint32_t cls);
+static stack_descriptor_t *stack_lookup(uint32_t pid, stack_descriptor_t ***link_out);
+static void stack_retire(stack_descriptor_t *desc);
 
 /*
  * Initialize the memory manager
  */
 void memory_init(void) {
-    /* Initialize heap blocks */
-    for (uint32_t i = 0; i < MAX_BLOCKS; i++) {
-        heap_blocks[i].address = NULL;
-        heap_blocks[i].size = 0;
-        heap_blocks[i].is_free = BLOCK_FREE;
-        heap_blocks[i].next = NULL;
-    }
-    
-    /* Create initial free block covering entire heap */
-    heap_blocks[0].address = heap_start;
-    heap_blocks[0].size = HEAP_SIZE;
-    heap_blocks[0].is_free = BLOCK_FREE;
-    heap_blocks[0].next = NULL;
-    num_heap_blocks = 1;
-    
-    /* Initialize stack region (after heap) */
-    stack_region_start = (void*)((uint32_t)HEAP_START + HEAP_SIZE);
-    
-    /* Initialize stack table */
-    for (uint32_t i = 0; i < MAX_PROCESS_STACKS; i++) {
-        stack_table[i].base = NULL;
-        stack_table[i].top = NULL;
-        stack_table[i].size = 0;
-        stack_table[i].pid = 0;
-        stack_table[i].is_free = 1;
-    }
-    
-    serial_puts("[MEMORY] Memory manager initialized\n");
-    serial_puts("[MEMORY] Heap: 0x");
-    serial_put_hex((uint32_t)heap_start);
-    serial_puts(" - 0x");
-    serial_put_hex((uint32_t)heap_start + HEAP_SIZE);
-    serial_puts(" (");
-    serial_put_dec(HEAP_SIZE / 1024 / 1024);
-    serial_puts(" MB)\n");
-}
-
-/*
- * Find a free block that can fit the requested size using First Fit algorithm
- */
-static heap_block_t *find_free_block(size_t size) {
-    for (uint32_t i = 0; i < num_heap_blocks; i++) {
-        if (heap_blocks[i].is_free == BLOCK_FREE && heap_blocks[i].size >= size) {
-            return &heap_blocks[i];
+    for (uint32_t i = 0; i < HEAP_NUM_BINS; i++) {
+        bins[i] = NULL;
+        bin_count[i] = 0;
+    }
+    bin_map = 0;
+    num_free_chunks = 0;
+    
+    memset(arena_map, 0, sizeof(arena_map));
+    heap_total = 0;
+    num_arenas = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        percpu_area(cpu)->heap_used = 0;
+        percpu_area(cpu)->heap_allocations = 0;
+    }
+    memset(heap_cpus, 0, sizeof(heap_cpus));
+    memset(heap_depot, 0, sizeof(heap_depot));
+    
+    /* Start with one arena; more are taken from the page allocator on demand */
+    heap_add_arena(0);
+    
+    /* Initialize stack hash and pool */
+    for (uint32_t i = 0; i < STACK_HASH_SIZE; i++) {
+        stack_hash[i] = NULL;
+    }
+    for (uint32_t i = 0; i < STACK_POOL_CLASSES; i++) {
+        stack_pool[i] = NULL;
+        stack_pool_count[i] = 0;
+    }
+    num_stacks = 0;
+    stack_bytes = 0;
+    
+    KLOG(KLOG_INFO, serial_puts("[MEMORY] Memory manager initialized\n"),
+         serial_puts("[MEMORY] Heap: "), serial_put_dec(heap_total / 1024),
+         serial_puts(" KB (grows on demand)\n"));
+}
+
+/*
+ * Take a block of pages from the buddy allocator and turn it into a heap
+ * arena big enough for a chunk of min_chunk bytes. Returns 0 on success.
+ *
+ * Arena layout:
+ *   [pad][prologue hdr|ftr][ ...... one big free chunk ...... ][epilogue hdr]
+ * The prologue and epilogue are permanently "allocated" fences, so
+ * coalescing never has to check whether a neighbour lies outside the arena.
+ * The pad puts every chunk header at 4 mod 8, so payloads are 8-aligned.
+ */
+static int heap_add_arena(size_t min_chunk) {
+    uint32_t order = HEAP_ARENA_ORDER;
+    while (order < BUDDY_MAX_ORDER && HEAP_ARENA_SIZE(order) < min_chunk + 4 * HEAP_ALIGN) {
+        order++;
+    }
+    
+    uint8_t *base = (uint8_t*)buddy_alloc(order);
+    if (base == NULL) {
+        return -1;
+    }
+    
+    uint8_t *end = base + HEAP_ARENA_SIZE(order);
+    
+    heap_tag_t *prologue = (heap_tag_t*)(base + TAG_SIZE);
+    prologue[0] = HEAP_ALIGN | HEAP_TAG_ALLOCATED;
+    prologue[1] = HEAP_ALIGN | HEAP_TAG_ALLOCATED;
+    
+    heap_chunk_t *first = (heap_chunk_t*)(base + TAG_SIZE + HEAP_ALIGN);
+    size_t first_size = (size_t)(end - TAG_SIZE - (uint8_t*)first);
+    
+    heap_tag_t *epilogue = (heap_tag_t*)(end - TAG_SIZE);
+    *epilogue = 0 | HEAP_TAG_ALLOCATED;
+    
+    set_chunk_tags(first, first_size, 0);
+    free_list_insert(first);
+    
+    /* An arena is aligned to its size, so it covers whole map entries */
+    uint32_t entry = (uint32_t)base >> ARENA_MAP_SHIFT;
+    for (uint32_t i = 0; i < (1u << (order - HEAP_ARENA_ORDER)); i++) {
+        arena_map[entry + i] = (uint8_t)(order + 1);
+    }
+    heap_total += HEAP_ARENA_SIZE(order);
+    num_arenas++;
+    
+    return 0;
+}
+
+/*
+ * If a free chunk now spans a whole arena, hand the arena back to the
+ * buddy allocator (the last arena left is always kept). Returns 1 if released.
+ */
+static int heap_release_arena(heap_chunk_t *chunk) {
+    uint8_t *base = (uint8_t*)chunk - TAG_SIZE - HEAP_ALIGN;
+    size_t arena_size = CHUNK_SIZE(chunk) + 2 * TAG_SIZE + HEAP_ALIGN;
+    
+    if (num_arenas <= 1 || ((uint32_t)base & (PAGE_SIZE - 1)) != 0 ||
+        *CHUNK_PREV_FOOTER(chunk) != (HEAP_ALIGN | HEAP_TAG_ALLOCATED) ||
+        CHUNK_NEXT(chunk)->header != (0 | HEAP_TAG_ALLOCATED)) {
+        return 0;
+    }
+    
+    uint32_t order = buddy_order_for_pages(arena_size / PAGE_SIZE);
+    if (HEAP_ARENA_SIZE(order) != arena_size) {
+        return 0;
+    }
+    
+    uint32_t entry = (uint32_t)base >> ARENA_MAP_SHIFT;
+    for (uint32_t i = 0; i < (1u << (order - HEAP_ARENA_ORDER)); i++) {
+        arena_map[entry + i] = 0;
+    }
+    
+    buddy_free(base, order);
+    heap_total -= arena_size;
+    num_arenas--;
+    return 1;
+}
+
+/*
+ * Write matching header and footer tags for a chunk
+ */
+static void set_chunk_tags(heap_chunk_t *chunk, size_t size, uint32_t allocated) {
+    heap_tag_t tag = (heap_tag_t)size | (allocated ? HEAP_TAG_ALLOCATED : 0);
+    chunk->header = tag;
+    *CHUNK_FOOTER(chunk) = tag;
+}
+
+/*
+ * Map a chunk size to its bin index
+ */
+static uint32_t size_to_bin(size_t size) {
+    if (size < MIN_CHUNK_SIZE + HEAP_EXACT_BINS * HEAP_ALIGN) {
+        return (size - MIN_CHUNK_SIZE) / HEAP_ALIGN;
+    }
+    
+    /* Range bins: bin 16 starts at 144 (log2 = 7), then one bin per power of two */
+    uint32_t bin = HEAP_EXACT_BINS + bit_scan_reverse(size) - 7;
+    return (bin < HEAP_NUM_BINS) ? bin : HEAP_NUM_BINS - 1;
+}
+
+/*
+ * Push a free chunk onto the head of its size-class bin
+ */
+static void free_list_insert(heap_chunk_t *chunk) {
+    uint32_t bin = size_to_bin(CHUNK_SIZE(chunk));
+    
+    chunk->prev_free = NULL;
+    chunk->next_free = bins[bin];
+    if (bins[bin] != NULL) {
+        bins[bin]->prev_free = chunk;
+    }
+    bins[bin] = chunk;
+    bin_map |= 1u << bin;
+    bin_count[bin]++;
+    num_free_chunks++;
+}
+
+/*
+ * Unlink a free chunk from its bin
+ */
+static void free_list_remove(heap_chunk_t *chunk) {
+    uint32_t bin = size_to_bin(CHUNK_SIZE(chunk));
+    
+    if (chunk->prev_free != NULL) {
+        chunk->prev_free->next_free = chunk->next_free;
+    } else {
+        bins[bin] = chunk->next_free;
+        if (bins[bin] == NULL) {
+            bin_map &= ~(1u << bin);
+        }
+    }
+    
+    if (chunk->next_free != NULL) {
+        chunk->next_free->prev_free = chunk->prev_free;
+    }
+    
+    chunk->next_free = NULL;
+    chunk->prev_free = NULL;
+    bin_count[bin]--;
+    num_free_chunks--;
+}
+
+/*
+ * Convert a requested payload size into a full chunk size (tags included)
+ */
+static size_t request_to_chunk_size(size_t size) {
+    size_t chunk_size = (size + 2 * TAG_SIZE + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    
+    if (chunk_size < MIN_CHUNK_SIZE) {
+        chunk_size = MIN_CHUNK_SIZE;
+    }
+    return chunk_size;
+}
+
+/*
+ * Find a free chunk that can fit the requested size.
+ * Every chunk in a bin above the request's own bin is large enough, so the
+ * search is one look at the home bin plus one bit scan. Only requests that
+ * land in the last (unbounded) bin fall back to a first-fit walk.
+ */
+static heap_chunk_t *find_free_chunk(size_t size) {
+    uint32_t bin = size_to_bin(size);
+    
+    /* Exact bins hold a single size; range bins may start with a fit */
+    if (bins[bin] != NULL && CHUNK_SIZE(bins[bin]) >= size) {
+        return bins[bin];
+    }
+    
+    if (bin < HEAP_NUM_BINS - 1) {
+        uint32_t candidates = bin_map & ~((2u << bin) - 1);
+        if (candidates != 0) {
+            return bins[bit_scan_forward(candidates)];
+        }
+        return NULL;
+    }
+    
+    for (heap_chunk_t *chunk = bins[bin]; chunk != NULL; chunk = chunk->next_free) {
+        if (CHUNK_SIZE(chunk) >= size) {
+            return chunk;
         }
     }
     return NULL;
 }
 
 /*
- * Split a block into two if it's larger than needed
+ * Split an allocated chunk, returning the unused tail to the free list
  */
-static void split_block(heap_block_t *block, size_t size) {
-    if (block->size > size + 32 && num_heap_blocks < MAX_BLOCKS) {
-        /* Find a free slot in the heap_blocks array */
-        uint32_t new_idx = num_heap_blocks;
-        
-        /* Create new block with remaining space */
-        heap_blocks[new_idx].address = (void*)((uint32_t)block->address + size);
-        heap_blocks[new_idx].size = block->size - size;
-        heap_blocks[new_idx].is_free = BLOCK_FREE;
-        heap_blocks[new_idx].next = block->next;
-        
-        /* Update original block */
-        block->size = size;
-        block->next = &heap_blocks[new_idx];
-        
-        num_heap_blocks++;
-    }
-}
-
-/*
- * Merge adjacent free blocks to reduce fragmentation
- */
-static void merge_free_blocks(void) {
-    for (uint32_t i = 0; i < num_heap_blocks - 1; i++) {
-        if (heap_blocks[i].is_free == BLOCK_FREE) {
-            for (uint32_t j = i + 1; j < num_heap_blocks; j++) {
-                /* Check if blocks are adjacent */
-                void *end_of_i = (void*)((uint32_t)heap_blocks[i].address + heap_blocks[i].size);
-                
-                if (heap_blocks[j].is_free == BLOCK_FREE && 
-                    heap_blocks[j].address == end_of_i) {
-                    /* Merge block j into block i */
-                    heap_blocks[i].size += heap_blocks[j].size;
-                    heap_blocks[i].next = heap_blocks[j].next;
-                    
-                    /* Remove block j by shifting remaining blocks */
-                    for (uint32_t k = j; k < num_heap_blocks - 1; k++) {
-                        heap_blocks[k] = heap_blocks[k + 1];
-                    }
-                    num_heap_blocks--;
-                    j--; /* Check again with the shifted block */
-                }
-            }
+static void split_chunk(heap_chunk_t *chunk, size_t size) {
+    size_t total = CHUNK_SIZE(chunk);
+    
+    if (total - size < MIN_CHUNK_SIZE) {
+        return;  /* Remainder too small to hold a free chunk */
+    }
+    
+    set_chunk_tags(chunk, size, 1);
+    
+    heap_chunk_t *rest = CHUNK_NEXT(chunk);
+    set_chunk_tags(rest, total - size, 0);
+    free_list_insert(coalesce_chunk(rest));
+}
+
+/*
+ * Merge a free chunk (not on the free list) with its free neighbours.
+ * Only the two physically adjacent chunks are inspected, so this is O(1).
+ */
+static heap_chunk_t *coalesce_chunk(heap_chunk_t *chunk) {
+    size_t size = CHUNK_SIZE(chunk);
+    
+    /* Absorb the following chunk */
+    heap_chunk_t *next = CHUNK_NEXT(chunk);
+    if (CHUNK_IS_FREE(next)) {
+        free_list_remove(next);
+        size += CHUNK_SIZE(next);
+    }
+    
+    /* Let the preceding chunk absorb us (its footer sits just before our header) */
+    heap_tag_t prev_tag = *CHUNK_PREV_FOOTER(chunk);
+    if ((prev_tag & HEAP_TAG_ALLOCATED) == 0) {
+        heap_chunk_t *prev = (heap_chunk_t*)((uint8_t*)chunk - (prev_tag & TAG_SIZE_MASK));
+        free_list_remove(prev);
+        size += CHUNK_SIZE(prev);
+        chunk = prev;
+    }
+    
+    set_chunk_tags(chunk, size, 0);
+    return chunk;
+}
+
+/*
+ * Map a payload pointer back to its chunk, rejecting pointers that were
+ * never handed out by kmalloc (outside a live arena or with mismatched tags)
+ */
+static heap_chunk_t *validate_payload(void *ptr) {
+    uint8_t *p = (uint8_t*)ptr;
+    
+    if (((uint32_t)p & (HEAP_ALIGN - 1)) != 0) {
+        return NULL;
+    }
+    
+    /* The arena map gives the order, and so the bounds, of the arena */
+    uint32_t order = arena_map[(uint32_t)p >> ARENA_MAP_SHIFT];
+    if (order == 0) {
+        return NULL;
+    }
+    uint8_t *base = (uint8_t*)((uint32_t)p & ~(HEAP_ARENA_SIZE(order - 1) - 1));
+    uint8_t *end = base + HEAP_ARENA_SIZE(order - 1);
+    
+    if (p < base + TAG_SIZE + HEAP_ALIGN + TAG_SIZE) {
+        return NULL;
+    }
+    
+    heap_chunk_t *chunk = PAYLOAD_CHUNK(p);
+    size_t size = CHUNK_SIZE(chunk);
+    
+    if (size < MIN_CHUNK_SIZE || size > (size_t)(end - TAG_SIZE - (uint8_t*)chunk) ||
+        *CHUNK_FOOTER(chunk) != chunk->header) {
+        return NULL;
+    }
+    return chunk;
+}
+
+/*
+ * Carve a chunk of exactly chunk_size bytes out of the heap, growing it
+ * if nothing fits. Called with heap_lock held; NULL when out of memory.
+ */
+static heap_chunk_t *heap_take(size_t chunk_size) {
+    /* Find a suitable free chunk, growing the heap if none is left */
+    heap_chunk_t *chunk = find_free_chunk(chunk_size);
+    
+    if (chunk == NULL && heap_add_arena(chunk_size) == 0) {
+        chunk = find_free_chunk(chunk_size);
+    }
+    if (chunk == NULL) {
+        return NULL;
+    }
+    
+    /* Take the chunk and give back whatever we do not need */
+    free_list_remove(chunk);
+    set_chunk_tags(chunk, CHUNK_SIZE(chunk), 1);
+    split_chunk(chunk, chunk_size);
+    return chunk;
+}
+
+/*
+ * Return an allocated chunk to the heap: mark it free, merge it with free
+ * neighbours and publish it. Called with heap_lock held.
+ */
+static void heap_put(heap_chunk_t *chunk) {
+    set_chunk_tags(chunk, CHUNK_SIZE(chunk), 0);
+    chunk = coalesce_chunk(chunk);
+    if (!heap_release_arena(chunk)) {
+        free_list_insert(chunk);
+    }
+}
+
+/*
+ * Magazine size class of a chunk, or HEAP_MAG_CLASSES if it has none
+ */
+static inline uint32_t magazine_class(size_t chunk_size) {
+    uint32_t cls = (chunk_size - MIN_CHUNK_SIZE) / HEAP_ALIGN;
+    return (cls < HEAP_MAG_CLASSES) ? cls : HEAP_MAG_CLASSES;
+}
+
+/*
+ * Flag a chunk as held by a magazine or the depot, or clear the flag
+ * again as it is handed out
+ */
+static inline void chunk_set_cached(heap_chunk_t *chunk, uint32_t cached) {
+    heap_tag_t tag = cached ? (chunk->header | HEAP_TAG_CACHED) : (chunk->header & ~HEAP_TAG_CACHED);
+    chunk->header = tag;
+    *CHUNK_FOOTER(chunk) = tag;
+}
+
+/*
+ * Load an empty magazine with one batch: a full batch from the depot if
+ * there is one, else a batch freshly carved from the heap (fewer when
+ * memory runs out). Called with interrupts off.
+ */
+static void magazine_refill(heap_magazine_t *mag, uint32_t cls) {
+    heap_depot_t *depot = &heap_depot[cls];
+    
+    spin_lock(&depot_lock);
+    heap_chunk_t *batch = depot->batches;
+    if (batch != NULL) {
+        depot->batches = batch->prev_free;
+        depot->count--;
+    }
+    spin_unlock(&depot_lock);
+    
+    if (batch != NULL) {
+        for (heap_chunk_t *chunk = batch; chunk != NULL; chunk = chunk->next_free) {
+            mag->chunks[mag->rounds++] = chunk;
+        }
+        return;
+    }
+    
+    size_t chunk_size = MIN_CHUNK_SIZE + cls * HEAP_ALIGN;
+    spin_lock(&heap_lock);
+    while (mag->rounds < HEAP_MAG_BATCH) {
+        heap_chunk_t *chunk = heap_take(chunk_size);
+        if (chunk == NULL) {
+            break;
         }
+        chunk_set_cached(chunk, 1);
+        mag->chunks[mag->rounds++] = chunk;
     }
+    spin_unlock(&heap_lock);
 }
 
 /*
- * Allocate heap memory (like malloc)
+ * Empty the oldest batch of a full magazine into the depot, or into the
+ * heap once the depot holds HEAP_DEPOT_BATCHES for this size. The most
+ * recently freed (cache-warm) chunks stay. Called with interrupts off.
+ */
+static void magazine_flush(heap_magazine_t *mag, uint32_t cls) {
+    heap_depot_t *depot = &heap_depot[cls];
+    heap_chunk_t *batch = NULL;
+    
+    /* Chain the batch through the payloads: next_free inside a batch,
+     * prev_free of its first chunk to the next batch in the depot */
+    for (uint32_t i = 0; i < HEAP_MAG_BATCH; i++) {
+        heap_chunk_t *chunk = mag->chunks[i];
+        chunk->next_free = batch;
+        batch = chunk;
+    }
+    for (uint32_t i = HEAP_MAG_BATCH; i < mag->rounds; i++) {
+        mag->chunks[i - HEAP_MAG_BATCH] = mag->chunks[i];
+    }
+    mag->rounds -= HEAP_MAG_BATCH;
+    
+    spin_lock(&depot_lock);
+    if (depot->count < HEAP_DEPOT_BATCHES) {
+        batch->prev_free = depot->batches;
+        depot->batches = batch;
+        depot->count++;
+        batch = NULL;
+    }
+    spin_unlock(&depot_lock);
+    
+    if (batch != NULL) {
+        spin_lock(&heap_lock);
+        while (batch != NULL) {
+            heap_chunk_t *next = batch->next_free;
+            heap_put(batch);
+            batch = next;
+        }
+        spin_unlock(&heap_lock);
+    }
+}
+
+/*
+ * Allocate heap memory (like malloc). Small sizes come from this CPU's
+ * magazine without taking a lock; the rest, and a magazine that cannot
+ * be refilled, go to the heap.
  */
 void *kmalloc(size_t size) {
-    if (size == 0) {
+    if (size == 0 || size > HEAP_MAX_ALLOC) {
         return NULL;
     }
     
-    /* Align size to 4-byte boundary */
-    size = (size + 3) & ~3;
+    uint64_t start = cycles_now();
+    size_t chunk_size = request_to_chunk_size(size);
+    uint32_t cls = magazine_class(chunk_size);
+    heap_chunk_t *chunk = NULL;
     
-    /* Find a suitable free block */
-    heap_block_t *block = find_free_block(size);
+    /* Interrupts off: a handler on this CPU may allocate too */
+    uint32_t flags = irq_save();
+    heap_cpu_t *cpu = &heap_cpus[smp_cpu_id()];
     
-    if (block == NULL) {
-        /* Try defragmentation and search again */
-        merge_free_blocks();
-        block = find_free_block(size);
+    if (cls < HEAP_MAG_CLASSES) {
+        heap_magazine_t *mag = &cpu->magazines[cls];
         
-        if (block == NULL) {
-            serial_puts("[MEMORY] kmalloc failed: out of memory\n");
-            return NULL;
+        if (mag->rounds == 0) {
+            cpu->refills++;
+            magazine_refill(mag, cls);
+        }
+        if (mag->rounds != 0) {
+            chunk = mag->chunks[--mag->rounds];
+            chunk_set_cached(chunk, 0);
         }
     }
     
-    /* Split block if it's much larger than needed */
-    split_block(block, size);
+    if (chunk == NULL) {
+        spin_lock(&heap_lock);
+        chunk = heap_take(chunk_size);
+        spin_unlock(&heap_lock);
+        
+        if (chunk == NULL) {
+            irq_restore(flags);
+            KLOG(KLOG_ERROR, serial_puts("[MEMORY] kmalloc failed: out of memory\n"));
+            TRACE(TRACE_KMALLOC_FAIL, 0, size);
+            return NULL;
+        }
+    }
     
-    /* Mark block as allocated */
-    block->is_free = BLOCK_ALLOCATED;
-    heap_used += block->size;
+    this_cpu_add(heap_used, CHUNK_SIZE(chunk));
+    this_cpu_add(heap_allocations, 1);
     
-    return block->address;
+    cycle_hist_record(&cpu->kmalloc_cycles, cycles_now() - start);
+    irq_restore(flags);
+    return CHUNK_PAYLOAD(chunk);
 }
 
 /*
- * Free heap memory (like free)
+ * Free heap memory (like free). Small chunks go to this CPU's magazine,
+ * whichever CPU allocated them.
  */
 void kfree(void *ptr) {
     if (ptr == NULL) {
         return;
     }
     
-    /* Find the block containing this address */
-    for (uint32_t i = 0; i < num_heap_blocks; i++) {
-        if (heap_blocks[i].address == ptr) {
-            if (heap_blocks[i].is_free == BLOCK_FREE) {
-                serial_puts("[MEMORY] Warning: Double free detected\n");
-                return;
-            }
-            
-            heap_blocks[i].is_free = BLOCK_FREE;
-            heap_used -= heap_blocks[i].size;
-            
-            /* Merge adjacent free blocks */
-            merge_free_blocks();
-            return;
+    uint64_t start = cycles_now();
+    heap_chunk_t *chunk = validate_payload(ptr);
+    if (chunk == NULL) {
+        KLOG(KLOG_WARN, serial_puts("[MEMORY] Warning: Attempt to free invalid pointer\n"));
+        return;
+    }
+    
+    if (CHUNK_IS_FREE(chunk) || (chunk->header & HEAP_TAG_CACHED)) {
+        KLOG(KLOG_WARN, serial_puts("[MEMORY] Warning: Double free detected\n"));
+        return;
+    }
+    
+    size_t chunk_size = CHUNK_SIZE(chunk);
+    uint32_t cls = magazine_class(chunk_size);
+    
+    uint32_t flags = irq_save();
+    heap_cpu_t *cpu = &heap_cpus[smp_cpu_id()];
+    
+    this_cpu_add(heap_used, -chunk_size);
+    this_cpu_add(heap_allocations, -1);
+    
+    if (cls < HEAP_MAG_CLASSES) {
+        heap_magazine_t *mag = &cpu->magazines[cls];
+        
+        if (mag->rounds == HEAP_MAG_ROUNDS) {
+            cpu->flushes++;
+            magazine_flush(mag, cls);
         }
+        chunk_set_cached(chunk, 1);
+        mag->chunks[mag->rounds++] = chunk;
+    } else {
+        spin_lock(&heap_lock);
+        heap_put(chunk);
+        spin_unlock(&heap_lock);
     }
     
-    serial_puts("[MEMORY] Warning: Attempt to free invalid pointer\n");
+    cycle_hist_record(&cpu->kfree_cycles, cycles_now() - start);
+    irq_restore(flags);
 }
 
 /*
@@ -200,32 +645,48 @@ void *krealloc(void *ptr, size_t new_size) {
         return NULL;
     }
     
-    /* Find the original block */
-    heap_block_t *old_block = NULL;
-    for (uint32_t i = 0; i < num_heap_blocks; i++) {
-        if (heap_blocks[i].address == ptr) {
-            old_block = &heap_blocks[i];
-            break;
-        }
+    /* Larger than any arena; also keeps the chunk-size rounding from wrapping */
+    if (new_size > HEAP_MAX_ALLOC) {
+        return NULL;
     }
     
-    if (old_block == NULL) {
+    /* Find the original chunk */
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    heap_chunk_t *chunk = validate_payload(ptr);
+    if (chunk == NULL || CHUNK_IS_FREE(chunk) || (chunk->header & HEAP_TAG_CACHED)) {
+        spin_unlock_irqrestore(&heap_lock, flags);
         return NULL;
     }
     
-    /* If new size fits in current block, just adjust size */
-    if (new_size <= old_block->size) {
+    size_t old_size = CHUNK_SIZE(chunk);
+    size_t chunk_size = request_to_chunk_size(new_size);
+    
+    /* If new size fits in current chunk, just adjust size */
+    if (chunk_size <= old_size) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        return ptr;
+    }
+    
+    /* Grow in place when the following chunk is free and big enough */
+    heap_chunk_t *next = CHUNK_NEXT(chunk);
+    if (CHUNK_IS_FREE(next) && old_size + CHUNK_SIZE(next) >= chunk_size) {
+        free_list_remove(next);
+        set_chunk_tags(chunk, old_size + CHUNK_SIZE(next), 1);
+        split_chunk(chunk, chunk_size);
+        this_cpu_add(heap_used, CHUNK_SIZE(chunk) - old_size);
+        spin_unlock_irqrestore(&heap_lock, flags);
         return ptr;
     }
+    spin_unlock_irqrestore(&heap_lock, flags);
     
-    /* Allocate new block and copy data */
+    /* Allocate new chunk and copy data */
     void *new_ptr = kmalloc(new_size);
     if (new_ptr == NULL) {
         return NULL;
     }
     
-    /* Copy old data to new location */
-    memcpy(new_ptr, ptr, old_block->size);
+    /* Copy old payload to new location */
+    memcpy(new_ptr, ptr, old_size - 2 * TAG_SIZE);
     kfree(ptr);
     
     return new_ptr;
@@ -246,76 +707,329 @@ void *kcalloc(size_t num, size_t size) {
 }
 
 /*
- * Allocate a stack for a process
+ * Allocate memory whose payload starts on an 'align' boundary
+ * (align must be a power of two and a multiple of HEAP_ALIGN).
+ * The result is released with kfree() like any other allocation.
+ */
+void *kmalloc_aligned(size_t size, size_t align) {
+    if (align <= HEAP_ALIGN) {
+        return kmalloc(size);
+    }
+    if (size == 0 || size > HEAP_MAX_ALLOC || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    
+    size_t chunk_size = request_to_chunk_size(size);
+    
+    /* Room for the worst-case alignment gap plus a free lead chunk */
+    size_t search_size = chunk_size + align + MIN_CHUNK_SIZE;
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    heap_chunk_t *chunk = find_free_chunk(search_size);
+    if (chunk == NULL && heap_add_arena(search_size) == 0) {
+        chunk = find_free_chunk(search_size);
+    }
+    if (chunk == NULL) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        KLOG(KLOG_ERROR, serial_puts("[MEMORY] kmalloc_aligned failed: out of memory\n"));
+        TRACE(TRACE_KMALLOC_FAIL, 0, size);
+        return NULL;
+    }
+    
+    free_list_remove(chunk);
+    
+    /* Work out where the aligned payload lands inside this chunk */
+    uint32_t payload = (uint32_t)CHUNK_PAYLOAD(chunk);
+    uint32_t aligned = (payload + align - 1) & ~(align - 1);
+    if (aligned != payload && aligned - payload < MIN_CHUNK_SIZE) {
+        aligned += align;  /* Gap too small to become a free chunk */
+    }
+    
+    /* Give the leading gap back as its own free chunk */
+    if (aligned != payload) {
+        size_t lead = aligned - payload;
+        size_t total = CHUNK_SIZE(chunk);
+        
+        set_chunk_tags(chunk, lead, 0);
+        free_list_insert(chunk);
+        
+        chunk = PAYLOAD_CHUNK(aligned);
+        set_chunk_tags(chunk, total - lead, 0);
+    }
+    
+    set_chunk_tags(chunk, CHUNK_SIZE(chunk), 1);
+    split_chunk(chunk, chunk_size);
+    
+    this_cpu_add(heap_used, CHUNK_SIZE(chunk));
+    this_cpu_add(heap_allocations, 1);
+    
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return CHUNK_PAYLOAD(chunk);
+}
+
+/*
+ * Allocate physically contiguous, page-aligned memory.
+ * Whole pages come straight from the buddy allocator, never from the heap.
+ */
+void *page_alloc(uint32_t num_pages) {
+    if (num_pages == 0) {
+        return NULL;
+    }
+    return buddy_alloc(buddy_order_for_pages(num_pages));
+}
+
+/*
+ * Free memory obtained from page_alloc
+ */
+void page_free(void *page, uint32_t num_pages) {
+    if (page == NULL || num_pages == 0) {
+        return;
+    }
+    buddy_free(page, buddy_order_for_pages(num_pages));
+}
+
+/*
+ * Find the live stack descriptor for a PID. If link_out is given it
+ * receives the chain link pointing at the descriptor, for unlinking.
+ */
+static stack_descriptor_t *stack_lookup(uint32_t pid, stack_descriptor_t ***link_out) {
+    stack_descriptor_t **link = &stack_hash[pid % STACK_HASH_SIZE];
+    
+    while (*link != NULL && (*link)->pid != pid) {
+        link = &(*link)->next;
+    }
+    
+    if (link_out != NULL) {
+        *link_out = link;
+    }
+    return *link;
+}
+
+/*
+ * Allocate a default-size stack for a process
  */
 void *stack_alloc(uint32_t pid) {
-    /* Find a free stack slot */
-    for (uint32_t i = 0; i < MAX_PROCESS_STACKS; i++) {
-        if (stack_table[i].is_free) {
-            /* Calculate stack address */
-            void *stack_base = (void*)((uint32_t)stack_region_start + (i * STACK_SIZE));
-            void *stack_top = (void*)((uint32_t)stack_base + STACK_SIZE);
-            
-            /* Initialize stack descriptor */
-            stack_table[i].base = stack_base;
-            stack_table[i].top = stack_top;
-            stack_table[i].size = STACK_SIZE;
-            stack_table[i].pid = pid;
-            stack_table[i].is_free = 0;
-            
-            num_stacks++;
-            
-            /* Zero out the stack memory */
-            memset(stack_base, 0, STACK_SIZE);
-            
-            return stack_top; /* Stack grows downward, so return top */
+    return stack_alloc_sized(pid, STACK_SIZE);
+}
+
+/*
+ * Allocate a stack of at least 'size' bytes for a process.
+ * Stacks of terminated processes are recycled from the pool as-is;
+ * only STACK_SCRUB builds pay for zeroing them.
+ */
+void *stack_alloc_sized(uint32_t pid, size_t size) {
+    if (size < STACK_MIN_SIZE) size = STACK_MIN_SIZE;
+    if (size > STACK_MAX_SIZE) {
+        KLOG(KLOG_ERROR, serial_puts("[MEMORY] stack_alloc failed: size exceeds STACK_MAX_SIZE\n"));
+        return NULL;
+    }
+    
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t flags = spin_lock_irqsave(&stack_lock);
+    stack_descriptor_t *desc = stack_pool[pages];
+    
+    if (desc != NULL) {
+        /* Recycle a pooled stack of the same size */
+        stack_pool[pages] = desc->next;
+        stack_pool_count[pages]--;
+    } else {
+        if (stack_desc_cache == NULL) {
+            stack_desc_cache = kmem_cache_create("stack_descriptor",
+                                                 sizeof(stack_descriptor_t), 0, NULL);
+        }
+        
+        desc = (stack_descriptor_t *)kmem_cache_alloc(stack_desc_cache);
+        if (desc == NULL) {
+            spin_unlock_irqrestore(&stack_lock, flags);
+            KLOG(KLOG_ERROR, serial_puts("[MEMORY] stack_alloc failed: no stack descriptors\n"));
+            return NULL;
+        }
+        
+        /* Stacks are whole pages straight from the page allocator */
+        uint8_t *block = (uint8_t*)buddy_alloc_pages(pages + STACK_GUARD_PAGES);
+        if (block == NULL) {
+            kmem_cache_free(stack_desc_cache, desc);
+            spin_unlock_irqrestore(&stack_lock, flags);
+            KLOG(KLOG_ERROR, serial_puts("[MEMORY] stack_alloc failed: out of page frames\n"));
+            return NULL;
+        }
+        
+        /* The guard stays unmapped while the block is a stack, pooled or
+         * not; without a frame for a page table the stack goes unguarded */
+        if (STACK_GUARD && paging_unmap((uint32_t)block) != 0) {
+            KLOG(KLOG_WARN, serial_puts("[MEMORY] No page table for a stack guard page\n"));
         }
+        desc->base = block + STACK_GUARD_SIZE;
+        desc->pages = pages;
+        desc->size = (size_t)pages * PAGE_SIZE;
+        desc->top = (void*)(block + STACK_GUARD_SIZE + desc->size);
     }
     
-    serial_puts("[MEMORY] stack_alloc failed: no free stack slots\n");
+    if (STACK_SCRUB) {
+        memset(desc->base, 0, desc->size);
+    }
+    desc->window = NULL;
+    desc->holds = 0;
+    
+    /* Publish in the PID hash (newest first, so duplicates free LIFO) */
+    stack_descriptor_t **bucket = &stack_hash[pid % STACK_HASH_SIZE];
+    desc->pid = pid;
+    desc->next = *bucket;
+    *bucket = desc;
+    
+    num_stacks++;
+    stack_bytes += desc->size;
+    
+    spin_unlock_irqrestore(&stack_lock, flags);
+    return desc->top; /* Stack grows downward, so return top */
+}
+
+/*
+ * Stack for child_pid, forked from parent_pid: a block of the same size
+ * that the child's address space maps over the parent's stack (the
+ * window). A child of a forked process shares the same window. The
+ * window's block stays allocated for as long as a fork maps over it,
+ * even after its own process is gone, so kernel code running in a forked
+ * space never finds its addresses handed out for something else.
+ */
+stack_descriptor_t *stack_fork(uint32_t parent_pid, uint32_t child_pid) {
+    uint32_t flags = spin_lock_irqsave(&stack_lock);
+    stack_descriptor_t *parent = stack_lookup(parent_pid, NULL);
+    
+    if (parent == NULL) {
+        spin_unlock_irqrestore(&stack_lock, flags);
+        return NULL;
+    }
+    
+    stack_descriptor_t *window = (parent->window != NULL) ? parent->window : parent;
+    window->holds++;
+    spin_unlock_irqrestore(&stack_lock, flags);
+    
+    stack_descriptor_t *desc = NULL;
+    if (stack_alloc_sized(child_pid, window->size) != NULL) {
+        flags = spin_lock_irqsave(&stack_lock);
+        desc = stack_lookup(child_pid, NULL);
+        desc->window = window;
+        spin_unlock_irqrestore(&stack_lock, flags);
+        return desc;
+    }
+    
+    /* The parent is the caller and still alive, so the window stays */
+    flags = spin_lock_irqsave(&stack_lock);
+    window->holds--;
+    spin_unlock_irqrestore(&stack_lock, flags);
     return NULL;
 }
 
 /*
- * Free a stack for a process
+ * Free a stack for a process. A stack that forks still map over waits
+ * for the last of them; the stack of a fork lets go of its window.
  */
 void stack_free(uint32_t pid) {
-    for (uint32_t i = 0; i < MAX_PROCESS_STACKS; i++) {
-        if (!stack_table[i].is_free && stack_table[i].pid == pid) {
-            stack_table[i].base = NULL;
-            stack_table[i].top = NULL;
-            stack_table[i].size = 0;
-            stack_table[i].pid = 0;
-            stack_table[i].is_free = 1;
-            
-            num_stacks--;
-            return;
-        }
+    stack_descriptor_t **link;
+    uint32_t flags = spin_lock_irqsave(&stack_lock);
+    stack_descriptor_t *desc = stack_lookup(pid, &link);
+    
+    if (desc == NULL) {
+        spin_unlock_irqrestore(&stack_lock, flags);
+        return;
+    }
+    
+    *link = desc->next;
+    num_stacks--;
+    stack_bytes -= desc->size;
+    desc->pid = 0;
+    
+    stack_descriptor_t *window = desc->window;
+    desc->window = NULL;
+    if (window != NULL && (--window->holds != 0 || window->pid != 0)) {
+        window = NULL;      /* Still in use */
+    }
+    uint32_t retire = (desc->holds == 0);
+    spin_unlock_irqrestore(&stack_lock, flags);
+    
+    if (retire) {
+        stack_retire(desc);
+    }
+    if (window != NULL) {
+        stack_retire(window);
     }
 }
 
+/*
+ * Keep a stack nobody uses any more in the pool for the next spawn, or
+ * give the pages back once the pool for its size is full
+ */
+static void stack_retire(stack_descriptor_t *desc) {
+    uint32_t flags = spin_lock_irqsave(&stack_lock);
+    
+    if (stack_pool_count[desc->pages] < STACK_POOL_DEPTH) {
+        desc->next = stack_pool[desc->pages];
+        stack_pool[desc->pages] = desc;
+        stack_pool_count[desc->pages]++;
+        spin_unlock_irqrestore(&stack_lock, flags);
+        return;
+    }
+    spin_unlock_irqrestore(&stack_lock, flags);
+    
+    uint8_t *block = (uint8_t*)desc->base - STACK_GUARD_SIZE;
+    if (STACK_GUARD) {
+        paging_map((uint32_t)block, (uint32_t)block, PAGE_WRITE);
+    }
+    buddy_free_pages(block, desc->pages + STACK_GUARD_PAGES);
+    kmem_cache_free(stack_desc_cache, desc);
+}
+
 /*
  * Get stack base address for a process
  */
 void *stack_get_base(uint32_t pid) {
-    for (uint32_t i = 0; i < MAX_PROCESS_STACKS; i++) {
-        if (!stack_table[i].is_free && stack_table[i].pid == pid) {
-            return stack_table[i].base;
-        }
-    }
-    return NULL;
+    uint32_t flags = spin_lock_irqsave(&stack_lock);
+    stack_descriptor_t *desc = stack_lookup(pid, NULL);
+    void *base = (desc != NULL) ? desc->base : NULL;
+    spin_unlock_irqrestore(&stack_lock, flags);
+    return base;
 }
 
 /*
  * Get stack top address for a process
  */
 void *stack_get_top(uint32_t pid) {
-    for (uint32_t i = 0; i < MAX_PROCESS_STACKS; i++) {
-        if (!stack_table[i].is_free && stack_table[i].pid == pid) {
-            return stack_table[i].top;
+    uint32_t flags = spin_lock_irqsave(&stack_lock);
+    stack_descriptor_t *desc = stack_lookup(pid, NULL);
+    void *top = (desc != NULL) ? desc->top : NULL;
+    spin_unlock_irqrestore(&stack_lock, flags);
+    return top;
+}
+
+/*
+ * Get stack size for a process
+ */
+size_t stack_get_size(uint32_t pid) {
+    uint32_t flags = spin_lock_irqsave(&stack_lock);
+    stack_descriptor_t *desc = stack_lookup(pid, NULL);
+    size_t size = (desc != NULL) ? desc->size : 0;
+    spin_unlock_irqrestore(&stack_lock, flags);
+    return size;
+}
+
+/*
+ * Which live stack has its guard page at addr, for fault reports. Reads
+ * the hash without stack_lock, since the faulting CPU may hold it.
+ */
+uint32_t stack_guard_owner(uint32_t addr) {
+    if (!STACK_GUARD) {
+        return 0;
+    }
+    
+    for (uint32_t i = 0; i < STACK_HASH_SIZE; i++) {
+        for (stack_descriptor_t *desc = stack_hash[i]; desc != NULL; desc = desc->next) {
+            uint32_t guard = (uint32_t)desc->base - STACK_GUARD_SIZE;
+            if (addr >= guard && addr < (uint32_t)desc->base) {
+                return desc->pid;
+            }
         }
     }
-    return NULL;
+    return 0;
 }
 
 /*
@@ -326,19 +1040,54 @@ void memory_get_stats(memory_stats_t *stats) {
         return;
     }
     
-    stats->total_heap = HEAP_SIZE;
-    stats->used_heap = heap_used;
-    stats->free_heap = HEAP_SIZE - heap_used;
-    stats->total_stacks = num_stacks * STACK_SIZE;
+    /* Each CPU counts its own kmalloc()/kfree(); only the sum means anything */
+    size_t used = 0;
+    uint32_t allocations = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        used += percpu_area(cpu)->heap_used;
+        allocations += percpu_area(cpu)->heap_allocations;
+    }
+    
+    stats->total_heap = heap_total;
+    stats->used_heap = used;
+    stats->free_heap = heap_total - used;
+    
+    uint32_t flags = spin_lock_irqsave(&stack_lock);
+    stats->total_stacks = stack_bytes;
     stats->num_stacks = num_stacks;
     
-    /* Count active allocations */
-    stats->num_allocations = 0;
-    for (uint32_t i = 0; i < num_heap_blocks; i++) {
-        if (heap_blocks[i].is_free == BLOCK_ALLOCATED) {
-            stats->num_allocations++;
+    stats->pooled_stacks = 0;
+    stats->pooled_bytes = 0;
+    for (uint32_t i = 0; i < STACK_POOL_CLASSES; i++) {
+        stats->pooled_stacks += stack_pool_count[i];
+        stats->pooled_bytes += stack_pool_count[i] * (size_t)i * PAGE_SIZE;
+    }
+    spin_unlock_irqrestore(&stack_lock, flags);
+    
+    stats->num_allocations = allocations;
+    
+    /* Other CPUs' magazines change under us; close enough for statistics */
+    stats->cached_chunks = 0;
+    stats->cached_bytes = 0;
+    stats->magazine_refills = 0;
+    stats->magazine_flushes = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        for (uint32_t cls = 0; cls < HEAP_MAG_CLASSES; cls++) {
+            uint32_t rounds = heap_cpus[cpu].magazines[cls].rounds;
+            stats->cached_chunks += rounds;
+            stats->cached_bytes += rounds * (MIN_CHUNK_SIZE + cls * HEAP_ALIGN);
         }
+        stats->magazine_refills += heap_cpus[cpu].refills;
+        stats->magazine_flushes += heap_cpus[cpu].flushes;
+    }
+    
+    flags = spin_lock_irqsave(&depot_lock);
+    for (uint32_t cls = 0; cls < HEAP_MAG_CLASSES; cls++) {
+        uint32_t chunks = heap_depot[cls].count * HEAP_MAG_BATCH;
+        stats->cached_chunks += chunks;
+        stats->cached_bytes += chunks * (MIN_CHUNK_SIZE + cls * HEAP_ALIGN);
     }
+    spin_unlock_irqrestore(&depot_lock, flags);
 }
 
 /*
@@ -348,39 +1097,130 @@ void memory_print_stats(void) {
     memory_stats_t stats;
     memory_get_stats(&stats);
     
-    serial_puts("\n=== Memory Statistics ===\n");
-    serial_puts("Heap Total:  ");
-    serial_put_dec(stats.total_heap / 1024);
-    serial_puts(" KB\n");
+    kprintf("\n=== Memory Statistics ===\n"
+            "Heap Total:  %u KB\n"
+            "Heap Used:   %u KB\n"
+            "Heap Free:   %u KB\n"
+            "Allocations: %u\n"
+            "Stacks:      %u (%u KB)\n"
+            "Stack Pool:  %u (%u KB)\n"
+            "Magazines:   %u cached (%u KB), %u refills, %u flushes\n"
+            "Arenas:      %u\n"
+            "Free Chunks: %u\n",
+            stats.total_heap / 1024, stats.used_heap / 1024, stats.free_heap / 1024,
+            stats.num_allocations,
+            stats.num_stacks, stats.total_stacks / 1024,
+            stats.pooled_stacks, stats.pooled_bytes / 1024,
+            stats.cached_chunks, stats.cached_bytes / 1024,
+            stats.magazine_refills, stats.magazine_flushes,
+            num_arenas, num_free_chunks);
+    
+    /* Bin occupancy - only non-empty bins are listed */
+    kprintf("Free Bins:   map=0x%08X\n", bin_map);
+    for (uint32_t i = 0; i < HEAP_NUM_BINS; i++) {
+        if (bin_count[i] == 0) {
+            continue;
+        }
+        
+        if (i < HEAP_EXACT_BINS) {
+            kprintf("  bin %2u (   %u B): %u\n", i, MIN_CHUNK_SIZE + i * HEAP_ALIGN,
+                    bin_count[i]);
+        } else {
+            kprintf("  bin %2u (>= %u B): %u\n", i,
+                    i == HEAP_EXACT_BINS ? MIN_CHUNK_SIZE + HEAP_EXACT_BINS * HEAP_ALIGN :
+                                           1u << (i - HEAP_EXACT_BINS + 7),
+                    bin_count[i]);
+        }
+    }
+    buddy_stats_t frames;
+    buddy_get_stats(&frames);
+    kprintf("Page Frames: %u free / %u (%u MB)\n"
+            "========================\n\n",
+            frames.free_frames, frames.total_frames,
+            frames.total_frames / (1024 * 1024 / PAGE_SIZE));
+}
+
+/*
+ * Defragment heap memory.
+ * Free chunks are coalesced with their neighbours as soon as they reach
+ * the heap, so the heap never holds two adjacent free chunks. Chunks
+ * cached in magazines are held back from that: hand this CPU's and the
+ * depot's back so they can merge (other CPUs' magazines are theirs alone).
+ */
+void memory_defragment(void) {
+    heap_chunk_t *batches[HEAP_MAG_CLASSES];
+    uint32_t returned = 0;
+    
+    uint32_t flags = irq_save();
+    heap_cpu_t *cpu = &heap_cpus[smp_cpu_id()];
     
-    serial_puts("Heap Used:   ");
-    serial_put_dec(stats.used_heap / 1024);
-    serial_puts(" KB\n");
+    spin_lock(&depot_lock);
+    for (uint32_t cls = 0; cls < HEAP_MAG_CLASSES; cls++) {
+        batches[cls] = heap_depot[cls].batches;
+        heap_depot[cls].batches = NULL;
+        heap_depot[cls].count = 0;
+    }
+    spin_unlock(&depot_lock);
     
-    serial_puts("Heap Free:   ");
-    serial_put_dec(stats.free_heap / 1024);
-    serial_puts(" KB\n");
+    spin_lock(&heap_lock);
+    for (uint32_t cls = 0; cls < HEAP_MAG_CLASSES; cls++) {
+        heap_magazine_t *mag = &cpu->magazines[cls];
+        
+        while (mag->rounds != 0) {
+            heap_put(mag->chunks[--mag->rounds]);
+            returned++;
+        }
+        
+        while (batches[cls] != NULL) {
+            heap_chunk_t *batch = batches[cls];
+            batches[cls] = batch->prev_free;
+            
+            while (batch != NULL) {
+                heap_chunk_t *next = batch->next_free;
+                heap_put(batch);
+                returned++;
+                batch = next;
+            }
+        }
+    }
+    uint32_t free_chunks = num_free_chunks;
+    spin_unlock(&heap_lock);
+    irq_restore(flags);
     
-    serial_puts("Allocations: ");
-    serial_put_dec(stats.num_allocations);
-    serial_puts("\n");
+    KLOG(KLOG_INFO, serial_puts("[MEMORY] Returned "), serial_put_dec(returned),
+         serial_puts(" cached chunks; heap coalesced ("),
+         serial_put_dec(free_chunks), serial_puts(" free chunks)\n"));
+}
+
+/*
+ * Print kmalloc/kfree latency rows (see cycle_hist_print_header())
+ */
+void memory_print_latency(void) {
+    cycle_hist_t kmalloc_cycles;
+    cycle_hist_t kfree_cycles;
     
-    serial_puts("Stacks:      ");
-    serial_put_dec(stats.num_stacks);
-    serial_puts(" (");
-    serial_put_dec(stats.total_stacks / 1024);
-    serial_puts(" KB)\n");
+    cycle_hist_reset(&kmalloc_cycles);
+    cycle_hist_reset(&kfree_cycles);
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        cycle_hist_merge(&kmalloc_cycles, &heap_cpus[cpu].kmalloc_cycles);
+        cycle_hist_merge(&kfree_cycles, &heap_cpus[cpu].kfree_cycles);
+    }
     
-    serial_puts("Heap Blocks: ");
-    serial_put_dec(num_heap_blocks);
-    serial_puts("\n");
-    serial_puts("========================\n\n");
+    cycle_hist_print("kmalloc", &kmalloc_cycles);
+    cycle_hist_print("kfree", &kfree_cycles);
 }
 
+/* Shell commands */
+
 /*
- * Defragment heap memory by merging adjacent free blocks
+ * memstats: display memory statistics
  */
-void memory_defragment(void) {
-    merge_free_blocks();
-    serial_puts("[MEMORY] Heap defragmented\n");
+static int memory_cmd_memstats(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    memory_print_stats();
+    return 0;
 }
+
+SHELL_COMMAND(memstats, "memstats", "memstats", "Display memory statistics", memory_cmd_memstats);
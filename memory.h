@@ -6,30 +6,90 @@
 
 /* Memory configuration constants */
 #define PAGE_SIZE           4096
-#define HEAP_START          0x200000    /* 2MB - Start of heap memory */
-#define HEAP_SIZE           0x1E00000   /* 30MB - Total heap size */
-#define STACK_SIZE          0x4000      /* 16KB per process stack */
-#define MAX_BLOCKS          1024        /* Maximum heap blocks */
-
-/* Memory block states */
-#define BLOCK_FREE          0
-#define BLOCK_ALLOCATED     1
-
-/* Heap block structure for managing heap memory */
-typedef struct heap_block {
-    void *address;          /* Starting address of the block */
-    size_t size;            /* Size of the block in bytes */
-    uint8_t is_free;        /* 1 if free, 0 if allocated */
-    struct heap_block *next; /* Next block in the list */
-} heap_block_t;
+#define PAGE_SHIFT          12
+#define HEAP_ARENA_ORDER    8           /* Heap grows in 2^8 pages (1MB) arenas */
+#define HEAP_ARENA_SIZE(order) ((size_t)PAGE_SIZE << (order))
+#define STACK_SIZE          0x4000      /* 16KB default process stack */
+#define STACK_MIN_SIZE      PAGE_SIZE   /* Smallest per-process stack */
+#define STACK_MAX_SIZE      0x10000     /* Largest per-process stack (64KB) */
+#define STACK_POOL_DEPTH    8           /* Recycled stacks kept per size class */
+
+/* Build-time security switch: zero stacks before handing them out.
+ * Off by default - recycled stacks keep their old contents, and
+ * process_create() never reads below the frame it builds itself. */
+#ifndef STACK_SCRUB
+#define STACK_SCRUB         0
+#endif
+
+/* Build-time switch: leave the page below every process stack unmapped,
+ * so running off the bottom faults instead of overwriting whatever lies
+ * there. The guard comes on top of the requested size. */
+#ifndef STACK_GUARD
+#define STACK_GUARD         1
+#endif
+#define STACK_GUARD_SIZE    (STACK_GUARD ? PAGE_SIZE : 0)
+
+/* Heap chunk layout (boundary-tag allocator)
+ *
+ *   +--------+---------------------------+--------+
+ *   | header |  payload (or free links)  | footer |
+ *   +--------+---------------------------+--------+
+ *
+ * Header and footer hold the same tag: the chunk size in bytes (always a
+ * multiple of HEAP_ALIGN) with the low bit set while the chunk is allocated.
+ * The footer lets kfree() find the previous chunk in O(1) so neighbours can
+ * be coalesced without any side table.
+ */
+#define HEAP_ALIGN          8           /* Payload alignment in bytes */
+#define HEAP_TAG_ALLOCATED  0x1         /* Tag bit: chunk is in use */
+
+/* Segregated free lists (size-class bins)
+ *
+ * Bins 0..HEAP_EXACT_BINS-1 hold chunks of one exact size
+ * (16, 24, ... 136 bytes). The remaining bins each cover a power-of-two
+ * range starting at 144 bytes; the last bin collects everything larger.
+ * A bitmap with one bit per non-empty bin lets kmalloc find a fitting bin
+ * with a single bit scan, independent of how many chunks are free.
+ */
+#define HEAP_NUM_BINS       32
+#define HEAP_EXACT_BINS     16
+
+/* Per-CPU magazines
+ *
+ * A freed chunk of one of the exact-bin sizes goes into the freeing CPU's
+ * magazine for that size and the next kmalloc() of the size on that CPU
+ * takes it back, with no lock and no cache line shared with other CPUs.
+ * An empty magazine is loaded and a full one emptied a batch at a time:
+ * through a small global depot of full batches per size and, past that,
+ * the heap itself, so one lock round trip covers HEAP_MAG_BATCH chunks.
+ * Cached chunks stay marked allocated, with HEAP_TAG_CACHED set as well.
+ */
+#define HEAP_MAG_CLASSES    HEAP_EXACT_BINS
+#define HEAP_MAG_ROUNDS     16          /* Chunks per magazine */
+#define HEAP_MAG_BATCH      8           /* Chunks moved per refill or flush */
+#define HEAP_DEPOT_BATCHES  8           /* Full batches kept per size */
+#define HEAP_TAG_CACHED     0x2         /* Tag bit: chunk is in a magazine or the depot */
+
+/* Boundary tag stored at both ends of every chunk */
+typedef uint32_t heap_tag_t;
+
+/* Free heap chunk - the free list links live inside the unused payload */
+typedef struct heap_chunk {
+    heap_tag_t header;              /* Size of the chunk | allocation bit */
+    struct heap_chunk *next_free;   /* Next chunk in the free list */
+    struct heap_chunk *prev_free;   /* Previous chunk in the free list */
+} heap_chunk_t;
 
 /* Stack descriptor for process stacks */
 typedef struct stack_descriptor {
-    void *base;             /* Base address of the stack */
+    void *base;             /* Base address of the stack (above its guard page) */
     void *top;              /* Current top of the stack */
     size_t size;            /* Total size of the stack */
     uint32_t pid;           /* Process ID owning this stack */
-    uint8_t is_free;        /* 1 if free, 0 if allocated */
+    uint32_t pages;         /* Pages of the stack, its guard not counted */
+    struct stack_descriptor *window; /* Forked: the stack mapped over this one */
+    uint32_t holds;         /* Forked stacks mapped over this one */
+    struct stack_descriptor *next; /* PID hash chain or pool list */
 } stack_descriptor_t;
 
 /* Memory statistics structure */
@@ -40,6 +100,12 @@ typedef struct memory_stats {
     size_t total_stacks;    /* Total stack memory allocated */
     uint32_t num_allocations; /* Number of active allocations */
     uint32_t num_stacks;    /* Number of active stacks */
+    uint32_t pooled_stacks; /* Freed stacks cached for reuse */
+    size_t pooled_bytes;    /* Memory held by the stack pool */
+    uint32_t cached_chunks; /* Freed chunks held in magazines and the depot */
+    size_t cached_bytes;    /* Memory held by them */
+    uint32_t magazine_refills; /* kmalloc() found its magazine empty */
+    uint32_t magazine_flushes; /* kfree() found its magazine full */
 } memory_stats_t;
 
 /* Memory manager initialization */
@@ -50,16 +116,26 @@ void *kmalloc(size_t size);                 /* Allocate heap memory */
 void kfree(void *ptr);                      /* Free heap memory */
 void *krealloc(void *ptr, size_t new_size); /* Reallocate heap memory */
 void *kcalloc(size_t num, size_t size);     /* Allocate and zero memory */
+void *kmalloc_aligned(size_t size, size_t align); /* Allocate with alignment */
+
+/* Page-granular memory functions (page-aligned, used by the slab allocator) */
+void *page_alloc(uint32_t num_pages);       /* Allocate contiguous pages */
+void page_free(void *page, uint32_t num_pages); /* Free pages from page_alloc */
 
 /* Stack memory functions */
-void *stack_alloc(uint32_t pid);            /* Allocate stack for a process */
-void stack_free(uint32_t pid);              /* Free stack for a process */
+void *stack_alloc(uint32_t pid);            /* Allocate default-size stack */
+void *stack_alloc_sized(uint32_t pid, size_t size); /* Allocate stack of given size */
+stack_descriptor_t *stack_fork(uint32_t parent_pid, uint32_t child_pid); /* Stack for a fork */
+void stack_free(uint32_t pid);              /* Return stack to the pool */
 void *stack_get_base(uint32_t pid);         /* Get stack base for a process */
 void *stack_get_top(uint32_t pid);          /* Get stack top for a process */
+size_t stack_get_size(uint32_t pid);        /* Get stack size for a process */
+uint32_t stack_guard_owner(uint32_t addr);  /* PID whose stack guard holds addr, or 0 */
 
 /* Memory utility functions */
 void memory_get_stats(memory_stats_t *stats); /* Get memory statistics */
 void memory_print_stats(void);               /* Print memory statistics */
-void memory_defragment(void);               /* Defragment heap memory */
+void memory_defragment(void);               /* Return cached chunks, report coalescing */
+void memory_print_latency(void);            /* kmalloc/kfree cycle histograms */
 
 #endif /* MEMORY_H */
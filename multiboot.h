@@ -0,0 +1,61 @@
+/* multiboot.h - Multiboot (v1) boot information structures */
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include "types.h"
+
+/* Value the bootloader leaves in EAX */
+#define MULTIBOOT_BOOTLOADER_MAGIC  0x2BADB002
+
+/* Header flags requested in boot.S */
+#define MULTIBOOT_PAGE_ALIGN        0x00000001  /* Align modules on 4KB */
+#define MULTIBOOT_MEMORY_INFO       0x00000002  /* Provide mem_* and mmap_* */
+
+/* multiboot_info_t.flags bits */
+#define MULTIBOOT_INFO_MEMORY       0x00000001  /* mem_lower/mem_upper valid */
+#define MULTIBOOT_INFO_CMDLINE      0x00000004  /* cmdline valid */
+#define MULTIBOOT_INFO_MODS         0x00000008  /* mods_count/mods_addr valid */
+#define MULTIBOOT_INFO_MEM_MAP      0x00000040  /* mmap_addr/mmap_length valid */
+
+/* Memory map entry types */
+#define MULTIBOOT_MEMORY_AVAILABLE  1
+
+/* Boot information passed in EBX */
+typedef struct multiboot_info {
+    uint32_t flags;
+    uint32_t mem_lower;             /* KB of memory below 1MB */
+    uint32_t mem_upper;             /* KB of memory above 1MB */
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;           /* Size of the memory map in bytes */
+    uint32_t mmap_addr;             /* Physical address of the first entry */
+    uint32_t drives_length;
+    uint32_t drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+} __attribute__((packed)) multiboot_info_t;
+
+/* Memory map entry. 'size' does not count itself, so the next entry
+ * starts at (uint8_t*)entry + entry->size + sizeof(entry->size). */
+typedef struct multiboot_mmap_entry {
+    uint32_t size;
+    uint32_t addr_low;
+    uint32_t addr_high;
+    uint32_t len_low;
+    uint32_t len_high;
+    uint32_t type;
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+/* Boot module list entry */
+typedef struct multiboot_module {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t string;                /* NUL-terminated command line */
+    uint32_t reserved;
+} __attribute__((packed)) multiboot_module_t;
+
+#endif /* MULTIBOOT_H */
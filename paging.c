@@ -0,0 +1,571 @@
+/* paging.c - Page tables */
+#include "paging.h"
+#include "memory.h"
+#include "string.h"
+#include "buddy.h"
+#include "serial.h"
+#include "klog.h"
+#include "cpu.h"
+#include "idt.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "percpu.h"
+#include "shell.h"
+
+/* Kernel text and read-only data (link.ld) */
+extern uint8_t __text_start[];
+extern uint8_t __text_end[];
+
+static page_entry_t page_directory[PAGE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+static page_entry_t low_table[PAGE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+static uint32_t global_flag = 0;        /* PAGE_GLOBAL when the CPU has PGE */
+static uint8_t large_pages = 0;         /* The CPU has PSE */
+
+/* Directory, tables and the space list. Taken under stack_lock; takes
+ * buddy_lock itself when a table has to be allocated. Readers of single
+ * entries (paging_lookup()) go without it: kernel tables are never freed. */
+static spinlock_t paging_lock = SPINLOCK_INIT;
+
+/* Forked address spaces, and the TLB generation: a CPU whose
+ * tlb_generation is behind this one may still hold entries, global ones
+ * included, that were dropped or changed, and flushes them all before it
+ * next switches to a process. */
+static address_space_t *spaces = NULL;
+static uint32_t num_spaces = 0;
+static uint32_t tlb_generation = 0;
+static kmem_cache_t *space_cache = NULL;
+
+#define DIR_INDEX(addr)     ((uint32_t)(addr) >> LARGE_PAGE_SHIFT)
+#define TABLE_INDEX(addr)   (((uint32_t)(addr) >> PAGE_SHIFT) & (PAGE_ENTRIES - 1))
+#define ENTRY_ADDR(entry)   ((entry) & ~PAGE_FLAGS_MASK)
+#define LARGE_BASE(addr)    ((uint32_t)(addr) & ~(LARGE_PAGE_SIZE - 1))
+
+/* Directory slots a space has its own page tables for */
+#define SPACE_PRIVATE(space, dir) \
+    ((dir) >= DIR_INDEX((space)->window_start) && (dir) <= DIR_INDEX((space)->window_end - 1))
+
+/* Attribute bits a 4MB entry shares with the 4KB entries it splits into */
+#define SPLIT_FLAGS         (PAGE_PRESENT | PAGE_WRITE | PAGE_PWT | PAGE_PCD | PAGE_GLOBAL)
+
+/* Forward declarations for internal functions */
+static page_entry_t *table_alloc(uint32_t base, uint32_t flags);
+static page_entry_t *paging_table(uint32_t virt);
+static int in_kernel_text(uint32_t addr);
+static void spaces_sync(uint32_t virt);
+static void space_free_tables(address_space_t *space);
+
+/*
+ * Map RAM, switch the boot CPU to the new directory and turn paging on.
+ * Runs after buddy_init(), which knows where RAM ends and provides the
+ * page tables.
+ */
+void paging_init(void) {
+    uint32_t features = cpu_features_edx();
+    buddy_stats_t frames;
+    buddy_get_stats(&frames);
+    
+    large_pages = (features & CPUID_FEAT_EDX_PSE) != 0;
+    global_flag = (features & CPUID_FEAT_EDX_PGE) ? PAGE_GLOBAL : 0;
+    
+    /* First 4MB: page 0 and the kernel text read-only, the rest writable */
+    for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+        uint32_t addr = i << PAGE_SHIFT;
+        uint32_t flags = PAGE_PRESENT | global_flag;
+        
+        if (addr != 0 && !in_kernel_text(addr)) {
+            flags |= PAGE_WRITE;
+        }
+        low_table[i] = addr | flags;
+    }
+    page_directory[0] = (uint32_t)low_table | PAGE_PRESENT | PAGE_WRITE;
+    
+    /* The rest of RAM, rounded up to whole 4MB */
+    uint32_t dir_entries = (frames.max_frame + PAGE_ENTRIES - 1) / PAGE_ENTRIES;
+    uint32_t flags = PAGE_PRESENT | PAGE_WRITE | global_flag;
+    for (uint32_t dir = 1; dir < dir_entries; dir++) {
+        uint32_t base = dir << LARGE_PAGE_SHIFT;
+        
+        if (large_pages) {
+            page_directory[dir] = base | flags | PAGE_LARGE;
+            continue;
+        }
+        
+        page_entry_t *table = table_alloc(base, flags);
+        if (table == NULL) {
+            KLOG(KLOG_ERROR, serial_puts("[PAGING] Out of frames for page tables, RAM above 0x"),
+                 serial_put_hex(base), serial_puts(" is not mapped\n"));
+            break;
+        }
+        page_directory[dir] = (uint32_t)table | PAGE_PRESENT | PAGE_WRITE;
+    }
+    
+    /* A double fault switches tasks, and the TSS names the directory */
+    idt_set_page_directory((uint32_t)page_directory);
+    
+    /* PSE before PG, or the 4MB entries mean nothing */
+    write_cr4(read_cr4() | (large_pages ? CR4_PSE : 0) | (global_flag ? CR4_PGE : 0));
+    paging_load();
+    write_cr0(read_cr0() | CR0_PG | CR0_WP);
+    
+    KLOG(KLOG_INFO, serial_puts("[PAGING] "), serial_put_dec(dir_entries * 4),
+         serial_puts(" MB identity-mapped with "),
+         serial_puts(large_pages ? "4MB" : "4KB"),
+         serial_puts(global_flag ? " global pages\n" : " pages\n"));
+}
+
+/*
+ * Load the kernel page directory on this CPU
+ */
+void paging_load(void) {
+    write_cr3((uint32_t)page_directory);
+}
+
+/*
+ * Whether addr is in a kernel text or read-only data page
+ */
+static int in_kernel_text(uint32_t addr) {
+    return addr >= (uint32_t)__text_start && addr < (uint32_t)__text_end;
+}
+
+/*
+ * A page table mapping 4KB pages from base on with flags, or with all
+ * entries not present for flags 0
+ */
+static page_entry_t *table_alloc(uint32_t base, uint32_t flags) {
+    page_entry_t *table = (page_entry_t *)buddy_alloc(0);
+    if (table == NULL) {
+        return NULL;
+    }
+    
+    for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+        table[i] = (flags != 0) ? (base + (i << PAGE_SHIFT)) | flags : 0;
+    }
+    return table;
+}
+
+/*
+ * The page table covering virt, created on demand. A 4MB page is split
+ * into 1024 4KB pages that map exactly what it did. NULL without a frame
+ * for the table. Called with paging_lock held.
+ */
+static page_entry_t *paging_table(uint32_t virt) {
+    page_entry_t *dir = &page_directory[DIR_INDEX(virt)];
+    
+    if ((*dir & PAGE_PRESENT) && !(*dir & PAGE_LARGE)) {
+        return (page_entry_t *)ENTRY_ADDR(*dir);
+    }
+    
+    page_entry_t *table = (*dir & PAGE_PRESENT) ?
+                          table_alloc(LARGE_BASE(*dir), *dir & SPLIT_FLAGS) :
+                          table_alloc(0, 0);
+    if (table == NULL) {
+        return NULL;
+    }
+    
+    *dir = (uint32_t)table | PAGE_PRESENT | PAGE_WRITE;
+    invlpg(LARGE_BASE(virt));
+    spaces_sync(virt);
+    return table;
+}
+
+/*
+ * Copy the kernel's entry for virt into every forked space: the
+ * directory entry, or inside a space's private tables the page entry,
+ * unless virt is in the window itself. Called with paging_lock held
+ * after each change to the kernel directory or its tables.
+ */
+static void spaces_sync(uint32_t virt) {
+    uint32_t dir = DIR_INDEX(virt);
+    
+    for (address_space_t *space = spaces; space != NULL; space = space->next) {
+        if (!SPACE_PRIVATE(space, dir)) {
+            space->directory[dir] = page_directory[dir];
+        } else if (virt < space->window_start || virt >= space->window_end) {
+            page_entry_t *kernel = (page_entry_t *)ENTRY_ADDR(page_directory[dir]);
+            page_entry_t *table = (page_entry_t *)ENTRY_ADDR(space->directory[dir]);
+            table[TABLE_INDEX(virt)] = kernel[TABLE_INDEX(virt)];
+        }
+    }
+}
+
+/*
+ * Map one 4KB page
+ */
+int paging_map(uint32_t virt, uint32_t phys, uint32_t flags) {
+    uint32_t irq_flags = spin_lock_irqsave(&paging_lock);
+    page_entry_t *table = paging_table(virt);
+    
+    if (table == NULL) {
+        spin_unlock_irqrestore(&paging_lock, irq_flags);
+        return -1;
+    }
+    
+    if (table[TABLE_INDEX(virt)] & PAGE_PRESENT) {
+        tlb_generation++;           /* Other CPUs may cache the old entry */
+    }
+    table[TABLE_INDEX(virt)] = ENTRY_ADDR(phys) | (flags & (PAGE_WRITE | PAGE_PWT | PAGE_PCD)) |
+                               PAGE_PRESENT | global_flag;
+    invlpg(virt);
+    spaces_sync(virt);
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return 0;
+}
+
+/*
+ * Unmap one 4KB page, splitting the 4MB page around it if need be. Other
+ * CPUs may hold a global entry for the whole 4MB page, which no CR3
+ * reload drops: the new generation has them flush before they next run
+ * a process.
+ */
+int paging_unmap(uint32_t virt) {
+    uint32_t irq_flags = spin_lock_irqsave(&paging_lock);
+    
+    if (!(page_directory[DIR_INDEX(virt)] & PAGE_PRESENT)) {
+        spin_unlock_irqrestore(&paging_lock, irq_flags);
+        return 0;
+    }
+    
+    page_entry_t *table = paging_table(virt);
+    if (table == NULL) {
+        spin_unlock_irqrestore(&paging_lock, irq_flags);
+        return -1;
+    }
+    
+    table[TABLE_INDEX(virt)] = 0;
+    invlpg(virt);
+    tlb_generation++;
+    spaces_sync(virt);
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return 0;
+}
+
+/*
+ * Identity-map [phys, phys + size). Pages that are already mapped are
+ * left as they are; an empty 4MB directory slot is filled with a single
+ * 4MB page when the CPU has PSE. Nothing was mapped there before, so no
+ * TLB can have an entry to drop.
+ */
+int paging_map_range(uint32_t phys, uint32_t size, uint32_t flags) {
+    if (size == 0) {
+        return 0;
+    }
+    
+    uint32_t addr = ENTRY_ADDR(phys);
+    uint32_t last = ENTRY_ADDR(phys + size - 1);
+    int result = 0;
+    
+    flags = (flags & (PAGE_WRITE | PAGE_PWT | PAGE_PCD)) | PAGE_PRESENT | global_flag;
+    
+    uint32_t irq_flags = spin_lock_irqsave(&paging_lock);
+    for (;;) {
+        page_entry_t *dir = &page_directory[DIR_INDEX(addr)];
+        uint32_t region_last = LARGE_BASE(addr) + LARGE_PAGE_SIZE - PAGE_SIZE;
+        
+        if (!(*dir & PAGE_PRESENT) && large_pages) {
+            *dir = LARGE_BASE(addr) | flags | PAGE_LARGE;
+            spaces_sync(addr);
+            addr = region_last;
+        } else if (*dir & PAGE_LARGE) {
+            addr = region_last;     /* Mapped already */
+        } else {
+            page_entry_t *table = paging_table(addr);
+            if (table == NULL) {
+                result = -1;
+                break;
+            }
+            if (!(table[TABLE_INDEX(addr)] & PAGE_PRESENT)) {
+                table[TABLE_INDEX(addr)] = addr | flags;
+                spaces_sync(addr);
+            }
+        }
+        
+        if (addr >= last) {
+            break;
+        }
+        addr += PAGE_SIZE;
+    }
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return result;
+}
+
+/*
+ * Entry that translates virt, as a 4KB entry even inside a 4MB page
+ */
+page_entry_t paging_lookup(uint32_t virt) {
+    page_entry_t dir = page_directory[DIR_INDEX(virt)];
+    
+    if (!(dir & PAGE_PRESENT)) {
+        return 0;
+    }
+    if (dir & PAGE_LARGE) {
+        return (LARGE_BASE(dir) | (ENTRY_ADDR(virt) & (LARGE_PAGE_SIZE - 1))) |
+               (dir & SPLIT_FLAGS);
+    }
+    
+    page_entry_t entry = ((page_entry_t *)ENTRY_ADDR(dir))[TABLE_INDEX(virt)];
+    return (entry & PAGE_PRESENT) ? entry : 0;
+}
+
+/*
+ * Address space that maps [start, end) to the frames from phys on and
+ * everything else like the kernel directory. NULL when out of memory.
+ * Costs a directory and one page table per 4MB the window touches.
+ */
+address_space_t *paging_space_create(uint32_t start, uint32_t end, uint32_t phys) {
+    if (space_cache == NULL) {
+        space_cache = kmem_cache_create("address_space", sizeof(address_space_t), 0, NULL);
+    }
+    
+    address_space_t *space = (space_cache != NULL) ?
+                             (address_space_t *)kmem_cache_alloc(space_cache) : NULL;
+    if (space == NULL) {
+        return NULL;
+    }
+    
+    space->window_start = ENTRY_ADDR(start);
+    space->window_end = ENTRY_ADDR(end + PAGE_SIZE - 1);
+    space->directory = (page_entry_t *)buddy_alloc(0);
+    if (space->directory == NULL) {
+        kmem_cache_free(space_cache, space);
+        return NULL;
+    }
+    
+    uint32_t irq_flags = spin_lock_irqsave(&paging_lock);
+    
+    /* The kernel's view of the window: 4KB pages, none of them global */
+    uint32_t flushed = 0;
+    for (uint32_t addr = space->window_start; addr < space->window_end; addr += PAGE_SIZE) {
+        page_entry_t *table = paging_table(addr);
+        if (table == NULL) {
+            spin_unlock_irqrestore(&paging_lock, irq_flags);
+            buddy_free(space->directory, 0);
+            kmem_cache_free(space_cache, space);
+            return NULL;
+        }
+        if (table[TABLE_INDEX(addr)] & PAGE_GLOBAL) {
+            table[TABLE_INDEX(addr)] &= ~PAGE_GLOBAL;
+            invlpg(addr);
+            spaces_sync(addr);
+            flushed = 1;
+        }
+    }
+    if (flushed) {
+        tlb_generation++;
+    }
+    
+    /* Private copies of the tables the window lives in */
+    memcpy(space->directory, page_directory, PAGE_SIZE);
+    for (uint32_t dir = DIR_INDEX(space->window_start);
+         dir <= DIR_INDEX(space->window_end - 1); dir++) {
+        page_entry_t *table = (page_entry_t *)buddy_alloc(0);
+        if (table == NULL) {
+            space->directory[dir] = page_directory[dir];
+            spin_unlock_irqrestore(&paging_lock, irq_flags);
+            space_free_tables(space);
+            return NULL;
+        }
+        memcpy(table, (void *)ENTRY_ADDR(page_directory[dir]), PAGE_SIZE);
+        space->directory[dir] = (uint32_t)table | PAGE_PRESENT | PAGE_WRITE;
+    }
+    for (uint32_t addr = space->window_start; addr < space->window_end; addr += PAGE_SIZE) {
+        page_entry_t *table = (page_entry_t *)ENTRY_ADDR(space->directory[DIR_INDEX(addr)]);
+        table[TABLE_INDEX(addr)] = (phys + (addr - space->window_start)) | PAGE_PRESENT | PAGE_WRITE;
+    }
+    
+    space->next = spaces;
+    spaces = space;
+    num_spaces++;
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return space;
+}
+
+/*
+ * Free the private tables and the directory of a space that is not on
+ * the list, and the space itself. Slots still pointing at the kernel's
+ * tables are left alone.
+ */
+static void space_free_tables(address_space_t *space) {
+    for (uint32_t dir = DIR_INDEX(space->window_start);
+         dir <= DIR_INDEX(space->window_end - 1); dir++) {
+        if (ENTRY_ADDR(space->directory[dir]) != ENTRY_ADDR(page_directory[dir])) {
+            buddy_free((void *)ENTRY_ADDR(space->directory[dir]), 0);
+        }
+    }
+    buddy_free(space->directory, 0);
+    kmem_cache_free(space_cache, space);
+}
+
+/*
+ * Free an address space. No CPU may still be running on it; a process's
+ * space goes when the process is reaped, after its CPU switched away.
+ */
+void paging_space_destroy(address_space_t *space) {
+    if (space == NULL) {
+        return;
+    }
+    
+    uint32_t irq_flags = spin_lock_irqsave(&paging_lock);
+    address_space_t **link = &spaces;
+    while (*link != NULL && *link != space) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = space->next;
+        num_spaces--;
+    }
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    
+    space_free_tables(space);
+}
+
+/*
+ * Switch this CPU to space, or back to the kernel directory. After any
+ * CPU dropped or changed a translation, the whole TLB is flushed first:
+ * toggling CR4.PGE drops global entries too, and without PGE a CR3
+ * reload drops everything.
+ */
+void paging_switch(address_space_t *space) {
+    uint32_t cr3 = (space != NULL) ? (uint32_t)space->directory : (uint32_t)page_directory;
+    uint32_t generation = __atomic_load_n(&tlb_generation, __ATOMIC_ACQUIRE);
+    
+    if (this_cpu_read(tlb_generation) != generation) {
+        this_cpu_write(tlb_generation, generation);
+        uint32_t cr4 = read_cr4();
+        if (cr4 & CR4_PGE) {
+            write_cr4(cr4 & ~CR4_PGE);
+            write_cr4(cr4);
+        } else {
+            write_cr3(cr3);
+        }
+    }
+    if (read_cr3() != cr3) {
+        write_cr3(cr3);
+    }
+}
+
+/*
+ * One line on what the faulting address is. Takes no locks: the fault
+ * may have hit while this CPU held one.
+ */
+void paging_describe(uint32_t addr) {
+    page_entry_t entry = paging_lookup(addr);
+    uint32_t pid = stack_guard_owner(addr);
+    
+    serial_puts("  ");
+    if (addr < PAGE_SIZE) {
+        serial_puts("NULL page (read-only)");
+    } else if (pid != 0) {
+        serial_puts("Guard page below the stack of PID ");
+        serial_put_dec(pid);
+        serial_puts(": stack overflow");
+    } else if (in_kernel_text(addr)) {
+        serial_puts("Kernel text (read-only)");
+    } else if (entry == 0) {
+        serial_puts("Address not mapped");
+    } else {
+        serial_puts((entry & PAGE_WRITE) ? "Mapped read/write" : "Mapped read-only");
+    }
+    serial_puts("\n");
+}
+
+/*
+ * Count what the directory maps
+ */
+void paging_get_stats(paging_stats_t *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    
+    stats->large_pages = 0;
+    stats->page_tables = 0;
+    stats->small_pages = 0;
+    stats->read_only_pages = 0;
+    stats->holes = 0;
+    
+    uint32_t irq_flags = spin_lock_irqsave(&paging_lock);
+    for (uint32_t dir = 0; dir < PAGE_ENTRIES; dir++) {
+        page_entry_t entry = page_directory[dir];
+        
+        if (!(entry & PAGE_PRESENT)) {
+            continue;
+        }
+        if (entry & PAGE_LARGE) {
+            stats->large_pages++;
+            continue;
+        }
+        
+        page_entry_t *table = (page_entry_t *)ENTRY_ADDR(entry);
+        stats->page_tables++;
+        for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+            if (!(table[i] & PAGE_PRESENT)) {
+                stats->holes++;
+            } else {
+                stats->small_pages++;
+                if (!(table[i] & PAGE_WRITE)) {
+                    stats->read_only_pages++;
+                }
+            }
+        }
+    }
+    stats->spaces = num_spaces;
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    
+    stats->mapped_mb = stats->large_pages * (LARGE_PAGE_SIZE >> 20) +
+                       stats->small_pages / ((1024 * 1024) / PAGE_SIZE);
+}
+
+/*
+ * Print page-table statistics
+ */
+void paging_print_stats(void) {
+    paging_stats_t stats;
+    paging_get_stats(&stats);
+    
+    serial_puts("\n=== Page Tables ===\n");
+    serial_puts("Directory:   0x");
+    serial_put_hex((uint32_t)page_directory);
+    serial_puts(large_pages ? " (PSE" : " (no PSE");
+    serial_puts(global_flag ? ", global)\n" : ")\n");
+    
+    serial_puts("Mapped:      ");
+    serial_put_dec(stats.mapped_mb);
+    serial_puts(" MB\n");
+    
+    serial_puts("4MB pages:   ");
+    serial_put_dec(stats.large_pages);
+    serial_puts("\n");
+    
+    serial_puts("Page tables: ");
+    serial_put_dec(stats.page_tables);
+    serial_puts("\n");
+    
+    serial_puts("4KB pages:   ");
+    serial_put_dec(stats.small_pages);
+    serial_puts(" (");
+    serial_put_dec(stats.read_only_pages);
+    serial_puts(" read-only)\n");
+    
+    serial_puts("Unmapped:    ");
+    serial_put_dec(stats.holes);
+    serial_puts(" pages inside tables\n");
+    
+    serial_puts("Forked:      ");
+    serial_put_dec(stats.spaces);
+    serial_puts(" address spaces\n");
+    serial_puts("===================\n\n");
+}
+
+/* Shell commands */
+
+/*
+ * paging: display page-table statistics
+ */
+static int paging_cmd_paging(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    paging_print_stats();
+    return 0;
+}
+
+SHELL_COMMAND(paging, "paging", "paging", "Display page-table statistics", paging_cmd_paging);
@@ -0,0 +1,111 @@
+/* paging.h - Page tables */
+#ifndef PAGING_H
+#define PAGING_H
+
+#include "types.h"
+
+/*
+ * One page directory, shared by every CPU, maps physical RAM at its own
+ * address, so turning paging on changes no pointer in the kernel. RAM
+ * above 4MB is mapped with 4MB (PSE) pages, one TLB entry each. The first
+ * 4MB goes through a page table so single pages can be protected: page 0
+ * is read-only (a store through NULL faults, the BIOS data area stays
+ * readable) and so is the kernel's text. Every mapping is global when the
+ * CPU has PGE, so the kernel's TLB entries survive CR3 reloads.
+ *
+ * A 4MB page is split into a page table the first time one of its 4KB
+ * pages needs to differ, such as the unmapped guard page below a process
+ * stack. Without PSE all of RAM goes through page tables.
+ *
+ * A change invalidates this CPU's TLB at once. Dropping or changing a
+ * translation also moves the TLB generation on, and every other CPU
+ * flushes its whole TLB, global entries included, before it next
+ * switches to a process, so a guard page unmapped before its process
+ * first runs faults on any CPU. Until then another CPU's null context
+ * may still use the old translation, so callers may only unmap memory
+ * they own and do not hand back while it is unmapped.
+ */
+
+/* Page directory and page table entry bits */
+#define PAGE_PRESENT        0x001
+#define PAGE_WRITE          0x002
+#define PAGE_PWT            0x008       /* Write-through */
+#define PAGE_PCD            0x010       /* Cache disabled */
+#define PAGE_ACCESSED       0x020
+#define PAGE_DIRTY          0x040
+#define PAGE_LARGE          0x080       /* Directory entry maps 4MB itself */
+#define PAGE_GLOBAL         0x100       /* Kept across CR3 reloads (PGE) */
+#define PAGE_FLAGS_MASK     0xFFF
+
+#define PAGE_ENTRIES        1024
+#define LARGE_PAGE_SHIFT    22
+#define LARGE_PAGE_SIZE     (1u << LARGE_PAGE_SHIFT)
+
+/* Device memory: uncached */
+#define PAGE_MMIO           (PAGE_WRITE | PAGE_PCD | PAGE_PWT)
+
+/* Page-fault error code bits */
+#define PAGE_FAULT_PRESENT  0x1         /* Protection fault, not a missing page */
+#define PAGE_FAULT_WRITE    0x2         /* Caused by a store */
+
+typedef uint32_t page_entry_t;
+
+/*
+ * Address space of a forked process (process_fork()). Its stack has to
+ * sit where the parent's does, or saved frame pointers and pointers to
+ * locals would lead back into the parent's stack. The space is a copy of
+ * the kernel directory whose page tables for that window point at the
+ * child's own frames; everything else maps exactly what the kernel
+ * directory does, and later changes to the kernel's tables are copied
+ * in. The kernel's own entries for a window are made non-global first,
+ * so no CPU can carry them into the child.
+ */
+typedef struct address_space {
+    page_entry_t *directory;        /* Loaded into CR3 while the process runs */
+    uint32_t window_start;          /* Privately mapped range (page aligned) */
+    uint32_t window_end;
+    struct address_space *next;     /* All spaces, for keeping them in sync */
+} address_space_t;
+
+/* Page-table statistics, gathered by walking the directory */
+typedef struct paging_stats {
+    uint32_t large_pages;           /* 4MB mappings */
+    uint32_t page_tables;           /* Directory entries split into 4KB pages */
+    uint32_t small_pages;           /* Present 4KB mappings */
+    uint32_t read_only_pages;       /* ... of which read-only */
+    uint32_t holes;                 /* Not-present entries inside page tables */
+    uint32_t mapped_mb;             /* Address space mapped, in MB */
+    uint32_t spaces;                /* Forked address spaces */
+} paging_stats_t;
+
+/* Build the kernel page directory and turn paging on, on the boot CPU */
+void paging_init(void);
+
+/* Load the kernel page directory on an AP before it sets CR0.PG */
+void paging_load(void);
+
+/* Map or unmap one 4KB page; 0 on success, -1 without memory for a table */
+int paging_map(uint32_t virt, uint32_t phys, uint32_t flags);
+int paging_unmap(uint32_t virt);
+
+/* Identity-map a range that lies outside RAM, such as device registers */
+int paging_map_range(uint32_t phys, uint32_t size, uint32_t flags);
+
+/* Entry that maps virt (physical address | flags), 0 if unmapped */
+page_entry_t paging_lookup(uint32_t virt);
+
+/* Forked address spaces: [start, end) maps the frames from phys on */
+address_space_t *paging_space_create(uint32_t start, uint32_t end, uint32_t phys);
+void paging_space_destroy(address_space_t *space);
+
+/* Run on space (NULL: the kernel directory) from now on */
+void paging_switch(address_space_t *space);
+
+/* Say what a faulting address is (NULL page, stack guard, ...) in a crash report */
+void paging_describe(uint32_t addr);
+
+/* Statistics */
+void paging_get_stats(paging_stats_t *stats);
+void paging_print_stats(void);
+
+#endif /* PAGING_H */
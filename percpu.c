@@ -0,0 +1,42 @@
+/* percpu.c - Per-CPU data area */
+#include "percpu.h"
+#include "smp.h"
+
+/* GDT (boot.S): per-CPU descriptors follow the flat code and data ones */
+extern uint32_t gdt_percpu[];
+extern uint8_t gdt_descriptor[];
+
+/* Descriptor bits: present ring-0 read/write data; 32-bit, byte granular */
+#define PERCPU_ACCESS           0x92
+#define PERCPU_FLAGS            0x4
+
+static percpu_t percpu_areas[MAX_CPUS];
+
+/*
+ * Point this CPU's GDT slot at its area and load %gs from it. The boot
+ * CPU calls this before anything asks smp_cpu_id(); an AP as soon as it
+ * reaches C.
+ */
+void percpu_init(uint32_t cpu) {
+    percpu_t *area = &percpu_areas[cpu];
+    uint32_t base = (uint32_t)area;
+    uint32_t limit = sizeof(percpu_t) - 1;
+    
+    area->self = area;
+    area->cpu_id = cpu;
+    
+    gdt_percpu[cpu * 2] = (base << 16) | (limit & 0xFFFF);
+    gdt_percpu[cpu * 2 + 1] = (base & 0xFF000000) | (PERCPU_FLAGS << 20) | (limit & 0xF0000) |
+                              (PERCPU_ACCESS << 8) | ((base >> 16) & 0xFF);
+    
+    /* An AP arrives with the trampoline's GDT limit, which stops at 0x10 */
+    __asm__ volatile ("lgdt (%0)" : : "r"(gdt_descriptor) : "memory");
+    __asm__ volatile ("mov %0, %%gs" : : "r"((uint32_t)PERCPU_SELECTOR(cpu)) : "memory");
+}
+
+/*
+ * Any CPU's area
+ */
+percpu_t *percpu_area(uint32_t cpu) {
+    return (cpu < MAX_CPUS) ? &percpu_areas[cpu] : NULL;
+}
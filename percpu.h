@@ -0,0 +1,66 @@
+/* percpu.h - Per-CPU data area */
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include "types.h"
+
+/*
+ * Every CPU owns one percpu_t, and its %gs segment is based at it. Code
+ * reaches its own CPU's copy with a single %gs-relative instruction and
+ * does not have to work out first which CPU it is on. Counters that every
+ * CPU bumps live here and are summed when someone reads them. Keeping
+ * them apart means a kmalloc() on one core never pulls another core's
+ * cache line over.
+ *
+ * The area sits in its own cache line and its segment limit ends where
+ * the structure does.
+ */
+
+typedef struct percpu {
+    struct percpu *self;            /* Linear address of this area (%gs:0) */
+    uint32_t cpu_id;                /* smp_cpu_id() */
+    
+    /* Heap counters. A block freed on another CPU than the one that
+     * allocated it makes one copy wrap, but the sum stays exact. */
+    size_t heap_used;               /* Bytes in allocated chunks */
+    uint32_t heap_allocations;      /* Live kmalloc() blocks */
+    
+    uint32_t tlb_generation;        /* Global TLB entries flushed up to here */
+} __attribute__((aligned(64))) percpu_t;
+
+/* GDT selector of a CPU's area (boot.S) */
+#define PERCPU_SELECTOR(cpu)    (0x18 + (cpu) * 8)
+
+#define PERCPU_OFFSET(field)    __builtin_offsetof(percpu_t, field)
+
+/* Read, write or add to a 32-bit field of this CPU's area */
+#define this_cpu_read(field) ({                                             \
+    uint32_t value__;                                                       \
+    __asm__ volatile ("movl %%gs:%c1, %0"                                   \
+                      : "=r"(value__) : "i"(PERCPU_OFFSET(field)));         \
+    (__typeof__(((percpu_t *)0)->field))value__;                            \
+})
+
+#define this_cpu_write(field, value)                                        \
+    __asm__ volatile ("movl %0, %%gs:%c1"                                   \
+                      : : "ri"((uint32_t)(value)), "i"(PERCPU_OFFSET(field)) \
+                      : "memory")
+
+/* One instruction, so an interrupt on this CPU cannot split it */
+#define this_cpu_add(field, value)                                          \
+    __asm__ volatile ("addl %0, %%gs:%c1"                                   \
+                      : : "ri"((uint32_t)(value)), "i"(PERCPU_OFFSET(field)) \
+                      : "memory", "cc")
+
+/* This CPU's area as an ordinary pointer */
+static inline percpu_t *this_cpu(void) {
+    return this_cpu_read(self);
+}
+
+/* Build this CPU's descriptor and load %gs with it; first thing on a CPU */
+void percpu_init(uint32_t cpu);
+
+/* Another CPU's area, for sum-on-read statistics */
+percpu_t *percpu_area(uint32_t cpu);
+
+#endif /* PERCPU_H */
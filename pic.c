@@ -0,0 +1,100 @@
+/* pic.c - 8259A Programmable Interrupt Controller */
+#include "pic.h"
+#include "io.h"
+
+#define PIC1_COMMAND    0x20
+#define PIC1_DATA       0x21
+#define PIC2_COMMAND    0xA0
+#define PIC2_DATA       0xA1
+
+#define PIC_EOI         0x20        /* Non-specific end of interrupt */
+#define PIC_READ_IRR    0x0A        /* OCW3: read interrupt request register */
+#define PIC_READ_ISR    0x0B        /* OCW3: read in-service register */
+
+#define ICW1_INIT       0x10
+#define ICW1_ICW4       0x01
+#define ICW4_8086       0x01
+
+#define PIC_CASCADE_IRQ 2           /* Slave PIC hangs off master line 2 */
+
+/*
+ * Remap the PICs away from the CPU exception vectors and mask every line
+ * except the cascade; drivers unmask the lines they handle
+ */
+void pic_init(uint8_t base_vector) {
+    outb(PIC1_COMMAND, ICW1_INIT | ICW1_ICW4);
+    io_wait();
+    outb(PIC2_COMMAND, ICW1_INIT | ICW1_ICW4);
+    io_wait();
+    outb(PIC1_DATA, base_vector);           /* ICW2: master vector offset */
+    io_wait();
+    outb(PIC2_DATA, base_vector + 8);       /* ICW2: slave vector offset */
+    io_wait();
+    outb(PIC1_DATA, 1 << PIC_CASCADE_IRQ);  /* ICW3: slave on line 2 */
+    io_wait();
+    outb(PIC2_DATA, PIC_CASCADE_IRQ);       /* ICW3: slave cascade identity */
+    io_wait();
+    outb(PIC1_DATA, ICW4_8086);
+    io_wait();
+    outb(PIC2_DATA, ICW4_8086);
+    io_wait();
+    
+    outb(PIC1_DATA, (uint8_t)~(1 << PIC_CASCADE_IRQ));
+    outb(PIC2_DATA, 0xFF);
+}
+
+/*
+ * Mask one IRQ line
+ */
+void pic_mask(uint32_t irq) {
+    uint16_t port = (irq < 8) ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) | (1 << (irq & 7)));
+}
+
+/*
+ * Unmask one IRQ line
+ */
+void pic_unmask(uint32_t irq) {
+    uint16_t port = (irq < 8) ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+}
+
+/*
+ * Acknowledge an IRQ; slave lines need an EOI on both chips
+ */
+void pic_send_eoi(uint32_t irq) {
+    if (irq >= 8) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+/*
+ * IRQ 7 and 15 can fire without a real request (line noise). The
+ * in-service bit tells: a spurious IRQ must not be acknowledged on its
+ * own chip, but a spurious slave IRQ still needs the master's EOI.
+ */
+int pic_is_spurious(uint32_t irq) {
+    if (irq == 7) {
+        outb(PIC1_COMMAND, PIC_READ_ISR);
+        return (inb(PIC1_COMMAND) & 0x80) == 0;
+    }
+    if (irq == 15) {
+        outb(PIC2_COMMAND, PIC_READ_ISR);
+        if ((inb(PIC2_COMMAND) & 0x80) == 0) {
+            outb(PIC1_COMMAND, PIC_EOI);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Check whether an IRQ is waiting to be delivered, e.g. while interrupts
+ * are off
+ */
+int pic_is_pending(uint32_t irq) {
+    uint16_t port = (irq < 8) ? PIC1_COMMAND : PIC2_COMMAND;
+    outb(port, PIC_READ_IRR);
+    return (inb(port) >> (irq & 7)) & 1;
+}
@@ -0,0 +1,21 @@
+/* pic.h - 8259A Programmable Interrupt Controller */
+#ifndef PIC_H
+#define PIC_H
+
+#include "types.h"
+
+/* Remap both PICs to base_vector .. base_vector + 15, all lines masked */
+void pic_init(uint8_t base_vector);
+
+/* Per-line masking */
+void pic_mask(uint32_t irq);
+void pic_unmask(uint32_t irq);
+
+/* End of interrupt, and spurious IRQ 7/15 detection */
+void pic_send_eoi(uint32_t irq);
+int pic_is_spurious(uint32_t irq);
+
+/* Line raised but not yet taken (interrupt request register) */
+int pic_is_pending(uint32_t irq);
+
+#endif /* PIC_H */
@@ -1,70 +1,179 @@
 /* process.c - Process Manager Implementation */
 #include "process.h"
 #include "memory.h"
+#include "slab.h"
 #include "string.h"
 #include "serial.h"
+#include "kprintf.h"
+#include "klog.h"
+#include "trace.h"
+#include "cycles.h"
+#include "bitops.h"
+#include "scheduler.h"
+#include "cpu.h"
+#include "ipc.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "paging.h"
+#include "shell.h"
 
-/* Process table - array of process pointers */
+/* Process table - indexed by PID_SLOT(pid) */
 static process_t *process_table[MAX_PROCESSES];
-static uint32_t next_pid = 1;  /* PID 0 reserved for null process */
-static process_t *current_process = NULL;
+static uint32_t slot_generation[MAX_PROCESSES];    /* Bumped each time a slot is freed */
+static uint16_t free_slots[MAX_PROCESSES];         /* Stack of unused slots */
+static uint32_t free_slot_count = 0;
+static uint32_t slot_high_water = 1;               /* One past the highest slot handed out */
+static uint32_t live_processes = 0;
+static process_t *current_process[MAX_CPUS];       /* Per CPU */
 static uint32_t total_processes_created = 0;
 
-/* Ready queue (circular linked list) */
-static process_t *ready_queue_head = NULL;
-static process_t *ready_queue_tail = NULL;
+/* Terminated processes waiting for process_reap(), oldest first, linked
+ * through next; the ready queues are done with them */
+static process_t *zombie_head = NULL;
+static process_t *zombie_tail = NULL;
+static uint32_t zombie_count = 0;
 
-/* Simple tick counter for timing */
-static uint32_t system_ticks = 0;
+/* Guards the table, every run queue, process states, current_process[]
+ * and on_cpu/exit_requested. It nests inside a channel lock and outside
+ * the timer, heap and serial locks. */
+static spinlock_t process_lock = SPINLOCK_INIT;
+
+/* Heap entry: the key sits beside the pointer, so sifting compares keys
+ * without touching a PCB */
+typedef struct {
+    uint32_t key;
+    process_t *proc;
+} ready_entry_t;
+
+/* A run queue per CPU: a FIFO per priority level with a bitmap of the
+ * non-empty levels, plus one FIFO over all its ready processes in arrival
+ * order. Under a keyed ready order (EDF, SRTF) the processes that have a
+ * key are also on a binary min-heap, so the next one is found in O(1) and
+ * taken off in O(log n). A ready process sits on the queue of proc->cpu. */
+typedef struct {
+    process_t *heads[PROC_PRIORITY_LEVELS];
+    process_t *tails[PROC_PRIORITY_LEVELS];
+    uint32_t map;
+    process_t *fifo_head;
+    process_t *fifo_tail;
+    uint32_t count;                 /* Ready processes queued */
+    ready_entry_t *heap;            /* heap_capacity entries */
+    uint32_t heap_count;
+} run_queue_t;
+
+static run_queue_t run_queues[MAX_CPUS];
+
+/* Every heap holds at least one entry per PID slot handed out, so linking
+ * a process never has to allocate; process_alloc() grows them all */
+static uint32_t heap_capacity = 0;
+static proc_order_t ready_order = PROC_ORDER_NONE;
+
+/* Keys are ticks or tick counts; compared so the clock may wrap */
+#define KEY_BEFORE(a, b)    ((int32_t)((a) - (b)) < 0)
+
+/* CPU share reserved by admitted deadline processes (PROC_UTIL_SCALE) */
+static uint32_t reserved_utilization = 0;
+
+/* First instructions of every new process, and the snapshot a forked
+ * one starts from (boot.S) */
+extern void process_start(void);
+extern uint32_t fork_context(cpu_context_t *ctx, void *child_top, void *parent_top);
+
+/* PCBs come from dedicated object caches instead of the general heap:
+ * the hot halves packed one per cache line, the cold halves beside them */
+static kmem_cache_t *pcb_cache = NULL;
+static kmem_cache_t *pcb_cold_cache = NULL;
 
 /* Forward declarations for internal functions */
-static void process_init_pcb(process_t *proc, const char *name, process_priority_t priority);
+static void process_init_pcb(process_t *proc, uint32_t pid, const char *name, process_priority_t priority);
+static process_t *process_alloc(const char *name, process_priority_t priority);
+static void process_discard(process_t *proc);
+static int process_setup_stack(process_t *proc, process_func_t entry_point, size_t stack_size);
+static void process_publish(process_t *proc);
+static void process_free_pcb(process_t *proc);
+static uint32_t process_alloc_pid(void);
+static void process_release_pid(uint32_t pid);
 static void process_add_to_table(process_t *proc);
 static void process_remove_from_table(uint32_t pid);
-static void process_add_to_ready_queue(process_t *proc);
+static void level_push(run_queue_t *rq, process_t *proc, int at_head);
+static void level_insert(run_queue_t *rq, process_t *proc);
+static void level_remove(run_queue_t *rq, process_t *proc);
+static void fifo_unlink(run_queue_t *rq, process_t *proc);
+static int ready_key(process_t *proc, uint32_t *key);
+static void heap_link(run_queue_t *rq, process_t *proc);
+static void heap_unlink(run_queue_t *rq, process_t *proc);
+static int heap_reserve(uint32_t needed);
+static process_t *process_create_timed(const char *name, process_func_t entry_point,
+                                       process_priority_t priority, uint32_t required_time,
+                                       uint32_t deadline, uint32_t utilization);
+static void process_add_to_ready_queue(process_t *proc, int at_head);
 static void process_remove_from_ready_queue(process_t *proc);
+static process_t *process_take_ready(process_t *proc);
+static void process_set_state_locked(process_t *proc, process_state_t new_state);
+static void process_set_priority_locked(process_t *proc, process_priority_t priority);
+static void process_wake(void *arg);
+static struct ipc_channel *process_mailbox(uint32_t pid);
 
 /*
  * Initialize the process manager
  */
 void process_init(void) {
-    /* Clear process table */
+    /* Clear process table; stack the free slots so the lowest pops first */
+    free_slot_count = 0;
     for (uint32_t i = 0; i < MAX_PROCESSES; i++) {
         process_table[i] = NULL;
+        slot_generation[i] = 0;
+    }
+    for (uint32_t slot = MAX_PROCESSES - 1; slot > 0; slot--) {
+        free_slots[free_slot_count++] = (uint16_t)slot;
     }
+    slot_high_water = 1;
+    live_processes = 0;
     
-    current_process = NULL;
-    ready_queue_head = NULL;
-    ready_queue_tail = NULL;
-    next_pid = 1;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        current_process[cpu] = NULL;
+        kfree(run_queues[cpu].heap);
+        memset(&run_queues[cpu], 0, sizeof(run_queue_t));
+    }
+    heap_capacity = 0;
+    reserved_utilization = 0;
     total_processes_created = 0;
-    system_ticks = 0;
+    zombie_head = NULL;
+    zombie_tail = NULL;
+    zombie_count = 0;
     
-    serial_puts("[PROCESS] Process manager initialized\n");
-    serial_puts("[PROCESS] Max processes: ");
-    serial_put_dec(MAX_PROCESSES);
-    serial_puts("\n");
+    if (pcb_cache == NULL) {
+        pcb_cache = kmem_cache_create("process_t", sizeof(process_t), 64, NULL);
+    }
+    if (pcb_cold_cache == NULL) {
+        pcb_cold_cache = kmem_cache_create("process_cold", sizeof(process_cold_t), 0, NULL);
+    }
+    
+    KLOG(KLOG_INFO, serial_puts("[PROCESS] Process manager initialized\n"),
+         serial_puts("[PROCESS] Max processes: "), serial_put_dec(MAX_PROCESSES),
+         serial_puts("\n"));
 }
 
 /*
  * Initialize a Process Control Block
  */
-static void process_init_pcb(process_t *proc, const char *name, process_priority_t priority) {
-    proc->pid = next_pid++;
+static void process_init_pcb(process_t *proc, uint32_t pid, const char *name, process_priority_t priority) {
+    proc->pid = pid;
     
     /* Copy process name */
     size_t len = strlen(name);
     if (len > 31) len = 31;
-    memcpy(proc->name, name, len);
-    proc->name[len] = '\0';
+    memcpy(proc->cold->name, name, len);
+    proc->cold->name[len] = '\0';
     
     proc->state = PROC_STATE_READY;
-    proc->priority = priority;
+    proc->priority = (priority < PROC_PRIORITY_LEVELS) ? priority : PROC_PRIORITY_CRITICAL;
     
     /* Memory info will be set by caller */
-    proc->stack_base = NULL;
-    proc->stack_top = NULL;
-    proc->stack_size = 0;
+    proc->cold->stack_base = NULL;
+    proc->cold->stack_top = NULL;
+    proc->cold->stack_size = 0;
+    proc->cold->space = NULL;
     
     /* Clear CPU context */
     memset(&proc->context, 0, sizeof(cpu_context_t));
@@ -73,112 +182,164 @@ static void process_init_pcb(process_t *proc, const char *name, process_priority
     proc->time_quantum = 100;  /* Default time quantum */
     proc->cpu_time = 0;
     proc->required_time = 0;   /* No requirement by default */
-    proc->wait_time = 0;
-    proc->creation_time = system_ticks;
+    proc->cold->wait_time = 0;
+    proc->cold->creation_time = scheduler_get_ticks();
+    proc->cold->run_cycles = 0;
+    proc->cold->wait_cycles = 0;
+    proc->cold->dispatch_tsc = 0;
+    proc->cold->enqueue_tsc = 0;
+    proc->on_cpu = 0;
+    proc->exit_requested = 0;
+    proc->heap_slot = 0;
+    proc->cold->deadline = 0;
+    proc->cold->relative_deadline = 0;
+    proc->cold->utilization = 0;
+    timer_event_init(&proc->cold->sleep_timer, process_wake, (void *)pid);
     
     /* IPC */
-    memset(proc->message_queue, 0, sizeof(proc->message_queue));
-    proc->msg_count = 0;
-    proc->waiting_for_msg = 0;
+    proc->cold->mailbox = NULL;
+    proc->cold->ipc_wait = NULL;
     
-    /* Relationships */
-    proc->parent_pid = (current_process != NULL) ? current_process->pid : 0;
+    /* Relationships: the process whose stack creates it, none from the
+     * null context; starts out on the creating CPU's run queue */
+    process_t *parent = scheduler_get_running();
+    proc->cold->parent_pid = (parent != NULL) ? parent->pid : 0;
+    proc->cold->unwaited = NULL;
+    proc->cpu = smp_cpu_id();
     
     /* Exit status */
-    proc->exit_code = 0;
+    proc->cold->exit_code = 0;
+    proc->cold->reaped = 0;
+    proc->cold->waiting_for = 0;
     
     /* Aging */
-    proc->age = 0;
+    proc->enqueue_tick = proc->cold->creation_time;
     
     /* List pointers */
     proc->next = NULL;
     proc->prev = NULL;
+    proc->fifo_next = NULL;
+    proc->fifo_prev = NULL;
+}
+
+/*
+ * Reserve a table slot and build the PID for it (0 if the table is full).
+ * The table helpers below are called with process_lock held.
+ */
+static uint32_t process_alloc_pid(void) {
+    if (free_slot_count == 0) {
+        KLOG(KLOG_WARN, serial_puts("[PROCESS] Warning: Process table full!\n"));
+        return 0;
+    }
+    
+    uint32_t slot = free_slots[--free_slot_count];
+    if (slot >= slot_high_water) {
+        slot_high_water = slot + 1;
+    }
+    
+    return (slot_generation[slot] << PID_SLOT_BITS) | slot;
+}
+
+/*
+ * Return a slot to the free stack; the next PID built on it differs
+ */
+static void process_release_pid(uint32_t pid) {
+    uint32_t slot = PID_SLOT(pid);
+    
+    slot_generation[slot]++;
+    free_slots[free_slot_count++] = (uint16_t)slot;
 }
 
 /*
  * Add process to process table
  */
 static void process_add_to_table(process_t *proc) {
-    for (uint32_t i = 0; i < MAX_PROCESSES; i++) {
-        if (process_table[i] == NULL) {
-            process_table[i] = proc;
-            return;
-        }
-    }
-    serial_puts("[PROCESS] Warning: Process table full!\n");
+    process_table[PID_SLOT(proc->pid)] = proc;
+    live_processes++;
 }
 
 /*
  * Remove process from process table
  */
 static void process_remove_from_table(uint32_t pid) {
-    for (uint32_t i = 0; i < MAX_PROCESSES; i++) {
-        if (process_table[i] != NULL && process_table[i]->pid == pid) {
-            process_table[i] = NULL;
-            return;
-        }
+    uint32_t slot = PID_SLOT(pid);
+    
+    if (process_table[slot] != NULL && process_table[slot]->pid == pid) {
+        process_table[slot] = NULL;
+        live_processes--;
+        process_release_pid(pid);
     }
 }
 
 /*
- * Add process to ready queue (priority-based insertion)
+ * Link a process into the queue for its priority level
  */
-static void process_add_to_ready_queue(process_t *proc) {
-    proc->state = PROC_STATE_READY;
+static void level_push(run_queue_t *rq, process_t *proc, int at_head) {
+    uint32_t level = proc->priority;
     
-    /* Empty queue */
-    if (ready_queue_head == NULL) {
-        ready_queue_head = proc;
-        ready_queue_tail = proc;
+    if (rq->heads[level] == NULL) {
         proc->next = NULL;
         proc->prev = NULL;
-        return;
-    }
-    
-    /* Insert based on priority (higher number = higher priority) */
-    process_t *current = ready_queue_head;
-    
-    /* Insert at head if higher priority than head */
-    if (proc->priority > current->priority) {
-        proc->next = ready_queue_head;
+        rq->heads[level] = proc;
+        rq->tails[level] = proc;
+        rq->map |= 1u << level;
+    } else if (at_head) {
         proc->prev = NULL;
-        ready_queue_head->prev = proc;
-        ready_queue_head = proc;
-        return;
+        proc->next = rq->heads[level];
+        rq->heads[level]->prev = proc;
+        rq->heads[level] = proc;
+    } else {
+        proc->next = NULL;
+        proc->prev = rq->tails[level];
+        rq->tails[level]->next = proc;
+        rq->tails[level] = proc;
     }
+}
+
+/*
+ * Link a process into its level behind every peer that joined no later,
+ * keeping the level ordered by enqueue_tick (migrated processes)
+ */
+static void level_insert(run_queue_t *rq, process_t *proc) {
+    uint32_t level = proc->priority;
+    process_t *after = rq->tails[level];
     
-    /* Find insertion point */
-    while (current->next != NULL && current->next->priority >= proc->priority) {
-        current = current->next;
+    while (after != NULL && (int32_t)(after->enqueue_tick - proc->enqueue_tick) > 0) {
+        after = after->prev;
     }
     
-    /* Insert after current */
-    proc->next = current->next;
-    proc->prev = current;
-    
-    if (current->next != NULL) {
-        current->next->prev = proc;
+    if (after == NULL) {
+        level_push(rq, proc, 1);
+    } else if (after == rq->tails[level]) {
+        level_push(rq, proc, 0);
     } else {
-        ready_queue_tail = proc;  /* Inserting at tail */
+        proc->prev = after;
+        proc->next = after->next;
+        after->next->prev = proc;
+        after->next = proc;
     }
-    
-    current->next = proc;
 }
 
 /*
- * Remove process from ready queue
+ * Unlink a process from the queue for its priority level
  */
-static void process_remove_from_ready_queue(process_t *proc) {
+static void level_remove(run_queue_t *rq, process_t *proc) {
+    uint32_t level = proc->priority;
+    
     if (proc->prev != NULL) {
         proc->prev->next = proc->next;
     } else {
-        ready_queue_head = proc->next;  /* Removing head */
+        rq->heads[level] = proc->next;  /* Removing head */
     }
     
     if (proc->next != NULL) {
         proc->next->prev = proc->prev;
     } else {
-        ready_queue_tail = proc->prev;  /* Removing tail */
+        rq->tails[level] = proc->prev;  /* Removing tail */
+    }
+    
+    if (rq->heads[level] == NULL) {
+        rq->map &= ~(1u << level);
     }
     
     proc->next = NULL;
@@ -186,114 +347,582 @@ static void process_remove_from_ready_queue(process_t *proc) {
 }
 
 /*
- * Create a new process
+ * Unlink a process from its run queue's arrival-order FIFO
+ */
+static void fifo_unlink(run_queue_t *rq, process_t *proc) {
+    if (proc->fifo_prev != NULL) {
+        proc->fifo_prev->fifo_next = proc->fifo_next;
+    } else {
+        rq->fifo_head = proc->fifo_next;
+    }
+    
+    if (proc->fifo_next != NULL) {
+        proc->fifo_next->fifo_prev = proc->fifo_prev;
+    } else {
+        rq->fifo_tail = proc->fifo_prev;
+    }
+    
+    proc->fifo_next = NULL;
+    proc->fifo_prev = NULL;
+}
+
+/*
+ * Key of a ready process under the current order; 0 if it has none and
+ * stays off the heap. SRTF's key only changes while the process runs, so
+ * it cannot go stale on the heap.
+ */
+static int ready_key(process_t *proc, uint32_t *key) {
+    switch (ready_order) {
+        case PROC_ORDER_DEADLINE:
+            if (proc->cold->relative_deadline == 0) {
+                return 0;
+            }
+            *key = proc->cold->deadline;
+            return 1;
+        
+        case PROC_ORDER_REMAINING:
+            if (proc->required_time == 0) {
+                return 0;
+            }
+            *key = (proc->cpu_time < proc->required_time) ?
+                   proc->required_time - proc->cpu_time : 0;
+            return 1;
+        
+        default:
+            return 0;
+    }
+}
+
+static inline void heap_place(run_queue_t *rq, uint32_t i, ready_entry_t entry) {
+    rq->heap[i] = entry;
+    entry.proc->heap_slot = (uint16_t)(i + 1);
+}
+
+/*
+ * Put entry at slot i or above it, moving bigger parents down
+ */
+static void heap_sift_up(run_queue_t *rq, uint32_t i, ready_entry_t entry) {
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (!KEY_BEFORE(entry.key, rq->heap[parent].key)) {
+            break;
+        }
+        heap_place(rq, i, rq->heap[parent]);
+        i = parent;
+    }
+    heap_place(rq, i, entry);
+}
+
+/*
+ * Put entry at slot i or below it, moving smaller children up
+ */
+static void heap_sift_down(run_queue_t *rq, uint32_t i, ready_entry_t entry) {
+    for (;;) {
+        uint32_t child = 2 * i + 1;
+        if (child >= rq->heap_count) {
+            break;
+        }
+        if (child + 1 < rq->heap_count && KEY_BEFORE(rq->heap[child + 1].key, rq->heap[child].key)) {
+            child++;
+        }
+        if (!KEY_BEFORE(rq->heap[child].key, entry.key)) {
+            break;
+        }
+        heap_place(rq, i, rq->heap[child]);
+        i = child;
+    }
+    heap_place(rq, i, entry);
+}
+
+/*
+ * Add a ready process to its run queue's heap, if it has a key
+ */
+static void heap_link(run_queue_t *rq, process_t *proc) {
+    ready_entry_t entry;
+    
+    if (!ready_key(proc, &entry.key)) {
+        return;
+    }
+    entry.proc = proc;
+    heap_sift_up(rq, rq->heap_count++, entry);
+}
+
+/*
+ * Take a process off its run queue's heap, wherever it is in it
+ */
+static void heap_unlink(run_queue_t *rq, process_t *proc) {
+    if (proc->heap_slot == 0) {
+        return;
+    }
+    
+    uint32_t i = proc->heap_slot - 1;
+    proc->heap_slot = 0;
+    
+    /* Fill the hole with the last entry and restore the order around it */
+    ready_entry_t last = rq->heap[--rq->heap_count];
+    if (i == rq->heap_count) {
+        return;
+    }
+    if (i > 0 && KEY_BEFORE(last.key, rq->heap[(i - 1) / 2].key)) {
+        heap_sift_up(rq, i, last);
+    } else {
+        heap_sift_down(rq, i, last);
+    }
+}
+
+/*
+ * Grow every CPU's heap to hold needed entries, doubling. Nothing changes
+ * unless all the new arrays could be allocated. Returns 0 or -1.
+ */
+static int heap_reserve(uint32_t needed) {
+    ready_entry_t *grown[MAX_CPUS];
+    uint32_t capacity = (heap_capacity != 0) ? heap_capacity : 16;
+    
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        grown[cpu] = (ready_entry_t *)kmalloc(capacity * sizeof(ready_entry_t));
+        if (grown[cpu] == NULL) {
+            while (cpu-- > 0) {
+                kfree(grown[cpu]);
+            }
+            return -1;
+        }
+    }
+    
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        run_queue_t *rq = &run_queues[cpu];
+        
+        if (rq->heap != NULL) {
+            memcpy(grown[cpu], rq->heap, rq->heap_count * sizeof(ready_entry_t));
+            kfree(rq->heap);
+        }
+        rq->heap = grown[cpu];
+    }
+    heap_capacity = capacity;
+    return 0;
+}
+
+/*
+ * Add process to its CPU's ready queues, behind (or ahead of) its peers.
+ * Run queues are only touched with process_lock held.
+ */
+static void process_add_to_ready_queue(process_t *proc, int at_head) {
+    run_queue_t *rq = &run_queues[proc->cpu];
+    
+    /* Keep each level ordered by enqueue_tick so aging only has to look at
+     * the head: a process requeued in front takes over the head's tick */
+    process_t *first = rq->heads[proc->priority];
+    proc->enqueue_tick = (at_head && first != NULL) ? first->enqueue_tick : scheduler_get_ticks();
+    proc->cold->enqueue_tsc = cycles_now();
+    
+    proc->state = PROC_STATE_READY;
+    level_push(rq, proc, at_head);
+    
+    if (rq->fifo_head == NULL) {
+        proc->fifo_next = NULL;
+        proc->fifo_prev = NULL;
+        rq->fifo_head = proc;
+        rq->fifo_tail = proc;
+    } else if (at_head) {
+        proc->fifo_prev = NULL;
+        proc->fifo_next = rq->fifo_head;
+        rq->fifo_head->fifo_prev = proc;
+        rq->fifo_head = proc;
+    } else {
+        proc->fifo_next = NULL;
+        proc->fifo_prev = rq->fifo_tail;
+        rq->fifo_tail->fifo_next = proc;
+        rq->fifo_tail = proc;
+    }
+    rq->count++;
+    heap_link(rq, proc);
+    
+    /* Another CPU's queue: wake it if idle. A second waiter on this one:
+     * an idle CPU may want to steal it. */
+    if (smp_cpu_count() > 1) {
+        if (proc->cpu != smp_cpu_id()) {
+            smp_wake_cpu(proc->cpu);
+        } else if (rq->count > 1) {
+            smp_kick_idle();
+        }
+    }
+}
+
+/*
+ * Remove process from its CPU's ready queues
+ */
+static void process_remove_from_ready_queue(process_t *proc) {
+    run_queue_t *rq = &run_queues[proc->cpu];
+    
+    proc->cold->wait_time += scheduler_get_ticks() - proc->enqueue_tick;
+    proc->cold->wait_cycles += cycles_now() - proc->cold->enqueue_tsc;
+    level_remove(rq, proc);
+    fifo_unlink(rq, proc);
+    heap_unlink(rq, proc);
+    rq->count--;
+}
+
+/*
+ * Create a new process with the default stack size
  */
 process_t *process_create(const char *name, process_func_t entry_point, process_priority_t priority) {
-    /* Allocate PCB */
-    process_t *proc = (process_t *)kmalloc(sizeof(process_t));
+    return process_create_with_stack(name, entry_point, priority, STACK_SIZE);
+}
+
+/*
+ * Create a new process with its own stack size (small workers can use
+ * a single page instead of the 16KB default)
+ */
+process_t *process_create_with_stack(const char *name, process_func_t entry_point,
+                                     process_priority_t priority, size_t stack_size) {
+    process_t *proc = process_alloc(name, priority);
+    
     if (proc == NULL) {
-        serial_puts("[PROCESS] Failed to allocate PCB\n");
+        return NULL;
+    }
+    if (process_setup_stack(proc, entry_point, stack_size) != 0) {
+        process_discard(proc);
+        return NULL;
+    }
+    
+    process_publish(proc);
+    return proc;
+}
+
+/*
+ * Start another process like pid: same name, priority, time quantum,
+ * required time and stack size, running entry_point (NULL: pid's own)
+ * on a stack of its own. Spawning many identical workers costs a PCB
+ * copy and a pooled stack each; nothing is scrubbed or looked up by name.
+ */
+process_t *process_clone(uint32_t pid, process_func_t entry_point) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    process_t *model = process_get_by_pid(pid);
+    
+    if (model == NULL) {
+        spin_unlock_irqrestore(&process_lock, flags);
+        KLOG(KLOG_WARN, serial_puts("[PROCESS] Cannot clone: PID "),
+             serial_put_dec(pid), serial_puts(" not found\n"));
         return NULL;
     }
     
-    /* Initialize PCB */
-    process_init_pcb(proc, name, priority);
+    char name[32];
+    memcpy(name, model->cold->name, sizeof(name));
+    process_priority_t priority = model->priority;
+    uint32_t time_quantum = model->time_quantum;
+    uint32_t required_time = model->required_time;
+    size_t stack_size = model->cold->stack_size;
+    if (entry_point == NULL) {
+        entry_point = (process_func_t)model->context.eip;   /* 0 for a fork */
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
     
-    /* Allocate stack */
-    proc->stack_top = stack_alloc(proc->pid);
-    if (proc->stack_top == NULL) {
-        serial_puts("[PROCESS] Failed to allocate stack\n");
-        kfree(proc);
+    if (entry_point == NULL) {
+        KLOG(KLOG_WARN, serial_puts("[PROCESS] Cannot clone: PID "),
+             serial_put_dec(pid), serial_puts(" has no entry point\n"));
         return NULL;
     }
     
-    proc->stack_base = stack_get_base(proc->pid);
-    proc->stack_size = STACK_SIZE;
+    process_t *proc = process_alloc(name, priority);
+    if (proc == NULL) {
+        return NULL;
+    }
+    proc->time_quantum = time_quantum;
+    proc->required_time = required_time;
     
-    /* ========== Initialize CPU context for REAL hardware context switch ========== */
-    /* Set up initial register values that will be loaded on first context switch */
+    if (process_setup_stack(proc, entry_point, stack_size) != 0) {
+        process_discard(proc);
+        return NULL;
+    }
     
-    /* Instruction pointer - where process will start executing */
-    proc->context.eip = (uint32_t)entry_point;
+    process_publish(proc);
+    return proc;
+}
+
+/*
+ * Fork the running process. The child is a copy of its PCB and of the
+ * live part of its stack, and returns from this call with 0; the parent
+ * gets the child's PID, or -1. Frame pointers and pointers to locals
+ * have to keep working in the child, so its stack is mapped at the
+ * parent's address through an address space of its own (paging.h);
+ * heap, globals and everything else are the same memory as before. A
+ * pointer into a forked stack means something only to its own process.
+ */
+int process_fork(void) {
+    process_t *parent = scheduler_get_running();
     
-    /* Stack pointers - process's own stack */
-    proc->context.esp = (uint32_t)proc->stack_top;
-    proc->context.ebp = (uint32_t)proc->stack_top;
-    
-    /* General purpose registers - initialize to distinguishable values */
-    /* Using PID-based values so each process has unique register values */
-    proc->context.eax = 0xAAAA0000 | proc->pid;  /* EAX = 0xAAAA00XX where XX is PID */
-    proc->context.ebx = 0xBBBB0000 | proc->pid;  /* EBX = 0xBBBB00XX */
-    proc->context.ecx = 0xCCCC0000 | proc->pid;  /* ECX = 0xCCCC00XX */
-    proc->context.edx = 0xDDDD0000 | proc->pid;  /* EDX = 0xDDDD00XX */
-    proc->context.esi = 0x5151E000 | proc->pid;  /* ESI = 0x5151E0XX */
-    proc->context.edi = 0xD1D10000 | proc->pid;  /* EDI = 0xD1D100XX */
-    
-    /* Flags register - interrupts enabled, reserved bit set */
-    proc->context.eflags = 0x202;  /* IF=1 (interrupts enabled), reserved bit 1 = 1 */
-    
-    /* Segment registers - use kernel segments (flat model) */
-    proc->context.cs = 0x08;   /* Kernel code segment */
-    proc->context.ds = 0x10;   /* Kernel data segment */
-    proc->context.es = 0x10;
-    proc->context.fs = 0x10;
-    proc->context.gs = 0x10;
-    proc->context.ss = 0x10;   /* Kernel stack segment */
-    
-    /* Add to process table */
-    process_add_to_table(proc);
+    if (parent == NULL) {
+        KLOG(KLOG_WARN, serial_puts("[PROCESS] Cannot fork the null context\n"));
+        return -1;
+    }
     
-    /* Add to ready queue */
-    process_add_to_ready_queue(proc);
+    process_t *child = process_alloc(parent->cold->name, parent->priority);
+    if (child == NULL) {
+        return -1;
+    }
+    child->time_quantum = parent->time_quantum;
+    child->required_time = parent->required_time;
+    
+    /* The child's own frames, and the stack they stand in for */
+    stack_descriptor_t *stack = stack_fork(parent->pid, child->pid);
+    if (stack == NULL) {
+        KLOG(KLOG_ERROR, serial_puts("[PROCESS] Failed to allocate stack\n"));
+        process_discard(child);
+        return -1;
+    }
     
-    total_processes_created++;
+    stack_descriptor_t *window = stack->window;
+    child->cold->stack_base = window->base;
+    child->cold->stack_top = window->top;
+    child->cold->stack_size = window->size;
+    child->cold->space = paging_space_create((uint32_t)window->base, (uint32_t)window->top,
+                                             (uint32_t)stack->base);
+    if (child->cold->space == NULL) {
+        KLOG(KLOG_ERROR, serial_puts("[PROCESS] Failed to allocate an address space\n"));
+        stack_free(child->pid);
+        process_discard(child);
+        return -1;
+    }
     
-    serial_puts("[PROCESS] Created process '");
-    serial_puts(proc->name);
-    serial_puts("' (PID ");
-    serial_put_dec(proc->pid);
-    serial_puts(", Priority ");
-    serial_put_dec(proc->priority);
-    serial_puts(")\n");
+    /* Nothing may run on this stack between the snapshot and the copy */
+    uint32_t flags = irq_save();
+    if (fork_context(&child->context, stack->top, window->top) == 0) {
+        irq_restore(flags);         /* The child, after its first switch */
+        return 0;
+    }
+    irq_restore(flags);
     
+    process_publish(child);
+    return (int)child->pid;
+}
+
+/*
+ * A PCB with a PID and default settings, not yet in the table or on a
+ * queue. NULL when out of PCBs or PIDs.
+ */
+static process_t *process_alloc(const char *name, process_priority_t priority) {
+    process_t *proc = (process_t *)kmem_cache_alloc(pcb_cache);
+    process_cold_t *cold = (process_cold_t *)kmem_cache_alloc(pcb_cold_cache);
+    if (proc == NULL || cold == NULL) {
+        KLOG(KLOG_ERROR, serial_puts("[PROCESS] Failed to allocate PCB\n"));
+        if (proc != NULL) kmem_cache_free(pcb_cache, proc);
+        if (cold != NULL) kmem_cache_free(pcb_cold_cache, cold);
+        return NULL;
+    }
+    proc->cold = cold;
+    
+    /* Reserve a process table slot, and heap room for it on every CPU */
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    uint32_t pid = process_alloc_pid();
+    if (pid != 0 && slot_high_water > heap_capacity && heap_reserve(slot_high_water) != 0) {
+        KLOG(KLOG_ERROR, serial_puts("[PROCESS] Failed to grow ready heaps\n"));
+        process_release_pid(pid);
+        pid = 0;
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
+    if (pid == 0) {
+        kmem_cache_free(pcb_cold_cache, cold);
+        kmem_cache_free(pcb_cache, proc);
+        return NULL;
+    }
+    
+    process_init_pcb(proc, pid, name, priority);
     return proc;
 }
 
+/*
+ * Give back the PID and PCB of a process that never got published
+ */
+static void process_discard(process_t *proc) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    process_release_pid(proc->pid);
+    spin_unlock_irqrestore(&process_lock, flags);
+    kmem_cache_free(pcb_cold_cache, proc->cold);
+    kmem_cache_free(pcb_cache, proc);
+}
+
+/*
+ * Allocate a stack and build the frame that starts entry_point on it
+ */
+static int process_setup_stack(process_t *proc, process_func_t entry_point, size_t stack_size) {
+    proc->cold->stack_top = stack_alloc_sized(proc->pid, stack_size);
+    if (proc->cold->stack_top == NULL) {
+        KLOG(KLOG_ERROR, serial_puts("[PROCESS] Failed to allocate stack\n"));
+        return -1;
+    }
+    
+    proc->cold->stack_base = stack_get_base(proc->pid);
+    proc->cold->stack_size = stack_get_size(proc->pid);
+    
+    /* Build the frame the first switch_to() unwinds: it pops EDI, ESI,
+     * EBX, EBP and EFLAGS, then returns into process_start, which calls
+     * the entry point held in EBX */
+    uint32_t *sp = (uint32_t *)proc->cold->stack_top;
+    *--sp = 0;                              /* Return slot of process_start's frame */
+    *--sp = (uint32_t)process_start;        /* switch_to() returns here */
+    *--sp = PROC_INITIAL_EFLAGS;            /* EFLAGS */
+    *--sp = 0;                              /* EBP: terminates frame-pointer walks */
+    *--sp = (uint32_t)entry_point;          /* EBX */
+    *--sp = 0;                              /* ESI */
+    *--sp = 0;                              /* EDI */
+    
+    proc->context.esp = (uint32_t)sp;
+    proc->context.eip = (uint32_t)entry_point;
+    return 0;
+}
+
+/*
+ * Add a fully built process to the table and its ready queue; another
+ * CPU may steal and run it as soon as the lock drops
+ */
+static void process_publish(process_t *proc) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    process_add_to_table(proc);
+    process_add_to_ready_queue(proc, 0);
+    total_processes_created++;
+    TRACE(TRACE_CREATE, proc->pid, proc->priority);
+    spin_unlock_irqrestore(&process_lock, flags);
+    
+    KLOG(KLOG_INFO, serial_puts("[PROCESS] Created process '"), serial_puts(proc->cold->name),
+         serial_puts("' (PID "), serial_put_dec(proc->pid), serial_puts(", Priority "),
+         serial_put_dec(proc->priority), serial_puts(")\n"));
+}
+
 /*
  * Create a new process with required time
  */
 process_t *process_create_with_time(const char *name, process_func_t entry_point, 
                                      process_priority_t priority, uint32_t required_time) {
-    process_t *proc = process_create(name, entry_point, priority);
+    return process_create_timed(name, entry_point, priority, required_time, 0, 0);
+}
+
+/*
+ * Create a process that has to get required_time ticks of CPU within
+ * deadline ticks from now. Admission control: its utilization,
+ * required_time / deadline, is reserved until it terminates, and a
+ * process that would take the reserved total past one CPU is rejected.
+ * Under that bound EDF meets every admitted deadline on a single CPU, and
+ * one CPU's worth spread over several by stealing is no harder.
+ */
+process_t *process_create_with_deadline(const char *name, process_func_t entry_point,
+                                        process_priority_t priority,
+                                        uint32_t required_time, uint32_t deadline) {
+    if (required_time == 0 || deadline < required_time) {
+        KLOG(KLOG_WARN, serial_puts("[PROCESS] Rejected '"), serial_puts(name),
+             serial_puts("': needs 0 < time <= deadline\n"));
+        return NULL;
+    }
     
-    if (proc != NULL) {
-        proc->required_time = required_time;
-        serial_puts("[PROCESS] Set required time: ");
-        serial_put_dec(required_time);
-        serial_puts(" ticks\n");
+    /* Rounded up, so admitted processes never add up to more than they need */
+    uint32_t utilization = (uint32_t)cycles_div(((uint64_t)required_time << 16) + deadline - 1,
+                                                deadline);
+    
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    uint32_t reserved = reserved_utilization;
+    if (reserved + utilization > PROC_UTIL_SCALE) {
+        spin_unlock_irqrestore(&process_lock, flags);
+        KLOG(KLOG_WARN, serial_puts("[PROCESS] Rejected '"), serial_puts(name),
+             serial_puts("': utilization "), serial_put_dec(utilization * 100 / PROC_UTIL_SCALE),
+             serial_puts("% on top of "), serial_put_dec(reserved * 100 / PROC_UTIL_SCALE),
+             serial_puts("% admitted\n"));
+        return NULL;
+    }
+    reserved_utilization += utilization;
+    spin_unlock_irqrestore(&process_lock, flags);
+    
+    process_t *proc = process_create_timed(name, entry_point, priority, required_time,
+                                           deadline, utilization);
+    if (proc == NULL) {
+        flags = spin_lock_irqsave(&process_lock);
+        reserved_utilization -= utilization;
+        spin_unlock_irqrestore(&process_lock, flags);
+    }
+    return proc;
+}
+
+/*
+ * Build a process whose timing is set before it is queued, so it lands
+ * on the ready heap under its key
+ */
+static process_t *process_create_timed(const char *name, process_func_t entry_point,
+                                       process_priority_t priority, uint32_t required_time,
+                                       uint32_t deadline, uint32_t utilization) {
+    process_t *proc = process_alloc(name, priority);
+    
+    if (proc == NULL) {
+        return NULL;
+    }
+    proc->required_time = required_time;
+    if (deadline > 0) {
+        proc->cold->deadline = proc->cold->creation_time + deadline;
+        proc->cold->relative_deadline = deadline;
+        proc->cold->utilization = utilization;
     }
     
+    if (process_setup_stack(proc, entry_point, STACK_SIZE) != 0) {
+        process_discard(proc);
+        return NULL;
+    }
+    
+    KLOG(KLOG_DEBUG, serial_puts("[PROCESS] Set required time: "),
+         serial_put_dec(required_time), serial_puts(" ticks, deadline: "),
+         serial_put_dec(deadline), serial_puts(" ticks\n"));
+    process_publish(proc);
     return proc;
 }
 
 /*
- * Terminate a process by PID
+ * CPU share reserved by live deadline processes, of PROC_UTIL_SCALE
+ */
+uint32_t process_get_utilization(void) {
+    return reserved_utilization;
+}
+
+/*
+ * Terminate a process by PID. A process that is on another CPU, or
+ * current there, is only marked: that CPU terminates it once it is off
+ * the processor (process_finish_switch(), scheduler_cpu_tick()).
+ *
+ * Terminating takes the process off every queue and leaves it a zombie;
+ * its stack, mailbox and PCB are freed later by process_reap(), so a
+ * tick that ends many processes stays short.
  */
 void process_terminate(uint32_t pid) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
     process_t *proc = process_get_by_pid(pid);
     
     if (proc == NULL) {
-        serial_puts("[PROCESS] Cannot terminate: PID ");
-        serial_put_dec(pid);
-        serial_puts(" not found\n");
+        spin_unlock_irqrestore(&process_lock, flags);
+        KLOG(KLOG_WARN, serial_puts("[PROCESS] Cannot terminate: PID "),
+             serial_put_dec(pid), serial_puts(" not found\n"));
         return;
     }
     
-    serial_puts("[PROCESS] Terminating process '");
-    serial_puts(proc->name);
-    serial_puts("' (PID ");
-    serial_put_dec(pid);
-    serial_puts(")\n");
+    /* A process cannot leave the stack it is running on: switch to the
+     * null context, which comes back here to finish the job */
+    if (proc == scheduler_get_running()) {
+        if (current_process[proc->cpu] == proc) {
+            current_process[proc->cpu] = NULL;
+        }
+        spin_unlock(&process_lock);
+        scheduler_exit_running();   /* Does not return */
+    }
+    
+    /* Already being torn down by someone else */
+    if (proc->state == PROC_STATE_TERMINATED) {
+        spin_unlock_irqrestore(&process_lock, flags);
+        return;
+    }
+    
+    if (proc->on_cpu || (proc->cpu != smp_cpu_id() &&
+                         (proc->state == PROC_STATE_CURRENT || proc->state == PROC_STATE_WAITING))) {
+        proc->exit_requested = 1;
+        spin_unlock_irqrestore(&process_lock, flags);
+        return;
+    }
     
     /* Remove from ready queue if in READY state */
     if (proc->state == PROC_STATE_READY) {
@@ -301,57 +930,230 @@ void process_terminate(uint32_t pid) {
     }
     
     /* Clear current process if this is it */
-    if (current_process == proc) {
-        current_process = NULL;
+    if (current_process[proc->cpu] == proc) {
+        current_process[proc->cpu] = NULL;
+    }
+    
+    /* Set state to terminated; nothing can queue or dispatch it now */
+    proc->state = PROC_STATE_TERMINATED;
+    reserved_utilization -= proc->cold->utilization;
+    proc->cold->utilization = 0;
+    spin_unlock_irqrestore(&process_lock, flags);
+    
+    KLOG(KLOG_INFO, serial_puts("[PROCESS] Terminating process '"), serial_puts(proc->cold->name),
+         serial_puts("' (PID "), serial_put_dec(pid), serial_puts(")\n"));
+    TRACE(TRACE_TERMINATE, pid, proc->cpu_time);
+    
+    /* Channel locks come before process_lock */
+    timer_event_cancel(&proc->cold->sleep_timer);
+    ipc_cancel_wait(proc);
+    
+    /* Leave it for the reaper, and wake a parent waiting for it */
+    flags = spin_lock_irqsave(&process_lock);
+    proc->next = NULL;
+    if (zombie_tail != NULL) {
+        zombie_tail->next = proc;
+    } else {
+        zombie_head = proc;
+    }
+    zombie_tail = proc;
+    zombie_count++;
+    
+    process_t *parent = process_get_by_pid(proc->cold->parent_pid);
+    if (parent != NULL && parent->state == PROC_STATE_BLOCKED && parent->cold->waiting_for == pid) {
+        parent->cold->waiting_for = 0;
+        process_set_state_locked(parent, PROC_STATE_READY);
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
+}
+
+/*
+ * Free up to max zombies, oldest first: mailbox, stack and address
+ * space, then the PCB as well unless a live parent may still collect the
+ * exit code with process_wait(); such a zombie waits on its parent's
+ * unwaited list instead. Called by idle null contexts, never on a
+ * process's own stack. Returns how many were reaped.
+ *
+ * Live children of a reaped process are left alone: PIDs are never
+ * reused as they are, so their parent_pid simply stops resolving.
+ */
+uint32_t process_reap(uint32_t max) {
+    uint32_t reaped = 0;
+    
+    while (reaped < max) {
+        uint32_t flags = spin_lock_irqsave(&process_lock);
+        process_t *proc = zombie_head;
+        if (proc == NULL) {
+            spin_unlock_irqrestore(&process_lock, flags);
+            break;
+        }
+        zombie_head = proc->next;
+        if (zombie_head == NULL) {
+            zombie_tail = NULL;
+        }
+        zombie_count--;
+        
+        /* Detached under the lock, so no sender can take a hold after it */
+        ipc_channel_t *mailbox = proc->cold->mailbox;
+        proc->cold->mailbox = NULL;
+        spin_unlock_irqrestore(&process_lock, flags);
+        
+        ipc_channel_destroy(mailbox);
+        
+        /* The CPU it ran on has left its stack and address space */
+        stack_free(proc->pid);
+        paging_space_destroy(proc->cold->space);
+        proc->cold->space = NULL;
+        
+        /* Its own reaped children have nobody left to wait for them */
+        flags = spin_lock_irqsave(&process_lock);
+        proc->cold->reaped = 1;
+        process_t *orphans = proc->cold->unwaited;
+        proc->cold->unwaited = NULL;
+        for (process_t *child = orphans; child != NULL; child = child->next) {
+            process_remove_from_table(child->pid);
+        }
+        
+        process_t *parent = process_get_by_pid(proc->cold->parent_pid);
+        if (parent == NULL || parent->state == PROC_STATE_TERMINATED) {
+            process_remove_from_table(proc->pid);
+            proc->next = orphans;
+            orphans = proc;
+        } else {
+            proc->prev = NULL;
+            proc->next = parent->cold->unwaited;
+            if (proc->next != NULL) {
+                proc->next->prev = proc;
+            }
+            parent->cold->unwaited = proc;
+        }
+        spin_unlock_irqrestore(&process_lock, flags);
+        
+        while (orphans != NULL) {
+            process_t *next = orphans->next;
+            process_free_pcb(orphans);
+            orphans = next;
+        }
+        reaped++;
     }
     
-    /* Set state to terminated */
-    proc->state = PROC_STATE_TERMINATED;
-    
-    /* Free stack */
-    stack_free(proc->pid);
-    
-    /* Remove from process table */
-    process_remove_from_table(proc->pid);
+    return reaped;
+}
+
+/*
+ * Wait until child pid has terminated and collect its exit code. Only
+ * its parent can, and only once; the parent blocks until the child is
+ * done. Returns 0, or -1 if pid is not a child of the running process.
+ */
+int process_wait(uint32_t pid, int *exit_code) {
+    process_t *self = scheduler_get_running();
     
-    /* Free PCB */
-    kfree(proc);
+    if (self == NULL) {
+        KLOG(KLOG_WARN, serial_puts("[PROCESS] The null context has no children to wait for\n"));
+        return -1;
+    }
     
-    /* If terminating current process, clear pointer */
-    if (current_process == proc) {
-        current_process = NULL;
+    for (;;) {
+        uint32_t flags = spin_lock_irqsave(&process_lock);
+        process_t *child = process_get_by_pid(pid);
+        
+        if (child == NULL || child->cold->parent_pid != self->pid) {
+            spin_unlock_irqrestore(&process_lock, flags);
+            return -1;
+        }
+        
+        if (child->state == PROC_STATE_TERMINATED) {
+            if (exit_code != NULL) {
+                *exit_code = child->cold->exit_code;
+            }
+            
+            /* Collected: a zombie still waiting for the reaper goes
+             * entirely when its turn comes, a reaped one goes now */
+            uint8_t reaped = child->cold->reaped;
+            child->cold->parent_pid = 0;
+            if (reaped) {
+                if (child->prev != NULL) {
+                    child->prev->next = child->next;
+                } else {
+                    self->cold->unwaited = child->next;
+                }
+                if (child->next != NULL) {
+                    child->next->prev = child->prev;
+                }
+                process_remove_from_table(pid);
+            }
+            spin_unlock_irqrestore(&process_lock, flags);
+            
+            if (reaped) {
+                process_free_pcb(child);
+            }
+            return 0;
+        }
+        
+        /* process_terminate() makes us ready again */
+        self->cold->waiting_for = pid;
+        process_set_state_locked(self, PROC_STATE_BLOCKED);
+        spin_unlock_irqrestore(&process_lock, flags);
+        scheduler_wait_tick();
     }
 }
 
+/*
+ * Free the PCB of a reaped process that is out of the table
+ */
+static void process_free_pcb(process_t *proc) {
+    kmem_cache_free(pcb_cold_cache, proc->cold);
+    kmem_cache_free(pcb_cache, proc);
+}
+
+/*
+ * A CPU has switched away from proc and is no longer using its stack.
+ * Returns its PID if it should now be terminated, otherwise 0.
+ */
+uint32_t process_finish_switch(process_t *proc) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    proc->on_cpu = 0;
+    uint32_t pid = proc->exit_requested ? proc->pid : 0;
+    spin_unlock_irqrestore(&process_lock, flags);
+    return pid;
+}
+
 /*
  * Current process exits voluntarily
  */
 void process_exit(int exit_code) {
-    if (current_process == NULL) {
-        serial_puts("[PROCESS] Warning: No current process to exit\n");
+    process_t *self = process_get_current();
+    
+    if (self == NULL) {
+        KLOG(KLOG_WARN, serial_puts("[PROCESS] Warning: No current process to exit\n"));
         return;
     }
     
-    current_process->exit_code = exit_code;
-    serial_puts("[PROCESS] Process '");
-    serial_puts(current_process->name);
-    serial_puts("' exiting with code ");
-    serial_put_dec(exit_code);
-    serial_puts("\n");
+    self->cold->exit_code = exit_code;
+    KLOG(KLOG_INFO, serial_puts("[PROCESS] Process '"), serial_puts(self->cold->name),
+         serial_puts("' exiting with code "), serial_put_dec(exit_code), serial_puts("\n"));
     
-    process_terminate(current_process->pid);
+    process_terminate(self->pid);
 }
 
 /*
  * Set process state
  */
 void process_set_state(uint32_t pid, process_state_t new_state) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
     process_t *proc = process_get_by_pid(pid);
     
-    if (proc == NULL) {
-        return;
+    if (proc != NULL && proc->state != PROC_STATE_TERMINATED) {
+        process_set_state_locked(proc, new_state);
     }
-    
+    spin_unlock_irqrestore(&process_lock, flags);
+}
+
+/*
+ * Move a process to a new state and the queues that go with it
+ */
+static void process_set_state_locked(process_t *proc, process_state_t new_state) {
+    uint32_t pid = proc->pid;
     process_state_t old_state = proc->state;
     proc->state = new_state;
     
@@ -359,14 +1161,21 @@ void process_set_state(uint32_t pid, process_state_t new_state) {
     if (old_state == PROC_STATE_READY && new_state != PROC_STATE_READY) {
         process_remove_from_ready_queue(proc);
     } else if (old_state != PROC_STATE_READY && new_state == PROC_STATE_READY) {
-        process_add_to_ready_queue(proc);
+        process_add_to_ready_queue(proc, 0);
+    }
+    
+    if (new_state == PROC_STATE_BLOCKED && old_state != PROC_STATE_BLOCKED) {
+        TRACE(TRACE_BLOCK, pid, old_state);
+    } else if (old_state == PROC_STATE_BLOCKED && new_state != PROC_STATE_BLOCKED) {
+        TRACE(TRACE_UNBLOCK, pid, new_state);
     }
     
-    /* Update current process pointer */
+    /* Update current process pointer; a process is made current by the
+     * CPU whose queue it came from */
     if (new_state == PROC_STATE_CURRENT) {
-        current_process = proc;
-    } else if (proc == current_process) {
-        current_process = NULL;
+        current_process[proc->cpu] = proc;
+    } else if (proc == current_process[proc->cpu]) {
+        current_process[proc->cpu] = NULL;
     }
 }
 
@@ -378,6 +1187,22 @@ process_state_t process_get_state(uint32_t pid) {
     return (proc != NULL) ? proc->state : PROC_STATE_TERMINATED;
 }
 
+/*
+ * Copy a process's scheduling state under process_lock, for callers that
+ * another CPU may free it under; -1 if the PID is gone
+ */
+int process_snapshot(uint32_t pid, process_t *copy) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    process_t *proc = process_get_by_pid(pid);
+    
+    if (proc != NULL) {
+        *copy = *proc;
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
+    
+    return (proc != NULL) ? 0 : -1;
+}
+
 /*
  * Block a process
  */
@@ -393,37 +1218,66 @@ void process_unblock(uint32_t pid) {
 }
 
 /*
- * Put process to sleep (simplified - just blocks it)
+ * Put a process to sleep for the given number of scheduler ticks. A
+ * running process sleeps on the spot; the call returns once it has been
+ * woken and dispatched again.
  */
 void process_sleep(uint32_t pid, uint32_t ticks) {
-    process_set_state(pid, PROC_STATE_SLEEPING);
-    /* In a real implementation, would set a wakeup time */
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    process_t *proc = process_get_by_pid(pid);
+    
+    if (proc == NULL || proc->state == PROC_STATE_TERMINATED) {
+        spin_unlock_irqrestore(&process_lock, flags);
+        return;
+    }
+    
+    process_set_state_locked(proc, PROC_STATE_SLEEPING);
+    timer_event_start(&proc->cold->sleep_timer, ticks);
+    spin_unlock_irqrestore(&process_lock, flags);
+    
+    if (proc == scheduler_get_running()) {
+        scheduler_wait_tick();
+    }
 }
 
 /*
- * Get process by PID
+ * Sleep timer expired: make the process runnable unless something else
+ * already moved it on. The event carries the PID, not the PCB, since a
+ * CPU may be terminating the process while another runs the callback.
  */
-process_t *process_get_by_pid(uint32_t pid) {
-    for (uint32_t i = 0; i < MAX_PROCESSES; i++) {
-        if (process_table[i] != NULL && process_table[i]->pid == pid) {
-            return process_table[i];
-        }
+static void process_wake(void *arg) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    process_t *proc = process_get_by_pid((uint32_t)arg);
+    
+    if (proc != NULL && proc->state == PROC_STATE_SLEEPING) {
+        process_set_state_locked(proc, PROC_STATE_READY);
     }
-    return NULL;
+    spin_unlock_irqrestore(&process_lock, flags);
+}
+
+/*
+ * Get process by PID. Takes no lock: the result is only stable while
+ * process_lock is held, or when the caller is the process itself or the
+ * context that alone can free it.
+ */
+process_t *process_get_by_pid(uint32_t pid) {
+    process_t *proc = process_table[PID_SLOT(pid)];
+    return (proc != NULL && proc->pid == pid) ? proc : NULL;
 }
 
 /*
  * Get current running process
  */
 process_t *process_get_current(void) {
-    return current_process;
+    return current_process[smp_cpu_id()];
 }
 
 /*
  * Get current process PID
  */
 uint32_t process_get_current_pid(void) {
-    return (current_process != NULL) ? current_process->pid : 0;
+    process_t *current = process_get_current();
+    return (current != NULL) ? current->pid : 0;
 }
 
 /*
@@ -431,7 +1285,7 @@ uint32_t process_get_current_pid(void) {
  */
 const char *process_get_name(uint32_t pid) {
     process_t *proc = process_get_by_pid(pid);
-    return (proc != NULL) ? proc->name : "Unknown";
+    return (proc != NULL) ? proc->cold->name : "Unknown";
 }
 
 /*
@@ -446,18 +1300,33 @@ process_priority_t process_get_priority(uint32_t pid) {
  * Set process priority
  */
 void process_set_priority(uint32_t pid, process_priority_t priority) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
     process_t *proc = process_get_by_pid(pid);
     
-    if (proc == NULL) {
-        return;
+    if (proc != NULL) {
+        process_set_priority_locked(proc, priority);
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
+}
+
+/*
+ * Change the priority of a process
+ */
+static void process_set_priority_locked(process_t *proc, process_priority_t priority) {
+    if (priority >= PROC_PRIORITY_LEVELS) {
+        priority = PROC_PRIORITY_CRITICAL;
     }
     
-    proc->priority = priority;
-    
-    /* If in ready queue, re-insert to maintain priority order */
+    /* If ready, move to the new level; arrival order is unchanged. It goes
+     * in by enqueue_tick, since aging only looks at a level's head: a
+     * process that waited longer than the new level's tail must not end
+     * up behind it. Aging restamps the tick first, so it lands at the tail. */
     if (proc->state == PROC_STATE_READY) {
-        process_remove_from_ready_queue(proc);
-        process_add_to_ready_queue(proc);
+        level_remove(&run_queues[proc->cpu], proc);
+        proc->priority = priority;
+        level_insert(&run_queues[proc->cpu], proc);
+    } else {
+        proc->priority = priority;
     }
 }
 
@@ -465,32 +1334,76 @@ void process_set_priority(uint32_t pid, process_priority_t priority) {
  * Boost process priority (for aging)
  */
 void process_boost_priority(uint32_t pid) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
     process_t *proc = process_get_by_pid(pid);
     
-    if (proc == NULL) {
-        return;
-    }
-    
-    if (proc->priority < PROC_PRIORITY_CRITICAL) {
-        proc->priority++;
-        
-        /* Re-insert in ready queue if applicable */
-        if (proc->state == PROC_STATE_READY) {
-            process_remove_from_ready_queue(proc);
-            process_add_to_ready_queue(proc);
-        }
+    if (proc != NULL && proc->priority < PROC_PRIORITY_CRITICAL) {
+        process_set_priority_locked(proc, proc->priority + 1);
     }
+    spin_unlock_irqrestore(&process_lock, flags);
 }
 
 /*
  * Reset age counter
  */
 void process_reset_age(uint32_t pid) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
     process_t *proc = process_get_by_pid(pid);
     
     if (proc != NULL) {
-        proc->age = 0;
+        uint32_t now = scheduler_get_ticks();
+        if (proc->state == PROC_STATE_READY) {
+            proc->cold->wait_time += now - proc->enqueue_tick;
+        }
+        proc->enqueue_tick = now;
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
+}
+
+/*
+ * Ticks a process has been waiting on its ready queue
+ */
+uint32_t process_get_age(process_t *proc) {
+    if (proc == NULL || proc->state != PROC_STATE_READY) {
+        return 0;
+    }
+    return scheduler_get_ticks() - proc->enqueue_tick;
+}
+
+/*
+ * Aging pass over one CPU's run queue. Each level is ordered by enqueue
+ * tick, so only its head can be the most starved: boost heads until one
+ * is under the threshold. A boosted process restarts its age at the tail
+ * of the next level up. Returns how many were boosted.
+ */
+uint32_t process_age_queue(uint32_t cpu, uint32_t threshold) {
+    if (cpu >= MAX_CPUS) {
+        return 0;
     }
+    
+    run_queue_t *rq = &run_queues[cpu];
+    uint32_t boosted = 0;
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    for (int32_t level = PROC_PRIORITY_CRITICAL - 1; level >= PROC_PRIORITY_LOW; level--) {
+        process_t *proc;
+        
+        while ((proc = rq->heads[level]) != NULL && process_get_age(proc) >= threshold) {
+            uint32_t age = process_get_age(proc);
+            
+            KLOG(KLOG_DEBUG, serial_puts("[SCHEDULER] Aging: Boosting priority of PID "),
+                 serial_put_dec(proc->pid), serial_puts(" (age="),
+                 serial_put_dec(age), serial_puts(")\n"));
+            TRACE(TRACE_AGING_BOOST, proc->pid, age);
+            
+            proc->cold->wait_time += age;
+            proc->enqueue_tick += age;
+            process_set_priority_locked(proc, proc->priority + 1);
+            boosted++;
+        }
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
+    
+    return boosted;
 }
 
 /*
@@ -501,13 +1414,14 @@ void process_get_stats(process_stats_t *stats) {
         return;
     }
     
+    uint32_t flags = spin_lock_irqsave(&process_lock);
     stats->total_processes = total_processes_created;
     stats->active_processes = 0;
     stats->ready_processes = 0;
     stats->blocked_processes = 0;
     stats->terminated_processes = 0;
     
-    for (uint32_t i = 0; i < MAX_PROCESSES; i++) {
+    for (uint32_t i = 1; i < slot_high_water; i++) {
         if (process_table[i] != NULL) {
             stats->active_processes++;
             
@@ -528,107 +1442,83 @@ void process_get_stats(process_stats_t *stats) {
             }
         }
     }
+    spin_unlock_irqrestore(&process_lock, flags);
 }
 
 /*
  * Print process table
  */
 void process_print_table(void) {
-    serial_puts("\n=== Process Table ===\n");
-    serial_puts("PID  Name          State    Pri  CPU  Req  Progress\n");
-    serial_puts("---  ------------  -------  ---  ---  ---  --------\n");
+    kprintf("\n=== Process Table ===\n"
+            "PID  Name          State    Pri  CPU  Req  Progress    Run Kcyc   Wait Kcyc\n"
+            "---  ------------  -------  ---  ---  ---  --------  ----------  ----------\n");
     
     uint32_t count = 0;
-    for (uint32_t i = 0; i < MAX_PROCESSES; i++) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    for (uint32_t i = 1; i < slot_high_water; i++) {
         if (process_table[i] != NULL) {
             process_t *p = process_table[i];
             
-            /* PID */
-            if (p->pid < 10) serial_puts(" ");
-            serial_put_dec(p->pid);
-            serial_puts("   ");
-            
-            /* Name (12 chars) */
-            serial_puts(p->name);
-            for (uint32_t j = strlen(p->name); j < 14; j++) {
-                serial_puts(" ");
-            }
-            
-            /* State (7 chars) */
-            const char *state_str = process_state_to_string(p->state);
-            serial_puts(state_str);
-            for (uint32_t j = strlen(state_str); j < 9; j++) {
-                serial_puts(" ");
-            }
-            
-            /* Priority */
-            serial_put_dec(p->priority);
-            serial_puts("    ");
-            
-            /* CPU Time */
-            if (p->cpu_time < 100) serial_puts(" ");
-            if (p->cpu_time < 10) serial_puts(" ");
-            serial_put_dec(p->cpu_time);
-            serial_puts("  ");
-            
-            /* Required Time */
-            if (p->required_time > 0) {
-                if (p->required_time < 100) serial_puts(" ");
-                if (p->required_time < 10) serial_puts(" ");
-                serial_put_dec(p->required_time);
-                serial_puts("  ");
-                
-                /* Progress */
-                if (p->cpu_time >= p->required_time) {
-                    serial_puts("DONE");
-                } else {
-                    uint32_t percent = (p->cpu_time * 100) / p->required_time;
-                    if (percent < 100) serial_puts(" ");
-                    if (percent < 10) serial_puts(" ");
-                    serial_put_dec(percent);
-                    serial_puts("%");
-                }
-            } else {
-                serial_puts("  -   -");
+            /* Required time and progress */
+            char progress[16] = "  -   -      ";
+            if (p->required_time > 0 && p->cpu_time >= p->required_time) {
+                ksnprintf(progress, sizeof(progress), "%3u  DONE    ", p->required_time);
+            } else if (p->required_time > 0) {
+                ksnprintf(progress, sizeof(progress), "%3u  %3u%%    ", p->required_time,
+                          (p->cpu_time * 100) / p->required_time);
             }
             
-            serial_puts("\n");
+            /* Cycles on the CPU and in ready queues, in thousands */
+            kprintf("%2u   %-14s%-9s%u    %3u  %s  %10llu  %10llu\n",
+                    p->pid, p->cold->name, process_state_to_string(p->state),
+                    p->priority, p->cpu_time, progress,
+                    cycles_div(p->cold->run_cycles, 1000),
+                    cycles_div(p->cold->wait_cycles, 1000));
             
             count++;
         }
     }
+    uint32_t zombies = zombie_count;
+    spin_unlock_irqrestore(&process_lock, flags);
     
-    serial_puts("---\n");
-    serial_puts("Total: ");
-    serial_put_dec(count);
-    serial_puts(" active processes\n");
-    serial_puts("====================\n\n");
+    kprintf("---\nTotal: %u active processes, %u waiting to be reaped\n"
+            "====================\n\n", count, zombies);
 }
 
 /*
  * Print detailed process info
  */
 void process_print_info(uint32_t pid) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
     process_t *proc = process_get_by_pid(pid);
     
     if (proc == NULL) {
+        spin_unlock_irqrestore(&process_lock, flags);
         serial_puts("Process not found\n");
         return;
     }
     
     serial_puts("\n=== Process Information ===\n");
     serial_puts("PID:          "); serial_put_dec(proc->pid); serial_puts("\n");
-    serial_puts("Name:         "); serial_puts(proc->name); serial_puts("\n");
+    serial_puts("Name:         "); serial_puts(proc->cold->name); serial_puts("\n");
     serial_puts("State:        "); serial_puts(process_state_to_string(proc->state)); serial_puts("\n");
     serial_puts("Priority:     "); serial_puts(process_priority_to_string(proc->priority)); serial_puts("\n");
-    serial_puts("Parent PID:   "); serial_put_dec(proc->parent_pid); serial_puts("\n");
-    serial_puts("Stack Base:   0x"); serial_put_hex((uint32_t)proc->stack_base); serial_puts("\n");
-    serial_puts("Stack Top:    0x"); serial_put_hex((uint32_t)proc->stack_top); serial_puts("\n");
-    serial_puts("Stack Size:   "); serial_put_dec(proc->stack_size); serial_puts(" bytes\n");
+    serial_puts("Parent PID:   "); serial_put_dec(proc->cold->parent_pid); serial_puts("\n");
+    serial_puts("Stack Base:   0x"); serial_put_hex((uint32_t)proc->cold->stack_base); serial_puts("\n");
+    serial_puts("Stack Top:    0x"); serial_put_hex((uint32_t)proc->cold->stack_top); serial_puts("\n");
+    serial_puts("Stack Size:   "); serial_put_dec(proc->cold->stack_size); serial_puts(" bytes\n");
     serial_puts("CPU Time:     "); serial_put_dec(proc->cpu_time); serial_puts("\n");
-    serial_puts("Wait Time:    "); serial_put_dec(proc->wait_time); serial_puts("\n");
-    serial_puts("Age:          "); serial_put_dec(proc->age); serial_puts("\n");
-    serial_puts("Messages:     "); serial_put_dec(proc->msg_count); serial_puts("\n");
+    serial_puts("Wait Time:    "); serial_put_dec(proc->cold->wait_time); serial_puts("\n");
+    serial_puts("Run Cycles:   "); cycles_put_dec(proc->cold->run_cycles); serial_puts("\n");
+    serial_puts("Wait Cycles:  "); cycles_put_dec(proc->cold->wait_cycles); serial_puts("\n");
+    serial_puts("Age:          "); serial_put_dec(process_get_age(proc)); serial_puts("\n");
+    if (proc->cold->relative_deadline != 0) {
+        serial_puts("Deadline:     tick "); serial_put_dec(proc->cold->deadline);
+        serial_puts(" ("); serial_put_dec(proc->cold->utilization * 100 / PROC_UTIL_SCALE);
+        serial_puts("% of a CPU)\n");
+    }
+    serial_puts("Messages:     "); serial_put_dec(ipc_channel_count(proc->cold->mailbox)); serial_puts("\n");
+    spin_unlock_irqrestore(&process_lock, flags);
     serial_puts("==========================\n\n");
 }
 
@@ -636,13 +1526,7 @@ void process_print_info(uint32_t pid) {
  * Count total processes
  */
 uint32_t process_count(void) {
-    uint32_t count = 0;
-    for (uint32_t i = 0; i < MAX_PROCESSES; i++) {
-        if (process_table[i] != NULL) {
-            count++;
-        }
-    }
-    return count;
+    return live_processes;
 }
 
 /*
@@ -650,93 +1534,134 @@ uint32_t process_count(void) {
  */
 uint32_t process_count_by_state(process_state_t state) {
     uint32_t count = 0;
-    for (uint32_t i = 0; i < MAX_PROCESSES; i++) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    for (uint32_t i = 1; i < slot_high_water; i++) {
         if (process_table[i] != NULL && process_table[i]->state == state) {
             count++;
         }
     }
+    spin_unlock_irqrestore(&process_lock, flags);
     return count;
 }
 
 /*
- * Send a message to another process (IPC)
+ * Send a one-word message to another process's mailbox (IPC). A running
+ * process waits while the mailbox is full; the null context fails.
  */
 int process_send_message(uint32_t dest_pid, uint32_t message) {
-    process_t *dest = process_get_by_pid(dest_pid);
+    ipc_channel_t *mailbox = process_mailbox(dest_pid);
     
-    if (dest == NULL) {
-        serial_puts("[IPC] Destination process not found\n");
+    if (mailbox == NULL) {
+        KLOG(KLOG_WARN, serial_puts("[IPC] Destination process not found or has no mailbox\n"));
         return -1;
     }
     
-    if (dest->msg_count >= 16) {
-        serial_puts("[IPC] Message queue full\n");
+    int result = ipc_send(mailbox, &message, sizeof(message), 0);
+    ipc_channel_release(mailbox);
+    if (result != IPC_OK) {
+        KLOG(KLOG_WARN, serial_puts("[IPC] Message queue full\n"));
         return -1;
     }
     
-    dest->message_queue[dest->msg_count++] = message;
-    
-    /* If destination was waiting for a message, unblock it */
-    if (dest->waiting_for_msg) {
-        dest->waiting_for_msg = 0;
-        process_unblock(dest_pid);
-    }
-    
     return 0;
 }
 
 /*
- * Receive a message (blocking)
+ * Receive a message (blocking). A running process sleeps until one
+ * arrives; without a running process an empty mailbox returns -1.
  */
 int process_receive_message(uint32_t *message) {
-    if (current_process == NULL) {
+    process_t *self = scheduler_get_running();
+    
+    if (self == NULL) {
+        KLOG(KLOG_WARN, serial_puts("[IPC] The null context has no mailbox\n"));
         return -1;
     }
     
-    if (current_process->msg_count == 0) {
-        /* No messages, block the process */
-        current_process->waiting_for_msg = 1;
-        process_block(current_process->pid);
-        return -1;  /* Would need scheduler to resume later */
+    ipc_channel_t *mailbox = process_mailbox(self->pid);
+    if (mailbox == NULL) {
+        return -1;
     }
     
-    /* Get first message */
-    *message = current_process->message_queue[0];
-    
-    /* Shift remaining messages */
-    for (uint32_t i = 0; i < current_process->msg_count - 1; i++) {
-        current_process->message_queue[i] = current_process->message_queue[i + 1];
+    int result = ipc_receive(mailbox, message, sizeof(*message), 0);
+    ipc_channel_release(mailbox);
+    return (result == (int)sizeof(*message)) ? 0 : -1;
+}
+
+/*
+ * The mailbox of a live process, created on first use, with a hold the
+ * caller drops with ipc_channel_release(). NULL if pid is gone or out of
+ * memory. The pointer is only read and installed under process_lock,
+ * where the reaper detaches it, so the channel cannot be freed under us.
+ */
+static struct ipc_channel *process_mailbox(uint32_t pid) {
+    ipc_channel_t *fresh = NULL;
+    
+    for (;;) {
+        uint32_t flags = spin_lock_irqsave(&process_lock);
+        process_t *proc = process_get_by_pid(pid);
+        ipc_channel_t *mailbox = NULL;
+        int gone = (proc == NULL || proc->state == PROC_STATE_TERMINATED);
+        
+        if (!gone) {
+            if (proc->cold->mailbox == NULL && fresh != NULL) {
+                proc->cold->mailbox = fresh;
+                fresh = NULL;
+            }
+            mailbox = proc->cold->mailbox;
+            if (mailbox != NULL) {
+                ipc_channel_hold(mailbox);
+            }
+        }
+        spin_unlock_irqrestore(&process_lock, flags);
+        
+        /* Gone, or found a mailbox: a sender and the owner may have raced
+         * to create it on different CPUs, and the loser throws its away */
+        if (mailbox != NULL || gone) {
+            ipc_channel_destroy(fresh);
+            return mailbox;
+        }
+        
+        fresh = ipc_channel_create(PROC_MAILBOX_SIZE);
+        if (fresh == NULL) {
+            return NULL;
+        }
     }
-    
-    current_process->msg_count--;
-    
-    return 0;
 }
 
 /*
  * Check if process has messages
  */
 int process_has_message(uint32_t pid) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
     process_t *proc = process_get_by_pid(pid);
-    return (proc != NULL) ? (proc->msg_count > 0) : 0;
+    int pending = (proc != NULL) ? (ipc_channel_count(proc->cold->mailbox) > 0) : 0;
+    spin_unlock_irqrestore(&process_lock, flags);
+    return pending;
 }
 
 /*
- * Get ready queue head
+ * Get the oldest ready process on this CPU (walk the rest with fifo_next)
  */
 process_t *process_get_ready_queue(void) {
-    return ready_queue_head;
+    return run_queues[smp_cpu_id()].fifo_head;
 }
 
 /*
- * Dequeue next ready process
+ * Ready processes queued on one CPU
  */
-process_t *process_dequeue_ready(void) {
-    if (ready_queue_head == NULL) {
+uint32_t process_ready_count(uint32_t cpu) {
+    return (cpu < MAX_CPUS) ? run_queues[cpu].count : 0;
+}
+
+/*
+ * Take a process off the ready queues for the scheduler
+ */
+static process_t *process_take_ready(process_t *proc) {
+    if (proc == NULL) {
         return NULL;
     }
     
-    process_t *proc = ready_queue_head;
     process_remove_from_ready_queue(proc);
     
     /* Mark as dequeued (not in READY state anymore) to prevent double-removal */
@@ -746,6 +1671,157 @@ process_t *process_dequeue_ready(void) {
     return proc;
 }
 
+/*
+ * Dequeue this CPU's next ready process of the highest non-empty level
+ */
+process_t *process_dequeue_ready(void) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    run_queue_t *rq = &run_queues[smp_cpu_id()];
+    process_t *proc = NULL;
+    
+    if (rq->map != 0) {
+        proc = process_take_ready(rq->heads[bit_scan_reverse(rq->map)]);
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
+    return proc;
+}
+
+/*
+ * Dequeue this CPU's longest waiting ready process, regardless of priority
+ */
+process_t *process_dequeue_ready_fifo(void) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    process_t *proc = process_take_ready(run_queues[smp_cpu_id()].fifo_head);
+    spin_unlock_irqrestore(&process_lock, flags);
+    return proc;
+}
+
+/*
+ * Dequeue this CPU's ready process with the smallest key under the ready
+ * order (earliest deadline, least time left); NULL if none has a key
+ */
+process_t *process_dequeue_ready_keyed(void) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    run_queue_t *rq = &run_queues[smp_cpu_id()];
+    process_t *proc = NULL;
+    
+    if (rq->heap_count != 0) {
+        proc = process_take_ready(rq->heap[0].proc);
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
+    return proc;
+}
+
+/*
+ * Whether a process waiting on proc's run queue comes first under the
+ * ready order: a smaller key, or any key when proc has none. Equal keys
+ * do not preempt.
+ */
+int process_ready_preempts(process_t *proc) {
+    uint32_t key;
+    int preempts = 0;
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    run_queue_t *rq = &run_queues[proc->cpu];
+    
+    if (rq->heap_count != 0) {
+        preempts = !ready_key(proc, &key) || KEY_BEFORE(rq->heap[0].key, key);
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
+    return preempts;
+}
+
+/*
+ * Key the ready heaps by order from now on, rebuilding every CPU's heap
+ * from its arrival FIFO
+ */
+void process_set_ready_order(proc_order_t order) {
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    
+    ready_order = order;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        run_queue_t *rq = &run_queues[cpu];
+        
+        for (uint32_t i = 0; i < rq->heap_count; i++) {
+            rq->heap[i].proc->heap_slot = 0;
+        }
+        rq->heap_count = 0;
+        for (process_t *proc = rq->fifo_head; proc != NULL; proc = proc->fifo_next) {
+            heap_link(rq, proc);
+        }
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
+}
+
+/*
+ * Work stealing: move half of the longest run queue of another CPU onto
+ * this CPU's empty one, oldest first. A process that is current on its
+ * CPU counts towards that CPU's load, so a lone waiter behind it can be
+ * taken too. A process still switching out on some CPU (on_cpu) stays
+ * where it is. Returns how many processes moved.
+ */
+uint32_t process_steal(void) {
+    uint32_t self = smp_cpu_id();
+    run_queue_t *rq = &run_queues[self];
+    uint32_t victim = self;
+    uint32_t best = 1;
+    
+    /* Cheap unlocked look first; idle CPUs call this on every pass */
+    if (rq->count != 0) {
+        return 0;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        uint32_t load = run_queues[cpu].count + (current_process[cpu] != NULL);
+        
+        if (cpu != self && run_queues[cpu].count > 0 && load > best) {
+            victim = cpu;
+            best = load;
+        }
+    }
+    if (victim == self || rq->count != 0) {
+        spin_unlock_irqrestore(&process_lock, flags);
+        return 0;
+    }
+    
+    /* Waiting carries on across the move: enqueue ticks and TSCs stay */
+    run_queue_t *from = &run_queues[victim];
+    uint32_t wanted = best / 2;
+    uint32_t moved = 0;
+    process_t *next;
+    
+    for (process_t *proc = from->fifo_head; proc != NULL && moved < wanted; proc = next) {
+        next = proc->fifo_next;
+        if (proc->on_cpu) {
+            continue;
+        }
+        
+        level_remove(from, proc);
+        fifo_unlink(from, proc);
+        heap_unlink(from, proc);
+        from->count--;
+        
+        proc->cpu = self;
+        level_insert(rq, proc);
+        heap_link(rq, proc);
+        proc->fifo_next = NULL;
+        proc->fifo_prev = rq->fifo_tail;
+        if (rq->fifo_tail != NULL) {
+            rq->fifo_tail->fifo_next = proc;
+        } else {
+            rq->fifo_head = proc;
+        }
+        rq->fifo_tail = proc;
+        rq->count++;
+        moved++;
+        TRACE(TRACE_MIGRATE, proc->pid, victim);
+    }
+    spin_unlock_irqrestore(&process_lock, flags);
+    
+    return moved;
+}
+
 /*
  * Enqueue process to ready queue
  */
@@ -753,7 +1829,25 @@ void process_enqueue_ready(process_t *proc) {
     if (proc == NULL) {
         return;
     }
-    process_add_to_ready_queue(proc);
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    process_add_to_ready_queue(proc, 0);
+    spin_unlock_irqrestore(&process_lock, flags);
+}
+
+/*
+ * Put a preempted process back at the front of its queues so it runs
+ * again before its peers
+ */
+void process_enqueue_ready_front(process_t *proc) {
+    if (proc == NULL) {
+        return;
+    }
+    uint32_t flags = spin_lock_irqsave(&process_lock);
+    if (proc == current_process[proc->cpu]) {
+        current_process[proc->cpu] = NULL;
+    }
+    process_add_to_ready_queue(proc, 1);
+    spin_unlock_irqrestore(&process_lock, flags);
 }
 
 /*
@@ -783,3 +1877,87 @@ const char *process_priority_to_string(process_priority_t priority) {
         default:                     return "UNKNOWN";
     }
 }
+
+/* Shell commands */
+
+/*
+ * ps: show the process table
+ */
+static int process_cmd_ps(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    process_print_table();
+    return 0;
+}
+
+/*
+ * kill <n>: terminate process n
+ */
+static int process_cmd_kill(int argc, char **argv) {
+    uint32_t pid;
+    
+    if (argc != 2 || shell_parse_uint(argv[1], &pid) != 0) {
+        return -1;
+    }
+    process_terminate(pid);
+    return 0;
+}
+
+/*
+ * clone <n>: start a copy of process n
+ */
+static int process_cmd_clone(int argc, char **argv) {
+    uint32_t pid;
+    
+    if (argc != 2 || shell_parse_uint(argv[1], &pid) != 0) {
+        return -1;
+    }
+    process_clone(pid, NULL);
+    return 0;
+}
+
+/*
+ * info <n>: show everything about process n
+ */
+static int process_cmd_info(int argc, char **argv) {
+    uint32_t pid;
+    
+    if (argc != 2 || shell_parse_uint(argv[1], &pid) != 0) {
+        return -1;
+    }
+    process_print_info(pid);
+    return 0;
+}
+
+/*
+ * sleep <n> <t>: put process n to sleep for t ticks
+ */
+static int process_cmd_sleep(int argc, char **argv) {
+    uint32_t pid;
+    uint32_t ticks;
+    
+    if (argc != 3 || shell_parse_uint(argv[1], &pid) != 0 ||
+        shell_parse_uint(argv[2], &ticks) != 0) {
+        return -1;
+    }
+    
+    if (process_get_by_pid(pid) == NULL) {
+        serial_puts("No such process\n");
+        return 0;
+    }
+    
+    process_sleep(pid, ticks);
+    serial_puts("PID ");
+    serial_put_dec(pid);
+    serial_puts(" sleeping until tick ");
+    serial_put_dec(scheduler_get_ticks() + (ticks ? ticks : 1));
+    serial_puts("\n");
+    return 0;
+}
+
+SHELL_COMMAND(ps, "ps", "ps", "Show process table", process_cmd_ps);
+SHELL_COMMAND(kill, "kill", "kill <n>", "Terminate process with PID n", process_cmd_kill);
+SHELL_COMMAND(clone, "clone", "clone <n>", "Start a copy of process n", process_cmd_clone);
+SHELL_COMMAND(info, "info", "info <n>", "Show process info for PID n", process_cmd_info);
+SHELL_COMMAND(sleep, "sleep", "sleep <n> <t>", "Put PID n to sleep for t ticks", process_cmd_sleep);
@@ -3,12 +3,13 @@
 #define PROCESS_H
 
 #include "types.h"
+#include "timer.h"
 
 /* Process states */
 typedef enum {
     PROC_STATE_READY = 0,       /* Process is ready to run */
     PROC_STATE_CURRENT,          /* Process is currently running */
-    PROC_STATE_TERMINATED,       /* Process has terminated */
+    PROC_STATE_TERMINATED,       /* Process has terminated (zombie until reaped) */
     PROC_STATE_BLOCKED,          /* Process is blocked (Good to Have) */
     PROC_STATE_WAITING,          /* Process is waiting (Good to Have) */
     PROC_STATE_SLEEPING          /* Process is sleeping (Good to Have) */
@@ -22,56 +23,93 @@ typedef enum {
     PROC_PRIORITY_CRITICAL
 } process_priority_t;
 
-/* CPU register context for context switching */
+#define PROC_PRIORITY_LEVELS (PROC_PRIORITY_CRITICAL + 1)
+
+/* CPU context for context switching. switch_to() (boot.S) keeps the
+ * callee-saved registers and EFLAGS on the process's own stack, so only
+ * the stack pointer has to live in the PCB. */
 typedef struct {
-    uint32_t eax, ebx, ecx, edx;    /* General purpose registers */
-    uint32_t esi, edi;              /* Index registers */
-    uint32_t ebp, esp;              /* Stack pointers */
-    uint32_t eip;                   /* Instruction pointer */
-    uint32_t eflags;                /* Flags register */
-    uint32_t cs, ds, es, fs, gs, ss; /* Segment registers */
+    uint32_t esp;                   /* Saved stack pointer (must stay first) */
+    uint32_t eip;                   /* Entry point */
 } cpu_context_t;
 
-/* Process Control Block (PCB) */
-typedef struct process {
-    uint32_t pid;                   /* Process ID */
+/* Process Control Block (PCB), split in two. process_t holds what the
+ * scheduler, run queues and table scans touch on every pass and is
+ * exactly one cache line; everything read only at creation, exit, in
+ * accounting or for display lives in the process_cold_t it points to. */
+struct ipc_channel;
+struct address_space;
+
+typedef struct process_cold {
     char name[32];                  /* Process name */
-    process_state_t state;          /* Current state */
-    process_priority_t priority;    /* Process priority */
     
     /* Memory management */
     void *stack_base;               /* Stack base address */
     void *stack_top;                /* Stack top address */
     size_t stack_size;              /* Stack size */
+    struct address_space *space;    /* Forked: maps its stack; NULL otherwise */
     
-    /* CPU context for context switching */
-    cpu_context_t context;          /* Saved CPU state */
-    
-    /* Scheduling information */
-    uint32_t time_quantum;          /* Time slice for scheduling */
-    uint32_t cpu_time;              /* Total CPU time used */
-    uint32_t required_time;         /* Time required to complete task */
+    /* Accounting */
     uint32_t wait_time;             /* Time spent waiting */
     uint32_t creation_time;         /* When process was created */
+    uint64_t run_cycles;            /* Cycles spent on the CPU */
+    uint64_t wait_cycles;           /* Cycles spent in ready queues */
+    uint64_t dispatch_tsc;          /* When it was last switched in */
+    uint64_t enqueue_tsc;           /* When it last joined a ready queue */
+    
+    /* Sleep wake-up, armed by process_sleep() */
+    timer_event_t sleep_timer;
     
     /* IPC - Message passing (Good to Have) */
-    uint32_t message_queue[16];     /* Simple message queue */
-    uint32_t msg_count;             /* Number of messages */
-    uint32_t waiting_for_msg;       /* 1 if waiting for message */
+    struct ipc_channel *mailbox;    /* Created on the first message */
+    struct ipc_channel *ipc_wait;   /* Channel it is blocked on, if any */
     
     /* Process relationships */
     uint32_t parent_pid;            /* Parent process ID */
+    struct process *unwaited;       /* Its reaped children not yet collected (next/prev) */
     
-    /* Exit status */
+    /* Exit status, kept by a zombie until its parent collects it */
     int exit_code;                  /* Exit code when terminated */
+    uint8_t reaped;                 /* Terminated and its stack freed */
+    uint32_t waiting_for;           /* Child it is blocked on in process_wait() */
+    
+    /* Deadline, set by process_create_with_deadline() */
+    uint32_t deadline;              /* Tick its required time is due by */
+    uint32_t relative_deadline;     /* Ticks from creation; 0 without a deadline */
+    uint32_t utilization;           /* Admitted share of a CPU (PROC_UTIL_SCALE) */
+} process_cold_t;
+
+typedef struct process {
+    uint32_t pid;                   /* Process ID */
+    process_state_t state;          /* Current state */
+    process_priority_t priority;    /* Process priority */
+    uint32_t cpu;                   /* CPU whose run queue it belongs to */
     
-    /* Aging for priority scheduling (Good to Have) */
-    uint32_t age;                   /* Age counter for priority boost */
+    /* Scheduling information */
+    uint32_t time_quantum;          /* Time slice for scheduling */
+    uint32_t cpu_time;              /* Total CPU time used */
+    uint32_t required_time;         /* Time required to complete task */
+    uint32_t enqueue_tick;          /* Tick it joined its ready queue; age is measured from here */
     
     /* Linked list pointers */
-    struct process *next;           /* Next process in queue */
+    struct process *next;           /* Next process in queue (ready: same priority level) */
     struct process *prev;           /* Previous process in queue */
-} process_t;
+    struct process *fifo_next;      /* Next ready process in arrival order */
+    struct process *fifo_prev;      /* Previous ready process in arrival order */
+    
+    /* CPU context for context switching */
+    cpu_context_t context;          /* Saved CPU state */
+    
+    /* SMP: set while some CPU is on this process's stack, which must
+     * not be stolen or freed until that CPU has switched away */
+    volatile uint8_t on_cpu;
+    uint8_t exit_requested;         /* Terminated from another CPU meanwhile */
+    uint16_t heap_slot;             /* 1 + its index in the ready heap, 0 if not in it */
+    
+    process_cold_t *cold;           /* The rest of the PCB */
+} __attribute__((aligned(64))) process_t;
+
+_Static_assert(sizeof(process_t) == 64, "process_t must stay one cache line");
 
 /* Process table statistics */
 typedef struct {
@@ -82,20 +120,48 @@ typedef struct {
     uint32_t terminated_processes;  /* Terminated processes count */
 } process_stats_t;
 
-/* Maximum number of processes */
-#define MAX_PROCESSES 32
+/*
+ * Maximum number of processes. A PID carries its process-table slot in the
+ * low PID_SLOT_BITS bits and the slot's reuse generation above them, so a
+ * lookup is a single array index and a stale PID never matches a newer
+ * process that inherited the same slot. Slot 0 belongs to the null process.
+ */
+#define PID_SLOT_BITS   12
+#define MAX_PROCESSES   (1u << PID_SLOT_BITS)
+#define PID_SLOT(pid)   ((pid) & (MAX_PROCESSES - 1))
 
 /* Process function pointer type */
 typedef void (*process_func_t)(void);
 
+/* Initial EFLAGS of a new process: reserved bit 1 only, interrupts off.
+ * Kernel services are not interrupt-safe, so a process that enables
+ * interrupts must keep them off around calls into the kernel. */
+#define PROC_INITIAL_EFLAGS 0x002
+
+/* Utilization is required_time / relative deadline in units of 1/65536,
+ * so one CPU is PROC_UTIL_SCALE */
+#define PROC_UTIL_SCALE     (1u << 16)
+
+/* Terminated processes freed per pass of an idle null context */
+#define PROC_REAP_BATCH     8
+
 /* Process Manager Initialization */
 void process_init(void);
 
 /* Process Creation and Termination */
 process_t *process_create(const char *name, process_func_t entry_point, process_priority_t priority);
 process_t *process_create_with_time(const char *name, process_func_t entry_point, process_priority_t priority, uint32_t required_time);
+process_t *process_create_with_stack(const char *name, process_func_t entry_point, process_priority_t priority, size_t stack_size);
+process_t *process_create_with_deadline(const char *name, process_func_t entry_point, process_priority_t priority,
+                                        uint32_t required_time, uint32_t deadline);  /* NULL if not admitted */
+uint32_t process_get_utilization(void);     /* Sum over admitted deadline processes */
+process_t *process_clone(uint32_t pid, process_func_t entry_point);  /* Like pid; NULL: same entry */
+int process_fork(void);                 /* Child PID, 0 in the child, -1 on failure */
 void process_terminate(uint32_t pid);
 void process_exit(int exit_code);
+int process_wait(uint32_t pid, int *exit_code);  /* Parent collects a child's exit code */
+uint32_t process_reap(uint32_t max);    /* Free terminated processes; returns how many */
+uint32_t process_finish_switch(process_t *proc);  /* Off its CPU; PID if it must go */
 
 /* State Transition Functions */
 void process_set_state(uint32_t pid, process_state_t new_state);
@@ -106,6 +172,7 @@ void process_sleep(uint32_t pid, uint32_t ticks);
 
 /* Process Table Queries */
 process_t *process_get_by_pid(uint32_t pid);
+int process_snapshot(uint32_t pid, process_t *copy);  /* Locked copy; -1 if gone */
 process_t *process_get_current(void);
 uint32_t process_get_current_pid(void);
 const char *process_get_name(uint32_t pid);
@@ -115,6 +182,8 @@ process_priority_t process_get_priority(uint32_t pid);
 void process_set_priority(uint32_t pid, process_priority_t priority);
 void process_boost_priority(uint32_t pid);    /* For aging */
 void process_reset_age(uint32_t pid);
+uint32_t process_get_age(process_t *proc);    /* Ticks waited while ready */
+uint32_t process_age_queue(uint32_t cpu, uint32_t threshold);  /* Boost starved heads */
 
 /* Process Statistics and Utilities */
 void process_get_stats(process_stats_t *stats);
@@ -124,14 +193,33 @@ uint32_t process_count(void);
 uint32_t process_count_by_state(process_state_t state);
 
 /* Inter-Process Communication (IPC) - Good to Have */
+#define PROC_MAILBOX_SIZE   256     /* Ring bytes: 16 one-word messages */
 int process_send_message(uint32_t dest_pid, uint32_t message);
 int process_receive_message(uint32_t *message);  /* Blocking receive */
 int process_has_message(uint32_t pid);
 
-/* Process List Management (for scheduler) */
-process_t *process_get_ready_queue(void);
-process_t *process_dequeue_ready(void);
+/* Process List Management (for scheduler)
+ * Each CPU has its own run queue. Its ready processes sit on one FIFO per
+ * priority level and, at the same time, on a single FIFO in arrival
+ * order. Under a keyed ready order they are also on a min-heap by that
+ * key, if they have one. Queries and dequeues work on the calling CPU's
+ * queue. */
+typedef enum {
+    PROC_ORDER_NONE = 0,            /* No heap */
+    PROC_ORDER_DEADLINE,            /* Earliest deadline; processes with one */
+    PROC_ORDER_REMAINING            /* Least required time left; processes with some */
+} proc_order_t;
+
+process_t *process_get_ready_queue(void);       /* Oldest ready process (follow fifo_next) */
+process_t *process_dequeue_ready(void);         /* Highest priority, FIFO within a level */
+process_t *process_dequeue_ready_fifo(void);    /* Oldest ready process, any priority */
+process_t *process_dequeue_ready_keyed(void);   /* Smallest key; NULL if none has one */
+int process_ready_preempts(process_t *proc);    /* A queued key beats proc's */
+void process_set_ready_order(proc_order_t order);   /* Rebuilds every heap */
+uint32_t process_ready_count(uint32_t cpu);     /* Ready processes on a CPU's queue */
+uint32_t process_steal(void);                   /* Empty queue: take half of the busiest one */
 void process_enqueue_ready(process_t *proc);
+void process_enqueue_ready_front(process_t *proc);  /* Requeue ahead of its peers */
 
 /* Helper functions for process state names */
 const char *process_state_to_string(process_state_t state);
@@ -2,28 +2,65 @@
 #include "scheduler.h"
 #include "process.h"
 #include "serial.h"
+#include "kprintf.h"
 #include "string.h"
+#include "cpu.h"
+#include "idt.h"
+#include "klog.h"
+#include "trace.h"
+#include "memory.h"
+#include "timer.h"
+#include "smp.h"
+#include "paging.h"
+#include "shell.h"
 
-/* External assembly functions for REAL hardware context switching */
-extern void asm_save_context(cpu_context_t *ctx);
-extern void asm_restore_context(cpu_context_t *ctx);
-extern uint32_t asm_get_eflags(void);
-extern uint32_t asm_get_eip(void);
+/* Stack switch (boot.S) */
+extern void switch_to(cpu_context_t *prev, cpu_context_t *next);
 
-/* Scheduler state */
+/* Scheduler state. The clock, timers and aging are global and advanced
+ * by the boot CPU; everything else is per CPU. */
 static sched_config_t sched_config;
-static sched_stats_t sched_stats;
 static uint8_t scheduler_running = 0;
 static uint32_t current_tick = 0;
-static uint32_t time_slice_remaining = 0;
+static uint32_t next_aging_tick = 0;
+
+/* A CPU's null context is its idle loop (kmain's shell loop on the boot
+ * CPU): it runs the CPU's scheduler ticks and dispatches its current
+ * process, which hands the CPU back when its work for the tick is done.
+ * Each CPU's block starts on its own cache line, so one CPU counting
+ * its statistics never invalidates a line another CPU is using. */
+typedef struct {
+    cpu_context_t null_context;
+    process_t *running_process;     /* Process on the CPU; NULL in the null context */
+    process_t *exited_process;      /* Exited on its own stack, not yet freed */
+    process_t *switched_from;       /* Left by the last switch_to(); NULL: null context */
+    uint64_t switch_start_tsc;      /* When the last switch_to() began */
+    uint32_t time_slice_remaining;
+    sched_stats_t stats;
+} __attribute__((aligned(64))) sched_cpu_t;
+
+static sched_cpu_t sched_cpus[MAX_CPUS];
 
 /* Forward declarations */
 static process_t *select_round_robin(void);
 static process_t *select_priority(void);
 static process_t *select_priority_rr(void);
 static process_t *select_fcfs(void);
-static void save_context(process_t *proc);
-static void restore_context(process_t *proc);
+static process_t *select_keyed(void);
+static proc_order_t scheduler_ready_order(sched_policy_t policy);
+static void scheduler_dispatch(void);
+static void scheduler_pick(void);
+static void scheduler_reap_exited(void);
+static uint32_t scheduler_quiet_ticks(void);
+static uint32_t scheduler_ready_total(void);
+static sched_cpu_t *sched_this_cpu(void);
+
+/*
+ * Scheduler state of the executing CPU
+ */
+static sched_cpu_t *sched_this_cpu(void) {
+    return &sched_cpus[smp_cpu_id()];
+}
 
 /*
  * Initialize the scheduler
@@ -34,24 +71,27 @@ void scheduler_init(sched_policy_t policy, uint32_t default_quantum) {
     sched_config.default_quantum = default_quantum;
     sched_config.min_quantum = 10;
     sched_config.max_quantum = 1000;
-    sched_config.aging_threshold = 100;      /* Boost after 10 ticks of waiting */
-    sched_config.aging_boost_interval = 50; /* (not used anymore, aging checked every tick) */
+    sched_config.aging_threshold = 100;      /* Boost after 100 ticks of waiting */
+    sched_config.aging_boost_interval = 50; /* Aging pass every 50 ticks */
     sched_config.enable_aging = 1;
     sched_config.enable_preemption = 1;
     
-    /* Initialize statistics */
-    memset(&sched_stats, 0, sizeof(sched_stats_t));
+    /* Initialize per-CPU state and statistics */
+    memset(sched_cpus, 0, sizeof(sched_cpus));
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        sched_cpus[cpu].time_slice_remaining = default_quantum;
+    }
     
     scheduler_running = 0;
     current_tick = 0;
-    time_slice_remaining = default_quantum;
+    timer_wheel_init(current_tick);
+    next_aging_tick = sched_config.aging_boost_interval;
+    process_set_ready_order(scheduler_ready_order(policy));
     
-    serial_puts("[SCHEDULER] Scheduler initialized\n");
-    serial_puts("[SCHEDULER] Policy: ");
-    serial_puts(scheduler_policy_to_string(policy));
-    serial_puts("\n[SCHEDULER] Time quantum: ");
-    serial_put_dec(default_quantum);
-    serial_puts(" ticks\n");
+    KLOG(KLOG_INFO, serial_puts("[SCHEDULER] Scheduler initialized\n"),
+         serial_puts("[SCHEDULER] Policy: "), serial_puts(scheduler_policy_to_string(policy)),
+         serial_puts("\n[SCHEDULER] Time quantum: "), serial_put_dec(default_quantum),
+         serial_puts(" ticks\n"));
 }
 
 /*
@@ -59,7 +99,7 @@ void scheduler_init(sched_policy_t policy, uint32_t default_quantum) {
  */
 void scheduler_start(void) {
     scheduler_running = 1;
-    serial_puts("[SCHEDULER] Scheduler started\n");
+    KLOG(KLOG_INFO, serial_puts("[SCHEDULER] Scheduler started\n"));
     
     /* Immediately schedule first process */
     scheduler_schedule();
@@ -70,11 +110,11 @@ void scheduler_start(void) {
  */
 void scheduler_stop(void) {
     scheduler_running = 0;
-    serial_puts("[SCHEDULER] Scheduler stopped\n");
+    KLOG(KLOG_INFO, serial_puts("[SCHEDULER] Scheduler stopped\n"));
 }
 
 /*
- * Timer tick handler - called on each timer interrupt
+ * Timer tick handler - called on each timer interrupt (boot CPU)
  */
 void scheduler_tick(void) {
     if (!scheduler_running) {
@@ -82,110 +122,297 @@ void scheduler_tick(void) {
     }
     
     current_tick++;
-    sched_stats.total_ticks++;
     
-    /* Check for aging FIRST - before any early returns */
-    /* This ensures waiting processes get aged every tick */
-    if (sched_config.enable_aging) {
+    /* Expired timers first, so woken sleepers can be picked this tick */
+    timer_wheel_advance(current_tick);
+    
+    /* Age waiting processes at interval boundaries - before any early returns.
+     * Ages are computed from enqueue ticks, so nothing is touched in between. */
+    if (sched_config.enable_aging && (int32_t)(current_tick - next_aging_tick) >= 0) {
+        next_aging_tick = current_tick +
+                          (sched_config.aging_boost_interval ? sched_config.aging_boost_interval : 1);
         scheduler_check_aging();
     }
     
+    scheduler_cpu_tick();
+}
+
+/*
+ * This CPU's part of a tick: charge, preempt or pick its current process
+ * and dispatch it. The other CPUs run only this, from their local timer.
+ */
+void scheduler_cpu_tick(void) {
+    if (!scheduler_running) {
+        return;
+    }
+    
+    sched_cpu_t *cpu = sched_this_cpu();
     process_t *current = process_get_current();
     
+    cpu->stats.total_ticks++;
+    
     if (current == NULL) {
-        sched_stats.idle_ticks++;
-        /* No process running, try to schedule */
+        cpu->stats.idle_ticks++;
+        /* No process running: take work from a busier CPU if this one's
+         * queue is empty, then try to schedule */
+        if (smp_cpu_count() > 1) {
+            process_steal();
+        }
         scheduler_schedule();
-        return;
+    } else {
+        /* Update current process CPU time */
+        current->cpu_time++;
+        
+        if (current->exit_requested) {
+            /* Terminated from another CPU while it was current here */
+            process_terminate(current->pid);
+            scheduler_schedule();
+        } else if (current->required_time > 0 && current->cpu_time >= current->required_time) {
+            /* Process has completed its required time */
+            KLOG(KLOG_INFO, serial_puts("[SCHEDULER] Process "),
+                 serial_put_dec(current->pid), serial_puts(" ("),
+                 serial_puts(current->cold->name), serial_puts(") completed after "),
+                 serial_put_dec(current->cpu_time), serial_puts(" ticks\n"));
+            
+            if (current->cold->relative_deadline != 0 &&
+                (int32_t)(current_tick - current->cold->deadline) > 0) {
+                cpu->stats.deadline_misses++;
+                KLOG(KLOG_WARN, serial_puts("[SCHEDULER] PID "), serial_put_dec(current->pid),
+                     serial_puts(" missed its deadline by "),
+                     serial_put_dec(current_tick - current->cold->deadline), serial_puts(" ticks\n"));
+            }
+            
+            /* On the process's own stack this does not return; the null
+             * context reaps it and picks the next process */
+            process_terminate(current->pid);
+            scheduler_schedule();  /* Schedule next process */
+        } else {
+            /* Decrease time slice */
+            if (cpu->time_slice_remaining > 0) {
+                cpu->time_slice_remaining--;
+            }
+            
+            /* Check if time slice expired and preemption is enabled */
+            if (sched_config.enable_preemption && cpu->time_slice_remaining == 0) {
+                KLOG(KLOG_DEBUG, serial_puts("[SCHEDULER] Time quantum expired for PID "),
+                     serial_put_dec(current->pid), serial_puts("\n"));
+                
+                cpu->stats.preemptions++;
+                TRACE(TRACE_PREEMPT, current->pid, current->cpu_time);
+                scheduler_schedule();  /* Preempt current process */
+            } else if (sched_config.enable_preemption &&
+                       scheduler_ready_order(sched_config.policy) != PROC_ORDER_NONE &&
+                       process_ready_preempts(current)) {
+                /* EDF/SRTF: an earlier deadline or a shorter job is waiting */
+                KLOG(KLOG_DEBUG, serial_puts("[SCHEDULER] Ready key beats PID "),
+                     serial_put_dec(current->pid), serial_puts("\n"));
+                
+                cpu->stats.preemptions++;
+                TRACE(TRACE_PREEMPT, current->pid, current->cpu_time);
+                scheduler_schedule();
+            }
+        }
     }
     
-    /* Update current process CPU time */
-    current->cpu_time++;
-    
-    /* Check if process has completed its required time */
-    if (current->required_time > 0 && current->cpu_time >= current->required_time) {
-        serial_puts("[SCHEDULER] Process ");
-        serial_put_dec(current->pid);
-        serial_puts(" (");
-        serial_puts(current->name);
-        serial_puts(") completed after ");
-        serial_put_dec(current->cpu_time);
-        serial_puts(" ticks\n");
+    /* Run the current process for this tick */
+    scheduler_dispatch();
+}
+
+/*
+ * Advance the clock by ticks with the same scheduling outcome as calling
+ * scheduler_tick() that many times. In a quiet stretch (no timer due, no
+ * aging pass, no quantum expiry or completion, nobody waiting to be
+ * picked) a tick can only bump counters and run the current process, so
+ * it skips the timer, aging and preemption work of scheduler_tick().
+ * The current process still runs once per tick, and the stretch is
+ * measured again after every run, since that run may sleep, yield, exit,
+ * create or wake a process. Idle stretches run nothing and go in one
+ * step. The last tick always goes through scheduler_tick(), so a single
+ * tick dispatches. Runs on the boot CPU and batches only its own share.
+ */
+void scheduler_advance(uint32_t ticks) {
+    while (ticks > 0 && scheduler_running) {
+        uint32_t quiet = scheduler_quiet_ticks();
         
-        process_terminate(current->pid);
-        scheduler_schedule();  /* Schedule next process */
-        return;
+        if (quiet > ticks - 1) {
+            quiet = ticks - 1;
+        }
+        if (quiet == 0) {
+            scheduler_tick();
+            ticks--;
+            continue;
+        }
+        
+        sched_cpu_t *cpu = sched_this_cpu();
+        process_t *current = process_get_current();
+        
+        if (current == NULL) {
+            current_tick += quiet;
+            cpu->stats.total_ticks += quiet;
+            cpu->stats.idle_ticks += quiet;
+            cpu->stats.batched_ticks += quiet;
+            timer_wheel_advance(current_tick);      /* Nothing due: catches up only */
+            ticks -= quiet;
+        } else {
+            current_tick++;
+            cpu->stats.total_ticks++;
+            cpu->stats.batched_ticks++;
+            timer_wheel_advance(current_tick);
+            current->cpu_time++;
+            if (cpu->time_slice_remaining > 0) {
+                cpu->time_slice_remaining--;
+            }
+            scheduler_dispatch();
+            ticks--;
+        }
+    }
+}
+
+/*
+ * Number of upcoming ticks that cannot change anything but counters
+ */
+static uint32_t scheduler_quiet_ticks(void) {
+    /* The first tick of a timer deadline, an aging pass or an event of
+     * the current process is not quiet */
+    uint32_t quiet = timer_wheel_next_expiry() - 1;
+    
+    if (sched_config.enable_aging) {
+        int32_t until_aging = (int32_t)(next_aging_tick - current_tick);
+        if (until_aging <= 0) {
+            return 0;
+        }
+        if ((uint32_t)until_aging - 1 < quiet) {
+            quiet = (uint32_t)until_aging - 1;
+        }
+    }
+    
+    process_t *current = process_get_current();
+    if (current == NULL) {
+        /* Idle ticks try to schedule or steal: quiet only with nothing
+         * ready on any CPU */
+        return (scheduler_ready_total() == 0) ? quiet : 0;
     }
     
-    /* Decrease time slice */
-    if (time_slice_remaining > 0) {
-        time_slice_remaining--;
+    if (current->state != PROC_STATE_CURRENT || current->exit_requested) {
+        return 0;
     }
     
-    /* Check if time slice expired and preemption is enabled */
-    if (sched_config.enable_preemption && time_slice_remaining == 0) {
-        serial_puts("[SCHEDULER] Time quantum expired for PID ");
-        serial_put_dec(current->pid);
-        serial_puts("\n");
-        
-        sched_stats.preemptions++;
-        scheduler_schedule();  /* Preempt current process */
+    if (current->required_time > 0) {
+        if (current->cpu_time + 1 >= current->required_time) {
+            return 0;
+        }
+        if (current->required_time - current->cpu_time - 1 < quiet) {
+            quiet = current->required_time - current->cpu_time - 1;
+        }
+    }
+    
+    uint32_t slice = sched_this_cpu()->time_slice_remaining;
+    if (sched_config.enable_preemption) {
+        if (slice <= 1) {
+            return 0;
+        }
+        /* Queued keys hold still and the current one only gets better */
+        if (scheduler_ready_order(sched_config.policy) != PROC_ORDER_NONE &&
+            process_ready_preempts(current)) {
+            return 0;
+        }
+        if (slice - 1 < quiet) {
+            quiet = slice - 1;
+        }
+    }
+    
+    return quiet;
+}
+
+/*
+ * Ready processes over every CPU's run queue
+ */
+static uint32_t scheduler_ready_total(void) {
+    uint32_t total = 0;
+    
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        total += process_ready_count(cpu);
+    }
+    return total;
+}
+
+/*
+ * Give the CPU to the current process until it waits for the next tick,
+ * yields or exits. When the tick interrupted a process that is no longer
+ * current, hand the CPU back to the null context instead.
+ */
+static void scheduler_dispatch(void) {
+    process_t *current = process_get_current();
+    process_t *running = sched_this_cpu()->running_process;
+    
+    if (running != NULL) {
+        if (running != current) {
+            scheduler_switch_context(running, NULL);
+        }
         return;
     }
+    
+    /* Do not start a process that another CPU has asked to terminate */
+    while (current != NULL && current->exit_requested) {
+        process_terminate(current->pid);
+        scheduler_schedule();
+        current = process_get_current();
+    }
+    
+    if (current != NULL && current->state == PROC_STATE_CURRENT) {
+        scheduler_switch_context(NULL, current);
+    }
 }
 
 /*
- * Main scheduling function - makes scheduling decision with REAL context switch
+ * Main scheduling function - picks the next current process; the switch
+ * itself happens when scheduler_tick() dispatches it
  */
 void scheduler_schedule(void) {
     if (!scheduler_running) {
         return;
     }
     
+    uint64_t start = cycles_now();
+    scheduler_pick();
+    cycle_hist_record(&sched_this_cpu()->stats.schedule_cycles, cycles_now() - start);
+}
+
+/*
+ * Requeue the current process and make the policy's choice current
+ */
+static void scheduler_pick(void) {
     process_t *current = process_get_current();
-    process_t *prev = current;  /* Save reference for context switch */
+    uint32_t prev_pid = (current != NULL) ? current->pid : 0;
     
     /* If there's a current process, save it back to READY state first */
     if (current != NULL && current->state == PROC_STATE_CURRENT) {
-        serial_puts("[SCHEDULER DEBUG] Saving current process: ");
-        serial_puts(current->name);
-        serial_puts(" -> READY\n");
-        process_set_state(current->pid, PROC_STATE_READY);
+        /* FCFS keeps the preempted process at the front; the other policies
+         * rotate it behind its peers, so processes aged up to its level get
+         * their turn */
+        if (sched_config.policy == SCHED_POLICY_FCFS) {
+            process_enqueue_ready_front(current);
+        } else {
+            process_set_state(current->pid, PROC_STATE_READY);
+        }
     }
     
     /* Now select next process from ready queue */
     process_t *next = scheduler_select_next_process();
     
-    serial_puts("[SCHEDULER DEBUG] Selected next=");
-    if (next) {
-        serial_puts(next->name);
-    } else {
-        serial_puts("NULL");
-    }
-    serial_puts("\n");
-    
     /* No process to run */
     if (next == NULL) {
-        serial_puts("[SCHEDULER] No process to schedule\n");
+        KLOG(KLOG_DEBUG, serial_puts("[SCHEDULER] No process to schedule\n"));
         return;
     }
     
     /* Load the next process and set it to CURRENT */
-    serial_puts("[SCHEDULER] Switching to: ");
-    serial_puts(next->name);
-    serial_puts(" (PID ");
-    serial_put_dec(next->pid);
-    serial_puts(")\n");
+    KLOG(KLOG_DEBUG, serial_puts("[SCHEDULER] Switching to: "), serial_puts(next->cold->name),
+         serial_puts(" (PID "), serial_put_dec(next->pid), serial_puts(")\n"));
     
+    TRACE(TRACE_SWITCH, next->pid, prev_pid);
     process_set_state(next->pid, PROC_STATE_CURRENT);
-    time_slice_remaining = next->time_quantum;
-    sched_stats.total_context_switches++;
-    
-    /* ========== REAL HARDWARE CONTEXT SWITCH ========== */
-    /* Only perform context switch if switching to a different process */
-    if (prev != next) {
-        scheduler_switch_context(prev, next);
-    }
+    sched_this_cpu()->time_slice_remaining = next->time_quantum;
 }
 
 /*
@@ -205,6 +432,10 @@ process_t *scheduler_select_next_process(void) {
         case SCHED_POLICY_FCFS:
             return select_fcfs();
         
+        case SCHED_POLICY_EDF:
+        case SCHED_POLICY_SRTF:
+            return select_keyed();
+        
         default:
             return select_round_robin();
     }
@@ -214,15 +445,16 @@ process_t *scheduler_select_next_process(void) {
  * Round-robin selection
  */
 static process_t *select_round_robin(void) {
-    /* Simply get next process from ready queue */
-    return process_dequeue_ready();
+    /* Oldest ready process; preempted processes rejoin at the tail */
+    return process_dequeue_ready_fifo();
 }
 
 /*
- * Priority-based selection (already handled by ready queue)
+ * Priority-based selection
  */
 static process_t *select_priority(void) {
-    /* Ready queue is priority-ordered, just dequeue */
+    /* Head of the highest non-empty level; lower levels only run once
+     * aging lifts them */
     return process_dequeue_ready();
 }
 
@@ -230,155 +462,230 @@ static process_t *select_priority(void) {
  * Priority with round-robin per level
  */
 static process_t *select_priority_rr(void) {
-    /* Get highest priority process */
-    process_t *next = process_dequeue_ready();
-    
-    /* Round-robin within same priority level would require
-     * tracking position within each priority level - simplified here */
-    return next;
+    /* Head of the highest non-empty level; a preempted process rejoins
+     * the tail of its level, so equal priorities take turns */
+    return process_dequeue_ready();
 }
 
 /*
  * First-Come-First-Served selection
  */
 static process_t *select_fcfs(void) {
-    /* Get first process from ready queue */
-    return process_dequeue_ready();
+    /* Oldest ready process; a preempted process keeps its place */
+    return process_dequeue_ready_fifo();
+}
+
+/*
+ * Earliest-deadline or shortest-remaining-time selection
+ */
+static process_t *select_keyed(void) {
+    /* Top of the ready heap; processes without a key fill in by priority */
+    process_t *proc = process_dequeue_ready_keyed();
+    return (proc != NULL) ? proc : process_dequeue_ready();
 }
 
 /*
- * Context switch (REAL hardware context switch using assembly)
+ * Ready heap order a policy needs; PROC_ORDER_NONE for the others
+ */
+static proc_order_t scheduler_ready_order(sched_policy_t policy) {
+    switch (policy) {
+        case SCHED_POLICY_EDF:
+            return PROC_ORDER_DEADLINE;
+        case SCHED_POLICY_SRTF:
+            return PROC_ORDER_REMAINING;
+        default:
+            return PROC_ORDER_NONE;
+    }
+}
+
+/*
+ * Switch the CPU from one context to another; NULL stands for this CPU's
+ * null context. from must be whatever is running now.
  */
 void scheduler_switch_context(process_t *from, process_t *to) {
-    serial_puts("[CONTEXT SWITCH] ===== REAL HARDWARE CONTEXT SWITCH =====\n");
+    sched_cpu_t *cpu = sched_this_cpu();
+    
+    if (from != cpu->running_process || from == to) {
+        return;
+    }
     
-    /* Save context of outgoing process */
+    cpu_context_t *prev = (from != NULL) ? &from->context : &cpu->null_context;
+    cpu_context_t *next = (to != NULL) ? &to->context : &cpu->null_context;
+    
+    /* Charge the outgoing process for its time on the CPU */
+    uint64_t now = cycles_now();
     if (from != NULL) {
-        save_context(from);
+        from->cold->run_cycles += now - from->cold->dispatch_tsc;
+    }
+    if (to != NULL) {
+        to->cold->dispatch_tsc = now;
+        to->on_cpu = 1;
     }
     
-    /* Load context of incoming process */
+    cpu->running_process = to;
+    cpu->switched_from = from;
+    cpu->stats.total_context_switches++;
+    cpu->switch_start_tsc = now;
+    
+    /* Switches go from or to the null context, whose stack every address
+     * space maps; a forked process's own stack is only there in its own */
     if (to != NULL) {
-        restore_context(to);
+        paging_switch(to->cold->space);
     }
+    switch_to(prev, next);
     
-    serial_puts("[CONTEXT SWITCH] ===== CONTEXT SWITCH COMPLETE =====\n");
+    /* Resumed by whichever context switched last, possibly on another
+     * CPU if a process was stolen meanwhile; a process starting for the
+     * first time enters process_start instead and is not sampled */
+    cpu = sched_this_cpu();
+    cycle_hist_record(&cpu->stats.switch_cycles, cycles_now() - cpu->switch_start_tsc);
+    scheduler_finish_switch();
+    
+    /* Resumed: back in the null context, free a process that exited */
+    if (cpu->running_process == NULL && cpu->exited_process != NULL) {
+        scheduler_reap_exited();
+    }
 }
 
 /*
- * Save CPU context - REAL hardware register save using x86 assembly
+ * Leave the running process for good (process_terminate() on itself).
+ * The null context terminates it for good once it is off the CPU.
  */
-static void save_context(process_t *proc) {
-    if (proc == NULL) {
-        return;
-    }
-    
-    serial_puts("[CONTEXT SAVE] Saving REAL CPU registers for PID ");
-    serial_put_dec(proc->pid);
-    serial_puts(" (");
-    serial_puts(proc->name);
-    serial_puts(")\n");
-    
-    /* Call assembly routine to save ALL CPU registers */
-    asm_save_context(&proc->context);
-    
-    /* Log the saved register values */
-    serial_puts("  [HW] EAX=0x");
-    serial_put_hex(proc->context.eax);
-    serial_puts(" EBX=0x");
-    serial_put_hex(proc->context.ebx);
-    serial_puts(" ECX=0x");
-    serial_put_hex(proc->context.ecx);
-    serial_puts(" EDX=0x");
-    serial_put_hex(proc->context.edx);
-    serial_puts("\n");
+void scheduler_exit_running(void) {
+    sched_cpu_t *cpu = sched_this_cpu();
+    process_t *self = cpu->running_process;
     
-    serial_puts("  [HW] ESI=0x");
-    serial_put_hex(proc->context.esi);
-    serial_puts(" EDI=0x");
-    serial_put_hex(proc->context.edi);
-    serial_puts(" EBP=0x");
-    serial_put_hex(proc->context.ebp);
-    serial_puts(" ESP=0x");
-    serial_put_hex(proc->context.esp);
-    serial_puts("\n");
-    
-    serial_puts("  [HW] EIP=0x");
-    serial_put_hex(proc->context.eip);
-    serial_puts(" EFLAGS=0x");
-    serial_put_hex(proc->context.eflags);
-    serial_puts("\n");
+    interrupts_disable();
+    cpu->switch_start_tsc = cycles_now();
+    self->cold->run_cycles += cpu->switch_start_tsc - self->cold->dispatch_tsc;
+    cpu->exited_process = self;
+    cpu->running_process = NULL;
+    cpu->switched_from = self;
+    cpu->stats.total_context_switches++;
+    switch_to(&self->context, &cpu->null_context);
     
-    serial_puts("  [HW] CS=0x");
-    serial_put_hex(proc->context.cs);
-    serial_puts(" DS=0x");
-    serial_put_hex(proc->context.ds);
-    serial_puts(" SS=0x");
-    serial_put_hex(proc->context.ss);
-    serial_puts("\n");
+    /* Never resumed */
+    for (;;) {
+        __asm__ volatile ("hlt");
+    }
 }
 
 /*
- * Restore CPU context - REAL hardware register restore using x86 assembly
+ * The CPU is off the stack of the process it switched away from: let
+ * other CPUs steal it again, and terminate it if one of them asked to
+ * while it was running. An exited process is left for the reaper.
  */
-static void restore_context(process_t *proc) {
-    if (proc == NULL) {
-        return;
+void scheduler_finish_switch(void) {
+    sched_cpu_t *cpu = sched_this_cpu();
+    process_t *prev = cpu->switched_from;
+    
+    cpu->switched_from = NULL;
+    if (cpu->running_process == NULL) {
+        paging_switch(NULL);        /* Before a forked space can be freed */
+    }
+    if (prev != NULL) {
+        uint32_t pid = process_finish_switch(prev);
+        if (pid != 0 && prev != cpu->exited_process) {
+            process_terminate(pid);
+        }
     }
+}
+
+/*
+ * Boot CPU's null context frees a batch of terminated processes, then
+ * halts until the next interrupt. With nothing runnable here and nothing
+ * waiting anywhere, the scheduler clock only matters for the timer
+ * wheel, so IRQ0 may skip ticks up to its next deadline; otherwise the
+ * next tick dispatches.
+ */
+void scheduler_idle(void) {
+    uint32_t ticks = TIMER_MAX_TICKS;       /* Nothing depends on the tick */
     
-    serial_puts("[CONTEXT RESTORE] Restoring REAL CPU registers for PID ");
-    serial_put_dec(proc->pid);
-    serial_puts(" (");
-    serial_puts(proc->name);
-    serial_puts(")\n");
-    
-    /* Log the register values being restored */
-    serial_puts("  [HW] EAX=0x");
-    serial_put_hex(proc->context.eax);
-    serial_puts(" EBX=0x");
-    serial_put_hex(proc->context.ebx);
-    serial_puts(" ECX=0x");
-    serial_put_hex(proc->context.ecx);
-    serial_puts(" EDX=0x");
-    serial_put_hex(proc->context.edx);
-    serial_puts("\n");
+    if (process_reap(PROC_REAP_BATCH) == PROC_REAP_BATCH) {
+        ticks = 1;                          /* More left for the next pass */
+    } else if (scheduler_running && timer_is_scheduling()) {
+        if (process_get_current() != NULL || scheduler_ready_total() != 0) {
+            ticks = 1;
+        } else {
+            ticks = timer_wheel_next_expiry();
+        }
+    }
     
-    serial_puts("  [HW] ESI=0x");
-    serial_put_hex(proc->context.esi);
-    serial_puts(" EDI=0x");
-    serial_put_hex(proc->context.edi);
-    serial_puts(" EBP=0x");
-    serial_put_hex(proc->context.ebp);
-    serial_puts(" ESP=0x");
-    serial_put_hex(proc->context.esp);
-    serial_puts("\n");
+    timer_idle(ticks);
+}
+
+/*
+ * Whether this CPU has a process to run, stealing from a busier CPU when
+ * its own queue is empty. Other CPUs only schedule while IRQ0 drives the
+ * clock; with manual ticks every process stays on the boot CPU.
+ */
+uint8_t scheduler_cpu_busy(void) {
+    if (!scheduler_running || !timer_is_scheduling()) {
+        return 0;
+    }
+    if (process_get_current() != NULL || process_ready_count(smp_cpu_id()) != 0) {
+        return 1;
+    }
+    return process_steal() > 0;
+}
+
+/*
+ * Finish off a process that exited on its own stack, now that this CPU
+ * is off it, and pick a successor
+ */
+static void scheduler_reap_exited(void) {
+    sched_cpu_t *cpu = sched_this_cpu();
+    process_t *proc = cpu->exited_process;
+    cpu->exited_process = NULL;
     
-    serial_puts("  [HW] EIP=0x");
-    serial_put_hex(proc->context.eip);
-    serial_puts(" EFLAGS=0x");
-    serial_put_hex(proc->context.eflags);
-    serial_puts("\n");
+    process_terminate(proc->pid);
+    if (process_get_current() == NULL) {
+        scheduler_schedule();
+    }
+}
+
+/*
+ * Process whose stack is live, or NULL in the null context
+ */
+process_t *scheduler_get_running(void) {
+    return sched_this_cpu()->running_process;
+}
+
+/*
+ * A process is done with this tick: return to the null context, which
+ * resumes it on a later tick
+ */
+void scheduler_wait_tick(void) {
+    process_t *self = scheduler_get_running();
     
-    /* Call assembly routine to restore ALL CPU registers */
-    asm_restore_context(&proc->context);
+    if (self == NULL) {
+        return;
+    }
     
-    serial_puts("  [HW] Registers restored from PCB to CPU\n");
+    uint32_t flags = irq_save();
+    scheduler_switch_context(self, NULL);
+    irq_restore(flags);
 }
 
 /*
  * Current process voluntarily yields CPU
  */
 void scheduler_yield(void) {
-    sched_stats.voluntary_yields++;
+    uint32_t flags = irq_save();
+    sched_this_cpu()->stats.voluntary_yields++;
+    TRACE(TRACE_YIELD, process_get_current_pid(), 0);
     
-    serial_puts("[SCHEDULER] Process ");
-    process_t *current = process_get_current();
-    if (current != NULL) {
-        serial_put_dec(current->pid);
-    }
-    serial_puts(" yielded CPU\n");
+    KLOG(KLOG_DEBUG, serial_puts("[SCHEDULER] Process "),
+         serial_put_dec(process_get_current_pid()), serial_puts(" yielded CPU\n"));
     
     scheduler_schedule();
+    
+    /* A yielding process gives up the rest of its tick */
+    process_t *self = scheduler_get_running();
+    if (self != NULL) {
+        scheduler_switch_context(self, NULL);
+    }
+    irq_restore(flags);
 }
 
 /*
@@ -389,36 +696,11 @@ void scheduler_check_aging(void) {
         return;
     }
     
-    /* Check all ready processes for aging */
-    uint32_t count = process_count();
-    
-    for (uint32_t pid = 1; pid <= count + 10; pid++) {
-        process_t *proc = process_get_by_pid(pid);
-        
-        if (proc == NULL) {
-            continue;
-        }
-        
-        /* Only age processes in ready state */
-        if (proc->state != PROC_STATE_READY) {
-            continue;
-        }
-        
-        /* Increment age */
-        proc->age++;
-        
-        /* Check if age threshold exceeded */
-        if (proc->age >= sched_config.aging_threshold) {
-            serial_puts("[SCHEDULER] Aging: Boosting priority of PID ");
-            serial_put_dec(proc->pid);
-            serial_puts(" (age=");
-            serial_put_dec(proc->age);
-            serial_puts(")\n");
-            
-            process_boost_priority(proc->pid);
-            process_reset_age(proc->pid);
-            sched_stats.total_aging_boosts++;
-        }
+    /* Every CPU's run queue is aged from the boot CPU's tick, with the
+     * queue locked so its heads cannot be dequeued or stolen meanwhile */
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        sched_this_cpu()->stats.total_aging_boosts +=
+            process_age_queue(cpu, sched_config.aging_threshold);
     }
 }
 
@@ -427,9 +709,9 @@ void scheduler_check_aging(void) {
  */
 void scheduler_set_policy(sched_policy_t policy) {
     sched_config.policy = policy;
-    serial_puts("[SCHEDULER] Policy changed to: ");
-    serial_puts(scheduler_policy_to_string(policy));
-    serial_puts("\n");
+    process_set_ready_order(scheduler_ready_order(policy));
+    KLOG(KLOG_INFO, serial_puts("[SCHEDULER] Policy changed to: "),
+         serial_puts(scheduler_policy_to_string(policy)), serial_puts("\n"));
 }
 
 /*
@@ -451,9 +733,8 @@ void scheduler_set_quantum(uint32_t quantum) {
     }
     
     sched_config.default_quantum = quantum;
-    serial_puts("[SCHEDULER] Time quantum set to: ");
-    serial_put_dec(quantum);
-    serial_puts(" ticks\n");
+    KLOG(KLOG_INFO, serial_puts("[SCHEDULER] Time quantum set to: "),
+         serial_put_dec(quantum), serial_puts(" ticks\n"));
 }
 
 /*
@@ -468,9 +749,8 @@ uint32_t scheduler_get_quantum(void) {
  */
 void scheduler_enable_aging(uint8_t enable) {
     sched_config.enable_aging = enable;
-    serial_puts("[SCHEDULER] Aging ");
-    serial_puts(enable ? "enabled" : "disabled");
-    serial_puts("\n");
+    KLOG(KLOG_INFO, serial_puts("[SCHEDULER] Aging "),
+         serial_puts(enable ? "enabled" : "disabled"), serial_puts("\n"));
 }
 
 /*
@@ -485,6 +765,7 @@ void scheduler_set_aging_threshold(uint32_t threshold) {
  */
 void scheduler_set_aging_interval(uint32_t interval) {
     sched_config.aging_boost_interval = interval;
+    next_aging_tick = current_tick + (interval ? interval : 1);
 }
 
 /*
@@ -492,9 +773,8 @@ void scheduler_set_aging_interval(uint32_t interval) {
  */
 void scheduler_enable_preemption(uint8_t enable) {
     sched_config.enable_preemption = enable;
-    serial_puts("[SCHEDULER] Preemption ");
-    serial_puts(enable ? "enabled" : "disabled");
-    serial_puts("\n");
+    KLOG(KLOG_INFO, serial_puts("[SCHEDULER] Preemption "),
+         serial_puts(enable ? "enabled" : "disabled"), serial_puts("\n"));
 }
 
 /*
@@ -540,11 +820,43 @@ void scheduler_update_process_time(process_t *proc, uint32_t ticks) {
 }
 
 /*
- * Get scheduler statistics
+ * Get the scheduler clock (ticks since scheduler_init)
+ */
+uint32_t scheduler_get_ticks(void) {
+    return current_tick;
+}
+
+/*
+ * Get scheduler statistics, summed over every CPU
  */
 void scheduler_get_stats(sched_stats_t *stats) {
-    if (stats != NULL) {
-        memcpy(stats, &sched_stats, sizeof(sched_stats_t));
+    if (stats == NULL) {
+        return;
+    }
+    
+    memset(stats, 0, sizeof(sched_stats_t));
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        const sched_stats_t *s = &sched_cpus[cpu].stats;
+        
+        stats->total_context_switches += s->total_context_switches;
+        stats->total_ticks += s->total_ticks;
+        stats->idle_ticks += s->idle_ticks;
+        stats->total_aging_boosts += s->total_aging_boosts;
+        stats->preemptions += s->preemptions;
+        stats->voluntary_yields += s->voluntary_yields;
+        stats->batched_ticks += s->batched_ticks;
+        stats->deadline_misses += s->deadline_misses;
+        cycle_hist_merge(&stats->schedule_cycles, &s->schedule_cycles);
+        cycle_hist_merge(&stats->switch_cycles, &s->switch_cycles);
+    }
+}
+
+/*
+ * Get one CPU's scheduler statistics
+ */
+void scheduler_get_cpu_stats(uint32_t cpu, sched_stats_t *stats) {
+    if (stats != NULL && cpu < MAX_CPUS) {
+        memcpy(stats, &sched_cpus[cpu].stats, sizeof(sched_stats_t));
     }
 }
 
@@ -552,41 +864,48 @@ void scheduler_get_stats(sched_stats_t *stats) {
  * Print scheduler statistics
  */
 void scheduler_print_stats(void) {
-    serial_puts("\n=== Scheduler Statistics ===\n");
-    serial_puts("Total Ticks:          ");
-    serial_put_dec(sched_stats.total_ticks);
-    serial_puts("\n");
-    
-    serial_puts("Idle Ticks:           ");
-    serial_put_dec(sched_stats.idle_ticks);
-    serial_puts("\n");
-    
-    serial_puts("Context Switches:     ");
-    serial_put_dec(sched_stats.total_context_switches);
-    serial_puts("\n");
-    
-    serial_puts("Preemptions:          ");
-    serial_put_dec(sched_stats.preemptions);
-    serial_puts("\n");
-    
-    serial_puts("Voluntary Yields:     ");
-    serial_put_dec(sched_stats.voluntary_yields);
-    serial_puts("\n");
+    sched_stats_t sched_stats;
+    scheduler_get_stats(&sched_stats);
     
-    serial_puts("Aging Boosts:         ");
-    serial_put_dec(sched_stats.total_aging_boosts);
-    serial_puts("\n");
+    kprintf("\n=== Scheduler Statistics ===\n"
+            "Total Ticks:          %u\n"
+            "Idle Ticks:           %u\n"
+            "Context Switches:     %u\n"
+            "Preemptions:          %u\n"
+            "Voluntary Yields:     %u\n"
+            "Aging Boosts:         %u\n"
+            "Batched Ticks:        %u\n"
+            "Deadline Misses:      %u\n",
+            sched_stats.total_ticks, sched_stats.idle_ticks,
+            sched_stats.total_context_switches, sched_stats.preemptions,
+            sched_stats.voluntary_yields, sched_stats.total_aging_boosts,
+            sched_stats.batched_ticks, sched_stats.deadline_misses);
     
     /* Calculate CPU utilization */
     if (sched_stats.total_ticks > 0) {
         uint32_t busy_ticks = sched_stats.total_ticks - sched_stats.idle_ticks;
         uint32_t utilization = (busy_ticks * 100) / sched_stats.total_ticks;
         
-        serial_puts("CPU Utilization:      ");
-        serial_put_dec(utilization);
-        serial_puts("%\n");
+        kprintf("CPU Utilization:      %u%%\n", utilization);
+    }
+    
+    /* Ticks and switches per CPU; the totals above are their sums */
+    if (smp_cpu_count() > 1) {
+        for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+            const sched_stats_t *s = &sched_cpus[cpu].stats;
+            
+            kprintf("  CPU %u:%*s%u ticks, %u idle, %u switches\n", cpu,
+                    (cpu < 10) ? 12 : 11, "",
+                    s->total_ticks, s->idle_ticks, s->total_context_switches);
+        }
     }
     
+    serial_puts("\nLatency (TSC cycles):\n");
+    cycle_hist_print_header();
+    cycle_hist_print("schedule", &sched_stats.schedule_cycles);
+    cycle_hist_print("switch", &sched_stats.switch_cycles);
+    memory_print_latency();
+    
     serial_puts("===========================\n\n");
 }
 
@@ -594,8 +913,19 @@ void scheduler_print_stats(void) {
  * Reset scheduler statistics
  */
 void scheduler_reset_stats(void) {
-    memset(&sched_stats, 0, sizeof(sched_stats_t));
-    serial_puts("[SCHEDULER] Statistics reset\n");
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        memset(&sched_cpus[cpu].stats, 0, sizeof(sched_stats_t));
+    }
+    KLOG(KLOG_INFO, serial_puts("[SCHEDULER] Statistics reset\n"));
+}
+
+/*
+ * Copy the scheduler configuration
+ */
+void scheduler_get_config(sched_config_t *config) {
+    if (config != NULL) {
+        *config = sched_config;
+    }
 }
 
 /*
@@ -635,6 +965,10 @@ void scheduler_print_config(void) {
     serial_puts(sched_config.enable_preemption ? "Enabled" : "Disabled");
     serial_puts("\n");
     
+    serial_puts("Deadline Load:        ");
+    serial_put_dec(process_get_utilization() * 100 / PROC_UTIL_SCALE);
+    serial_puts("% admitted\n");
+    
     serial_puts("Scheduler:            ");
     serial_puts(scheduler_running ? "Running" : "Stopped");
     serial_puts("\n");
@@ -655,7 +989,105 @@ const char *scheduler_policy_to_string(sched_policy_t policy) {
             return "Priority Round-Robin";
         case SCHED_POLICY_FCFS:
             return "First-Come-First-Served";
+        case SCHED_POLICY_EDF:
+            return "Earliest-Deadline-First";
+        case SCHED_POLICY_SRTF:
+            return "Shortest-Remaining-Time-First";
         default:
             return "Unknown";
     }
 }
+
+/* Shell commands */
+
+/*
+ * schedstats: show scheduler statistics
+ */
+static int scheduler_cmd_schedstats(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    scheduler_print_stats();
+    return 0;
+}
+
+/*
+ * schedconf: show the scheduler configuration
+ */
+static int scheduler_cmd_schedconf(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    scheduler_print_config();
+    return 0;
+}
+
+/* Names the policy command takes, in sched_policy_t order */
+static const char *const policy_names[] = { "rr", "priority", "priority-rr", "fcfs", "edf", "srtf" };
+
+/*
+ * policy [name]: show or change the scheduling policy
+ */
+static int scheduler_cmd_policy(int argc, char **argv) {
+    if (argc > 2) {
+        return -1;
+    }
+    if (argc == 2) {
+        uint32_t i = 0;
+        while (i < sizeof(policy_names) / sizeof(policy_names[0]) &&
+               strcmp(argv[1], policy_names[i]) != 0) {
+            i++;
+        }
+        if (i == sizeof(policy_names) / sizeof(policy_names[0])) {
+            return -1;
+        }
+        scheduler_set_policy((sched_policy_t)i);
+    }
+    
+    serial_puts("Policy: ");
+    serial_puts(scheduler_policy_to_string(sched_config.policy));
+    serial_puts("\n");
+    return 0;
+}
+
+/*
+ * sched: start the scheduler
+ */
+static int scheduler_cmd_sched(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    scheduler_start();
+    return 0;
+}
+
+/*
+ * tick [n]: advance the scheduler by n ticks, 1 by default
+ */
+static int scheduler_cmd_tick(int argc, char **argv) {
+    uint32_t ticks = 1;
+    
+    if (argc > 2 || (argc == 2 && shell_parse_uint(argv[1], &ticks) != 0)) {
+        return -1;
+    }
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    
+    serial_puts("Advancing scheduler by ");
+    serial_put_dec(ticks);
+    serial_puts(" tick(s)\n");
+    
+    scheduler_advance(ticks);
+    return 0;
+}
+
+SHELL_COMMAND(schedstats, "schedstats", "schedstats", "Show scheduler statistics",
+              scheduler_cmd_schedstats);
+SHELL_COMMAND(schedconf, "schedconf", "schedconf", "Show scheduler configuration",
+              scheduler_cmd_schedconf);
+SHELL_COMMAND(policy, "policy", "policy [rr|priority|priority-rr|fcfs|edf|srtf]",
+              "Show or set the scheduling policy", scheduler_cmd_policy);
+SHELL_COMMAND(sched, "sched", "sched", "Start the scheduler", scheduler_cmd_sched);
+SHELL_COMMAND(tick, "tick", "tick [n]", "Advance scheduler by n ticks (default 1)",
+              scheduler_cmd_tick);
@@ -4,15 +4,23 @@
 
 #include "types.h"
 #include "process.h"
+#include "cycles.h"
 
 /* Scheduling policies */
 typedef enum {
     SCHED_POLICY_ROUND_ROBIN = 0,   /* Round-robin scheduling */
     SCHED_POLICY_PRIORITY,          /* Priority-based scheduling */
     SCHED_POLICY_PRIORITY_RR,       /* Priority with round-robin per level */
-    SCHED_POLICY_FCFS               /* First-Come-First-Served */
+    SCHED_POLICY_FCFS,              /* First-Come-First-Served */
+    SCHED_POLICY_EDF,               /* Earliest deadline first */
+    SCHED_POLICY_SRTF               /* Shortest remaining (required) time first */
 } sched_policy_t;
 
+/* EDF and SRTF take the process with the smallest key off the CPU's ready
+ * heap and preempt the current process as soon as a queued key beats its
+ * own. Processes without a key (no deadline, no required time) run by
+ * priority when no keyed process is ready. */
+
 /* Scheduler configuration */
 typedef struct {
     sched_policy_t policy;          /* Current scheduling policy */
@@ -20,7 +28,7 @@ typedef struct {
     uint32_t min_quantum;           /* Minimum time quantum */
     uint32_t max_quantum;           /* Maximum time quantum */
     uint32_t aging_threshold;       /* Ticks before aging kicks in */
-    uint32_t aging_boost_interval;  /* How often to check for aging */
+    uint32_t aging_boost_interval;  /* Ticks between aging passes */
     uint8_t enable_aging;           /* 1 if aging enabled, 0 otherwise */
     uint8_t enable_preemption;      /* 1 if preemptive, 0 if cooperative */
 } sched_config_t;
@@ -33,6 +41,10 @@ typedef struct {
     uint32_t total_aging_boosts;         /* Total priority boosts from aging */
     uint32_t preemptions;                /* Number of preemptions */
     uint32_t voluntary_yields;           /* Number of voluntary yields */
+    uint32_t batched_ticks;              /* Ticks scheduler_advance() took without scheduler_tick() */
+    uint32_t deadline_misses;            /* Processes done after their deadline */
+    cycle_hist_t schedule_cycles;        /* Latency of scheduler_schedule() */
+    cycle_hist_t switch_cycles;          /* Context switch, switch-out to resume */
 } sched_stats_t;
 
 /* Scheduler Initialization */
@@ -41,12 +53,25 @@ void scheduler_init(sched_policy_t policy, uint32_t default_quantum);
 /* Scheduling Functions */
 void scheduler_start(void);                     /* Start the scheduler */
 void scheduler_stop(void);                      /* Stop the scheduler */
-void scheduler_tick(void);                      /* Called on timer tick */
+void scheduler_tick(void);                      /* Called on timer tick (boot CPU) */
+void scheduler_cpu_tick(void);                  /* This CPU's share of a tick */
+void scheduler_advance(uint32_t ticks);         /* Same outcome as ticks x scheduler_tick() */
 void scheduler_schedule(void);                  /* Trigger scheduling decision */
 void scheduler_yield(void);                     /* Current process yields CPU */
 
-/* Context Switch */
+/* Context Switch
+ * Each CPU has a null context, its idle loop; on the boot CPU that is
+ * kmain's shell loop. A tick runs the CPU's current process on its own
+ * stack until it calls scheduler_wait_tick(), yields, exits or is
+ * preempted, then switches back. NULL stands for the null context in
+ * scheduler_switch_context(). */
 void scheduler_switch_context(process_t *from, process_t *to);
+void scheduler_wait_tick(void);                 /* Process is done for this tick */
+process_t *scheduler_get_running(void);         /* Process on the CPU, NULL in null context */
+void scheduler_exit_running(void);              /* Running process leaves for good */
+void scheduler_finish_switch(void);             /* First thing after switch_to() lands */
+void scheduler_idle(void);                      /* Null context waits for an interrupt */
+uint8_t scheduler_cpu_busy(void);               /* This CPU has (or stole) work */
 
 /* Policy Configuration */
 void scheduler_set_policy(sched_policy_t policy);
@@ -58,7 +83,7 @@ uint32_t scheduler_get_quantum(void);
 void scheduler_enable_aging(uint8_t enable);
 void scheduler_set_aging_threshold(uint32_t threshold);
 void scheduler_set_aging_interval(uint32_t interval);
-void scheduler_check_aging(void);               /* Check and apply aging */
+void scheduler_check_aging(void);               /* Run one aging pass now */
 
 /* Preemption Control */
 void scheduler_enable_preemption(uint8_t enable);
@@ -69,12 +94,15 @@ void scheduler_set_process_quantum(uint32_t pid, uint32_t quantum);
 uint32_t scheduler_get_process_quantum(uint32_t pid);
 
 /* Statistics and Monitoring */
-void scheduler_get_stats(sched_stats_t *stats);
+uint32_t scheduler_get_ticks(void);             /* Scheduler clock */
+void scheduler_get_stats(sched_stats_t *stats);         /* Summed over CPUs */
+void scheduler_get_cpu_stats(uint32_t cpu, sched_stats_t *stats);
 void scheduler_print_stats(void);
 void scheduler_reset_stats(void);
 
 /* Utility Functions */
 const char *scheduler_policy_to_string(sched_policy_t policy);
+void scheduler_get_config(sched_config_t *config);
 void scheduler_print_config(void);
 
 /* Advanced Scheduling */
@@ -1,9 +1,60 @@
 /* serial.c - Serial port driver (COM1) */
 #include "serial.h"
 #include "io.h"
+#include "cpu.h"
+#include "idt.h"
+#include "process.h"
+#include "scheduler.h"
+#include "spinlock.h"
 
 #define COM1 0x3F8   /* I/O port base address for COM1 */
 
+/* 16550 registers (offsets from COM1) */
+#define UART_DATA           0       /* RBR on read, THR on write */
+#define UART_IER            1       /* Interrupt enable */
+#define UART_IIR            2       /* Interrupt identification (read) */
+#define UART_LSR            5       /* Line status */
+
+#define UART_IER_RX         0x01    /* Received data available */
+#define UART_IER_TX         0x02    /* Transmit holding register empty */
+
+#define UART_IIR_NONE       0x01    /* No interrupt pending */
+#define UART_IIR_ID_MASK    0x0E
+#define UART_IIR_TX         0x02
+#define UART_IIR_RX         0x04
+#define UART_IIR_LINE       0x06
+#define UART_IIR_TIMEOUT    0x0C    /* RX FIFO holds data below the trigger level */
+
+#define UART_LSR_DATA       0x01
+#define UART_LSR_THRE       0x20
+
+#define UART_FIFO_DEPTH     16      /* Bytes the TX FIFO takes per THRE interrupt */
+#define UART_CLOCK          115200  /* Divisor 1 */
+
+/* Ring buffers. Indices run freely and are masked on access; head is only
+ * written by the producer and tail only by the consumer. TX producers are
+ * kernel code and the consumer is the IRQ handler; RX is the other way
+ * round. Once interrupts drive the rings, serial_lock serializes every
+ * CPU and handler touching them. Callers may hold other locks when they
+ * print, so nothing here calls into the process manager with it held. */
+static volatile char tx_ring[SERIAL_TX_BUFFER_SIZE];
+static volatile uint32_t tx_head = 0;
+static volatile uint32_t tx_tail = 0;
+static volatile char rx_ring[SERIAL_RX_BUFFER_SIZE];
+static volatile uint32_t rx_head = 0;
+static volatile uint32_t rx_tail = 0;
+
+static uint8_t serial_irq_mode = 0;     /* Rings in use; polled until enabled */
+static uint8_t uart_ier = 0;            /* Shadow of UART_IER */
+static volatile uint32_t rx_waiter = 0; /* PID blocked in serial_getc(), 0 if none */
+static spinlock_t serial_lock = SPINLOCK_INIT;
+static uint32_t rx_dropped = 0;
+
+/* Forward declarations for internal functions */
+static void serial_irq_handler(interrupt_frame_t *frame);
+static void tx_enqueue(char c);
+static void tx_fill_fifo(void);
+
 /*
 You can find more information here: https://caro.su/msx/ocm_de1/16550.pdf
 
@@ -23,40 +74,266 @@ If you want real keyboard input, you'd need to add a keyboard driver.
 */
 
 void serial_init(void) {
+    uint32_t divisor = UART_CLOCK / SERIAL_BAUD;
+    
     outb(COM1 + 1, 0x00);    /* Disable interrupts */
     outb(COM1 + 3, 0x80);    /* Enable DLAB (set baud rate divisor) */
-    outb(COM1 + 0, 0x03);    /* Divisor low byte (38400 baud) */
-    outb(COM1 + 1, 0x00);    /* Divisor high byte */
+    outb(COM1 + 0, divisor & 0xFF);         /* Divisor low byte */
+    outb(COM1 + 1, (divisor >> 8) & 0xFF);  /* Divisor high byte */
     outb(COM1 + 3, 0x03);    /* 8 bits, no parity, 1 stop bit */
     outb(COM1 + 2, 0xC7);    /* Enable FIFO, clear, 14-byte threshold */
     outb(COM1 + 4, 0x0B);    /* IRQs enabled, RTS/DSR set */
 }
 
+/*
+ * Switch from polling to IRQ4-driven ring buffers. Needs the IDT.
+ */
+void serial_enable_interrupts(void) {
+    uint32_t flags = irq_save();
+    
+    tx_head = tx_tail = 0;
+    rx_head = rx_tail = 0;
+    
+    /* Take anything typed before now */
+    while (inb(COM1 + UART_LSR) & UART_LSR_DATA) {
+        rx_ring[rx_head++ & (SERIAL_RX_BUFFER_SIZE - 1)] = inb(COM1 + UART_DATA);
+    }
+    
+    irq_register(SERIAL_IRQ, serial_irq_handler);
+    uart_ier = UART_IER_RX;
+    outb(COM1 + UART_IER, uart_ier);
+    serial_irq_mode = 1;
+    
+    irq_restore(flags);
+}
+
 static int is_transmit_empty(void) {
     return inb(COM1 + 5) & 0x20;
 }
 
+/*
+ * Move up to one FIFO's worth of queued bytes into the UART. Runs in the
+ * IRQ handler, or with interrupts masked when the ring has to drain
+ * synchronously.
+ */
+static void tx_fill_fifo(void) {
+    for (uint32_t n = 0; n < UART_FIFO_DEPTH && tx_tail != tx_head; n++) {
+        outb(COM1 + UART_DATA, tx_ring[tx_tail & (SERIAL_TX_BUFFER_SIZE - 1)]);
+        tx_tail++;
+    }
+    
+    /* Nothing left: stop THRE interrupts until the next write */
+    if (tx_tail == tx_head && (uart_ier & UART_IER_TX)) {
+        uart_ier &= ~UART_IER_TX;
+        outb(COM1 + UART_IER, uart_ier);
+    }
+}
+
+/*
+ * Queue one byte; serial_lock must be held. A full ring is drained by
+ * polling, since the caller may be running with interrupts off for long.
+ */
+static void tx_enqueue(char c) {
+    while (tx_head - tx_tail >= SERIAL_TX_BUFFER_SIZE) {
+        while (!is_transmit_empty());
+        tx_fill_fifo();
+    }
+    
+    tx_ring[tx_head & (SERIAL_TX_BUFFER_SIZE - 1)] = c;
+    __asm__ volatile ("" : : : "memory");   /* Publish the byte before the index */
+    tx_head++;
+    
+    /* Arm THRE; the UART raises it at once while its holding register is empty */
+    if (!(uart_ier & UART_IER_TX)) {
+        uart_ier |= UART_IER_TX;
+        outb(COM1 + UART_IER, uart_ier);
+    }
+}
+
 void serial_putc(char c) {
+    if (!serial_irq_mode) {
+        if (c == '\n') {
+            serial_putc('\r');  /* Add carriage return */
+        }
+        while (!is_transmit_empty());
+        outb(COM1, c);
+        return;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
     if (c == '\n') {
-        serial_putc('\r');  /* Add carriage return */
+        tx_enqueue('\r');
     }
-    while (!is_transmit_empty());
-    outb(COM1, c);
+    tx_enqueue(c);
+    spin_unlock_irqrestore(&serial_lock, flags);
 }
 
 void serial_puts(const char* str) {
+    if (!serial_irq_mode) {
+        while (*str) {
+            serial_putc(*str++);
+        }
+        return;
+    }
+    
+    /* One locked section for the whole string, so lines do not interleave */
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
     while (*str) {
-        serial_putc(*str++);
+        if (*str == '\n') {
+            tx_enqueue('\r');
+        }
+        tx_enqueue(*str++);
+    }
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+/*
+ * Write len bytes in one locked section, as
+ * serial_puts() does for a string; kprintf() flushes through this
+ */
+void serial_write(const char *data, size_t len) {
+    if (!serial_irq_mode) {
+        for (size_t i = 0; i < len; i++) {
+            serial_putc(data[i]);
+        }
+        return;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == '\n') {
+            tx_enqueue('\r');
+        }
+        tx_enqueue(data[i]);
     }
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+/*
+ * Push every queued byte out by polling (panic, shutdown, benchmarks)
+ */
+void serial_flush(void) {
+    if (!serial_irq_mode) {
+        return;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
+    while (tx_tail != tx_head) {
+        while (!is_transmit_empty());
+        tx_fill_fifo();
+    }
+    spin_unlock_irqrestore(&serial_lock, flags);
 }
 
 static int serial_received(void) {
     return inb(COM1 + 5) & 0x01;
 }
 
+/*
+ * Blocking read. A process blocks until the RX interrupt wakes it; the
+ * null context idles in scheduler_idle() instead of polling the UART.
+ * A process is blocked before it is published as rx_waiter, so the
+ * handler's wake-up cannot arrive ahead of the block.
+ */
 char serial_getc(void) {
-    while (!serial_received());
-    return inb(COM1);
+    if (!serial_irq_mode) {
+        while (!serial_received());
+        return inb(COM1);
+    }
+    
+    uint32_t flags = irq_save();
+    for (;;) {
+        spin_lock(&serial_lock);
+        if (rx_head != rx_tail) {
+            break;
+        }
+        spin_unlock(&serial_lock);
+        
+        process_t *self = scheduler_get_running();
+        if (self != NULL) {
+            process_block(self->pid);
+            
+            spin_lock(&serial_lock);
+            int ready = (rx_head != rx_tail);
+            if (!ready) {
+                rx_waiter = self->pid;
+            }
+            spin_unlock(&serial_lock);
+            
+            if (ready) {
+                process_set_state(self->pid, PROC_STATE_CURRENT);  /* Data beat us */
+            } else {
+                scheduler_wait_tick();
+            }
+        } else {
+            scheduler_idle();
+        }
+    }
+    
+    char c = rx_ring[rx_tail & (SERIAL_RX_BUFFER_SIZE - 1)];
+    rx_tail++;
+    spin_unlock(&serial_lock);
+    irq_restore(flags);
+    
+    return c;
+}
+
+/*
+ * IRQ4: refill the TX FIFO, drain the RX FIFO and wake a blocked reader
+ */
+static void serial_irq_handler(interrupt_frame_t *frame) {
+    uint8_t iir;
+    (void)frame;
+    
+    spin_lock(&serial_lock);
+    while (!((iir = inb(COM1 + UART_IIR)) & UART_IIR_NONE)) {
+        switch (iir & UART_IIR_ID_MASK) {
+        case UART_IIR_TX:
+            tx_fill_fifo();
+            break;
+        
+        case UART_IIR_RX:
+        case UART_IIR_TIMEOUT:
+            while (inb(COM1 + UART_LSR) & UART_LSR_DATA) {
+                char c = inb(COM1 + UART_DATA);
+                if (rx_head - rx_tail < SERIAL_RX_BUFFER_SIZE) {
+                    rx_ring[rx_head & (SERIAL_RX_BUFFER_SIZE - 1)] = c;
+                    __asm__ volatile ("" : : : "memory");
+                    rx_head++;
+                } else {
+                    rx_dropped++;
+                }
+            }
+            break;
+        
+        case UART_IIR_LINE:
+            inb(COM1 + UART_LSR);
+            break;
+        
+        default:
+            inb(COM1 + 6);      /* Modem status */
+            break;
+        }
+    }
+    
+    uint32_t pid = 0;
+    if (rx_waiter != 0 && rx_head != rx_tail) {
+        pid = rx_waiter;
+        rx_waiter = 0;
+    }
+    spin_unlock(&serial_lock);
+    
+    /* Outside the lock: the process manager prints while holding its own */
+    if (pid != 0 && process_get_state(pid) == PROC_STATE_BLOCKED) {
+        process_unblock(pid);
+    }
+}
+
+/*
+ * Bytes dropped because the RX ring was full
+ */
+uint32_t serial_get_rx_dropped(void) {
+    return rx_dropped;
 }
 
 void serial_put_hex(uint32_t value) {
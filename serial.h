@@ -4,11 +4,29 @@
 
 #include "types.h"
 
+/*
+ * COM1 starts out polled. serial_enable_interrupts() switches it to the
+ * 16550's RX-available and THR-empty interrupts: writers queue into a ring
+ * and return, and serial_getc() sleeps until input arrives.
+ */
+
+#ifndef SERIAL_BAUD
+#define SERIAL_BAUD             115200  /* Makefile SERIAL_BAUD; divides 115200 */
+#endif
+
+#define SERIAL_IRQ              4       /* COM1 */
+#define SERIAL_TX_BUFFER_SIZE   4096    /* Power of two */
+#define SERIAL_RX_BUFFER_SIZE   256     /* Power of two */
+
 void serial_init(void);
+void serial_enable_interrupts(void);
 void serial_putc(char c);
 void serial_puts(const char* str);
+void serial_write(const char *data, size_t len);
+void serial_flush(void);
 char serial_getc(void);
 void serial_put_hex(uint32_t value);
 void serial_put_dec(uint32_t value);
+uint32_t serial_get_rx_dropped(void);
 
-#endif
\ No newline at end of file
+#endif
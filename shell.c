@@ -0,0 +1,283 @@
+/* shell.c - Serial command shell */
+#include "shell.h"
+#include "serial.h"
+#include "string.h"
+#include "klog.h"
+#include "idt.h"
+
+/* Descriptors from every SHELL_COMMAND() in the link (link.ld) */
+extern const shell_command_t __shell_commands_start[];
+extern const shell_command_t __shell_commands_end[];
+
+/* FNV-1a, 32 bits */
+#define FNV_OFFSET          2166136261u
+#define FNV_PRIME           16777619u
+
+#define IS_SPACE(c)         ((c) == ' ' || (c) == '\t')
+
+/* Open addressing with linear probing; hashes kept beside the entries so
+ * a probe compares strings only on a full hash match */
+static const shell_command_t *shell_index[SHELL_INDEX_SIZE];
+static uint32_t shell_hashes[SHELL_INDEX_SIZE];
+
+/* The same commands by name, for help */
+static const shell_command_t *shell_sorted[SHELL_INDEX_SIZE];
+static uint32_t shell_count = 0;
+static uint8_t shell_ready = 0;
+
+/* Forward declarations for internal functions */
+static uint32_t shell_hash(const char *name);
+static const shell_command_t *shell_lookup(const char *name, uint32_t hash);
+static int shell_tokenize(char *line, char **argv, uint32_t *hash);
+
+/*
+ * Build the hash index and the sorted list from the linked-in commands.
+ * A name defined twice keeps its first definition.
+ */
+void shell_init(void) {
+    shell_count = 0;
+    for (uint32_t i = 0; i < SHELL_INDEX_SIZE; i++) {
+        shell_index[i] = NULL;
+        shell_hashes[i] = 0;
+    }
+    
+    for (const shell_command_t *cmd = __shell_commands_start; cmd < __shell_commands_end; cmd++) {
+        uint32_t hash = shell_hash(cmd->name);
+        
+        if (shell_lookup(cmd->name, hash) != NULL) {
+            KLOG(KLOG_WARN, serial_puts("[SHELL] Command '"), serial_puts(cmd->name),
+                 serial_puts("' defined twice\n"));
+            continue;
+        }
+        
+        /* Half full at most, so probes stay short and always end */
+        if (shell_count >= SHELL_INDEX_SIZE / 2) {
+            KLOG(KLOG_WARN, serial_puts("[SHELL] Command table full, dropping '"),
+                 serial_puts(cmd->name), serial_puts("'\n"));
+            continue;
+        }
+        
+        uint32_t slot = hash & (SHELL_INDEX_SIZE - 1);
+        while (shell_index[slot] != NULL) {
+            slot = (slot + 1) & (SHELL_INDEX_SIZE - 1);
+        }
+        shell_index[slot] = cmd;
+        shell_hashes[slot] = hash;
+        
+        /* Insertion sort: a few dozen entries, once */
+        uint32_t pos = shell_count++;
+        while (pos > 0 && strcmp(shell_sorted[pos - 1]->name, cmd->name) > 0) {
+            shell_sorted[pos] = shell_sorted[pos - 1];
+            pos--;
+        }
+        shell_sorted[pos] = cmd;
+    }
+    
+    shell_ready = 1;
+    KLOG(KLOG_INFO, serial_puts("[SHELL] "), serial_put_dec(shell_count),
+         serial_puts(" commands\n"));
+}
+
+/*
+ * Hash a NUL-terminated name, the way shell_tokenize() hashes a word
+ */
+static uint32_t shell_hash(const char *name) {
+    uint32_t hash = FNV_OFFSET;
+    
+    while (*name != '\0') {
+        hash = (hash ^ (uint8_t)*name++) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Command called name, or NULL
+ */
+static const shell_command_t *shell_lookup(const char *name, uint32_t hash) {
+    uint32_t slot = hash & (SHELL_INDEX_SIZE - 1);
+    
+    while (shell_index[slot] != NULL) {
+        if (shell_hashes[slot] == hash && strcmp(shell_index[slot]->name, name) == 0) {
+            return shell_index[slot];
+        }
+        slot = (slot + 1) & (SHELL_INDEX_SIZE - 1);
+    }
+    return NULL;
+}
+
+/*
+ * Split line into words in place, hashing the first as it goes. Returns
+ * the word count, or -1 for more than SHELL_MAX_ARGS words.
+ */
+static int shell_tokenize(char *line, char **argv, uint32_t *hash) {
+    int argc = 0;
+    char *p = line;
+    
+    *hash = FNV_OFFSET;
+    for (;;) {
+        while (IS_SPACE(*p)) {
+            p++;
+        }
+        if (*p == '\0') {
+            return argc;
+        }
+        if (argc == SHELL_MAX_ARGS) {
+            return -1;
+        }
+        
+        argv[argc] = p;
+        if (argc == 0) {
+            while (*p != '\0' && !IS_SPACE(*p)) {
+                *hash = (*hash ^ (uint8_t)*p++) * FNV_PRIME;
+            }
+        } else {
+            while (*p != '\0' && !IS_SPACE(*p)) {
+                p++;
+            }
+        }
+        argc++;
+        
+        if (*p != '\0') {
+            *p++ = '\0';
+        }
+    }
+}
+
+/*
+ * Parse and run one command line
+ */
+void shell_execute(char *line) {
+    char *argv[SHELL_MAX_ARGS + 1];
+    uint32_t hash;
+    
+    if (!shell_ready) {
+        shell_init();
+    }
+    
+    int argc = shell_tokenize(line, argv, &hash);
+    if (argc == 0) {
+        return;
+    }
+    if (argc < 0) {
+        serial_puts("Too many arguments (at most ");
+        serial_put_dec(SHELL_MAX_ARGS - 1);
+        serial_puts(")\n");
+        return;
+    }
+    argv[argc] = NULL;
+    
+    const shell_command_t *cmd = shell_lookup(argv[0], hash);
+    if (cmd == NULL) {
+        serial_puts("Unknown command: ");
+        serial_puts(argv[0]);
+        serial_puts("\n");
+        serial_puts("Type 'help' for available commands\n");
+        return;
+    }
+    
+    if (cmd->handler(argc, argv) != 0) {
+        serial_puts("Usage: ");
+        serial_puts(cmd->usage);
+        serial_puts("\n");
+    }
+}
+
+/*
+ * Read lines from the serial console and run them. Interrupts are only
+ * taken while waiting for a key, so timer ticks never land in the middle
+ * of a command.
+ */
+void shell_run(void) {
+    char input[SHELL_MAX_INPUT];
+    
+    if (!shell_ready) {
+        shell_init();
+    }
+    
+    for (;;) {
+        uint32_t pos = 0;
+        serial_puts("kacchiOS> ");
+        
+        for (;;) {
+            interrupts_enable();
+            char c = serial_getc();
+            interrupts_disable();
+            
+            if (c == '\r' || c == '\n') {
+                input[pos] = '\0';
+                serial_puts("\n");
+                break;
+            } else if ((c == '\b' || c == 0x7F) && pos > 0) {
+                pos--;
+                serial_puts("\b \b");  /* Erase character on screen */
+            } else if (c >= 32 && c < 127 && pos < SHELL_MAX_INPUT - 1) {
+                input[pos++] = c;
+                serial_putc(c);  /* Echo character */
+            }
+        }
+        
+        shell_execute(input);
+    }
+}
+
+/*
+ * Parse a decimal number that fills the whole argument and fits 32 bits
+ */
+int shell_parse_uint(const char *text, uint32_t *value) {
+    uint32_t result = 0;
+    
+    if (text == NULL || *text == '\0') {
+        return -1;
+    }
+    for (; *text != '\0'; text++) {
+        if (*text < '0' || *text > '9') {
+            return -1;
+        }
+        uint32_t digit = (uint32_t)(*text - '0');
+        if (result > (0xFFFFFFFFu - digit) / 10) {
+            return -1;          /* Would wrap */
+        }
+        result = result * 10 + digit;
+    }
+    
+    *value = result;
+    return 0;
+}
+
+/*
+ * help: every command, by name
+ */
+static int shell_cmd_help(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    serial_puts("Available commands:\n");
+    for (uint32_t i = 0; i < shell_count; i++) {
+        const char *usage = shell_sorted[i]->usage;
+        uint32_t len = strlen(usage);
+        
+        serial_puts("  ");
+        serial_puts(usage);
+        for (uint32_t pad = len; pad < 10; pad++) {
+            serial_putc(' ');
+        }
+        serial_puts((len < 10) ? "- " : " - ");
+        serial_puts(shell_sorted[i]->help);
+        serial_puts("\n");
+    }
+    return 0;
+}
+
+/*
+ * clear: ANSI escape codes to clear the screen
+ */
+static int shell_cmd_clear(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    serial_puts("\033[2J\033[H");
+    return 0;
+}
+
+SHELL_COMMAND(help, "help", "help", "Show this help message", shell_cmd_help);
+SHELL_COMMAND(clear, "clear", "clear", "Clear the screen", shell_cmd_clear);
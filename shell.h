@@ -0,0 +1,51 @@
+/* shell.h - Serial command shell */
+#ifndef SHELL_H
+#define SHELL_H
+
+#include "types.h"
+
+/*
+ * Commands live with the subsystem they belong to. SHELL_COMMAND() puts a
+ * descriptor into the .shell_commands section (link.ld), and shell_init()
+ * indexes whatever the link brought together, so adding a command never
+ * touches kmain() or this file.
+ *
+ * A line is split into words in one pass, which also hashes the first
+ * word (FNV-1a). The command is found with one probe into an open-addressed
+ * table in the common case, however many commands there are, and its
+ * handler gets the words as argc/argv.
+ */
+
+#define SHELL_MAX_INPUT     128
+#define SHELL_MAX_ARGS      8       /* Command name included */
+#define SHELL_INDEX_SIZE    128     /* Hash slots, power of two */
+
+/* Handler: argv[0] is the command name. A return of -1 prints usage. */
+typedef int (*shell_handler_t)(int argc, char **argv);
+
+/* 16 bytes, so the compiler has no reason to pad the section */
+typedef struct shell_command {
+    const char *name;
+    const char *usage;              /* Name and arguments, for help */
+    const char *help;               /* What it does, one line */
+    shell_handler_t handler;
+} shell_command_t;
+
+#define SHELL_COMMAND(ident, name, usage, help, handler)                    \
+    static const shell_command_t shell_command_##ident                     \
+        __attribute__((used, section(".shell_commands"), aligned(4))) =    \
+        { name, usage, help, handler }
+
+/* Index the linked-in commands; shell_run() does this itself */
+void shell_init(void);
+
+/* Run one line (modified in place) */
+void shell_execute(char *line);
+
+/* Prompt, read and run commands forever: the null context's main loop */
+void shell_run(void) __attribute__((noreturn));
+
+/* Decimal argument; 0 on success, -1 if text is not a 32-bit number */
+int shell_parse_uint(const char *text, uint32_t *value);
+
+#endif /* SHELL_H */
@@ -0,0 +1,349 @@
+/* slab.c - Slab / Object Cache Allocator Implementation */
+#include "slab.h"
+#include "memory.h"
+#include "string.h"
+#include "serial.h"
+#include "klog.h"
+#include "shell.h"
+
+/* The cache of caches: kmem_cache_t descriptors come from a slab cache too */
+static kmem_cache_t cache_cache;
+static kmem_cache_t *cache_list = NULL;
+static spinlock_t cache_list_lock = SPINLOCK_INIT;
+
+/* Slab geometry helpers */
+#define SLAB_HEADER_SIZE    ((sizeof(kmem_slab_t) + 7) & ~7)
+#define SLAB_OF(obj)        ((kmem_slab_t*)((uint32_t)(obj) & ~(PAGE_SIZE - 1)))
+#define OBJ_LINK(c, obj)    ((void**)((uint8_t*)(obj) + (c)->link_offset))
+
+/* Forward declarations for internal functions */
+static void cache_setup(kmem_cache_t *cache, const char *name, size_t size,
+                        size_t align, kmem_ctor_t ctor);
+static kmem_slab_t *slab_grow(kmem_cache_t *cache);
+static void slab_list_push(kmem_slab_t **list, kmem_slab_t *slab);
+static void slab_list_remove(kmem_slab_t **list, kmem_slab_t *slab);
+
+/*
+ * Initialize the slab allocator
+ */
+void slab_init(void) {
+    cache_list = NULL;
+    cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0, NULL);
+    
+    KLOG(KLOG_INFO, serial_puts("[SLAB] Slab allocator initialized ("),
+         serial_put_dec(PAGE_SIZE), serial_puts(" byte slabs)\n"));
+}
+
+/*
+ * Fill in a cache descriptor and link it into the global list
+ */
+static void cache_setup(kmem_cache_t *cache, const char *name, size_t size,
+                        size_t align, kmem_ctor_t ctor) {
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+    
+    /* The free link sits after the object so constructed state survives
+     * free. Without a constructor there is no such state and the link
+     * overlays the object, so a 64-byte object fills a 64-byte slot. */
+    size_t slot = sizeof(void*);
+    cache->name = name;
+    cache->object_size = size;
+    if (ctor != NULL) {
+        cache->link_offset = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+        slot += cache->link_offset;
+    } else {
+        cache->link_offset = 0;
+        if (size > slot) {
+            slot = size;
+        }
+    }
+    cache->slot_size = (slot + align - 1) & ~(align - 1);
+    cache->first_offset = (SLAB_HEADER_SIZE + align - 1) & ~(align - 1);
+    cache->objects_per_slab = (PAGE_SIZE - cache->first_offset) / cache->slot_size;
+    cache->ctor = ctor;
+    spin_lock_init(&cache->lock);
+    
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    
+    cache->num_slabs = 0;
+    cache->num_empty = 0;
+    cache->num_active = 0;
+    cache->total_allocs = 0;
+    
+    uint32_t flags = spin_lock_irqsave(&cache_list_lock);
+    cache->next = cache_list;
+    cache_list = cache;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+}
+
+/*
+ * Create a new object cache
+ */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, kmem_ctor_t ctor) {
+    if (size == 0 || (align & (align - 1)) != 0 ||
+        SLAB_HEADER_SIZE + size + sizeof(void*) + align > PAGE_SIZE) {
+        KLOG(KLOG_ERROR, serial_puts("[SLAB] Cannot create cache '"), serial_puts(name),
+             serial_puts("': unsupported size or alignment\n"));
+        return NULL;
+    }
+    
+    kmem_cache_t *cache = (kmem_cache_t *)kmem_cache_alloc(&cache_cache);
+    if (cache == NULL) {
+        return NULL;
+    }
+    
+    cache_setup(cache, name, size, align, ctor);
+    
+    KLOG(KLOG_INFO, serial_puts("[SLAB] Created cache '"), serial_puts(name),
+         serial_puts("' ("), serial_put_dec(cache->slot_size),
+         serial_puts(" byte slots, "), serial_put_dec(cache->objects_per_slab),
+         serial_puts(" per slab)\n"));
+    
+    return cache;
+}
+
+/*
+ * Destroy a cache. All of its objects must have been freed.
+ */
+void kmem_cache_destroy(kmem_cache_t *cache) {
+    if (cache == NULL || cache == &cache_cache) {
+        return;
+    }
+    
+    if (cache->num_active != 0) {
+        KLOG(KLOG_WARN, serial_puts("[SLAB] Warning: destroying cache '"),
+             serial_puts(cache->name), serial_puts("' with live objects\n"));
+    }
+    
+    /* Release every slab regardless of state */
+    kmem_slab_t **lists[3] = { &cache->partial, &cache->full, &cache->empty };
+    for (uint32_t i = 0; i < 3; i++) {
+        while (*lists[i] != NULL) {
+            kmem_slab_t *slab = *lists[i];
+            slab_list_remove(lists[i], slab);
+            slab->magic = 0;
+            page_free(slab, 1);
+        }
+    }
+    
+    /* Unlink from the global cache list */
+    uint32_t flags = spin_lock_irqsave(&cache_list_lock);
+    kmem_cache_t **link = &cache_list;
+    while (*link != NULL && *link != cache) {
+        link = &(*link)->next;
+    }
+    if (*link == cache) {
+        *link = cache->next;
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+    
+    kmem_cache_free(&cache_cache, cache);
+}
+
+/*
+ * Push a slab onto the head of a slab list
+ */
+static void slab_list_push(kmem_slab_t **list, kmem_slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+/*
+ * Unlink a slab from a slab list
+ */
+static void slab_list_remove(kmem_slab_t **list, kmem_slab_t *slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+/*
+ * Get a fresh page, carve it into objects and run the constructor on each.
+ * Called with the cache locked.
+ */
+static kmem_slab_t *slab_grow(kmem_cache_t *cache) {
+    kmem_slab_t *slab = (kmem_slab_t *)page_alloc(1);
+    if (slab == NULL) {
+        KLOG(KLOG_ERROR, serial_puts("[SLAB] Failed to grow cache '"),
+             serial_puts(cache->name), serial_puts("'\n"));
+        return NULL;
+    }
+    
+    slab->cache = cache;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->in_use = 0;
+    slab->magic = KMEM_SLAB_MAGIC;
+    
+    /* Thread the free list in address order so early objects are hot */
+    uint8_t *first = (uint8_t*)slab + cache->first_offset;
+    void *free_head = NULL;
+    for (uint32_t i = cache->objects_per_slab; i > 0; i--) {
+        void *obj = first + (i - 1) * cache->slot_size;
+        if (cache->ctor != NULL) {
+            cache->ctor(obj);
+        }
+        *OBJ_LINK(cache, obj) = free_head;
+        free_head = obj;
+    }
+    slab->free_objects = free_head;
+    
+    cache->num_slabs++;
+    return slab;
+}
+
+/*
+ * Allocate one object from a cache
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    if (cache == NULL) {
+        return NULL;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+    kmem_slab_t *slab = cache->partial;
+    
+    if (slab == NULL) {
+        /* Reuse a cached empty slab before asking for a new page */
+        slab = cache->empty;
+        if (slab != NULL) {
+            slab_list_remove(&cache->empty, slab);
+            cache->num_empty--;
+        } else {
+            slab = slab_grow(cache);
+            if (slab == NULL) {
+                spin_unlock_irqrestore(&cache->lock, flags);
+                return NULL;
+            }
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+    
+    void *obj = slab->free_objects;
+    slab->free_objects = *OBJ_LINK(cache, obj);
+    slab->in_use++;
+    
+    if (slab->in_use == cache->objects_per_slab) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+    
+    cache->num_active++;
+    cache->total_allocs++;
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+/*
+ * Return an object to its cache
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (cache == NULL || obj == NULL) {
+        return;
+    }
+    
+    kmem_slab_t *slab = SLAB_OF(obj);
+    if (slab->magic != KMEM_SLAB_MAGIC || slab->cache != cache) {
+        KLOG(KLOG_WARN, serial_puts("[SLAB] Warning: object freed to wrong cache '"),
+             serial_puts(cache->name), serial_puts("'\n"));
+        return;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+    
+    /* A slab that was full becomes partial again */
+    if (slab->in_use == cache->objects_per_slab) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+    
+    *OBJ_LINK(cache, obj) = slab->free_objects;
+    slab->free_objects = obj;
+    slab->in_use--;
+    cache->num_active--;
+    
+    /* Fully free slab: keep a small reserve, return the rest */
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        
+        if (cache->num_empty < KMEM_MAX_EMPTY_SLABS) {
+            slab_list_push(&cache->empty, slab);
+            cache->num_empty++;
+        } else {
+            slab->magic = 0;
+            page_free(slab, 1);
+            cache->num_slabs--;
+        }
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/*
+ * Print statistics for every cache
+ */
+void kmem_cache_print_stats(void) {
+    serial_puts("\n=== Slab Caches ===\n");
+    serial_puts("Name              Size  Slot  Active  Total  Slabs\n");
+    serial_puts("----------------  ----  ----  ------  -----  -----\n");
+    
+    for (kmem_cache_t *c = cache_list; c != NULL; c = c->next) {
+        serial_puts(c->name);
+        for (uint32_t j = strlen(c->name); j < 18; j++) {
+            serial_puts(" ");
+        }
+        
+        if (c->object_size < 1000) serial_puts(" ");
+        if (c->object_size < 100) serial_puts(" ");
+        if (c->object_size < 10) serial_puts(" ");
+        serial_put_dec(c->object_size);
+        serial_puts("  ");
+        
+        if (c->slot_size < 1000) serial_puts(" ");
+        if (c->slot_size < 100) serial_puts(" ");
+        if (c->slot_size < 10) serial_puts(" ");
+        serial_put_dec(c->slot_size);
+        serial_puts("  ");
+        
+        serial_put_dec(c->num_active);
+        serial_puts("/");
+        serial_put_dec(c->num_slabs * c->objects_per_slab);
+        serial_puts("  ");
+        serial_put_dec(c->total_allocs);
+        serial_puts("  ");
+        serial_put_dec(c->num_slabs);
+        serial_puts("\n");
+    }
+    
+    serial_puts("===================\n\n");
+}
+
+/* Shell commands */
+
+/*
+ * slabstats: display slab cache statistics
+ */
+static int slab_cmd_slabstats(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    kmem_cache_print_stats();
+    return 0;
+}
+
+SHELL_COMMAND(slabstats, "slabstats", "slabstats", "Display slab cache statistics", slab_cmd_slabstats);
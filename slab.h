@@ -0,0 +1,78 @@
+/* slab.h - Slab / Object Cache Allocator Interface */
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "types.h"
+#include "spinlock.h"
+
+/*
+ * An object cache hands out fixed-size objects carved from page-sized
+ * slabs. Each slab keeps its own free list, so allocation and free are
+ * constant time and objects of one kind stay packed together in memory.
+ *
+ * Every slab is one page, page-aligned, with its descriptor at the start
+ * of the page: kmem_cache_free() finds the owning slab by masking the
+ * object address.
+ *
+ * Each cache has its own lock. A constructor runs with it held, so it
+ * must not allocate from the same cache.
+ */
+
+/* Optional constructor, run once when an object is first carved from a slab.
+ * Objects handed back with kmem_cache_free() are expected to be returned in
+ * their constructed state, so the constructor does not run again on reuse. */
+typedef void (*kmem_ctor_t)(void *obj);
+
+typedef struct kmem_slab kmem_slab_t;
+
+/* Slab descriptor - lives at the start of every slab page */
+struct kmem_slab {
+    struct kmem_cache *cache;       /* Owning cache */
+    kmem_slab_t *next;              /* Next slab in the cache list */
+    kmem_slab_t *prev;              /* Previous slab in the cache list */
+    void *free_objects;             /* Free objects inside this slab */
+    uint32_t in_use;                /* Objects currently allocated */
+    uint32_t magic;                 /* KMEM_SLAB_MAGIC while owned by a cache */
+};
+
+/* Object cache descriptor */
+typedef struct kmem_cache {
+    const char *name;               /* Cache name (for statistics) */
+    size_t object_size;             /* Size requested by the user */
+    size_t slot_size;               /* Object (plus free link with a ctor), aligned */
+    size_t link_offset;             /* Offset of the free link in a slot */
+    size_t first_offset;            /* Offset of the first object in a slab */
+    uint32_t objects_per_slab;      /* Objects that fit in one slab */
+    kmem_ctor_t ctor;               /* Optional constructor */
+    spinlock_t lock;                /* Slab lists and counters below */
+
+    kmem_slab_t *partial;           /* Slabs with some free objects */
+    kmem_slab_t *full;              /* Slabs with no free objects */
+    kmem_slab_t *empty;             /* Fully free slabs kept for reuse */
+
+    uint32_t num_slabs;             /* Slabs owned by this cache */
+    uint32_t num_empty;             /* Slabs on the empty list */
+    uint32_t num_active;            /* Objects currently allocated */
+    uint32_t total_allocs;          /* Lifetime allocation count */
+
+    struct kmem_cache *next;        /* Next cache in the global list */
+} kmem_cache_t;
+
+#define KMEM_SLAB_MAGIC     0x51AB51AB
+#define KMEM_MAX_EMPTY_SLABS 1      /* Empty slabs kept per cache */
+
+/* Slab allocator initialization */
+void slab_init(void);
+
+/* Cache management */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align, kmem_ctor_t ctor);
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+/* Object allocation */
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/* Statistics */
+void kmem_cache_print_stats(void);
+
+#endif /* SLAB_H */
@@ -0,0 +1,558 @@
+/* smp.c - Multiprocessor bring-up and the local APIC */
+#include "smp.h"
+#include "cpu.h"
+#include "buddy.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "serial.h"
+#include "string.h"
+#include "timer.h"
+#include "klog.h"
+#include "cycles.h"
+#include "paging.h"
+#include "shell.h"
+
+/* Local APIC registers, as byte offsets from its MMIO base */
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080   /* Task priority */
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0   /* Spurious vector; bit 8 enables the APIC */
+#define LAPIC_ICR_LOW       0x300   /* Interrupt command */
+#define LAPIC_ICR_HIGH      0x310   /* Destination APIC ID in bits 24-31 */
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_TIMER_INIT    0x380   /* Initial count */
+#define LAPIC_TIMER_COUNT   0x390   /* Current count */
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_LVT_MASKED    0x10000
+#define LAPIC_LVT_PERIODIC  0x20000
+#define LAPIC_LVT_EXTINT    0x700   /* LINT0: the PIC in virtual-wire mode */
+#define LAPIC_LVT_NMI       0x400
+#define LAPIC_DIVIDE_16     0x3
+#define LAPIC_ICR_INIT      0x4500  /* INIT, level assert */
+#define LAPIC_ICR_STARTUP   0x4600  /* Start-up IPI; vector = page number */
+#define LAPIC_ICR_FIXED     0x4000  /* Fixed delivery, level assert */
+#define LAPIC_ICR_PENDING   0x1000  /* Delivery status */
+
+#define LAPIC_CALIBRATE_US  10000
+
+/* MP specification tables */
+typedef struct __attribute__((packed)) {
+    char signature[4];              /* "_MP_" */
+    uint32_t config;                /* Physical address of the config table */
+    uint8_t length;                 /* In 16-byte units */
+    uint8_t revision;
+    uint8_t checksum;
+    uint8_t feature[5];
+} mp_floating_t;
+
+typedef struct __attribute__((packed)) {
+    char signature[4];              /* "PCMP" */
+    uint16_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[8];
+    char product[12];
+    uint32_t oem_table;
+    uint16_t oem_size;
+    uint16_t entry_count;
+    uint32_t lapic_address;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} mp_config_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;                   /* MP_ENTRY_PROCESSOR */
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;                  /* MP_CPU_* */
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} mp_processor_t;
+
+#define MP_ENTRY_PROCESSOR  0
+#define MP_PROCESSOR_SIZE   20      /* Every other entry type is 8 bytes */
+#define MP_CPU_ENABLED      0x01
+
+/* Trampoline (smp_boot.S) and the AP entry it calls */
+extern uint8_t ap_trampoline[];
+extern uint8_t ap_trampoline_stack[];
+extern uint8_t ap_trampoline_end[];
+void smp_ap_main(void);
+
+static volatile uint32_t *lapic = NULL;
+static cpu_t cpus[MAX_CPUS];                    /* Online CPUs, in start-up order */
+static uint32_t cpu_found = 1;                  /* Listed in the MP table */
+static volatile uint32_t cpu_online = 1;
+static uint8_t ap_apic_ids[MAX_CPUS];           /* Listed APs, waiting to start */
+static uint8_t apic_to_cpu[256];
+static uint32_t lapic_timer_count = 0;          /* Initial count for one tick */
+static uint32_t boot_cr0 = 0;                   /* Copied onto each AP */
+static uint32_t boot_cr4 = 0;
+
+/* Forward declarations for internal functions */
+static uint32_t lapic_read(uint32_t reg);
+static void lapic_write(uint32_t reg, uint32_t value);
+static void lapic_enable(uint32_t lint0);
+static void lapic_send_ipi(uint32_t apic_id, uint32_t command);
+static void lapic_calibrate(void);
+static uint16_t bda_read16(uint32_t addr);
+static mp_floating_t *mp_find(void);
+static mp_floating_t *mp_scan(uint32_t base, uint32_t length);
+static uint8_t mp_checksum(const void *data, uint32_t length);
+static void mp_read_config(mp_config_t *config);
+static int smp_start_ap(uint32_t apic_id);
+static void ap_idle_loop(void);
+static void lapic_timer_handler(interrupt_frame_t *frame);
+static void lapic_wakeup_handler(interrupt_frame_t *frame);
+
+/*
+ * Local APIC register access
+ */
+static uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+    (void)lapic[LAPIC_ID / 4];      /* Read back: the write has landed */
+}
+
+/*
+ * Acknowledge the interrupt in service
+ */
+void lapic_eoi(void) {
+    if (lapic != NULL) {
+        lapic_write(LAPIC_EOI, 0);
+    }
+}
+
+/*
+ * Software-enable this CPU's local APIC with the local timer masked
+ */
+static void lapic_enable(uint32_t lint0) {
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_LVT_LINT0, lint0);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapic_write(LAPIC_TPR, 0);
+}
+
+/*
+ * Send an IPI and wait until the local APIC has delivered it. Interrupts
+ * stay off in between, so a handler sending one cannot run between the
+ * destination and command writes.
+ */
+static void lapic_send_ipi(uint32_t apic_id, uint32_t command) {
+    uint32_t flags = irq_save();
+    
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile ("pause");
+    }
+    irq_restore(flags);
+}
+
+/*
+ * Count local APIC timer decrements over a PIT-timed interval and derive
+ * the initial count for one scheduler tick. Every CPU shares the bus
+ * clock, so the boot CPU's figure holds for all of them.
+ */
+static void lapic_calibrate(void) {
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    timer_busy_wait_us(LAPIC_CALIBRATE_US);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_COUNT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    
+    uint64_t per_second = (uint64_t)elapsed * (1000000 / LAPIC_CALIBRATE_US);
+    lapic_timer_count = (uint32_t)cycles_div(per_second, timer_get_hz());
+}
+
+/*
+ * Read a BIOS data area word. The address goes through a register so the
+ * compiler does not take it for a null-page dereference.
+ */
+static uint16_t bda_read16(uint32_t addr) {
+    const volatile uint16_t *word;
+    
+    __asm__ ("" : "=r"(word) : "0"(addr));
+    return *word;
+}
+
+/*
+ * Look for the MP floating pointer where the specification puts it: the
+ * first KB of the EBDA, the last KB of base memory, then the BIOS ROM
+ */
+static mp_floating_t *mp_find(void) {
+    uint32_t ebda = (uint32_t)bda_read16(0x40E) << 4;
+    uint32_t base_kb = bda_read16(0x413);
+    mp_floating_t *mp = NULL;
+    
+    if (ebda != 0) {
+        mp = mp_scan(ebda, 1024);
+    }
+    if (mp == NULL && base_kb != 0) {
+        mp = mp_scan(base_kb * 1024 - 1024, 1024);
+    }
+    if (mp == NULL) {
+        mp = mp_scan(0xF0000, 0x10000);
+    }
+    return mp;
+}
+
+/*
+ * Search one range on 16-byte boundaries
+ */
+static mp_floating_t *mp_scan(uint32_t base, uint32_t length) {
+    for (uint32_t addr = base; addr + sizeof(mp_floating_t) <= base + length; addr += 16) {
+        mp_floating_t *mp = (mp_floating_t *)addr;
+        
+        if (memcmp(mp->signature, "_MP_", 4) == 0 &&
+            mp_checksum(mp, sizeof(mp_floating_t)) == 0) {
+            return mp;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Byte sum; a valid MP structure sums to zero
+ */
+static uint8_t mp_checksum(const void *data, uint32_t length) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint8_t sum = 0;
+    
+    for (uint32_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+/*
+ * Collect the APIC IDs of the enabled processors other than this one
+ */
+static void mp_read_config(mp_config_t *config) {
+    uint8_t *entry = (uint8_t *)(config + 1);
+    uint8_t *end = (uint8_t *)config + config->length;
+    uint32_t bsp_apic = lapic_read(LAPIC_ID) >> 24;
+    
+    cpus[0].apic_id = bsp_apic;
+    
+    for (uint32_t i = 0; i < config->entry_count && entry < end; i++) {
+        if (*entry != MP_ENTRY_PROCESSOR) {
+            entry += 8;
+            continue;
+        }
+        
+        mp_processor_t *proc = (mp_processor_t *)entry;
+        entry += MP_PROCESSOR_SIZE;
+        
+        if (!(proc->flags & MP_CPU_ENABLED) || proc->apic_id == bsp_apic) {
+            continue;
+        }
+        if (cpu_found == MAX_CPUS) {
+            KLOG(KLOG_WARN, serial_puts("[SMP] More than "), serial_put_dec(MAX_CPUS),
+                 serial_puts(" CPUs, ignoring the rest\n"));
+            break;
+        }
+        
+        ap_apic_ids[cpu_found++] = proc->apic_id;
+    }
+}
+
+/*
+ * Find and start the other processors. Stays uniprocessor without a
+ * local APIC or an MP table.
+ */
+void smp_init(void) {
+    cpus[0].id = 0;
+    
+    if (!(cpu_features_edx() & CPUID_FEAT_EDX_APIC)) {
+        KLOG(KLOG_INFO, serial_puts("[SMP] No local APIC, running on one CPU\n"));
+        return;
+    }
+    
+    mp_floating_t *mp = mp_find();
+    if (mp == NULL || mp->config == 0) {
+        KLOG(KLOG_INFO, serial_puts("[SMP] No MP configuration table, running on one CPU\n"));
+        return;
+    }
+    
+    /* The table may sit at the top of memory, past the RAM paging maps */
+    mp_config_t *config = (mp_config_t *)mp->config;
+    if (paging_map_range(mp->config, sizeof(mp_config_t), 0) != 0 ||
+        paging_map_range(mp->config, config->length, 0) != 0 ||
+        memcmp(config->signature, "PCMP", 4) != 0 ||
+        mp_checksum(config, config->length) != 0) {
+        KLOG(KLOG_WARN, serial_puts("[SMP] Bad MP configuration table, running on one CPU\n"));
+        return;
+    }
+    
+    if (paging_map_range(config->lapic_address, PAGE_SIZE, PAGE_MMIO) != 0) {
+        KLOG(KLOG_WARN, serial_puts("[SMP] Cannot map the local APIC, running on one CPU\n"));
+        return;
+    }
+    lapic = (volatile uint32_t *)config->lapic_address;
+    mp_read_config(config);
+    apic_to_cpu[cpus[0].apic_id] = 0;
+    
+    /* The PIC keeps interrupting the boot CPU through LINT0 */
+    lapic_enable(LAPIC_LVT_EXTINT);
+    lapic_calibrate();
+    local_vector_register(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+    local_vector_register(LAPIC_WAKEUP_VECTOR, lapic_wakeup_handler);
+    
+    boot_cr0 = read_cr0();
+    boot_cr4 = read_cr4();
+    memcpy((void *)AP_TRAMPOLINE_BASE, ap_trampoline, ap_trampoline_end - ap_trampoline);
+    
+    for (uint32_t i = 1; i < cpu_found; i++) {
+        if (!smp_start_ap(ap_apic_ids[i])) {
+            KLOG(KLOG_WARN, serial_puts("[SMP] APIC "), serial_put_dec(ap_apic_ids[i]),
+                 serial_puts(" did not start\n"));
+        }
+    }
+    
+    KLOG(KLOG_INFO, serial_puts("[SMP] "), serial_put_dec(cpu_online), serial_puts(" of "),
+         serial_put_dec(cpu_found), serial_puts(" CPUs online\n"));
+}
+
+/*
+ * INIT, then two start-up IPIs pointing at the trampoline; wait up to
+ * 100ms for the AP to report in. It takes the next free CPU index. CPUs
+ * are started one at a time, so the trampoline's single stack slot is
+ * enough.
+ */
+static int smp_start_ap(uint32_t apic_id) {
+    cpu_t *cpu = &cpus[cpu_online];
+    uint8_t *stack = (uint8_t *)buddy_alloc(AP_STACK_ORDER);
+    if (stack == NULL) {
+        return 0;
+    }
+    
+    cpu->id = cpu_online;
+    cpu->apic_id = apic_id;
+    apic_to_cpu[apic_id] = (uint8_t)cpu->id;
+    
+    uint32_t *stack_slot = (uint32_t *)(AP_TRAMPOLINE_BASE + (ap_trampoline_stack - ap_trampoline));
+    *stack_slot = (uint32_t)stack + (PAGE_SIZE << AP_STACK_ORDER);
+    
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT);
+    timer_busy_wait_us(10000);
+    for (uint32_t i = 0; i < 2; i++) {
+        lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE_BASE >> 12));
+        timer_busy_wait_us(200);
+    }
+    
+    for (uint32_t ms = 0; ms < 100 && cpu_online == cpu->id; ms++) {
+        timer_busy_wait_us(1000);
+    }
+    if (cpu_online == cpu->id) {
+        lapic_send_ipi(apic_id, LAPIC_ICR_INIT);    /* Park it again */
+        buddy_free(stack, AP_STACK_ORDER);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * First C code on an AP, on the stack smp_start_ap() gave it
+ */
+void smp_ap_main(void) {
+    /* Same paging as the boot CPU: PSE and PGE first, then CR3, then PG */
+    write_cr4(boot_cr4);
+    paging_load();
+    write_cr0(boot_cr0);
+    
+    cpu_t *cpu = &cpus[apic_to_cpu[lapic_read(LAPIC_ID) >> 24]];
+    percpu_init(cpu->id);
+    idt_load();
+    lapic_enable(LAPIC_LVT_MASKED);
+    
+    /* The boot CPU waits for the count before starting the next one */
+    __atomic_fetch_add(&cpu_online, 1, __ATOMIC_SEQ_CST);
+    
+    KLOG(KLOG_INFO, serial_puts("[SMP] CPU "), serial_put_dec(cpu->id),
+         serial_puts(" online (APIC "), serial_put_dec(cpu->apic_id), serial_puts(")\n"));
+    ap_idle_loop();
+}
+
+/*
+ * An AP's null context. It keeps its local timer ticking while it has a
+ * process to run (its own or one stolen from a busier CPU) and halts
+ * with the timer stopped otherwise, until a wakeup IPI arrives. Before
+ * halting it frees a batch of terminated processes.
+ *
+ * Going idle publishes the flag before looking at the queues once more.
+ * A CPU queueing work looks at the flag after its enqueue (smp_wake_cpu()),
+ * so at least one of the two sees the other and the work is not left
+ * waiting behind a halted CPU.
+ */
+static void ap_idle_loop(void) {
+    cpu_t *cpu = &cpus[smp_cpu_id()];
+    
+    for (;;) {
+        uint8_t busy = scheduler_cpu_busy();
+        
+        if (!busy) {
+            process_reap(PROC_REAP_BATCH);
+        }
+        
+        smp_set_local_timer(busy);
+        __atomic_store_n(&cpu->idle, !busy, __ATOMIC_SEQ_CST);
+        if (busy || !scheduler_cpu_busy()) {
+            smp_halt();
+        }
+        cpu->idle = 0;
+    }
+}
+
+/*
+ * Start or stop this AP's periodic scheduler tick
+ */
+void smp_set_local_timer(uint8_t enable) {
+    cpu_t *cpu = &cpus[smp_cpu_id()];
+    
+    if (lapic == NULL || cpu->id == 0 || cpu->timer_running == enable) {
+        return;
+    }
+    
+    cpu->timer_running = enable;
+    if (enable) {
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_PERIODIC | LAPIC_TIMER_VECTOR);
+        lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+    } else {
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+        lapic_write(LAPIC_TIMER_INIT, 0);
+    }
+}
+
+/*
+ * Local timer: one scheduler tick for this AP's run queue
+ */
+static void lapic_timer_handler(interrupt_frame_t *frame) {
+    (void)frame;
+    
+    cpus[smp_cpu_id()].local_ticks++;
+    scheduler_cpu_tick();
+}
+
+/*
+ * Wakeup IPI: nothing to do here, the idle loop looks at its queue again
+ */
+static void lapic_wakeup_handler(interrupt_frame_t *frame) {
+    (void)frame;
+    
+    cpus[smp_cpu_id()].wakeups++;
+}
+
+/*
+ * CPUs running kernel code
+ */
+uint32_t smp_cpu_count(void) {
+    return cpu_online;
+}
+
+/*
+ * CPU table entry, NULL past the last one found
+ */
+cpu_t *smp_get_cpu(uint32_t id) {
+    return (id < cpu_online) ? &cpus[id] : NULL;
+}
+
+/*
+ * Wake another CPU that halted with nothing to do. The exchange orders
+ * the caller's enqueue before the read of the flag (see ap_idle_loop()),
+ * and only one of several wakers sends the IPI.
+ */
+void smp_wake_cpu(uint32_t id) {
+    if (id < cpu_online && id != smp_cpu_id() &&
+        __atomic_exchange_n(&cpus[id].idle, 0, __ATOMIC_SEQ_CST)) {
+        lapic_send_ipi(cpus[id].apic_id, LAPIC_ICR_FIXED | LAPIC_WAKEUP_VECTOR);
+    }
+}
+
+/*
+ * Wake one idle CPU so it can steal from the queues
+ */
+void smp_kick_idle(void) {
+    uint32_t self = smp_cpu_id();
+    
+    if (!timer_is_scheduling()) {
+        return;                     /* Manual ticks: nobody steals */
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (uint32_t id = 1; id < cpu_online; id++) {
+        if (id != self && cpus[id].idle) {
+            smp_wake_cpu(id);
+            return;
+        }
+    }
+}
+
+/*
+ * Halt until the next interrupt, which is taken right away
+ */
+void smp_halt(void) {
+    __asm__ volatile ("sti; hlt; cli" : : : "memory");
+}
+
+/*
+ * Print the CPU table
+ */
+void smp_print_cpus(void) {
+    serial_puts("\n=== CPUs ===\n");
+    serial_puts("CPU  APIC  State    Ready  Local Ticks  Wakeups\n");
+    serial_puts("---  ----  -------  -----  -----------  -------\n");
+    
+    for (uint32_t id = 0; id < cpu_online; id++) {
+        cpu_t *cpu = &cpus[id];
+        const char *state = cpu->idle ? "idle" : "busy";
+        
+        if (id < 10) serial_puts(" ");
+        serial_put_dec(id);
+        serial_puts("   ");
+        
+        serial_put_dec(cpu->apic_id);
+        for (uint32_t n = 1000; n > 1 && cpu->apic_id < n; n /= 10) serial_puts(" ");
+        serial_puts("  ");
+        
+        serial_puts(state);
+        for (uint32_t j = strlen(state); j < 9; j++) serial_puts(" ");
+        
+        uint32_t ready = process_ready_count(id);
+        serial_put_dec(ready);
+        for (uint32_t n = 10000; n > 1 && ready < n; n /= 10) serial_puts(" ");
+        serial_puts("  ");
+        
+        serial_put_dec(cpu->local_ticks);
+        for (uint32_t n = 1000000000; n > 1 && cpu->local_ticks < n; n /= 10) serial_puts(" ");
+        serial_puts("   ");
+        
+        serial_put_dec(cpu->wakeups);
+        serial_puts("\n");
+    }
+    serial_puts("============\n\n");
+}
+
+/* Shell commands */
+
+/*
+ * cpus: show CPUs and their run queues
+ */
+static int smp_cmd_cpus(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    
+    smp_print_cpus();
+    return 0;
+}
+
+SHELL_COMMAND(cpus, "cpus", "cpus", "Show CPUs and their run queues", smp_cmd_cpus);
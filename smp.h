@@ -0,0 +1,66 @@
+/* smp.h - Multiprocessor bring-up and the local APIC */
+#ifndef SMP_H
+#define SMP_H
+
+#include "types.h"
+#include "idt.h"
+#include "percpu.h"
+
+/*
+ * The boot CPU finds the other processors in the BIOS MP table and starts
+ * each one with the local APIC INIT/SIPI/SIPI sequence. An application
+ * processor (AP) enters through a real-mode trampoline copied below 1MB,
+ * loads the kernel's GDT and IDT and becomes a scheduler CPU with its own
+ * run queue, null context and local APIC timer.
+ *
+ * CPUs are numbered in start-up order; the boot CPU is 0. Each one finds
+ * its number in its per-CPU area (percpu.h). Shared kernel state is
+ * guarded by the spinlock of the subsystem that owns it (spinlock.h).
+ */
+
+#define MAX_CPUS                16
+
+/* Local APIC vectors */
+#define LAPIC_TIMER_VECTOR      (LOCAL_BASE_VECTOR + 0)     /* Scheduler tick on an AP */
+#define LAPIC_WAKEUP_VECTOR     (LOCAL_BASE_VECTOR + 1)     /* IPI: queue changed, look again */
+#define LAPIC_SPURIOUS_VECTOR   (LOCAL_BASE_VECTOR + 15)    /* Low four bits set for P6 APICs */
+
+/* Where the AP trampoline is copied; SIPI vector = address >> 12 */
+#define AP_TRAMPOLINE_BASE      0x7000
+#define AP_STACK_ORDER          2       /* 16KB null-context stack per AP */
+
+typedef struct cpu {
+    uint32_t id;                    /* Index into the CPU table */
+    uint32_t apic_id;               /* Local APIC ID */
+    volatile uint8_t idle;          /* Halted with nothing to run */
+    uint8_t timer_running;          /* Local APIC timer armed */
+    uint32_t wakeups;               /* Wakeup IPIs received */
+    uint32_t local_ticks;           /* Local APIC timer interrupts */
+} cpu_t;
+
+/* Start every CPU the MP table lists; uniprocessor without one */
+void smp_init(void);
+
+/* This CPU, and how many are online */
+static inline uint32_t smp_cpu_id(void) {
+    return this_cpu_read(cpu_id);
+}
+uint32_t smp_cpu_count(void);
+cpu_t *smp_get_cpu(uint32_t id);
+
+/* Wake cpu if it is idle, or the first idle CPU other than this one */
+void smp_wake_cpu(uint32_t id);
+void smp_kick_idle(void);
+
+/* An AP's local scheduler tick on or off */
+void smp_set_local_timer(uint8_t enable);
+
+/* Acknowledge a local APIC interrupt */
+void lapic_eoi(void);
+
+/* Halt until an interrupt; called and returns with interrupts off */
+void smp_halt(void);
+
+void smp_print_cpus(void);
+
+#endif /* SMP_H */
@@ -0,0 +1,69 @@
+/* spinlock.h - Ticket spinlocks */
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "types.h"
+#include "cpu.h"
+
+/*
+ * A ticket lock hands out tickets in arrival order and serves them in
+ * the same order, so a waiting CPU cannot be overtaken forever the way
+ * it can on a plain test-and-set lock. Each waiter spins reading owner
+ * until its own number comes up.
+ *
+ * Locks are not recursive. Code that an interrupt handler can reach takes
+ * its lock with spin_lock_irqsave(), otherwise the handler could spin on
+ * a lock its own CPU already holds.
+ */
+
+typedef struct {
+    volatile uint16_t next;         /* Next ticket to hand out */
+    volatile uint16_t owner;        /* Ticket being served */
+} spinlock_t;
+
+#define SPINLOCK_INIT   { 0, 0 }
+
+static inline void spin_lock_init(spinlock_t *lock) {
+    lock->next = 0;
+    lock->owner = 0;
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        __asm__ volatile ("pause");
+    }
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+/* Take the lock only if nobody holds or waits for it; 1 on success */
+static inline int spin_trylock(spinlock_t *lock) {
+    uint16_t ticket = lock->owner;
+    uint16_t expected = ticket;
+    
+    return __atomic_compare_exchange_n(&lock->next, &expected, (uint16_t)(ticket + 1), 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* Whether anyone holds the lock (for assertions and diagnostics) */
+static inline int spin_is_locked(spinlock_t *lock) {
+    return lock->next != lock->owner;
+}
+
+/* Disable interrupts, then lock; pair with spin_unlock_irqrestore() */
+static inline uint32_t spin_lock_irqsave(spinlock_t *lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif /* SPINLOCK_H */
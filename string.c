@@ -1,5 +1,47 @@
 /* string.c - String utility implementations */
 #include "string.h"
+#include "cpu.h"
+#include "serial.h"
+
+/*
+ * Copies and fills below this size stay byte-at-a-time: aligning and
+ * setting up a string instruction costs more than it saves.
+ */
+#define STRING_WORD_THRESHOLD   16
+
+/* Word type allowed to alias any object, for the word-at-a-time loops */
+typedef uint32_t __attribute__((may_alias)) string_word_t;
+
+#if STRING_SSE2
+/*
+ * SSE2 bulk copy for large blocks. XMM registers are not part of the saved
+ * process context, so each burst runs with interrupts off and is bounded
+ * to keep interrupt latency short.
+ */
+#define STRING_SSE2_THRESHOLD   512
+#define STRING_SSE2_BURST       4096
+
+static int sse2_enabled = 0;
+#endif
+
+/*
+ * Detect optional CPU features used by the memory routines
+ */
+void string_init(void) {
+#if STRING_SSE2
+    uint32_t features = cpu_features_edx();
+    
+    if ((features & CPUID_FEAT_EDX_SSE2) && (features & CPUID_FEAT_EDX_FXSR)) {
+        /* Allow SSE instructions: no x87 emulation, OS supports FXSR/XMM */
+        write_cr0((read_cr0() & ~CR0_EM) | CR0_MP);
+        write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+        sse2_enabled = 1;
+        serial_puts("[STRING] SSE2 block copies enabled\n");
+    } else {
+        serial_puts("[STRING] SSE2 not available, using rep movsd\n");
+    }
+#endif
+}
 
 size_t strlen(const char* str) {
     size_t len = 0;
@@ -23,23 +65,153 @@ char* strcpy(char* dest, const char* src) {
     return original_dest;
 }
 
+#if STRING_SSE2
+/*
+ * Copy 64-byte lines with unaligned loads and aligned stores.
+ * The destination must be 16-byte aligned.
+ */
+static void sse2_copy_lines(uint8_t* d, const uint8_t* s, size_t lines) {
+    while (lines > 0) {
+        size_t burst = lines;
+        if (burst > STRING_SSE2_BURST / 64) {
+            burst = STRING_SSE2_BURST / 64;
+        }
+        lines -= burst;
+        
+        uint32_t flags = irq_save();
+        for (; burst > 0; burst--) {
+            __asm__ volatile (
+                "movdqu   (%1), %%xmm0\n\t"
+                "movdqu 16(%1), %%xmm1\n\t"
+                "movdqu 32(%1), %%xmm2\n\t"
+                "movdqu 48(%1), %%xmm3\n\t"
+                "movdqa %%xmm0,   (%0)\n\t"
+                "movdqa %%xmm1, 16(%0)\n\t"
+                "movdqa %%xmm2, 32(%0)\n\t"
+                "movdqa %%xmm3, 48(%0)\n\t"
+                : : "r"(d), "r"(s)
+                : "memory");  /* No XMM clobbers: the compiler never uses them */
+            d += 64;
+            s += 64;
+        }
+        irq_restore(flags);
+    }
+}
+#endif
+
 void* memcpy(void* dest, const void* src, size_t n) {
-    unsigned char* d = (unsigned char*)dest;
-    const unsigned char* s = (const unsigned char*)src;
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    
+    if (n >= STRING_WORD_THRESHOLD) {
+#if STRING_SSE2
+        if (sse2_enabled && n >= STRING_SSE2_THRESHOLD) {
+            /* Bytes up to a 16-byte destination boundary, then whole lines */
+            size_t lead = -(uint32_t)d & 15;
+            n -= lead;
+            __asm__ volatile ("rep movsb"
+                              : "+D"(d), "+S"(s), "+c"(lead) : : "memory");
+            
+            sse2_copy_lines(d, s, n >> 6);
+            d += n & ~63u;
+            s += n & ~63u;
+            n &= 63;
+        }
+#endif
+        /* Byte head until the destination is word aligned, then dwords */
+        size_t head = -(uint32_t)d & 3;
+        n -= head;
+        size_t words = n >> 2;
+        n &= 3;
+        __asm__ volatile ("rep movsb\n\t"
+                          "mov %3, %%ecx\n\t"
+                          "rep movsl"
+                          : "+D"(d), "+S"(s), "+c"(head)
+                          : "r"(words)
+                          : "memory");
+    }
+    
+    __asm__ volatile ("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+    return dest;
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    
+    /* A forward copy is safe unless dest starts inside the source */
+    if (d <= s || d >= s + n) {
+        return memcpy(dest, src, n);
+    }
     
+    /* Overlapping with dest above src: copy backwards from the end */
+    d += n;
+    s += n;
+    if (n >= STRING_WORD_THRESHOLD) {
+        size_t tail = (uint32_t)d & 3;
+        n -= tail;
+        while (tail--) {
+            *--d = *--s;
+        }
+        while (n >= 4) {
+            d -= 4;
+            s -= 4;
+            *(string_word_t*)d = *(const string_word_t*)s;
+            n -= 4;
+        }
+    }
     while (n--) {
-        *d++ = *s++;
+        *--d = *--s;
     }
     
     return dest;
 }
 
 void* memset(void* s, int c, size_t n) {
-    unsigned char* p = (unsigned char*)s;
+    uint8_t* p = (uint8_t*)s;
     
-    while (n--) {
-        *p++ = (unsigned char)c;
+    if (n >= STRING_WORD_THRESHOLD) {
+        uint32_t pattern = (uint8_t)c * 0x01010101u;
+        size_t head = -(uint32_t)p & 3;
+        n -= head;
+        size_t words = n >> 2;
+        n &= 3;
+        __asm__ volatile ("rep stosb\n\t"
+                          "mov %2, %%ecx\n\t"
+                          "rep stosl"
+                          : "+D"(p), "+c"(head)
+                          : "r"(words), "a"(pattern)
+                          : "memory");
     }
     
+    __asm__ volatile ("rep stosb" : "+D"(p), "+c"(n) : "a"(c) : "memory");
+    return s;
+}
+
+void* memset32(void* s, uint32_t value, size_t count) {
+    uint32_t* p = (uint32_t*)s;
+    __asm__ volatile ("rep stosl" : "+D"(p), "+c"(count) : "a"(value) : "memory");
     return s;
 }
+
+int memcmp(const void* s1, const void* s2, size_t n) {
+    const uint8_t* a = (const uint8_t*)s1;
+    const uint8_t* b = (const uint8_t*)s2;
+    
+    /* Skip equal words quickly; fall through to bytes to find the difference */
+    while (n >= 4 && *(const string_word_t*)a == *(const string_word_t*)b) {
+        a += 4;
+        b += 4;
+        n -= 4;
+    }
+    
+    while (n--) {
+        if (*a != *b) {
+            return *a - *b;
+        }
+        a++;
+        b++;
+    }
+    
+    return 0;
+}
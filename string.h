@@ -4,10 +4,20 @@
 
 #include "types.h"
 
+/* Build with STRING_SSE2=1 to use SSE2 for large copies on CPUs that have it */
+#ifndef STRING_SSE2
+#define STRING_SSE2 0
+#endif
+
+void string_init(void);
+
 size_t strlen(const char* str);
 int strcmp(const char* str1, const char* str2);
 char* strcpy(char* dest, const char* src);
 void* memcpy(void* dest, const void* src, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
 void* memset(void* s, int c, size_t n);
+void* memset32(void* s, uint32_t value, size_t count);
+int memcmp(const void* s1, const void* s2, size_t n);
 
-#endif
\ No newline at end of file
+#endif
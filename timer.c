@@ -0,0 +1,563 @@
+/* timer.c - Programmable Interval Timer (8253/8254) and timer wheel */
+#include "timer.h"
+#include "string.h"
+#include "idt.h"
+#include "io.h"
+#include "pic.h"
+#include "scheduler.h"
+#include "serial.h"
+#include "slab.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "shell.h"
+
+#define PIT_CHANNEL0        0x40
+#define PIT_COMMAND         0x43
+#define PIT_MODE_RATE_GEN   0x34    /* Channel 0, lobyte/hibyte, mode 2 */
+#define PIT_LATCH_COUNT     0x00    /* Channel 0 counter latch */
+#define PIT_MAX_COUNT       0xFFFF
+#define PIT_CHANNEL2        0x42
+#define PIT_MODE_ONESHOT2   0xB0    /* Channel 2, lobyte/hibyte, mode 0 */
+#define PIT_GATE_PORT       0x61    /* Bit 0: channel 2 gate, bit 1: speaker, bit 5: output */
+
+static volatile uint32_t timer_ticks = 0;
+static uint32_t timer_hz = 0;
+static uint32_t timer_divisor = 0;
+static volatile uint8_t timer_scheduling = 0;
+
+/* Tickless idle. idle_armed is the number of ticks the stretched PIT
+ * period ends on, 0 while the PIT runs at its regular rate. */
+static volatile uint32_t idle_armed = 0;
+static uint32_t idle_periods = 0;       /* Stretched periods armed */
+static uint32_t idle_ticks_saved = 0;   /* Ticks accounted without their own IRQ0 */
+
+/* Timer wheel. wheel_tick is the next tick whose slot has not run yet. */
+static timer_event_t *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+static uint32_t wheel_tick = 0;
+static uint32_t wheel_pending = 0;
+static spinlock_t wheel_lock = SPINLOCK_INIT;  /* Slots, wheel_tick, wheel_pending */
+static kmem_cache_t *timer_cache = NULL;
+
+#define WHEEL_INDEX(ticks, level) \
+    (((ticks) >> ((level) * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SIZE - 1))
+
+/* Forward declarations for internal functions */
+static void timer_irq_handler(interrupt_frame_t *frame);
+static void pit_set_period(uint32_t count);
+static uint32_t pit_read_count(void);
+static void timer_run_ticks(uint32_t ticks);
+static void wheel_insert(timer_event_t *event);
+static void wheel_unlink(timer_event_t *event);
+static uint32_t wheel_cascade(uint32_t level);
+static int wheel_disarm(timer_event_t *event);
+
+/*
+ * Program PIT channel 0 as a rate generator at hz and hook IRQ0
+ */
+void timer_init(uint32_t hz) {
+    if (hz < 19) {
+        hz = 19;                    /* Divisor must fit in 16 bits */
+    }
+    if (hz > PIT_BASE_FREQUENCY) {
+        hz = PIT_BASE_FREQUENCY;
+    }
+    
+    uint32_t divisor = (PIT_BASE_FREQUENCY + hz / 2) / hz;
+    timer_hz = hz;
+    timer_divisor = divisor;
+    timer_ticks = 0;
+    idle_armed = 0;
+    
+    pit_set_period(divisor);
+    
+    irq_register(TIMER_IRQ, timer_irq_handler);
+    
+    serial_puts("[TIMER] PIT running at ");
+    serial_put_dec(hz);
+    serial_puts(" Hz (divisor ");
+    serial_put_dec(divisor);
+    serial_puts(")\n");
+}
+
+/*
+ * Restart channel 0 as a rate generator with the given period
+ */
+static void pit_set_period(uint32_t count) {
+    outb(PIT_COMMAND, PIT_MODE_RATE_GEN);
+    outb(PIT_CHANNEL0, count & 0xFF);
+    outb(PIT_CHANNEL0, (count >> 8) & 0xFF);
+}
+
+/*
+ * PIT input clocks left in the current period
+ */
+static uint32_t pit_read_count(void) {
+    outb(PIT_COMMAND, PIT_LATCH_COUNT);
+    uint32_t low = inb(PIT_CHANNEL0);
+    uint32_t high = inb(PIT_CHANNEL0);
+    return (high << 8) | low;
+}
+
+/*
+ * Spin for us microseconds on PIT channel 2, leaving channel 0 and IRQ0
+ * alone. Used before interrupts run, e.g. between INIT and SIPI.
+ */
+void timer_busy_wait_us(uint32_t us) {
+    uint8_t gate = inb(PIT_GATE_PORT) & ~0x02;      /* Speaker stays off */
+    
+    while (us > 0) {
+        uint32_t chunk = (us > 50000) ? 50000 : us;
+        uint32_t count = chunk * (PIT_BASE_FREQUENCY / 1000) / 1000 + 1;
+        
+        outb(PIT_GATE_PORT, gate & ~0x01);          /* Gate low: counter holds */
+        outb(PIT_COMMAND, PIT_MODE_ONESHOT2);
+        outb(PIT_CHANNEL2, count & 0xFF);
+        outb(PIT_CHANNEL2, (count >> 8) & 0xFF);
+        outb(PIT_GATE_PORT, gate | 0x01);           /* Rising gate starts the count */
+        
+        while (!(inb(PIT_GATE_PORT) & 0x20)) {
+            __asm__ volatile ("pause");
+        }
+        us -= chunk;
+    }
+    outb(PIT_GATE_PORT, gate & ~0x01);
+}
+
+/*
+ * IRQ0: advance uptime and, when enabled, run one scheduler tick. The end
+ * of a stretched idle period stands for several ticks.
+ */
+static void timer_irq_handler(interrupt_frame_t *frame) {
+    (void)frame;
+    
+    uint32_t ticks = 1;
+    if (idle_armed != 0) {
+        ticks = idle_armed;
+        idle_armed = 0;
+        idle_ticks_saved += ticks - 1;
+        pit_set_period(timer_divisor);
+    }
+    
+    timer_run_ticks(ticks);
+}
+
+/*
+ * Account elapsed ticks to uptime and the scheduler
+ */
+static void timer_run_ticks(uint32_t ticks) {
+    timer_ticks += ticks;
+    
+    if (timer_scheduling) {
+        scheduler_advance(ticks);
+    }
+}
+
+/*
+ * Halt until the next interrupt; called with interrupts off. When nothing
+ * needs a tick before max_ticks have passed, the current PIT period is
+ * stretched to end on that tick (as far as the 16-bit counter reaches),
+ * so an idle CPU takes one IRQ0 instead of one per tick. An earlier
+ * interrupt settles the whole ticks that have passed and finishes the
+ * tick in progress, which keeps uptime on the original tick grid.
+ */
+void timer_idle(uint32_t max_ticks) {
+    if (TIMER_TICKLESS && max_ticks > 1 && timer_divisor != 0 && idle_armed == 0 &&
+        !pic_is_pending(TIMER_IRQ)) {
+        uint32_t remaining = pit_read_count();
+        uint32_t extra = (PIT_MAX_COUNT - remaining) / timer_divisor;
+        
+        if (extra > max_ticks - 1) {
+            extra = max_ticks - 1;
+        }
+        if (extra > 0) {
+            uint32_t period = remaining + extra * timer_divisor;
+            
+            pit_set_period(period);
+            idle_armed = extra + 1;
+            idle_periods++;
+            
+            smp_halt();
+            
+            /* Still armed: another device woke us. If IRQ0 is already
+             * pending its handler does the accounting instead. */
+            if (idle_armed != 0) {
+                uint32_t count = pit_read_count();
+                
+                if (!pic_is_pending(TIMER_IRQ)) {
+                    uint32_t elapsed = (timer_divisor - remaining) + (period - count);
+                    uint32_t ticks = elapsed / timer_divisor;
+                    uint32_t rest = timer_divisor - elapsed % timer_divisor;
+                    
+                    idle_armed = 1;
+                    idle_ticks_saved += ticks;
+                    pit_set_period(rest < 2 ? 2 : rest);
+                    timer_run_ticks(ticks);
+                }
+            }
+            return;
+        }
+    }
+    
+    smp_halt();
+}
+
+/*
+ * Enable or disable timer-driven scheduling
+ */
+void timer_set_scheduling(uint8_t enable) {
+    timer_scheduling = enable;
+    if (enable) {
+        smp_kick_idle();            /* Idle CPUs may steal from here on */
+    }
+    serial_puts("[TIMER] Timer-driven scheduling ");
+    serial_puts(enable ? "enabled" : "disabled");
+    serial_puts("\n");
+}
+
+/*
+ * Check whether IRQ0 drives the scheduler
+ */
+uint8_t timer_is_scheduling(void) {
+    return timer_scheduling;
+}
+
+/*
+ * Ticks since timer_init
+ */
+uint32_t timer_get_ticks(void) {
+    return timer_ticks;
+}
+
+/*
+ * Configured tick rate
+ */
+uint32_t timer_get_hz(void) {
+    return timer_hz;
+}
+
+/*
+ * Print timer status
+ */
+void timer_print_status(void) {
+    uint32_t ticks = timer_ticks;
+    
+    serial_puts("\n=== Timer ===\n");
+    serial_puts("Frequency:   ");
+    serial_put_dec(timer_hz);
+    serial_puts(" Hz\n");
+    
+    serial_puts("Uptime:      ");
+    serial_put_dec(ticks / timer_hz);
+    serial_puts(".");
+    uint32_t hundredths = (ticks % timer_hz) * 100 / timer_hz;
+    if (hundredths < 10) serial_puts("0");
+    serial_put_dec(hundredths);
+    serial_puts(" s (");
+    serial_put_dec(ticks);
+    serial_puts(" ticks)\n");
+    
+    serial_puts("Scheduling:  ");
+    serial_puts(timer_scheduling ? "timer-driven" : "manual (tick command)");
+    serial_puts("\n");
+    
+    serial_puts("Timers:      ");
+    serial_put_dec(wheel_pending);
+    serial_puts(" pending\n");
+    
+    serial_puts("Tickless:    ");
+    if (TIMER_TICKLESS) {
+        serial_put_dec(idle_periods);
+        serial_puts(" idle periods, ");
+        serial_put_dec(idle_ticks_saved);
+        serial_puts(" ticks without IRQ0\n");
+    } else {
+        serial_puts("off\n");
+    }
+    serial_puts("=============\n\n");
+}
+
+/*
+ * Empty the wheel and start counting from the given scheduler tick
+ */
+void timer_wheel_init(uint32_t now) {
+    for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (uint32_t slot = 0; slot < TIMER_WHEEL_SIZE; slot++) {
+            wheel[level][slot] = NULL;
+        }
+    }
+    wheel_tick = now + 1;
+    wheel_pending = 0;
+    
+    if (timer_cache == NULL) {
+        timer_cache = kmem_cache_create("timer_event", sizeof(timer_event_t), 0, NULL);
+    }
+}
+
+/*
+ * Link an event into the slot for its distance from wheel_tick. The
+ * wheel helpers are called with wheel_lock held.
+ */
+static void wheel_insert(timer_event_t *event) {
+    uint32_t delta = event->expires - wheel_tick;
+    uint32_t level;
+    
+    if ((int32_t)delta < 0) {
+        /* Already due: run with the next slot */
+        event->expires = wheel_tick;
+        level = 0;
+    } else if (delta >= (1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+        event->expires = wheel_tick + TIMER_MAX_TICKS;
+        level = TIMER_WHEEL_LEVELS - 1;
+    } else {
+        level = 0;
+        while (delta >= (1u << (TIMER_WHEEL_BITS * (level + 1)))) {
+            level++;
+        }
+    }
+    
+    timer_event_t **slot = &wheel[level][WHEEL_INDEX(event->expires, level)];
+    event->prev = NULL;
+    event->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->prev = event;
+    }
+    *slot = event;
+}
+
+/*
+ * Unlink an event from whichever slot holds it
+ */
+static void wheel_unlink(timer_event_t *event) {
+    if (event->prev != NULL) {
+        event->prev->next = event->next;
+    } else {
+        /* Head of its slot: find the slot from the expiry and level */
+        for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            timer_event_t **slot = &wheel[level][WHEEL_INDEX(event->expires, level)];
+            if (*slot == event) {
+                *slot = event->next;
+                break;
+            }
+        }
+    }
+    
+    if (event->next != NULL) {
+        event->next->prev = event->prev;
+    }
+    event->next = NULL;
+    event->prev = NULL;
+}
+
+/*
+ * Move the current slot of a level down to the levels below; returns the
+ * slot index, which is 0 when this level wrapped too
+ */
+static uint32_t wheel_cascade(uint32_t level) {
+    uint32_t index = WHEEL_INDEX(wheel_tick, level);
+    timer_event_t *event = wheel[level][index];
+    wheel[level][index] = NULL;
+    
+    while (event != NULL) {
+        timer_event_t *next = event->next;
+        wheel_insert(event);
+        event = next;
+    }
+    return index;
+}
+
+/*
+ * Take an event off the wheel if it is on it; returns whether it was
+ */
+static int wheel_disarm(timer_event_t *event) {
+    if (!event->pending) {
+        return 0;
+    }
+    wheel_unlink(event);
+    event->pending = 0;
+    wheel_pending--;
+    return 1;
+}
+
+/*
+ * Run every slot up to and including now. Events are taken off one at a
+ * time and the lock is dropped around each callback.
+ */
+void timer_wheel_advance(uint32_t now) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    
+    if (wheel_pending == 0) {
+        wheel_tick = now + 1;
+        spin_unlock_irqrestore(&wheel_lock, flags);
+        return;
+    }
+    
+    while ((int32_t)(now - wheel_tick) >= 0) {
+        uint32_t index = WHEEL_INDEX(wheel_tick, 0);
+        
+        /* Level 0 wrapped: pull the next stretch down from above */
+        if (index == 0) {
+            for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                if (wheel_cascade(level) != 0) {
+                    break;
+                }
+            }
+        }
+        
+        timer_event_t *event;
+        while ((event = wheel[0][index]) != NULL) {
+            /* The event may be freed or rearmed once the lock drops */
+            timer_callback_t callback = event->callback;
+            void *arg = event->arg;
+            
+            wheel_disarm(event);
+            if (event->allocated) {
+                kmem_cache_free(timer_cache, event);
+            }
+            
+            /* May add timers; those land in later slots */
+            spin_unlock(&wheel_lock);
+            callback(arg);
+            spin_lock(&wheel_lock);
+        }
+        wheel_tick++;
+    }
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
+
+/*
+ * Prepare a caller-owned event
+ */
+void timer_event_init(timer_event_t *event, timer_callback_t callback, void *arg) {
+    event->next = NULL;
+    event->prev = NULL;
+    event->expires = 0;
+    event->callback = callback;
+    event->arg = arg;
+    event->pending = 0;
+    event->allocated = 0;
+}
+
+/*
+ * (Re)arm an event to fire ticks scheduler ticks from now
+ */
+void timer_event_start(timer_event_t *event, uint32_t ticks) {
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    if (event->pending) {
+        wheel_unlink(event);
+    } else {
+        wheel_pending++;
+    }
+    
+    event->expires = scheduler_get_ticks() + ticks;
+    event->pending = 1;
+    wheel_insert(event);
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
+
+/*
+ * Disarm an event; harmless if it already fired
+ */
+void timer_event_cancel(timer_event_t *event) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    wheel_disarm(event);
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
+
+/*
+ * One-shot timer: call callback(arg) ticks scheduler ticks from now
+ */
+timer_event_t *timer_add(timer_callback_t callback, void *arg, uint32_t ticks) {
+    if (callback == NULL || timer_cache == NULL) {
+        return NULL;
+    }
+    
+    timer_event_t *timer = (timer_event_t *)kmem_cache_alloc(timer_cache);
+    if (timer == NULL) {
+        return NULL;
+    }
+    
+    timer_event_init(timer, callback, arg);
+    timer->allocated = 1;
+    timer_event_start(timer, ticks);
+    return timer;
+}
+
+/*
+ * Cancel a timer_add() timer that has not fired yet
+ */
+void timer_cancel(timer_event_t *timer) {
+    if (timer == NULL) {
+        return;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    int disarmed = wheel_disarm(timer);
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    
+    if (disarmed) {
+        kmem_cache_free(timer_cache, timer);
+    }
+}
+
+/*
+ * Ticks from the current scheduler tick until the wheel next has work:
+ * exact for timers in the innermost level, otherwise the next cascade,
+ * which is early but never late
+ */
+uint32_t timer_wheel_next_expiry(void) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    uint32_t index = WHEEL_INDEX(wheel_tick, 0);
+    uint32_t ticks;
+    
+    if (wheel_pending == 0) {
+        ticks = TIMER_MAX_TICKS;
+    } else if (index == 0) {
+        /* Level 0 has not been refilled yet; the next tick cascades */
+        ticks = 1;
+    } else {
+        uint32_t limit = TIMER_WHEEL_SIZE - index;
+        
+        ticks = limit + 1;
+        for (uint32_t i = 0; i < limit; i++) {
+            if (wheel[0][index + i] != NULL) {
+                ticks = i + 1;
+                break;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    
+    return ticks;
+}
+
+/*
+ * Events currently on the wheel
+ */
+uint32_t timer_pending_count(void) {
+    return wheel_pending;
+}
+
+/* Shell commands */
+
+/*
+ * timer [on|off]: show the timer, or choose whether IRQ0 drives the scheduler
+ */
+static int timer_cmd_timer(int argc, char **argv) {
+    if (argc == 1) {
+        timer_print_status();
+    } else if (argc == 2 && strcmp(argv[1], "on") == 0) {
+        timer_set_scheduling(1);
+    } else if (argc == 2 && strcmp(argv[1], "off") == 0) {
+        timer_set_scheduling(0);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+SHELL_COMMAND(timer, "timer", "timer [on|off]", "Show timer, or let IRQ0 drive the scheduler",
+              timer_cmd_timer);
@@ -0,0 +1,83 @@
+/* timer.h - Programmable Interval Timer (8253/8254) and timer wheel */
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "types.h"
+
+/* Default tick rate; override with make TIMER_HZ=... */
+#ifndef TIMER_HZ
+#define TIMER_HZ 100
+#endif
+
+#define PIT_BASE_FREQUENCY  1193182     /* PIT input clock in Hz */
+#define TIMER_IRQ           0
+
+/* Stretch the PIT period while idle; make TICKLESS=0 keeps a fixed tick */
+#ifndef TIMER_TICKLESS
+#define TIMER_TICKLESS 1
+#endif
+
+/* Program PIT channel 0 for hz interrupts per second and hook IRQ0 */
+void timer_init(uint32_t hz);
+
+/* Let IRQ0 drive scheduler_tick() (off: ticks only advance uptime) */
+void timer_set_scheduling(uint8_t enable);
+uint8_t timer_is_scheduling(void);
+
+/* Uptime */
+uint32_t timer_get_ticks(void);
+uint32_t timer_get_hz(void);
+
+/* Busy-wait without interrupts (PIT channel 2) */
+void timer_busy_wait_us(uint32_t us);
+
+/* Halt until an interrupt, skipping up to max_ticks - 1 IRQ0s if possible */
+void timer_idle(uint32_t max_ticks);
+
+void timer_print_status(void);
+
+/*
+ * Timer wheel, in scheduler ticks. scheduler_tick() advances it, so timers
+ * follow the scheduler's clock whether IRQ0 or the 'tick' command drives
+ * it. Four levels of 64 slots each cover 2^24 ticks. A timer sits in the
+ * level matching its distance and moves down a level when the lower
+ * wheel wraps. That makes add, cancel and per-tick expiry O(1), with at
+ * most three cascades over a timer's lifetime. Callbacks run from
+ * scheduler_tick() with interrupts off and the wheel unlocked, so they
+ * may take other locks; code holding those may still arm timers. A
+ * cancel that races with expiry can find the callback already running.
+ */
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SIZE    (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  4
+#define TIMER_MAX_TICKS     ((1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+typedef void (*timer_callback_t)(void *arg);
+
+typedef struct timer_event {
+    struct timer_event *next;       /* Wheel slot list */
+    struct timer_event *prev;
+    uint32_t expires;               /* Scheduler tick it fires on */
+    timer_callback_t callback;
+    void *arg;
+    uint8_t pending;                /* 1 while on the wheel */
+    uint8_t allocated;              /* From timer_add(): freed once it fires */
+} timer_event_t;
+
+/* Wheel setup; now is the current scheduler tick */
+void timer_wheel_init(uint32_t now);
+void timer_wheel_advance(uint32_t now);         /* Fire everything due by now */
+uint32_t timer_wheel_next_expiry(void);         /* Ticks until the next deadline */
+
+/* Caller-owned events (embedded in another object) */
+void timer_event_init(timer_event_t *event, timer_callback_t callback, void *arg);
+void timer_event_start(timer_event_t *event, uint32_t ticks);
+void timer_event_cancel(timer_event_t *event);
+
+/* One-shot timers from the timer cache. The handle is only valid until the
+ * callback runs; a periodic task calls timer_add() again from it. */
+timer_event_t *timer_add(timer_callback_t callback, void *arg, uint32_t ticks);
+void timer_cancel(timer_event_t *timer);
+uint32_t timer_pending_count(void);
+
+#endif /* TIMER_H */
@@ -0,0 +1,169 @@
+/* trace.c - Binary scheduler event trace */
+#include "trace.h"
+#include "cpu.h"
+#include "scheduler.h"
+#include "serial.h"
+#include "string.h"
+#include "shell.h"
+
+/* Per-CPU ring. head counts every record ever claimed; slot = head & mask. */
+typedef struct {
+    trace_record_t records[TRACE_RING_SIZE];
+    volatile uint32_t head;
+} trace_ring_t;
+
+static trace_ring_t trace_rings[TRACE_NUM_CPUS];
+
+static const char *event_names[TRACE_EVENT_COUNT] = {
+    "?", "switch", "preempt", "yield", "aging", "block",
+    "unblock", "create", "terminate", "kmalloc-fail", "migrate"
+};
+
+/* Forward declarations for internal functions */
+static uint32_t trace_first(uint32_t head);
+
+/*
+ * Record one event. The slot is claimed with an atomic add, so an
+ * interrupt that traces in the middle of this gets its own slot.
+ */
+void trace_event(trace_event_t event, uint32_t pid, uint32_t arg) {
+    uint32_t cpu = smp_cpu_id();
+    trace_ring_t *ring = &trace_rings[cpu];
+    uint32_t slot = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    trace_record_t *rec = &ring->records[slot & (TRACE_RING_SIZE - 1)];
+    
+    rec->tsc = rdtsc();
+    rec->tick = scheduler_get_ticks();
+    rec->pid = pid;
+    rec->arg = arg;
+    rec->event = (uint16_t)event;
+    rec->cpu = (uint16_t)cpu;
+}
+
+/*
+ * Index of the oldest record still in the ring
+ */
+static uint32_t trace_first(uint32_t head) {
+    return (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+}
+
+/*
+ * Print the ring oldest first, with TSC offsets from the oldest record
+ */
+void trace_dump(void) {
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        trace_ring_t *ring = &trace_rings[cpu];
+        uint32_t head = ring->head;
+        uint32_t first = trace_first(head);
+        
+        serial_puts("\n=== Trace CPU ");
+        serial_put_dec(cpu);
+        serial_puts(": ");
+        serial_put_dec(head - first);
+        serial_puts(" of ");
+        serial_put_dec(head);
+        serial_puts(" events ===\n");
+        
+        if (head == first) {
+            continue;
+        }
+        
+        serial_puts("Tick      TSC offset  Event         PID   Arg\n");
+        serial_puts("--------  ----------  ------------  ----  ----------\n");
+        
+        uint64_t base = ring->records[first & (TRACE_RING_SIZE - 1)].tsc;
+        for (uint32_t i = first; i != head; i++) {
+            trace_record_t *rec = &ring->records[i & (TRACE_RING_SIZE - 1)];
+            const char *name = trace_event_to_string((trace_event_t)rec->event);
+            uint32_t offset = (uint32_t)(rec->tsc - base);
+            
+            serial_put_dec(rec->tick);
+            for (uint32_t n = 1000000; n > 1 && rec->tick < n; n /= 10) serial_puts(" ");
+            serial_puts("  ");
+            
+            serial_put_dec(offset);
+            for (uint32_t n = 1000000000; n > 1 && offset < n; n /= 10) serial_puts(" ");
+            serial_puts("  ");
+            
+            serial_puts(name);
+            for (uint32_t j = strlen(name); j < 14; j++) serial_puts(" ");
+            
+            serial_put_dec(rec->pid);
+            for (uint32_t n = 1000; n > 1 && rec->pid < n; n /= 10) serial_puts(" ");
+            serial_puts("  ");
+            
+            serial_put_dec(rec->arg);
+            serial_puts("\n");
+        }
+    }
+    serial_puts("\n");
+}
+
+/*
+ * Write the ring for host-side tools. Format, one record per line:
+ *   R <tsc:16 hex><tick:8><event:4><cpu:4><pid:8><arg:8>
+ * framed by "TRACE 1 <cpus>" and "END".
+ */
+void trace_export(void) {
+    serial_puts("TRACE 1 ");
+    serial_put_dec(smp_cpu_count());
+    serial_puts("\n");
+    
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        trace_ring_t *ring = &trace_rings[cpu];
+        uint32_t head = ring->head;
+        
+        for (uint32_t i = trace_first(head); i != head; i++) {
+            trace_record_t *rec = &ring->records[i & (TRACE_RING_SIZE - 1)];
+            
+            serial_puts("R ");
+            serial_put_hex((uint32_t)(rec->tsc >> 32));
+            serial_put_hex((uint32_t)rec->tsc);
+            serial_put_hex(rec->tick);
+            serial_put_hex(((uint32_t)rec->event << 16) | rec->cpu);
+            serial_put_hex(rec->pid);
+            serial_put_hex(rec->arg);
+            serial_puts("\n");
+        }
+    }
+    
+    serial_puts("END\n");
+}
+
+/*
+ * Drop every record
+ */
+void trace_clear(void) {
+    for (uint32_t cpu = 0; cpu < TRACE_NUM_CPUS; cpu++) {
+        trace_rings[cpu].head = 0;
+    }
+}
+
+/*
+ * Event name for dumps
+ */
+const char *trace_event_to_string(trace_event_t event) {
+    return ((uint32_t)event < TRACE_EVENT_COUNT) ? event_names[event] : "?";
+}
+
+/* Shell commands */
+
+/*
+ * trace [export|clear]: dump, export or clear the event trace
+ */
+static int trace_cmd_trace(int argc, char **argv) {
+    if (argc == 1) {
+        trace_dump();
+    } else if (argc == 2 && strcmp(argv[1], "export") == 0) {
+        trace_export();
+    } else if (argc == 2 && strcmp(argv[1], "clear") == 0) {
+        trace_clear();
+        serial_puts("Trace cleared\n");
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+SHELL_COMMAND(trace, "trace", "trace [export|clear]", "Dump, export or clear the event trace",
+              trace_cmd_trace);
@@ -0,0 +1,65 @@
+/* trace.h - Binary scheduler event trace */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h"
+#include "smp.h"
+
+/*
+ * Hot paths record fixed-size binary events into a per-CPU ring instead of
+ * formatting text over the serial line. Writers claim a slot with one
+ * atomic add and never wait; once the ring is full the oldest records are
+ * overwritten. The 'trace' shell command decodes the ring, 'trace export'
+ * writes it as one hex record per line for host-side tools.
+ *
+ * TRACE(...) compiles to nothing when the Makefile sets TRACE=0.
+ */
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED       1
+#endif
+
+#define TRACE_RING_SIZE     1024    /* Records per CPU, power of two */
+#define TRACE_NUM_CPUS      MAX_CPUS
+
+typedef enum {
+    TRACE_SWITCH = 1,       /* pid: next, arg: previous pid (0 for none) */
+    TRACE_PREEMPT,          /* pid: preempted, arg: ticks of CPU time */
+    TRACE_YIELD,            /* pid: yielding process */
+    TRACE_AGING_BOOST,      /* pid: boosted, arg: age in ticks */
+    TRACE_BLOCK,            /* pid: blocked process, arg: previous state */
+    TRACE_UNBLOCK,          /* pid: unblocked process, arg: new state */
+    TRACE_CREATE,           /* pid: new process, arg: priority */
+    TRACE_TERMINATE,        /* pid: terminated, arg: ticks of CPU time */
+    TRACE_KMALLOC_FAIL,     /* arg: requested size */
+    TRACE_MIGRATE,          /* pid: stolen process, arg: CPU it came from */
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+/* One event, 24 bytes */
+typedef struct trace_record {
+    uint64_t tsc;           /* Time-stamp counter */
+    uint32_t tick;          /* Scheduler tick */
+    uint32_t pid;
+    uint32_t arg;           /* Event specific */
+    uint16_t event;         /* trace_event_t */
+    uint16_t cpu;
+} trace_record_t;
+
+/* Record one event */
+void trace_event(trace_event_t event, uint32_t pid, uint32_t arg);
+
+#if TRACE_ENABLED
+#define TRACE(event, pid, arg)  trace_event((event), (pid), (arg))
+#else
+#define TRACE(event, pid, arg)  \
+    ((void)sizeof(event), (void)sizeof(pid), (void)sizeof(arg))  /* Not evaluated */
+#endif
+
+/* Dump and control */
+void trace_dump(void);                  /* Decoded, oldest first */
+void trace_export(void);                /* Compact hex format */
+void trace_clear(void);
+const char *trace_event_to_string(trace_event_t event);
+
+#endif /* TRACE_H */